@@ -0,0 +1,272 @@
+// This file is part of hat-trie.
+// Copyright (c) 2013 by Andrew Aladjev <aladjev.andrew@gmail.com>
+
+#include "allocator.h"
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <talloc2/tree.h>
+#include <talloc2/ext/destructor.h>
+
+/* talloc */
+
+static void * talloc_alloc ( void * data, size_t size )
+{
+    return talloc ( data, size );
+}
+
+static void * talloc_resize ( void * data, void * pointer, size_t old_size, size_t size )
+{
+    ( void ) old_size;
+    if ( pointer == NULL ) {
+        return talloc ( data, size );
+    }
+    return talloc_realloc ( pointer, size );
+}
+
+static void talloc_release ( void * data, void * pointer, size_t size )
+{
+    ( void ) data;
+    ( void ) size;
+    talloc_free ( pointer );
+}
+
+htr_allocator * htr_allocator_talloc ( void * ctx )
+{
+    htr_allocator * allocator = talloc ( ctx, sizeof ( htr_allocator ) );
+    if ( allocator == NULL ) {
+        return NULL;
+    }
+    allocator->alloc   = talloc_alloc;
+    allocator->realloc = talloc_resize;
+    allocator->free    = talloc_release;
+    allocator->data    = allocator;
+    return allocator;
+}
+
+/* arena */
+
+// Blocks up to 1 KiB have classes of 16 bytes, greater blocks have 4 classes between powers of 2.
+#define ARENA_SMALL_SIZE 1024
+#define ARENA_SMALL_CLASSES ( ARENA_SMALL_SIZE / 16 + 1 )
+#define ARENA_CLASSES ( ARENA_SMALL_CLASSES + 4 * 54 )
+
+static const size_t ARENA_ALIGNMENT = 16;
+static const size_t ARENA_HUGE_PAGE = 2 * 1024 * 1024;
+static const size_t ARENA_MIN_CHUNK = 64 * 1024;
+
+// Chunk starts with its header, blocks follow it.
+typedef struct arena_chunk_t {
+    struct arena_chunk_t * next;
+    size_t                 size;
+    bool                   mapped;
+    uint8_t                reserved[15]; // blocks are aligned
+} arena_chunk;
+
+typedef struct arena_t {
+    htr_allocator allocator;
+    size_t        chunk_size;
+    bool          huge;
+    arena_chunk * chunks;
+
+    // free space of the current chunk, the last block may grow in place
+    uint8_t * top;
+    uint8_t * end;
+    uint8_t * last;
+
+    // freed blocks of the class, every block keeps the pointer to the next one
+    void * blocks[ARENA_CLASSES];
+} arena;
+
+// Class of the block and its size rounded up to the class.
+static size_t arena_class ( size_t size, size_t * rounded )
+{
+    if ( size <= ARENA_SMALL_SIZE ) {
+        *rounded = size < ARENA_ALIGNMENT ? ARENA_ALIGNMENT : ( size + ARENA_ALIGNMENT - 1 ) & ~ ( ARENA_ALIGNMENT - 1 );
+        return *rounded / ARENA_ALIGNMENT;
+    }
+    // 2 ^ bits < size <= 2 ^ ( bits + 1 ), rounded size is 5 to 8 steps
+    unsigned int bits = 63 - ( unsigned int ) __builtin_clzll ( ( unsigned long long ) ( size - 1 ) );
+    size_t step = ( size_t ) 1 << ( bits - 2 );
+    *rounded = ( size + step - 1 ) & ~ ( step - 1 );
+    return ARENA_SMALL_CLASSES + ( bits - 10 ) * 4 + *rounded / step - 5;
+}
+
+static void arena_unmap ( arena_chunk * chunk )
+{
+    if ( chunk->mapped ) {
+        munmap ( chunk, chunk->size );
+    } else {
+        free ( chunk );
+    }
+}
+
+// Huge chunk is mapped on reserved huge pages or aligned to the huge page for transparent huge pages.
+static arena_chunk * arena_map ( size_t size )
+{
+    void * memory;
+#ifdef MAP_HUGETLB
+    memory = mmap ( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+    if ( memory != MAP_FAILED ) {
+        return memory;
+    }
+#endif
+    memory = mmap ( NULL, size + ARENA_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( memory == MAP_FAILED ) {
+        return NULL;
+    }
+    uint8_t * start   = memory;
+    uint8_t * aligned = ( uint8_t * ) ( ( ( uintptr_t ) start + ARENA_HUGE_PAGE - 1 ) & ~ ( uintptr_t ) ( ARENA_HUGE_PAGE - 1 ) );
+    if ( aligned > start ) {
+        munmap ( start, ( size_t ) ( aligned - start ) );
+    }
+    if ( aligned + size < start + size + ARENA_HUGE_PAGE ) {
+        munmap ( aligned + size, ( size_t ) ( start + size + ARENA_HUGE_PAGE - aligned - size ) );
+    }
+#ifdef MADV_HUGEPAGE
+    madvise ( aligned, size, MADV_HUGEPAGE );
+#endif
+    return ( arena_chunk * ) aligned;
+}
+
+// New chunk for at least size bytes of blocks.
+static arena_chunk * arena_chunk_new ( arena * A, size_t size )
+{
+    size_t chunk_size = sizeof ( arena_chunk ) + size;
+    if ( chunk_size < A->chunk_size ) {
+        chunk_size = A->chunk_size;
+    }
+    arena_chunk * chunk;
+    if ( A->huge ) {
+        chunk_size = ( chunk_size + ARENA_HUGE_PAGE - 1 ) & ~ ( ARENA_HUGE_PAGE - 1 );
+        chunk = arena_map ( chunk_size );
+    } else {
+        chunk = malloc ( chunk_size );
+    }
+    if ( chunk == NULL ) {
+        return NULL;
+    }
+    chunk->size   = chunk_size;
+    chunk->mapped = A->huge;
+    chunk->next   = A->chunks;
+    A->chunks     = chunk;
+    return chunk;
+}
+
+static void * arena_alloc ( void * data, size_t size )
+{
+    arena * A = data;
+    size_t rounded, class = arena_class ( size, &rounded );
+    void * block = A->blocks[class];
+    if ( block != NULL ) {
+        memcpy ( &A->blocks[class], block, sizeof ( void * ) );
+        return block;
+    }
+
+    if ( ( size_t ) ( A->end - A->top ) < rounded ) {
+        arena_chunk * chunk = arena_chunk_new ( A, rounded );
+        if ( chunk == NULL ) {
+            return NULL;
+        }
+        uint8_t * top = ( uint8_t * ) chunk + sizeof ( arena_chunk );
+        uint8_t * end = ( uint8_t * ) chunk + chunk->size;
+        // block of its own chunk keeps the free space of the current chunk
+        if ( ( size_t ) ( end - top ) - rounded < ( size_t ) ( A->end - A->top ) ) {
+            return top;
+        }
+        A->top = top;
+        A->end = end;
+    }
+    block   = A->top;
+    A->top += rounded;
+    A->last = block;
+    return block;
+}
+
+static void arena_free ( void * data, void * pointer, size_t size )
+{
+    arena * A = data;
+    // every block has at least the size of the smallest class, so emptied slot is listed too
+    if ( pointer == A->last ) {
+        A->last = NULL;
+    }
+    size_t rounded, class = arena_class ( size, &rounded );
+    memcpy ( pointer, &A->blocks[class], sizeof ( void * ) );
+    A->blocks[class] = pointer;
+}
+
+static void * arena_resize ( void * data, void * pointer, size_t old_size, size_t size )
+{
+    arena * A = data;
+    size_t old_rounded, rounded;
+    arena_class ( size, &rounded );
+    if ( pointer != NULL ) {
+        arena_class ( old_size, &old_rounded );
+        if ( rounded <= old_rounded ) {
+            return pointer;
+        }
+        // the last block grows into the free space of chunk
+        if ( pointer == A->last && ( size_t ) ( A->end - ( uint8_t * ) pointer ) >= rounded ) {
+            A->top = ( uint8_t * ) pointer + rounded;
+            return pointer;
+        }
+    }
+    void * block = arena_alloc ( data, size );
+    if ( block == NULL ) {
+        return NULL;
+    }
+    if ( pointer != NULL ) {
+        memcpy ( block, pointer, old_size );
+        arena_free ( data, pointer, old_size );
+    }
+    return block;
+}
+
+static uint8_t arena_destroy ( void * child_data, void * user_data )
+{
+    ( void ) user_data;
+    arena * A = child_data;
+    arena_chunk * chunk = A->chunks, * next;
+    while ( chunk != NULL ) {
+        next = chunk->next;
+        arena_unmap ( chunk );
+        chunk = next;
+    }
+    return 0;
+}
+
+static htr_allocator * arena_new ( void * ctx, size_t chunk_size, bool huge )
+{
+    arena * A = talloc ( ctx, sizeof ( arena ) );
+    if ( A == NULL ) {
+        return NULL;
+    }
+    if ( talloc_add_destructor ( A, arena_destroy, NULL ) != 0 ) {
+        talloc_free ( A );
+        return NULL;
+    }
+    A->allocator.alloc   = arena_alloc;
+    A->allocator.realloc = arena_resize;
+    A->allocator.free    = arena_free;
+    A->allocator.data    = A;
+    A->chunk_size = chunk_size < ARENA_MIN_CHUNK ? ARENA_MIN_CHUNK : chunk_size;
+    A->huge       = huge;
+    A->chunks     = NULL;
+    A->top        = NULL;
+    A->end        = NULL;
+    A->last       = NULL;
+    memset ( A->blocks, 0, sizeof ( A->blocks ) );
+    return &A->allocator;
+}
+
+htr_allocator * htr_allocator_arena ( void * ctx, size_t chunk_size )
+{
+    return arena_new ( ctx, chunk_size, false );
+}
+
+htr_allocator * htr_allocator_huge ( void * ctx, size_t chunk_size )
+{
+    return arena_new ( ctx, chunk_size, true );
+}
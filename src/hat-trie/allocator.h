@@ -0,0 +1,75 @@
+// This file is part of hat-trie.
+// Copyright (c) 2013 by Andrew Aladjev <aladjev.andrew@gmail.com>
+//
+// Allocator of the trie memory: trie nodes, buckets, their slots, out of line keys and blob values of trie nodes.
+// Temporary buffers of iterators, walks and images are allocated by malloc.
+// Functions get the data of allocator and the size of the block. Size is the number of bytes used in the block,
+// it is never greater than the size the block was allocated with, because slots are not shrunk by deletes.
+
+#ifndef HTR_ALLOCATOR_H
+#define HTR_ALLOCATOR_H
+
+#include <stdlib.h>
+#include "common.h"
+
+typedef struct htr_allocator_t {
+    // returns NULL if memory can't be allocated
+    void * ( * alloc ) ( void * data, size_t size );
+    // pointer may be NULL with old_size 0, the first old_size bytes are kept, old block is kept if NULL is returned
+    void * ( * realloc ) ( void * data, void * pointer, size_t old_size, size_t size );
+    void ( * free ) ( void * data, void * pointer, size_t size );
+    void * data;
+} htr_allocator;
+
+// Trie without allocator uses malloc, functions below dispatch to it for NULL allocator.
+
+static inline
+void * htr_allocator_alloc ( const htr_allocator * allocator, size_t size )
+{
+    if ( allocator == NULL ) {
+        return malloc ( size );
+    }
+    return allocator->alloc ( allocator->data, size );
+}
+
+static inline
+void * htr_allocator_realloc ( const htr_allocator * allocator, void * pointer, size_t old_size, size_t size )
+{
+    if ( allocator == NULL ) {
+        return realloc ( pointer, size );
+    }
+    return allocator->realloc ( allocator->data, pointer, old_size, size );
+}
+
+static inline
+void htr_allocator_free ( const htr_allocator * allocator, void * pointer, size_t size )
+{
+    if ( allocator == NULL ) {
+        free ( pointer );
+    } else if ( pointer != NULL ) {
+        allocator->free ( allocator->data, pointer, size );
+    }
+}
+
+// Allocators below are released by talloc_free together with all their blocks, so they must outlive their tries.
+// They are not thread safe, like the mutable trie itself. Returns NULL if memory can't be allocated.
+
+// Every block is a talloc child of the allocator.
+htr_allocator * htr_allocator_talloc ( void * ctx );
+
+// Blocks are cut from chunks of chunk_size bytes one after another. Freed blocks are kept in lists of size classes
+// (16 bytes up to 1 KiB, then 4 classes for every power of 2) and reused by later blocks of the class, chunks are released only with arena.
+// Block greater than chunk gets its own chunk, chunks are at least 64 KiB.
+htr_allocator * htr_allocator_arena ( void * ctx, size_t chunk_size );
+
+// Arena with chunks mapped on huge pages to reduce TLB misses of large tries. Chunk size is rounded up to 2 MiB.
+// Chunks are mapped with MAP_HUGETLB if the system has reserved huge pages, otherwise they are aligned to 2 MiB and advised for transparent huge pages.
+htr_allocator * htr_allocator_huge ( void * ctx, size_t chunk_size );
+
+struct htr_t;
+
+// Allocate nodes and buckets of the trie by the allocator, NULL returns to malloc. Trie keeps the pointer, so allocator must outlive the trie.
+// Allocator may be changed only for empty mutable trie, otherwise it returns -1 with EINVAL.
+int htr_set_allocator ( struct htr_t * trie, const htr_allocator * allocator );
+
+#endif
@@ -12,6 +12,18 @@ typedef uint8_t * htr_slot;
 typedef uint64_t  htr_value;
 typedef struct htr_table_iterator_t htr_table_iterator;
 
+// Key split into the prefix consumed by trie nodes and the suffix stored in bucket.
+// Full key is the concatenation of prefix and suffix.
+typedef struct htr_key_view_t {
+    const char * prefix;
+    size_t       prefix_length;
+    const char * suffix;
+    size_t       suffix_length;
+} htr_key_view;
+
 typedef uint32_t ( * htr_hash_function ) ( const uint8_t * data, size_t len );
 
+// Value size of the trie with variable length values, they are stored as length and bytes of the blob.
+#define HTR_VALUE_BLOB 0xff
+
 #endif
@@ -0,0 +1,334 @@
+// This file is part of hat-trie.
+// Copyright (c) 2013 by Andrew Aladjev <aladjev.andrew@gmail.com>
+
+#include "encoder.h"
+#include "node.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include <talloc2/tree.h>
+
+// End of the key is the first symbol, byte c is the symbol c + 1.
+#define ENCODER_SYMBOLS 257
+
+// Longer codes are avoided by flattening of frequencies, so the code is always read from 32 bits window.
+static const uint8_t ENCODER_MAX_LENGTH = 32;
+
+struct htr_encoder_t {
+    uint8_t  lengths[ENCODER_SYMBOLS];
+    uint32_t codes[ENCODER_SYMBOLS];  // code in the low bits
+    uint32_t bounds[ENCODER_SYMBOLS]; // code aligned to the high bit of the window, the first window decoded to the symbol
+
+    // symbols starting with the byte b are searched between firsts[b] and firsts[b + 1]
+    uint16_t firsts[257];
+
+    // Alphabet encoder has the length 0 for the end and 1 for every byte of the alphabet.
+    // Byte is replaced by its number in the alphabet, unmap returns it back. Size is 0 for the code encoder.
+    uint16_t size;
+    uint8_t  map[256];
+    uint8_t  unmap[256];
+};
+
+// Number the bytes of the alphabet in their order. Returns 1 if lengths are not the alphabet, it has at least 2 bytes for hybrid buckets.
+static uint8_t assign_alphabet ( htr_encoder * E )
+{
+    size_t b;
+    E->size = 0;
+    for ( b = 0; b < 256; b++ ) {
+        uint8_t length = E->lengths[b + 1];
+        if ( length > 1 ) {
+            return 1;
+        }
+        if ( length == 1 ) {
+            E->map[b] = ( uint8_t ) E->size;
+            E->unmap[E->size++] = ( uint8_t ) b;
+        } else {
+            E->map[b] = 0;
+        }
+    }
+    return E->size < 2 ? 1 : 0;
+}
+
+// Assign codes to the lengths of leaves of the alphabetic tree from left to right.
+// The next code is the previous one plus 1, that is extended or shortened to its length. Returns 1 if lengths don't make the full tree.
+static uint8_t assign_codes ( htr_encoder * E )
+{
+    uint64_t code = 0;
+    size_t s;
+    for ( s = 0; s < ENCODER_SYMBOLS; s++ ) {
+        uint8_t length = E->lengths[s];
+        if ( length == 0 || length > ENCODER_MAX_LENGTH ) {
+            return 1;
+        }
+        if ( s > 0 ) {
+            uint8_t previous = E->lengths[s - 1];
+            code++;
+            if ( length >= previous ) {
+                code <<= length - previous;
+            } else {
+                // only zero bits may be dropped
+                if ( code & ( ( ( uint64_t ) 1 << ( previous - length ) ) - 1 ) ) {
+                    return 1;
+                }
+                code >>= previous - length;
+            }
+        }
+        if ( code >> length != 0 ) {
+            return 1;
+        }
+        E->codes[s]  = ( uint32_t ) code;
+        E->bounds[s] = ( uint32_t ) ( code << ( ENCODER_MAX_LENGTH - length ) );
+    }
+    // the last code is all ones
+    if ( code + 1 != ( uint64_t ) 1 << E->lengths[ENCODER_SYMBOLS - 1] ) {
+        return 1;
+    }
+
+    size_t b;
+    for ( b = 0, s = 0; b < 256; b++ ) {
+        while ( s + 1 < ENCODER_SYMBOLS && E->bounds[s + 1] <= ( uint32_t ) b << 24 ) {
+            s++;
+        }
+        E->firsts[b] = ( uint16_t ) s;
+    }
+    E->firsts[256] = ENCODER_SYMBOLS - 1;
+    return 0;
+}
+
+typedef struct encoder_item_t {
+    uint64_t weight;
+    size_t   node;
+} encoder_item;
+
+// Lengths of codes of the optimal alphabetic tree by Garsia-Wachs algorithm.
+// Pair is combined at the first position where the left neighbour is not heavier than the right one, combined pair moves left past lighter items.
+// The tree is not alphabetic, but its depths of leaves are the depths of the optimal alphabetic tree.
+static void build_lengths ( const uint64_t * weights, uint8_t * lengths )
+{
+    encoder_item items[ENCODER_SYMBOLS];
+    size_t left[2 * ENCODER_SYMBOLS], right[2 * ENCODER_SYMBOLS];
+    size_t count = ENCODER_SYMBOLS, next = ENCODER_SYMBOLS, k, j;
+
+    for ( k = 0; k < ENCODER_SYMBOLS; k++ ) {
+        items[k].weight = weights[k];
+        items[k].node   = k;
+    }
+    while ( count > 1 ) {
+        for ( k = 1; k + 1 < count && items[k - 1].weight > items[k + 1].weight; k++ );
+
+        encoder_item item;
+        item.weight = items[k - 1].weight + items[k].weight;
+        item.node   = next;
+        left[next]  = items[k - 1].node;
+        right[next] = items[k].node;
+        next++;
+
+        memmove ( &items[k - 1], &items[k + 1], ( count - k - 1 ) * sizeof ( encoder_item ) );
+        count -= 2;
+        for ( j = k - 1; j > 0 && items[j - 1].weight < item.weight; j-- );
+        memmove ( &items[j + 1], &items[j], ( count - j ) * sizeof ( encoder_item ) );
+        items[j] = item;
+        count++;
+    }
+
+    // depths of leaves, the tree has less than 2 * ENCODER_SYMBOLS nodes
+    size_t stack[2 * ENCODER_SYMBOLS];
+    size_t depths[2 * ENCODER_SYMBOLS];
+    size_t top = 0, node;
+    stack[top++]          = items[0].node;
+    depths[items[0].node] = 0;
+    while ( top > 0 ) {
+        node = stack[--top];
+        if ( node < ENCODER_SYMBOLS ) {
+            lengths[node] = depths[node] > 255 ? 255 : ( uint8_t ) depths[node];
+            continue;
+        }
+        depths[left[node]]  = depths[node] + 1;
+        depths[right[node]] = depths[node] + 1;
+        stack[top++] = left[node];
+        stack[top++] = right[node];
+    }
+}
+
+htr_encoder * htr_encoder_new ( void * ctx, const char * const * keys, const size_t * lengths, size_t count )
+{
+    htr_encoder * E = talloc ( ctx, sizeof ( htr_encoder ) );
+    if ( E == NULL ) {
+        return NULL;
+    }
+
+    // every symbol is counted once more, so bytes missing in the sample still have codes
+    uint64_t weights[ENCODER_SYMBOLS];
+    size_t s, i, j;
+    for ( s = 0; s < ENCODER_SYMBOLS; s++ ) {
+        weights[s] = 1;
+    }
+    weights[0] += count;
+    for ( i = 0; i < count; i++ ) {
+        for ( j = 0; j < lengths[i]; j++ ) {
+            weights[( uint8_t ) keys[i][j] + 1]++;
+        }
+    }
+
+    while ( true ) {
+        build_lengths ( weights, E->lengths );
+        uint8_t max = 0;
+        for ( s = 0; s < ENCODER_SYMBOLS; s++ ) {
+            if ( E->lengths[s] > max ) {
+                max = E->lengths[s];
+            }
+        }
+        if ( max <= ENCODER_MAX_LENGTH ) {
+            break;
+        }
+        // rare symbols are too deep, frequencies are flattened until the tree fits the window
+        for ( s = 0; s < ENCODER_SYMBOLS; s++ ) {
+            weights[s] = weights[s] / 2 + 1;
+        }
+    }
+
+    E->size = 0;
+    if ( assign_codes ( E ) != 0 ) {
+        talloc_free ( E );
+        return NULL;
+    }
+    return E;
+}
+
+htr_encoder * htr_encoder_alphabet ( void * ctx, const char * bytes, size_t count )
+{
+    htr_encoder * E = talloc ( ctx, sizeof ( htr_encoder ) );
+    if ( E == NULL ) {
+        return NULL;
+    }
+    memset ( E->lengths, 0, ENCODER_SYMBOLS );
+    size_t i;
+    for ( i = 0; i < count; i++ ) {
+        E->lengths[( uint8_t ) bytes[i] + 1] = 1;
+    }
+    if ( assign_alphabet ( E ) != 0 ) {
+        talloc_free ( E );
+        return NULL;
+    }
+    return E;
+}
+
+htr_encoder * htr_encoder_load ( void * ctx, const uint8_t * lengths )
+{
+    htr_encoder * E = talloc ( ctx, sizeof ( htr_encoder ) );
+    if ( E == NULL ) {
+        return NULL;
+    }
+    memcpy ( E->lengths, lengths, ENCODER_SYMBOLS );
+    E->size = 0;
+    if ( lengths[0] == 0 ? assign_alphabet ( E ) != 0 : assign_codes ( E ) != 0 ) {
+        talloc_free ( E );
+        return NULL;
+    }
+    return E;
+}
+
+const uint8_t * htr_encoder_lengths ( const htr_encoder * E )
+{
+    return E->lengths;
+}
+
+size_t htr_encoder_alphabet_size ( const htr_encoder * E )
+{
+    return E->size;
+}
+
+bool htr_encoder_equal ( const htr_encoder * a, const htr_encoder * b )
+{
+    if ( a == NULL || b == NULL ) {
+        return a == b;
+    }
+    return memcmp ( a->lengths, b->lengths, ENCODER_SYMBOLS ) == 0;
+}
+
+size_t htr_encoded_size_max ( size_t length )
+{
+    return ( length + 1 ) * ENCODER_MAX_LENGTH / 8 + 1;
+}
+
+// Bits are collected in the low bits of buffer, only count of them are valid and full bytes are written out.
+size_t htr_encode ( const htr_encoder * E, const char * key, size_t length, bool terminate, uint8_t * output )
+{
+    uint64_t buffer = 0;
+    size_t count = 0, size = 0, i, s;
+    if ( E->size != 0 ) {
+        // every byte is a full code, so keys need no end
+        for ( i = 0; i < length; i++ ) {
+            s = ( uint8_t ) key[i];
+            if ( E->lengths[s + 1] == 0 ) {
+                return SIZE_MAX;
+            }
+            output[i] = E->map[s];
+        }
+        return length;
+    }
+    for ( i = 0; i <= length; i++ ) {
+        if ( i == length ) {
+            if ( !terminate ) {
+                // prefix keeps only full bytes, they are shared by all keys starting with it
+                return size;
+            }
+            s = 0;
+        } else {
+            s = ( uint8_t ) key[i] + 1;
+        }
+        buffer  = ( buffer << E->lengths[s] ) | E->codes[s];
+        count  += E->lengths[s];
+        while ( count >= 8 ) {
+            count -= 8;
+            output[size++] = ( uint8_t ) ( buffer >> count );
+        }
+    }
+    if ( count > 0 ) {
+        output[size++] = ( uint8_t ) ( buffer << ( 8 - count ) );
+    }
+    return size;
+}
+
+// Bits are taken from the high bits of buffer, missing bytes after the end are zeros.
+size_t htr_decode ( const htr_encoder * E, const uint8_t * input, size_t size, char * output, size_t capacity )
+{
+    uint64_t buffer = 0;
+    size_t count = 0, length = 0, i = 0;
+    if ( E->size != 0 ) {
+        for ( i = 0; i < size && i < capacity; i++ ) {
+            output[i] = ( char ) E->unmap[input[i]];
+        }
+        return size;
+    }
+    while ( true ) {
+        while ( count <= 56 && i < size ) {
+            buffer |= ( uint64_t ) input[i++] << ( 56 - count );
+            count  += 8;
+        }
+
+        uint32_t window = ( uint32_t ) ( buffer >> 32 );
+        size_t low  = E->firsts[window >> 24];
+        size_t high = E->firsts[( window >> 24 ) + 1];
+        while ( low < high ) {
+            size_t middle = ( low + high + 1 ) / 2;
+            if ( E->bounds[middle] <= window ) {
+                low = middle;
+            } else {
+                high = middle - 1;
+            }
+        }
+
+        uint8_t bits = E->lengths[low];
+        if ( low == 0 || bits > count ) {
+            // end of the key or broken input
+            return length;
+        }
+        if ( length < capacity ) {
+            output[length] = ( char ) ( low - 1 );
+        }
+        length++;
+        buffer <<= bits;
+        count   -= bits;
+    }
+}
@@ -0,0 +1,35 @@
+// This file is part of hat-trie.
+// Copyright (c) 2013 by Andrew Aladjev <aladjev.andrew@gmail.com>
+//
+// Order preserving key encoder, it is the single character scheme of HOPE: Zhang, H., Liu, X., Andersen, D. G., Kaminsky, M., Keeton, K., & Pavlo, A. (2020).
+// Order-preserving key compression for in-memory search trees. SIGMOD (pp. 1601–1615).
+//
+// Every byte of the key is replaced by its code from the optimal alphabetic (Hu-Tucker) tree, built from byte frequencies of the sample,
+// and the key is terminated by the code of the end, that is padded by zero bits to the byte.
+// Codes are ordered like bytes and the end is less than any byte, so encoded keys are compared by memcmp in the same order as the original keys.
+//
+// Alphabet encoder replaces every byte of the alphabet by its number in the alphabet. Keys keep their length,
+// but trie nodes have a child only for every byte of the alphabet, so nodes of the trie with small alphabet are smaller.
+
+#ifndef HTR_ENCODER_H
+#define HTR_ENCODER_H
+
+#include "trie.h"
+
+typedef struct htr_encoder_t htr_encoder;
+
+// Build the encoder from the sample of keys, every byte gets a code even if it is missing in the sample.
+// Encoder is released by talloc_free. Returns NULL if memory can't be allocated.
+htr_encoder * htr_encoder_new ( void * ctx, const char * const * keys, const size_t * lengths, size_t count );
+
+// Build the alphabet encoder from count bytes, repeated bytes are counted once. Keys with other bytes are rejected by the trie:
+// htr_get returns NULL and htr_set returns -1 with EINVAL, lookups don't find them. Returns NULL if alphabet has less than 2 bytes or memory can't be allocated.
+htr_encoder * htr_encoder_alphabet ( void * ctx, const char * bytes, size_t count );
+
+// Encode keys of the trie: htr_get, htr_tryget, htr_del and other functions take original keys, iterators and htr_walk return them decoded.
+// Trie keeps its own copy of the encoder, NULL removes it. Images of the trie keep the encoder too.
+// Encoder may be changed only for empty mutable trie, otherwise it returns -1 with EINVAL.
+// Logged trie gets the encoder back from its snapshot, so checkpoint the trie after setting the encoder.
+int htr_set_encoder ( htr * trie, const htr_encoder * encoder );
+
+#endif
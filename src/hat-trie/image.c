@@ -0,0 +1,490 @@
+// This file is part of hat-trie.
+// Copyright (c) 2013 by Andrew Aladjev <aladjev.andrew@gmail.com>
+
+#include "image.h"
+#include "node.h"
+#include "slot.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <talloc2/tree.h>
+#include <talloc2/ext/destructor.h>
+
+// Image is a header followed by records of trie nodes and buckets, each record is aligned to IMAGE_ALIGN.
+// Records are written in post order, so children are always before their parent.
+// Numbers are stored in host byte order, byte order mark allows to reject image from another architecture.
+
+static const char     IMAGE_MAGIC[8]     = "HATTRIE";
+static const uint32_t IMAGE_VERSION      = 8;
+static const uint32_t IMAGE_BYTE_ORDER   = 0x01020304;
+static const size_t   IMAGE_ALIGN        = 8;
+static const size_t   IMAGE_BUFFER_SIZE  = 1 << 16;
+
+typedef struct htr_image_header_t {
+    char     magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t size;        // size of the whole image
+    uint64_t pairs_count;
+    uint64_t root;        // offset of the root trie node
+    uint64_t value_size;
+    uint64_t encoder;     // offset of the lengths of codes of the key encoder, 0 if keys are not encoded
+} htr_image_header;
+
+// encoder is saved as the code lengths of the end and every byte, alphabet encoder has the length 0 of the end
+static const size_t IMAGE_ENCODER_SIZE = 257;
+
+// Records are collected in the buffer and written by large chunks.
+// Writer without file descriptor keeps the whole image in the buffer.
+typedef struct htr_image_writer_t {
+    int               fd;
+    uint8_t           encoding; // encoding of buckets
+    htr_hash_function hash_function;
+    size_t            value_size;
+    unsigned int      childs;   // children of mutable trie nodes
+    uint8_t * buffer;
+    size_t    buffer_size;
+    size_t    buffer_capacity;
+    uint64_t  offset; // offset of the end of image
+    uint64_t  encoder;
+    int       error;
+} htr_image_writer;
+
+static int write_all ( int fd, const uint8_t * data, size_t size )
+{
+    ssize_t written;
+    while ( size > 0 ) {
+        written = write ( fd, data, size );
+        if ( written < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        size -= ( size_t ) written;
+    }
+    return 0;
+}
+
+static void writer_flush ( htr_image_writer * w )
+{
+    if ( w->error == 0 && write_all ( w->fd, w->buffer, w->buffer_size ) != 0 ) {
+        w->error = errno;
+    }
+    w->buffer_size = 0;
+}
+
+static uint8_t writer_grow ( htr_image_writer * w, size_t capacity )
+{
+    uint8_t * buffer = realloc ( w->buffer, capacity );
+    if ( buffer == NULL ) {
+        w->error = ENOMEM;
+        return 1;
+    }
+    w->buffer          = buffer;
+    w->buffer_capacity = capacity;
+    return 0;
+}
+
+// Reserve zeroed aligned record at the end of image. Returns NULL on error.
+static uint8_t * writer_reserve ( htr_image_writer * w, size_t size )
+{
+    size = ( size + IMAGE_ALIGN - 1 ) & ~ ( IMAGE_ALIGN - 1 );
+
+    if ( w->error == 0 && w->buffer_size + size > w->buffer_capacity ) {
+        if ( w->fd < 0 ) {
+            size_t capacity = w->buffer_capacity * 2;
+            if ( capacity < w->buffer_size + size ) {
+                capacity = w->buffer_size + size;
+            }
+            writer_grow ( w, capacity );
+        } else {
+            writer_flush ( w );
+            if ( size > w->buffer_capacity ) {
+                writer_grow ( w, size );
+            }
+        }
+    }
+    if ( w->error != 0 ) {
+        return NULL;
+    }
+
+    uint8_t * record = w->buffer + w->buffer_size;
+    memset ( record, 0, size );
+    w->buffer_size += size;
+    w->offset      += size;
+    return record;
+}
+
+// Write node with all its children, returns offset of the node record, the maximum of its values and the number of its keys.
+static uint64_t save_node ( htr_image_writer * w, htr_node_ptr node, htr_value * max, uint64_t * pairs )
+{
+    uint64_t offset, child_pairs;
+    htr_value child_max;
+    *max   = 0;
+    *pairs = 0;
+
+    if ( *node.flag & NODE_TYPE_TRIE ) {
+        uint64_t childs[NODE_CHILDS];
+        uint64_t runs[NODE_CHILDS / 64];
+        uint8_t  ranks[4];
+        size_t c, count = 0;
+
+        memset ( runs, 0, sizeof ( runs ) );
+        if ( node.trie_node->flag & NODE_HAS_VAL ) {
+            *pairs = 1;
+            if ( w->value_size != HTR_VALUE_BLOB ) {
+                *max = value_load ( ( const uint8_t * ) &node.trie_node->value, w->value_size );
+            }
+        }
+        for ( c = 0; c < NODE_CHILDS; c++ ) {
+            if ( c % 64 == 0 ) {
+                ranks[c / 64] = ( uint8_t ) count;
+            }
+            // characters out of the alphabet belong to the last run
+            if ( c >= w->childs || ( c > 0 && node.trie_node->xs[c].flag == node.trie_node->xs[c - 1].flag ) ) {
+                continue;
+            }
+            childs[count++] = save_node ( w, node.trie_node->xs[c], &child_max, &child_pairs );
+            if ( child_max > *max ) {
+                *max = child_max;
+            }
+            *pairs += child_pairs;
+            runs[c / 64]   |= ( uint64_t ) 1 << ( c % 64 );
+        }
+
+        // distances back from this node
+        bool wide = false;
+        offset = w->offset;
+        for ( c = 0; c < count; c++ ) {
+            childs[c] = offset - childs[c];
+            if ( childs[c] > UINT32_MAX ) {
+                wide = true;
+            }
+        }
+
+        // blob value of the node follows the distances, value keeps its offset from the node
+        const uint8_t * blob = NULL;
+        size_t blob_size = 0;
+        if ( w->value_size == HTR_VALUE_BLOB && node.trie_node->flag & NODE_HAS_VAL ) {
+            blob      = ( const uint8_t * ) ( uintptr_t ) node.trie_node->value;
+            blob_size = value_field_size ( blob, w->value_size );
+        }
+
+        size_t distance_size = wide ? sizeof ( uint64_t ) : sizeof ( uint32_t );
+        size_t blob_offset   = sizeof ( htr_image_node ) + count * distance_size;
+        htr_image_node * record = ( htr_image_node * ) writer_reserve ( w, blob_offset + blob_size );
+        if ( record == NULL ) {
+            return 0;
+        }
+        record->flag         = node.trie_node->flag;
+        record->wide         = wide;
+        record->childs_count = ( uint16_t ) count;
+        record->max          = *max;
+        record->count        = *pairs;
+        if ( blob != NULL ) {
+            record->value = blob_offset;
+            memcpy ( ( uint8_t * ) record + blob_offset, blob, blob_size );
+        } else {
+            record->value = node.trie_node->value;
+        }
+        memcpy ( record->ranks, ranks, sizeof ( ranks ) );
+        memcpy ( record->runs, runs, sizeof ( runs ) );
+        if ( wide ) {
+            memcpy ( record->childs, childs, count * sizeof ( uint64_t ) );
+        } else {
+            for ( c = 0; c < count; c++ ) {
+                record->childs[c] = ( uint32_t ) childs[c];
+            }
+        }
+        return offset;
+    }
+
+    size_t size;
+    htr_table_image * image = htr_table_image_new ( node.table, w->hash_function, w->encoding, &size );
+    if ( image == NULL ) {
+        w->error = errno;
+        return 0;
+    }
+
+    *max   = image->max;
+    *pairs = image->pairs_count;
+    offset = w->offset;
+    uint8_t * record = writer_reserve ( w, size );
+    if ( record != NULL ) {
+        memcpy ( record, image, size );
+    }
+    free ( image );
+    return offset;
+}
+
+// Write all records of the trie after the header placeholder, returns offset of the root.
+static uint64_t save_trie ( htr_image_writer * w, const htr * T )
+{
+    writer_reserve ( w, sizeof ( htr_image_header ) );
+
+    w->encoder = 0;
+    if ( T->encoder != NULL ) {
+        w->encoder = w->offset;
+        uint8_t * record = writer_reserve ( w, IMAGE_ENCODER_SIZE );
+        if ( record != NULL ) {
+            memcpy ( record, htr_encoder_lengths ( T->encoder ), IMAGE_ENCODER_SIZE );
+        }
+    }
+    htr_value max;
+    uint64_t pairs;
+    return save_node ( w, T->root, &max, &pairs );
+}
+
+static void fill_header ( htr_image_header * header, const htr * T, uint64_t size, uint64_t root, uint64_t encoder )
+{
+    memset ( header, 0, sizeof ( htr_image_header ) );
+    memcpy ( header->magic, IMAGE_MAGIC, sizeof ( header->magic ) );
+    header->version     = IMAGE_VERSION;
+    header->byte_order  = IMAGE_BYTE_ORDER;
+    header->size        = size;
+    header->pairs_count = T->pairs_count;
+    header->root        = root;
+    header->value_size  = T->value_size;
+    header->encoder     = encoder;
+}
+
+int htr_save ( const htr * T, int fd )
+{
+    off_t start = lseek ( fd, 0, SEEK_CUR );
+    if ( start < 0 ) {
+        return -1;
+    }
+
+    // image of the read only trie is already position independent
+    if ( T->image != NULL ) {
+        return write_all ( fd, T->image, T->image_size );
+    }
+
+    htr_image_writer w;
+    w.fd              = fd;
+    w.encoding        = HTR_TABLE_IMAGE_HASHED;
+    w.hash_function   = T->hash_function;
+    w.value_size      = T->value_size;
+    w.childs          = T->childs;
+    w.buffer          = malloc ( IMAGE_BUFFER_SIZE );
+    w.buffer_size     = 0;
+    w.buffer_capacity = IMAGE_BUFFER_SIZE;
+    w.offset          = 0;
+    w.error           = 0;
+    if ( w.buffer == NULL ) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    uint64_t root = save_trie ( &w, T );
+    writer_flush ( &w );
+    free ( w.buffer );
+
+    if ( w.error != 0 ) {
+        errno = w.error;
+        return -1;
+    }
+
+    htr_image_header header;
+    fill_header ( &header, T, w.offset, root, w.encoder );
+    if ( pwrite ( fd, &header, sizeof ( header ), start ) != ( ssize_t ) sizeof ( header ) ) {
+        return -1;
+    }
+    return 0;
+}
+
+htr_value * htr_image_tryget ( const htr * T, const char * key, size_t len )
+{
+    htr_node_ptr parent = T->root;
+
+    if ( len == 0 ) {
+        if ( ! ( *parent.flag & NODE_HAS_VAL ) ) {
+            return NULL;
+        }
+        return node_value ( T, parent );
+    }
+
+    htr_node_ptr node = node_consume ( T, &parent, &key, &len, 1 );
+
+    /* if the trie node consumes value, use it */
+    if ( *node.flag & NODE_TYPE_TRIE ) {
+        if ( ! ( *node.flag & NODE_HAS_VAL ) ) {
+            return NULL;
+        }
+        return node_value ( T, node );
+    }
+
+    /* pure bucket holds only key suffixes, skip current char */
+    if ( *node.flag & NODE_TYPE_PURE_BUCKET ) {
+        key += 1;
+        len -= 1;
+    }
+
+    return htr_table_image_tryget ( node.table_image, T->hash_function, key, len );
+}
+
+static
+uint8_t htr_image_unmap ( void * child_data, void * user_data )
+{
+    ( void ) user_data;
+    htr * trie = child_data;
+    munmap ( ( void * ) trie->image, trie->image_size );
+    return 0;
+}
+
+static
+uint8_t htr_image_free ( void * child_data, void * user_data )
+{
+    ( void ) user_data;
+    htr * trie = child_data;
+    free ( ( void * ) trie->image );
+    return 0;
+}
+
+// Read only trie served from the valid image, destructor releases the image. Returns NULL and leaves the image to caller on error.
+static htr * image_trie ( void * ctx, const uint8_t * image, size_t size, htr_hash_function hash_function, uint8_t ( * destructor ) ( void *, void * ) )
+{
+    const htr_image_header * header = ( const htr_image_header * ) image;
+
+    htr * trie = talloc ( ctx, sizeof ( htr ) );
+    if ( trie == NULL ) {
+        return NULL;
+    }
+    trie->image         = image;
+    trie->image_size    = size;
+    trie->root.flag     = ( uint8_t * ) image + header->root;
+    trie->pairs_count   = header->pairs_count;
+    trie->hash_function = hash_function;
+    trie->value_size    = ( size_t ) header->value_size;
+    trie->log           = NULL;
+    trie->front_coded   = false;
+    trie->scored        = false;
+    trie->counted       = false;
+    trie->encoder       = NULL;
+    trie->childs        = NODE_CHILDS;
+    trie->allocator     = NULL;
+
+    if ( header->encoder != 0 ) {
+        trie->encoder = htr_encoder_load ( trie, image + header->encoder );
+        if ( trie->encoder == NULL ) {
+            talloc_free ( trie );
+            return NULL;
+        }
+        if ( htr_encoder_alphabet_size ( trie->encoder ) != 0 ) {
+            trie->childs = ( unsigned int ) htr_encoder_alphabet_size ( trie->encoder );
+        }
+    }
+
+    if ( talloc_add_destructor ( trie, destructor, NULL ) != 0 ) {
+        // destructor is not set, so image is still owned by caller
+        talloc_free ( trie );
+        return NULL;
+    }
+    return trie;
+}
+
+// Values of the image have one of sizes accepted by htr_new_sized, slots of other sizes are never written.
+static bool image_value_size ( uint64_t value_size )
+{
+    return value_size == 0 || value_size == 1 || value_size == 2 || value_size == 4 || value_size == 8 || value_size == HTR_VALUE_BLOB;
+}
+
+htr * htr_open_mmap ( void * ctx, const char * path, htr_hash_function hash_function )
+{
+    int fd = open ( path, O_RDONLY );
+    if ( fd < 0 ) {
+        return NULL;
+    }
+
+    struct stat st;
+    if ( fstat ( fd, &st ) != 0 || ( size_t ) st.st_size < sizeof ( htr_image_header ) ) {
+        close ( fd );
+        return NULL;
+    }
+    size_t size = ( size_t ) st.st_size;
+
+    uint8_t * image = mmap ( NULL, size, PROT_READ, MAP_SHARED, fd, 0 );
+    close ( fd );
+    if ( image == MAP_FAILED ) {
+        return NULL;
+    }
+
+    const htr_image_header * header = ( const htr_image_header * ) image;
+    if (
+        memcmp ( header->magic, IMAGE_MAGIC, sizeof ( header->magic ) ) != 0 ||
+        header->version    != IMAGE_VERSION ||
+        header->byte_order != IMAGE_BYTE_ORDER ||
+        header->size       != size ||
+        header->root       >= size ||
+        header->encoder + IMAGE_ENCODER_SIZE > size ||
+        !image_value_size ( header->value_size )
+    ) {
+        munmap ( image, size );
+        errno = EINVAL;
+        return NULL;
+    }
+
+    htr * trie = image_trie ( ctx, image, size, hash_function, htr_image_unmap );
+    if ( trie == NULL ) {
+        munmap ( image, size );
+    }
+    return trie;
+}
+
+htr * htr_freeze ( void * ctx, const htr * T, bool sorted )
+{
+    uint8_t * image;
+    size_t size;
+
+    if ( T->image != NULL ) {
+        // trie is already frozen, buckets are left in their encoding
+        size  = T->image_size;
+        image = malloc ( size );
+        if ( image == NULL ) {
+            return NULL;
+        }
+        memcpy ( image, T->image, size );
+    } else {
+        htr_image_writer w;
+        w.fd              = -1;
+        w.encoding        = sorted ? HTR_TABLE_IMAGE_SORTED : HTR_TABLE_IMAGE_HASHED;
+        w.hash_function   = T->hash_function;
+        w.value_size      = T->value_size;
+        w.childs          = T->childs;
+        w.buffer          = malloc ( IMAGE_BUFFER_SIZE );
+        w.buffer_size     = 0;
+        w.buffer_capacity = IMAGE_BUFFER_SIZE;
+        w.offset          = 0;
+        w.error           = 0;
+        if ( w.buffer == NULL ) {
+            return NULL;
+        }
+
+        uint64_t root = save_trie ( &w, T );
+        if ( w.error != 0 ) {
+            free ( w.buffer );
+            return NULL;
+        }
+        fill_header ( ( htr_image_header * ) w.buffer, T, w.offset, root, w.encoder );
+
+        // give back the spare capacity of the buffer
+        size  = w.buffer_size;
+        image = realloc ( w.buffer, size );
+        if ( image == NULL ) {
+            image = w.buffer;
+        }
+    }
+
+    htr * trie = image_trie ( ctx, image, size, T->hash_function, htr_image_free );
+    if ( trie == NULL ) {
+        free ( image );
+    }
+    return trie;
+}
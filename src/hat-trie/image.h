@@ -0,0 +1,28 @@
+// This file is part of hat-trie.
+// Copyright (c) 2013 by Andrew Aladjev <aladjev.andrew@gmail.com>
+//
+// Binary image of the trie. Image is position independent: trie nodes and buckets refer to each other by offsets from the beginning of the image.
+// So saved trie can be mapped into memory and used without deserialization.
+
+#ifndef HTR_IMAGE_H
+#define HTR_IMAGE_H
+
+#include "trie.h"
+
+// Write the image of the trie into the file descriptor starting from its current position.
+// File must be seekable, because header is written last. Returns 0 on success or -1 on error (errno is set).
+int htr_save ( const htr * trie, int fd );
+
+// Map the image written by htr_save read only.
+// Returned trie is served directly from the mapping: htr_tryget, iterators and htr_walk work on it, htr_get and htr_del fail.
+// Values are read only. Hash function must be the same that was used by the saved trie.
+// Returns NULL if the file can't be mapped or it is not a valid image of the current version.
+htr * htr_open_mmap ( void * ctx, const char * path, htr_hash_function hash_function );
+
+// Build compact read only copy of the trie in memory, it is served like the mapped image and can be saved with htr_save.
+// Trie nodes keep only distinct children, buckets are sized for their pairs and have 32 bit offsets.
+// Buckets are front coded when sorted is true: they are smaller and iterated in order without sorting, but lookup makes binary search.
+// Otherwise buckets are array hash tables. Returns NULL if memory can't be allocated or bucket is too big.
+htr * htr_freeze ( void * ctx, const htr * trie, bool sorted );
+
+#endif
@@ -0,0 +1,494 @@
+// This file is part of hat-trie.
+// Copyright (c) 2013 by Andrew Aladjev <aladjev.andrew@gmail.com>
+
+#include "log.h"
+#include "image.h"
+#include "encoder.h"
+#include "node.h"
+#include "slot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <talloc2/tree.h>
+#include <talloc2/ext/destructor.h>
+
+// Log is a header followed by records: operation, key length (varint), key, value for set operation and checksum of the record.
+// Blob set operation keeps blob length (varint) and bytes of the blob in place of the value.
+// Numbers are stored in host byte order like in the image.
+
+static const char     LOG_MAGIC[8]     = "HTRLOG";
+static const uint32_t LOG_VERSION      = 2;
+static const uint32_t LOG_BYTE_ORDER   = 0x01020304;
+static const size_t   LOG_BUFFER_SIZE  = 1 << 16;
+
+typedef struct htr_log_header_t {
+    char     magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t value_size; // records are replayed into the trie with the same values
+    uint32_t reserved;
+} htr_log_header;
+
+struct htr_log_t {
+    int    fd;
+    size_t commit_size;
+
+    uint8_t * buffer;
+    size_t    buffer_size;
+    size_t    buffer_capacity;
+
+    char * snapshot_path;
+    char * temp_path; // new snapshot is written here and renamed
+};
+
+// FNV-1a
+static uint32_t checksum ( const uint8_t * data, size_t size )
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for ( i = 0; i < size; i++ ) {
+        hash = ( hash ^ data[i] ) * 16777619u;
+    }
+    return hash;
+}
+
+static int write_all ( int fd, const uint8_t * data, size_t size )
+{
+    ssize_t written;
+    while ( size > 0 ) {
+        written = write ( fd, data, size );
+        if ( written < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        size -= ( size_t ) written;
+    }
+    return 0;
+}
+
+static int log_write ( htr_log * log )
+{
+    int result = write_all ( log->fd, log->buffer, log->buffer_size );
+    log->buffer_size = 0;
+    return result;
+}
+
+// Reserve the record of the given size at the end of the buffer, returns NULL on error.
+static uint8_t * log_reserve ( htr_log * log, size_t size )
+{
+    if ( log->buffer_size + size > log->buffer_capacity ) {
+        if ( log_write ( log ) != 0 ) {
+            return NULL;
+        }
+        if ( size > log->buffer_capacity ) {
+            uint8_t * buffer = realloc ( log->buffer, size );
+            if ( buffer == NULL ) {
+                errno = ENOMEM;
+                return NULL;
+            }
+            log->buffer          = buffer;
+            log->buffer_capacity = size;
+        }
+    }
+    return log->buffer + log->buffer_size;
+}
+
+// Write checksum at the end s of the reserved record and commit the group if it is large enough.
+static int log_seal ( htr_log * log, uint8_t * record, uint8_t * s )
+{
+    uint32_t sum = checksum ( record, ( size_t ) ( s - record ) );
+    memcpy ( s, &sum, sizeof ( uint32_t ) );
+    log->buffer_size += ( size_t ) ( s - record ) + sizeof ( uint32_t );
+
+    if ( log->commit_size != 0 && log->buffer_size >= log->commit_size ) {
+        if ( log_write ( log ) != 0 || fdatasync ( log->fd ) != 0 ) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int htr_log_append ( htr_log * log, uint8_t operation, const char * key, size_t length, htr_value value )
+{
+    size_t size = 1 + varint_size ( length ) + length + sizeof ( uint32_t );
+    if ( operation == HTR_LOG_SET ) {
+        size += sizeof ( htr_value );
+    }
+
+    uint8_t * record = log_reserve ( log, size );
+    if ( record == NULL ) {
+        return -1;
+    }
+    uint8_t * s = record;
+    *s++ = operation;
+    s = varint_write ( s, length );
+    memcpy ( s, key, length );
+    s += length;
+    if ( operation == HTR_LOG_SET ) {
+        memcpy ( s, &value, sizeof ( htr_value ) );
+        s += sizeof ( htr_value );
+    }
+    return log_seal ( log, record, s );
+}
+
+int htr_log_append_blob ( htr_log * log, const char * key, size_t length, const void * data, size_t data_size )
+{
+    size_t size = 1 + varint_size ( length ) + length + varint_size ( data_size ) + data_size + sizeof ( uint32_t );
+
+    uint8_t * record = log_reserve ( log, size );
+    if ( record == NULL ) {
+        return -1;
+    }
+    uint8_t * s = record;
+    *s++ = HTR_LOG_BLOB;
+    s = varint_write ( s, length );
+    memcpy ( s, key, length );
+    s += length;
+    s = varint_write ( s, data_size );
+    memcpy ( s, data, data_size );
+    s += data_size;
+    return log_seal ( log, record, s );
+}
+
+int htr_log_commit ( htr * T )
+{
+    if ( T->log == NULL ) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ( log_write ( T->log ) != 0 || fdatasync ( T->log->fd ) != 0 ) {
+        return -1;
+    }
+    return 0;
+}
+
+int htr_log_checkpoint ( htr * T )
+{
+    htr_log * log = T->log;
+    if ( htr_log_commit ( T ) != 0 ) {
+        return -1;
+    }
+
+    int fd = open ( log->temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if ( fd < 0 ) {
+        return -1;
+    }
+    if ( htr_save ( T, fd ) != 0 || fsync ( fd ) != 0 ) {
+        int error = errno;
+        close ( fd );
+        unlink ( log->temp_path );
+        errno = error;
+        return -1;
+    }
+    if ( close ( fd ) != 0 || rename ( log->temp_path, log->snapshot_path ) != 0 ) {
+        int error = errno;
+        unlink ( log->temp_path );
+        errno = error;
+        return -1;
+    }
+
+    // Crash before truncation replays records that are in the snapshot already, they set the same values again.
+    if ( ftruncate ( log->fd, sizeof ( htr_log_header ) ) != 0 || lseek ( log->fd, 0, SEEK_END ) < 0 || fdatasync ( log->fd ) != 0 ) {
+        return -1;
+    }
+    return 0;
+}
+
+// Read varint that may be torn, returns NULL if it does not end before the end.
+static const uint8_t * read_length ( const uint8_t * s, const uint8_t * end, size_t * value )
+{
+    size_t rest = ( size_t ) ( end - s );
+    size_t j;
+    for ( j = 0; j < rest && j < 10 && ( s[j] & 0x80 ); j++ );
+    if ( j == rest || j == 10 ) {
+        return NULL;
+    }
+    return varint_read ( s, value );
+}
+
+// Parse records of the log and apply them to the trie, the size of the valid part of the log is written to valid.
+// Returns -1 if the valid record can't be applied, the log must be kept then.
+static int replay ( htr * T, const uint8_t * data, size_t size, size_t * valid_size )
+{
+    const uint8_t * s   = data + sizeof ( htr_log_header );
+    const uint8_t * end = data + size;
+    const uint8_t * valid = s;
+    size_t length, rest, blob_size = 0;
+    uint32_t sum;
+    htr_value value = 0;
+    const uint8_t * blob = NULL;
+
+    while ( s < end ) {
+        const uint8_t * record = s;
+        uint8_t operation = *s++;
+        if ( operation != HTR_LOG_SET && operation != HTR_LOG_DEL && operation != HTR_LOG_BLOB ) {
+            break;
+        }
+
+        // varint may be torn too
+        s = read_length ( s, end, &length );
+        if ( s == NULL ) {
+            break;
+        }
+
+        rest = ( size_t ) ( end - s );
+        size_t need = length + sizeof ( uint32_t ) + ( operation == HTR_LOG_SET ? sizeof ( htr_value ) : 0 );
+        if ( length > rest || need > rest ) {
+            break;
+        }
+        const char * key = ( const char * ) s;
+        s += length;
+        if ( operation == HTR_LOG_SET ) {
+            memcpy ( &value, s, sizeof ( htr_value ) );
+            s += sizeof ( htr_value );
+        } else if ( operation == HTR_LOG_BLOB ) {
+            s = read_length ( s, end, &blob_size );
+            if ( s == NULL ) {
+                break;
+            }
+            rest = ( size_t ) ( end - s );
+            if ( blob_size > rest || blob_size + sizeof ( uint32_t ) > rest ) {
+                break;
+            }
+            blob = s;
+            s += blob_size;
+        }
+        memcpy ( &sum, s, sizeof ( uint32_t ) );
+        if ( sum != checksum ( record, ( size_t ) ( s - record ) ) ) {
+            break;
+        }
+        s += sizeof ( uint32_t );
+
+        if ( operation == HTR_LOG_SET ) {
+            if ( htr_set ( T, key, length, value ) != 0 ) {
+                errno = ENOMEM;
+                return -1;
+            }
+        } else if ( operation == HTR_LOG_BLOB ) {
+            if ( htr_blob_set ( T, key, length, blob, blob_size ) != 0 ) {
+                errno = ENOMEM;
+                return -1;
+            }
+        } else {
+            htr_del ( T, key, length );
+        }
+        valid = s;
+    }
+
+    *valid_size = ( size_t ) ( valid - data );
+    return 0;
+}
+
+typedef struct load_state_t {
+    htr *  T;
+    char * key;
+    size_t capacity;
+    int    error;
+} load_state;
+
+static int load_pair ( const htr_key_view * view, htr_value * value, void * data )
+{
+    load_state * state = data;
+    size_t length = view->prefix_length + view->suffix_length;
+    if ( length > state->capacity ) {
+        char * key = realloc ( state->key, length );
+        if ( key == NULL ) {
+            state->error = ENOMEM;
+            return 1;
+        }
+        state->key      = key;
+        state->capacity = length;
+    }
+    memcpy ( state->key, view->prefix, view->prefix_length );
+    memcpy ( state->key + view->prefix_length, view->suffix, view->suffix_length );
+    int result;
+    if ( state->T->value_size == HTR_VALUE_BLOB ) {
+        size_t size;
+        const void * blob = htr_blob_data ( value, &size );
+        result = htr_blob_set ( state->T, state->key, length, blob, size );
+    } else {
+        result = htr_set ( state->T, state->key, length, *value );
+    }
+    if ( result != 0 ) {
+        state->error = ENOMEM;
+        return 1;
+    }
+    return 0;
+}
+
+// Insert all pairs of the snapshot into the trie, missing snapshot is empty.
+static int load_snapshot ( htr * T, const char * path )
+{
+    if ( access ( path, F_OK ) != 0 ) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    htr * snapshot = htr_open_mmap ( NULL, path, T->hash_function );
+    if ( snapshot == NULL ) {
+        if ( errno == 0 ) {
+            errno = EINVAL;
+        }
+        return -1;
+    }
+    // narrower values would be truncated by htr_set
+    if ( snapshot->value_size != T->value_size ) {
+        talloc_free ( snapshot );
+        errno = EINVAL;
+        return -1;
+    }
+    // recovered trie encodes keys like the trie that saved the snapshot
+    if ( snapshot->encoder != NULL && htr_set_encoder ( T, snapshot->encoder ) != 0 ) {
+        talloc_free ( snapshot );
+        return -1;
+    }
+
+    load_state state;
+    state.T        = T;
+    state.key      = NULL;
+    state.capacity = 0;
+    state.error    = 0;
+    htr_walk ( snapshot, "", 0, false, load_pair, &state );
+    free ( state.key );
+    talloc_free ( snapshot );
+
+    if ( state.error != 0 ) {
+        errno = state.error;
+        return -1;
+    }
+    return 0;
+}
+
+// Replay the log file and leave it positioned after the last valid record.
+static int load_log ( htr * T, int fd )
+{
+    struct stat st;
+    if ( fstat ( fd, &st ) != 0 ) {
+        return -1;
+    }
+    size_t size = ( size_t ) st.st_size;
+
+    if ( size < sizeof ( htr_log_header ) ) {
+        // new log or torn header
+        htr_log_header header;
+        memset ( &header, 0, sizeof ( header ) );
+        memcpy ( header.magic, LOG_MAGIC, sizeof ( header.magic ) );
+        header.version    = LOG_VERSION;
+        header.byte_order = LOG_BYTE_ORDER;
+        header.value_size = ( uint32_t ) T->value_size;
+        if ( ftruncate ( fd, 0 ) != 0 || pwrite ( fd, &header, sizeof ( header ), 0 ) != ( ssize_t ) sizeof ( header ) || fdatasync ( fd ) != 0 ) {
+            return -1;
+        }
+        size = sizeof ( header );
+    } else {
+        const uint8_t * data = mmap ( NULL, size, PROT_READ, MAP_SHARED, fd, 0 );
+        if ( data == MAP_FAILED ) {
+            return -1;
+        }
+        const htr_log_header * header = ( const htr_log_header * ) data;
+        if (
+            memcmp ( header->magic, LOG_MAGIC, sizeof ( header->magic ) ) != 0 ||
+            header->version    != LOG_VERSION ||
+            header->byte_order != LOG_BYTE_ORDER ||
+            header->value_size != T->value_size
+        ) {
+            munmap ( ( void * ) data, size );
+            errno = EINVAL;
+            return -1;
+        }
+
+        size_t valid;
+        int result = replay ( T, data, size, &valid );
+        int error  = errno;
+        munmap ( ( void * ) data, size );
+        if ( result != 0 ) {
+            errno = error;
+            return -1;
+        }
+
+        // drop torn tail, so new records follow the valid ones
+        if ( valid < size && ftruncate ( fd, ( off_t ) valid ) != 0 ) {
+            return -1;
+        }
+        size = valid;
+    }
+
+    if ( lseek ( fd, ( off_t ) size, SEEK_SET ) < 0 ) {
+        return -1;
+    }
+    return 0;
+}
+
+static
+uint8_t htr_log_free ( void * child_data, void * user_data )
+{
+    ( void ) user_data;
+    htr_log * log = child_data;
+    if ( log->buffer_size > 0 ) {
+        log_write ( log );
+    }
+    free ( log->buffer );
+    close ( log->fd );
+    return 0;
+}
+
+htr * htr_log_open ( void * ctx, const char * snapshot_path, const char * log_path, htr_hash_function hash_function, size_t value_size, size_t commit_size )
+{
+    htr * T = htr_new_sized ( ctx, hash_function, value_size );
+    if ( T == NULL ) {
+        return NULL;
+    }
+
+    size_t path_length = strlen ( snapshot_path );
+    htr_log * log = talloc ( T, sizeof ( htr_log ) + 2 * path_length + 6 );
+    if ( log == NULL ) {
+        talloc_free ( T );
+        return NULL;
+    }
+    log->commit_size     = commit_size;
+    log->buffer          = NULL;
+    log->buffer_size     = 0;
+    log->buffer_capacity = 0;
+    log->snapshot_path   = ( char * ) ( log + 1 );
+    log->temp_path       = log->snapshot_path + path_length + 1;
+    memcpy ( log->snapshot_path, snapshot_path, path_length + 1 );
+    memcpy ( log->temp_path, snapshot_path, path_length );
+    memcpy ( log->temp_path + path_length, ".tmp", 5 );
+
+    log->fd = open ( log_path, O_RDWR | O_CREAT, 0644 );
+    if ( log->fd < 0 ) {
+        talloc_free ( T );
+        return NULL;
+    }
+    if ( talloc_add_destructor ( log, htr_log_free, NULL ) != 0 ) {
+        close ( log->fd );
+        talloc_free ( T );
+        return NULL;
+    }
+
+    // log is attached after recovery, so replayed changes are not logged again
+    if ( load_snapshot ( T, snapshot_path ) != 0 || load_log ( T, log->fd ) != 0 ) {
+        int error = errno;
+        talloc_free ( T );
+        errno = error;
+        return NULL;
+    }
+
+    log->buffer = malloc ( LOG_BUFFER_SIZE );
+    if ( log->buffer == NULL ) {
+        talloc_free ( T );
+        return NULL;
+    }
+    log->buffer_capacity = LOG_BUFFER_SIZE;
+
+    T->log = log;
+    return T;
+}
@@ -0,0 +1,30 @@
+// This file is part of hat-trie.
+// Copyright (c) 2013 by Andrew Aladjev <aladjev.andrew@gmail.com>
+//
+// Write-ahead log of the mutable trie. Changes made by htr_set and htr_del are appended to the log,
+// values written through pointers returned by htr_get are not logged. Lookups never touch the log.
+//
+// Records are collected in the buffer and written with a single fdatasync by commit (group commit).
+// Checkpoint saves the snapshot image of the trie and truncates the log, recovery loads the snapshot and replays the log.
+
+#ifndef HTR_LOG_H
+#define HTR_LOG_H
+
+#include "trie.h"
+
+// Recover the trie with values of value_size bytes (see htr_new_sized) from the snapshot and the log and attach the log to it.
+// Missing files are treated as empty.
+// Buffer is committed automatically when it reaches commit_size bytes, 0 means that only htr_log_commit commits.
+// Torn record at the end of the log is dropped. Log written with other value_size is rejected,
+// log with the record that can't be applied is kept untouched. Returns NULL on error (errno is set).
+htr * htr_log_open ( void * ctx, const char * snapshot_path, const char * log_path, htr_hash_function hash_function, size_t value_size, size_t commit_size );
+
+// Write buffered records and sync the log, changes are durable after it returns.
+// Returns 0 on success or -1 on error (errno is set).
+int htr_log_commit ( htr * trie );
+
+// Commit the log, replace the snapshot with the image of the trie and truncate the log.
+// Returns 0 on success or -1 on error (errno is set).
+int htr_log_checkpoint ( htr * trie );
+
+#endif
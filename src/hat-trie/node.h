@@ -0,0 +1,190 @@
+// This file is part of hat-trie.
+// Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+// Copyright (c) 2013 by Andrew Aladjev <aladjev.andrew@gmail.com>
+//
+// Trie nodes layout. It is private for hat-trie sources.
+
+#ifndef HTR_NODE_H
+#define HTR_NODE_H
+
+#include "trie.h"
+#include "table.h"
+
+#define NODE_MAXCHAR 0xff // 0x7f for 7-bit ASCII
+#define NODE_CHILDS (NODE_MAXCHAR+1)
+
+static const uint8_t NODE_TYPE_TRIE          = 1;
+static const uint8_t NODE_TYPE_PURE_BUCKET   = 1 << 1;
+static const uint8_t NODE_TYPE_HYBRID_BUCKET = 1 << 2;
+static const uint8_t NODE_HAS_VAL            = 1 << 3;
+
+// Node's may be trie nodes or buckets. This union allows us to keep non-specific pointer.
+// Nodes of the mapped image also start with flag, so it can point to them too.
+typedef union htr_node_ptr_t {
+    htr_table *               table;
+    struct htr_trie_node_t *  trie_node;
+    htr_table_image *         table_image;
+    struct htr_image_node_t * image_node;
+    uint8_t *                 flag;
+} htr_node_ptr;
+
+struct htr_t {
+    htr_node_ptr      root;
+    size_t            pairs_count;
+    htr_hash_function hash_function;
+    size_t            value_size;
+    // buckets front code their keys
+    bool              front_coded;
+    // trie nodes and buckets keep the maximum of their values for htr_topk_prefix
+    bool              scored;
+    // trie nodes keep the number of keys below them for order statistics
+    bool              counted;
+
+    // keys are encoded before they reach nodes and buckets, NULL if keys are stored as is
+    struct htr_encoder_t * encoder;
+    // trie nodes have a child for every code of the alphabet encoder or for every byte
+    unsigned int childs;
+
+    // allocator of nodes and buckets, NULL for malloc
+    const htr_allocator * allocator;
+
+    // read only trie is served from the image, NULL for mutable trie
+    const uint8_t * image;
+    size_t          image_size;
+
+    // write-ahead log of changes, NULL if trie is not logged
+    struct htr_log_t * log;
+};
+
+typedef struct htr_trie_node_t {
+    uint8_t flag;
+
+    // the value for the key that is consumed on a trie node, pointer to the value field for blob values
+    htr_value value;
+
+    // not less than any value below the node if trie is scored
+    htr_value max;
+
+    // the number of keys below the node including its own one if trie is counted
+    size_t count;
+
+    // Map a character to either a htr_trie_node_t or a htr_table_t.
+    // The first byte must be examined to determine which. There are childs of the trie pointers.
+    htr_node_ptr xs[];
+} htr_trie_node;
+
+// Trie node in the image. Children are stored once for each run of equal pointers, the bit of runs is set for the first character of every run.
+// Number of the run for the character is the number of bits set up to it, ranks keep the number of runs before each word of bits.
+// Children are always written before their parent, so they are referred by the distance back from the node.
+// Distances are 32 bit, but node with a far child is wide and keeps 64 bit distances.
+typedef struct htr_image_node_t {
+    uint8_t   flag;
+    uint8_t   wide;
+    uint16_t  childs_count;
+    uint8_t   ranks[4];
+    htr_value value;
+    htr_value max;   // the maximum of values below the node, 0 for blob values
+    uint64_t  count; // the number of keys below the node including its own one
+    uint64_t  runs[NODE_CHILDS / 64];
+    uint32_t  childs[];
+} htr_image_node;
+
+static inline
+htr_node_ptr image_node_child ( const htr_image_node * node, unsigned char c )
+{
+    size_t word = c / 64;
+    size_t rank = node->ranks[word] + ( size_t ) __builtin_popcountll ( node->runs[word] & ( UINT64_MAX >> ( 63 - c % 64 ) ) ) - 1;
+    uint64_t distance = node->wide ? ( ( const uint64_t * ) node->childs ) [rank] : node->childs[rank];
+
+    htr_node_ptr child;
+    child.flag = ( uint8_t * ) node - distance;
+    return child;
+}
+
+static inline
+htr_node_ptr node_child ( const htr * trie, htr_node_ptr node, unsigned char c )
+{
+    if ( trie->image == NULL ) {
+        return node.trie_node->xs[c];
+    }
+    return image_node_child ( node.image_node, c );
+}
+
+// Blob value of the trie node is kept out of line: live node points to the allocated value field, image node keeps its offset from the node.
+static inline
+htr_value * node_value ( const htr * trie, htr_node_ptr node )
+{
+    if ( trie->image == NULL ) {
+        if ( trie->value_size == HTR_VALUE_BLOB ) {
+            return ( htr_value * ) ( uintptr_t ) node.trie_node->value;
+        }
+        return &node.trie_node->value;
+    }
+    if ( trie->value_size == HTR_VALUE_BLOB ) {
+        return ( htr_value * ) ( node.flag + node.image_node->value );
+    }
+    return &node.image_node->value;
+}
+
+static inline
+size_t node_table_size ( const htr * trie, htr_node_ptr node )
+{
+    if ( trie->image == NULL ) {
+        return htr_table_size ( node.table );
+    }
+    return node.table_image->pairs_count;
+}
+
+// Iterate trie nodes until string is consumed or bucket is found.
+// It works for both mutable and mapped tries, hot paths of mutable trie use their own consume.
+static inline
+htr_node_ptr node_consume ( const htr * trie, htr_node_ptr * p, const char ** k, size_t * l, unsigned brk )
+{
+    htr_node_ptr node = node_child ( trie, *p, ( unsigned char ) ** k );
+    while ( * node.flag & NODE_TYPE_TRIE && * l > brk ) {
+        ++ * k;
+        -- * l;
+        * p  = node;
+        node = node_child ( trie, node, ( unsigned char ) ** k );
+    }
+    return node;
+}
+
+// find the key in the read only trie, defined in image.c
+htr_value * htr_image_tryget ( const htr * trie, const char * key, size_t length );
+
+struct htr_encoder_t;
+
+// Encoder functions used by trie, defined in encoder.c.
+// Encoded key takes at most htr_encoded_size_max bytes, prefix is encoded without the end and only its full bytes are returned.
+// Alphabet encoder returns SIZE_MAX if the key has a byte out of the alphabet.
+size_t htr_encoded_size_max ( size_t length );
+size_t htr_encode           ( const struct htr_encoder_t * encoder, const char * key, size_t length, bool terminate, uint8_t * output );
+
+// Decode the key into the output, returns its whole length even if it is greater than capacity.
+size_t htr_decode ( const struct htr_encoder_t * encoder, const uint8_t * input, size_t size, char * output, size_t capacity );
+
+// Encoder is saved in the image as lengths of its codes, they are validated by load.
+const uint8_t *          htr_encoder_lengths ( const struct htr_encoder_t * encoder );
+struct htr_encoder_t *   htr_encoder_load    ( void * ctx, const uint8_t * lengths );
+
+// Size of the alphabet of the alphabet encoder, 0 for the code encoder.
+size_t htr_encoder_alphabet_size ( const struct htr_encoder_t * encoder );
+
+// Encoders are equal if they have the same codes, NULL encoders are equal too.
+bool htr_encoder_equal ( const struct htr_encoder_t * a, const struct htr_encoder_t * b );
+
+typedef struct htr_log_t htr_log;
+
+static const uint8_t HTR_LOG_SET = 1;
+static const uint8_t HTR_LOG_DEL = 2;
+
+static const uint8_t HTR_LOG_BLOB = 3;
+
+// append the change to the log buffer, defined in log.c
+int htr_log_append ( htr_log * log, uint8_t operation, const char * key, size_t length, htr_value value );
+
+// append the blob value set to the log buffer
+int htr_log_append_blob ( htr_log * log, const char * key, size_t length, const void * data, size_t size );
+
+#endif
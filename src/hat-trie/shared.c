@@ -0,0 +1,224 @@
+// This file is part of hat-trie.
+// Copyright (c) 2013 by Andrew Aladjev <aladjev.andrew@gmail.com>
+
+#include "shared.h"
+#include "image.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <talloc2/tree.h>
+#include <talloc2/ext/destructor.h>
+
+static const char     SHARED_MAGIC[8]   = "HTRSHMC";
+static const uint32_t SHARED_VERSION    = 1;
+static const uint32_t SHARED_BYTE_ORDER = 0x01020304;
+
+// length of the generation suffix ".%llu" with terminating zero
+#define SHARED_SUFFIX_SIZE 22
+
+typedef struct htr_shared_control_t {
+    char     magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t generation; // accessed atomically
+} htr_shared_control;
+
+struct htr_shared_t {
+    int                  fd;
+    bool                 writable;
+    htr_shared_control * control;
+    htr_hash_function    hash_function;
+
+    // trie of the mapped generation, it is a child of this structure
+    htr *    trie;
+    uint64_t generation;
+
+    char * image_path;
+    size_t path_length;
+};
+
+static
+uint8_t htr_shared_free ( void * child_data, void * user_data )
+{
+    ( void ) user_data;
+    htr_shared * shared = child_data;
+    if ( shared->control != NULL ) {
+        munmap ( shared->control, sizeof ( htr_shared_control ) );
+    }
+    close ( shared->fd );
+    return 0;
+}
+
+static const char * image_path ( htr_shared * shared, uint64_t generation )
+{
+    snprintf ( shared->image_path + shared->path_length, SHARED_SUFFIX_SIZE, ".%llu", ( unsigned long long ) generation );
+    return shared->image_path;
+}
+
+// Write the header of the new control file, it is done under the lock, so only one process initializes it.
+static int init_control ( int fd )
+{
+    struct stat st;
+    if ( fstat ( fd, &st ) != 0 ) {
+        return -1;
+    }
+    if ( st.st_size != 0 ) {
+        return 0;
+    }
+
+    htr_shared_control control;
+    memset ( &control, 0, sizeof ( control ) );
+    memcpy ( control.magic, SHARED_MAGIC, sizeof ( control.magic ) );
+    control.version    = SHARED_VERSION;
+    control.byte_order = SHARED_BYTE_ORDER;
+    control.generation = 0;
+    if ( pwrite ( fd, &control, sizeof ( control ), 0 ) != ( ssize_t ) sizeof ( control ) ) {
+        return -1;
+    }
+    return 0;
+}
+
+htr_shared * htr_shared_open ( void * ctx, const char * path, htr_hash_function hash_function )
+{
+    size_t path_length = strlen ( path );
+    htr_shared * shared = talloc ( ctx, sizeof ( htr_shared ) + path_length + SHARED_SUFFIX_SIZE );
+    if ( shared == NULL ) {
+        return NULL;
+    }
+    shared->control       = NULL;
+    shared->hash_function = hash_function;
+    shared->trie          = NULL;
+    shared->generation    = 0;
+    shared->image_path    = ( char * ) ( shared + 1 );
+    shared->path_length   = path_length;
+    memcpy ( shared->image_path, path, path_length + 1 );
+
+    shared->writable = true;
+    shared->fd       = open ( path, O_RDWR | O_CREAT, 0644 );
+    if ( shared->fd < 0 && errno == EACCES ) {
+        shared->writable = false;
+        shared->fd       = open ( path, O_RDONLY );
+    }
+    if ( shared->fd < 0 ) {
+        talloc_free ( shared );
+        return NULL;
+    }
+    if ( talloc_add_destructor ( shared, htr_shared_free, NULL ) != 0 ) {
+        close ( shared->fd );
+        talloc_free ( shared );
+        return NULL;
+    }
+
+    if ( shared->writable ) {
+        if ( flock ( shared->fd, LOCK_EX ) != 0 ) {
+            talloc_free ( shared );
+            return NULL;
+        }
+        int result = init_control ( shared->fd );
+        flock ( shared->fd, LOCK_UN );
+        if ( result != 0 ) {
+            talloc_free ( shared );
+            return NULL;
+        }
+    }
+
+    struct stat st;
+    if ( fstat ( shared->fd, &st ) != 0 || ( size_t ) st.st_size < sizeof ( htr_shared_control ) ) {
+        talloc_free ( shared );
+        return NULL;
+    }
+
+    void * control = mmap ( NULL, sizeof ( htr_shared_control ), shared->writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, shared->fd, 0 );
+    if ( control == MAP_FAILED ) {
+        talloc_free ( shared );
+        return NULL;
+    }
+    shared->control = control;
+
+    if (
+        memcmp ( shared->control->magic, SHARED_MAGIC, sizeof ( shared->control->magic ) ) != 0 ||
+        shared->control->version    != SHARED_VERSION ||
+        shared->control->byte_order != SHARED_BYTE_ORDER
+    ) {
+        talloc_free ( shared );
+        return NULL;
+    }
+
+    return shared;
+}
+
+int htr_shared_publish ( htr_shared * shared, const htr * trie )
+{
+    if ( !shared->writable ) {
+        errno = EACCES;
+        return -1;
+    }
+    if ( flock ( shared->fd, LOCK_EX ) != 0 ) {
+        return -1;
+    }
+
+    uint64_t generation = __atomic_load_n ( &shared->control->generation, __ATOMIC_ACQUIRE ) + 1;
+
+    int result = -1;
+    int fd = open ( image_path ( shared, generation ), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if ( fd >= 0 ) {
+        result = htr_save ( trie, fd );
+        if ( close ( fd ) != 0 ) {
+            result = -1;
+        }
+    }
+
+    if ( result == 0 ) {
+        __atomic_store_n ( &shared->control->generation, generation, __ATOMIC_RELEASE );
+
+        // Readers that still map the previous image keep it alive.
+        // Reader that is late to open it sees the new generation and retries.
+        if ( generation > 1 ) {
+            unlink ( image_path ( shared, generation - 1 ) );
+        }
+    } else {
+        int error = errno;
+        unlink ( image_path ( shared, generation ) );
+        errno = error;
+    }
+
+    flock ( shared->fd, LOCK_UN );
+    return result;
+}
+
+htr * htr_shared_get ( htr_shared * shared )
+{
+    uint64_t generation = __atomic_load_n ( &shared->control->generation, __ATOMIC_ACQUIRE );
+
+    while ( generation != shared->generation ) {
+        htr * trie = htr_open_mmap ( shared, image_path ( shared, generation ), shared->hash_function );
+        if ( trie != NULL ) {
+            if ( shared->trie != NULL ) {
+                talloc_free ( shared->trie );
+            }
+            shared->trie       = trie;
+            shared->generation = generation;
+            break;
+        }
+
+        // image is replaced while it was opened, retry with the newer one, otherwise keep the current trie
+        uint64_t next = __atomic_load_n ( &shared->control->generation, __ATOMIC_ACQUIRE );
+        if ( next == generation ) {
+            break;
+        }
+        generation = next;
+    }
+
+    return shared->trie;
+}
+
+uint64_t htr_shared_generation ( const htr_shared * shared )
+{
+    return shared->generation;
+}
@@ -0,0 +1,34 @@
+// This file is part of hat-trie.
+// Copyright (c) 2013 by Andrew Aladjev <aladjev.andrew@gmail.com>
+//
+// Trie shared by many processes. Images are position independent, so every process maps the same pages of the published image.
+// Single writer publishes new images, readers switch to them when they see the new generation.
+//
+// Path is a small control file with the generation counter, it may be placed in /dev/shm to keep everything in memory.
+// Image of each generation is the file with the generation number appended to the path.
+
+#ifndef HTR_SHARED_H
+#define HTR_SHARED_H
+
+#include "trie.h"
+
+typedef struct htr_shared_t htr_shared;
+
+// Open the control file, it is created if it doesn't exist. Control file that can't be written is opened for reading only.
+// Returns NULL on error.
+htr_shared * htr_shared_open ( void * ctx, const char * path, htr_hash_function hash_function );
+
+// Write the image of the trie as the next generation and make it visible to readers.
+// Frozen trie is written as it is, so htr_freeze can make the published image smaller.
+// Writers are serialized by the lock of the control file. Returns 0 on success or -1 on error (errno is set).
+int htr_shared_publish ( htr_shared * shared, const htr * trie );
+
+// Read only trie of the current generation or NULL if nothing is published yet.
+// Check of the generation is a single atomic load, so it can be called before every query.
+// When generation is changed, the new image is mapped and the previous trie is freed, so pointers into it become invalid.
+htr * htr_shared_get ( htr_shared * shared );
+
+// generation of the trie returned by the last htr_shared_get, 0 if nothing is mapped
+uint64_t htr_shared_generation ( const htr_shared * shared );
+
+#endif
@@ -0,0 +1,279 @@
+// This file is part of hat-trie.
+// Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+// Copyright (c) 2013 by Andrew Aladjev <aladjev.andrew@gmail.com>
+//
+// Layout of pairs in table slots. It is private for hat-trie sources, that scan slots directly.
+// Slot is a sequence of pairs: key header, key and value.
+// Header of the key shorter than 128 bytes is its length in 1 byte with the highest bit clear, so short keys are read without a loop.
+// Longer keys have header with varint of the length shifted by one, the lowest bit is set for the key stored out of line.
+// Out of line key of the table is replaced with the stub: 32 bit hash of the key and pointer to the allocated bytes of the key.
+// Keys of images are always inline.
+// Value has the size of 0, 1, 2, 4 or 8 bytes, that is fixed for the trie. It is stored in host byte order.
+// Blob value is the varint length and bytes of the blob, empty blob is a single zero byte.
+
+#ifndef HTR_SLOT_H
+#define HTR_SLOT_H
+
+#include "common.h"
+#include <stdbool.h>
+#include <string.h>
+
+// keys of this length and longer are stored out of line in tables, only long headers have the stub bit, so it is at least 128
+static const size_t SLOT_LONG_KEY = 1024;
+
+// size of the stub of out of line key
+#define SLOT_STUB_SIZE ( sizeof ( uint32_t ) + sizeof ( uint8_t * ) )
+
+// LEB128 variable length numbers, 7 bits per byte, the highest bit is set when more bytes follow.
+
+static inline
+size_t varint_size ( size_t value )
+{
+    size_t size = 1;
+    while ( value >= 0x80 ) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+static inline
+uint8_t * varint_write ( uint8_t * s, size_t value )
+{
+    while ( value >= 0x80 ) {
+        * s++ = ( uint8_t ) ( value | 0x80 );
+        value >>= 7;
+    }
+    * s++ = ( uint8_t ) value;
+    return s;
+}
+
+static inline
+const uint8_t * varint_read ( const uint8_t * s, size_t * value )
+{
+    size_t result = 0;
+    unsigned shift = 0;
+    while ( * s & 0x80 ) {
+        result |= ( size_t ) ( * s++ & 0x7f ) << shift;
+        shift  += 7;
+    }
+    * value = result | ( ( size_t ) * s++ << shift );
+    return s;
+}
+
+// Read the header of the key, returns the beginning of the key field.
+static inline __attribute__ ( ( always_inline ) )
+uint8_t * key_read ( const uint8_t * s, size_t * length, bool * stub )
+{
+    if ( ! ( * s & 0x80 ) ) {
+        * length = * s;
+        * stub   = false;
+        return ( uint8_t * ) s + 1;
+    }
+    size_t header;
+    s = varint_read ( s, &header );
+    * length = header >> 1;
+    * stub   = header & 1;
+    return ( uint8_t * ) s;
+}
+
+static inline
+size_t key_header_size ( size_t length, bool stub )
+{
+    return length < 128 ? 1 : varint_size ( length << 1 | stub );
+}
+
+static inline
+uint8_t * key_header_write ( uint8_t * s, size_t length, bool stub )
+{
+    if ( length < 128 ) {
+        * s = ( uint8_t ) length;
+        return s + 1;
+    }
+    return varint_write ( s, length << 1 | stub );
+}
+
+// should the new key of the table be stored out of line
+static inline
+bool key_stub ( size_t length )
+{
+    return length >= SLOT_LONG_KEY;
+}
+
+// size of the key field
+static inline
+size_t key_field_size ( size_t length, bool stub )
+{
+    return stub ? SLOT_STUB_SIZE : length;
+}
+
+// bytes of the key starting at the key field
+static inline
+const uint8_t * key_data ( const uint8_t * field, bool stub )
+{
+    if ( !stub ) {
+        return field;
+    }
+    const uint8_t * data;
+    memcpy ( &data, field + sizeof ( uint32_t ), sizeof ( data ) );
+    return data;
+}
+
+static inline
+uint32_t stub_hash ( const uint8_t * field )
+{
+    uint32_t hash;
+    memcpy ( &hash, field, sizeof ( uint32_t ) );
+    return hash;
+}
+
+static inline
+uint8_t * stub_write ( uint8_t * s, uint32_t hash, const uint8_t * data )
+{
+    memcpy ( s, &hash, sizeof ( uint32_t ) );
+    memcpy ( s + sizeof ( uint32_t ), &data, sizeof ( data ) );
+    return s + SLOT_STUB_SIZE;
+}
+
+// size of the value field starting at value
+static inline __attribute__ ( ( always_inline ) )
+size_t value_field_size ( const uint8_t * value, size_t value_size )
+{
+    if ( value_size == HTR_VALUE_BLOB ) {
+        size_t length;
+        const uint8_t * data = varint_read ( value, &length );
+        return ( size_t ) ( data - value ) + length;
+    }
+    return value_size;
+}
+
+// size of the value field of new pair
+static inline
+size_t value_empty_size ( size_t value_size )
+{
+    return value_size == HTR_VALUE_BLOB ? 1 : value_size;
+}
+
+// size of the new pair of the table
+static inline
+size_t pair_size ( size_t length, size_t value_size )
+{
+    bool stub = key_stub ( length );
+    return key_header_size ( length, stub ) + key_field_size ( length, stub ) + value_empty_size ( value_size );
+}
+
+// value field of the pair
+static inline __attribute__ ( ( always_inline ) )
+uint8_t * slot_value ( const uint8_t * s )
+{
+    size_t k;
+    bool stub;
+    uint8_t * field = key_read ( s, &k, &stub );
+    return field + key_field_size ( k, stub );
+}
+
+// beginning of the pair after the given one
+static inline __attribute__ ( ( always_inline ) )
+uint8_t * slot_next ( uint8_t * s, size_t value_size )
+{
+    s = slot_value ( s );
+    return s + value_field_size ( s, value_size );
+}
+
+static inline
+htr_value value_load ( const uint8_t * s, size_t value_size )
+{
+    uint8_t  v8;
+    uint16_t v16;
+    uint32_t v32;
+    uint64_t v64;
+    switch ( value_size ) {
+    case 0:
+        return 0;
+    case 1:
+        memcpy ( &v8, s, 1 );
+        return v8;
+    case 2:
+        memcpy ( &v16, s, 2 );
+        return v16;
+    case 4:
+        memcpy ( &v32, s, 4 );
+        return v32;
+    default:
+        memcpy ( &v64, s, 8 );
+        return v64;
+    }
+}
+
+// value is truncated to the value size
+static inline
+void value_store ( uint8_t * s, size_t value_size, htr_value value )
+{
+    uint8_t  v8  = ( uint8_t )  value;
+    uint16_t v16 = ( uint16_t ) value;
+    uint32_t v32 = ( uint32_t ) value;
+    uint64_t v64 = ( uint64_t ) value;
+    switch ( value_size ) {
+    case 0:
+        break;
+    case 1:
+        memcpy ( s, &v8, 1 );
+        break;
+    case 2:
+        memcpy ( s, &v16, 2 );
+        break;
+    case 4:
+        memcpy ( s, &v32, 4 );
+        break;
+    default:
+        memcpy ( s, &v64, 8 );
+        break;
+    }
+}
+
+// Value size is a constant in every call of this function from slot_find, so each of them is compiled into its own loop.
+// Stub is compared by the hash before its key is dereferenced.
+static inline __attribute__ ( ( always_inline ) )
+uint8_t * slot_find_sized ( uint8_t * s, const uint8_t * end, const char * key, size_t length, uint32_t hash, const size_t value_size )
+{
+    size_t k;
+    bool stub;
+    uint8_t * field;
+    while ( s < end ) {
+        field = key_read ( s, &k, &stub );
+        if ( k == length ) {
+            if ( !stub ) {
+                if ( memcmp ( field, key, length ) == 0 ) {
+                    return s;
+                }
+            } else if ( stub_hash ( field ) == hash && memcmp ( key_data ( field, true ), key, length ) == 0 ) {
+                return s;
+            }
+        }
+        s  = field + key_field_size ( k, stub );
+        s += value_field_size ( s, value_size );
+    }
+    return NULL;
+}
+
+// find the pair with the given key and its hash in the slot, returns pointer to the pair or NULL
+static inline
+uint8_t * slot_find ( uint8_t * s, const uint8_t * end, const char * key, size_t length, uint32_t hash, size_t value_size )
+{
+    switch ( value_size ) {
+    case 0:
+        return slot_find_sized ( s, end, key, length, hash, 0 );
+    case 1:
+        return slot_find_sized ( s, end, key, length, hash, 1 );
+    case 2:
+        return slot_find_sized ( s, end, key, length, hash, 2 );
+    case 4:
+        return slot_find_sized ( s, end, key, length, hash, 4 );
+    case HTR_VALUE_BLOB:
+        return slot_find_sized ( s, end, key, length, hash, HTR_VALUE_BLOB );
+    default:
+        return slot_find_sized ( s, end, key, length, hash, 8 );
+    }
+}
+
+#endif
@@ -2,47 +2,63 @@
 // Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
 
 #include "table.h"
+#include "slot.h"
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 const double htr_table_max_load_factor    = 100000.0; // arbitrary large number => don't resize
 const const size_t htr_table_initial_size = 4096;
-static const uint16_t LONG_KEYLEN_MASK    = 0x7fff;
+// Front coded slots are scanned sequentially and gain more from shared prefixes, so they hold more pairs.
+const size_t htr_table_front_coded_size = 256;
 
+// average number of pairs in the slot of hashed image
+static const size_t IMAGE_PAIRS_PER_SLOT = 2;
+// number of pairs in the block of sorted image
+static const size_t IMAGE_PAIRS_PER_BLOCK = 16;
+
+// slots data of the image is after the offsets
 static inline
-size_t keylen ( htr_slot slot )
+htr_slot image_data ( const htr_table_image * image )
 {
-    if ( 0x1 & * slot ) {
-        return ( size_t ) ( * ( ( uint16_t * ) slot ) >> 1 );
-    } else {
-        return ( size_t ) ( * slot >> 1 );
-    }
+    return ( htr_slot ) ( image->offsets + image->slots_count + 1 );
 }
 
 htr_table * htr_table_new_n ( size_t n )
 {
-    htr_table * table = malloc ( sizeof ( htr_table ) );
+    return htr_table_new_allocator ( n, NULL );
+}
+
+htr_table * htr_table_new_allocator ( size_t n, const htr_allocator * allocator )
+{
+    htr_table * table = htr_allocator_alloc ( allocator, sizeof ( htr_table ) );
     if ( table == NULL ) {
         return NULL;
     }
-    table->flag = 0;
-    table->c0   = table->c1 = '\0';
+    table->allocator   = allocator;
+    table->flag        = 0;
+    table->c0          = table->c1 = '\0';
+    table->value_size  = sizeof ( htr_value );
+    table->front_coded = false;
 
     table->slots_count = n;
     table->pairs_count = 0;
+    table->stubs_count = 0;
+    table->lengths     = 0;
+    table->max         = 0;
     table->max_pairs_count = ( size_t ) ( htr_table_max_load_factor * ( double ) table->slots_count );
-    htr_slot * slots = malloc ( n * sizeof ( htr_slot ) );
+    htr_slot * slots = htr_allocator_alloc ( allocator, n * sizeof ( htr_slot ) );
     if ( slots == NULL ) {
-        free ( table );
+        htr_allocator_free ( allocator, table, sizeof ( htr_table ) );
         return NULL;
     }
     memset ( slots, 0, n * sizeof ( htr_slot ) );
     table->slots = slots;
 
-    size_t * slot_sizes = malloc ( n * sizeof ( size_t ) );
+    size_t * slot_sizes = htr_allocator_alloc ( allocator, n * sizeof ( size_t ) );
     if ( slot_sizes == NULL ) {
-        free ( slots );
-        free ( table );
+        htr_allocator_free ( allocator, slots, n * sizeof ( htr_slot ) );
+        htr_allocator_free ( allocator, table, sizeof ( htr_table ) );
         return NULL;
     }
     memset ( slot_sizes, 0, n * sizeof ( size_t ) );
@@ -51,35 +67,58 @@ htr_table * htr_table_new_n ( size_t n )
     return table;
 }
 
+// free keys stored out of line
+static void free_stubs ( htr_table * table )
+{
+    size_t i, k;
+    bool stub;
+    htr_slot s, end, field;
+    for ( i = 0; i < table->slots_count && table->stubs_count > 0; i++ ) {
+        s   = table->slots[i];
+        end = s + table->slots_sizes[i];
+        while ( s < end ) {
+            field = key_read ( s, &k, &stub );
+            if ( stub ) {
+                htr_allocator_free ( table->allocator, ( void * ) key_data ( field, true ), k );
+                table->stubs_count--;
+            }
+            s = slot_next ( s, table->value_size );
+        }
+    }
+}
+
 void htr_table_free ( htr_table * table )
 {
     if ( table == NULL ) {
         return;
     }
+    free_stubs ( table );
+    const htr_allocator * allocator = table->allocator;
     size_t i;
     for ( i = 0; i < table->slots_count; i++ ) {
-        free ( table->slots[i] );
+        htr_allocator_free ( allocator, table->slots[i], table->slots_sizes[i] );
     }
-    free ( table->slots );
-    free ( table->slots_sizes );
-    free ( table );
+    htr_allocator_free ( allocator, table->slots, table->slots_count * sizeof ( htr_slot ) );
+    htr_allocator_free ( allocator, table->slots_sizes, table->slots_count * sizeof ( size_t ) );
+    htr_allocator_free ( allocator, table, sizeof ( htr_table ) );
 }
 
 uint8_t htr_table_clear ( htr_table * table )
 {
+    free_stubs ( table );
     size_t i;
     for ( i = 0; i < table->slots_count; i++ ) {
-        free ( table->slots[i] );
+        htr_allocator_free ( table->allocator, table->slots[i], table->slots_sizes[i] );
     }
 
-    htr_slot * slots = realloc ( table->slots, htr_table_initial_size * sizeof ( htr_slot ) );
+    htr_slot * slots = htr_allocator_realloc ( table->allocator, table->slots, table->slots_count * sizeof ( htr_slot ), htr_table_initial_size * sizeof ( htr_slot ) );
     if ( slots == NULL ) {
         return 1;
     }
     memset ( slots, 0, htr_table_initial_size * sizeof ( htr_slot ) );
     table->slots = slots;
 
-    size_t * slots_sizes = realloc ( table->slots_sizes, htr_table_initial_size * sizeof ( size_t ) );
+    size_t * slots_sizes = htr_allocator_realloc ( table->allocator, table->slots_sizes, table->slots_count * sizeof ( size_t ), htr_table_initial_size * sizeof ( size_t ) );
     if ( slots_sizes == NULL ) {
         return 2;
     }
@@ -87,102 +126,321 @@ uint8_t htr_table_clear ( htr_table * table )
     table->slots_sizes = slots_sizes;
 
     table->slots_count = htr_table_initial_size;
+    table->lengths     = 0;
+    table->max         = 0;
 
     return 0;
 }
 
 
-static htr_slot ins_key ( htr_slot s, const char * key, size_t len, htr_value ** val )
+// Write the pair with the copy of the value field or zero value if value is NULL.
+// Key is written inline unless stub is given, stub is written in place of the long key.
+static htr_slot ins_key ( htr_slot s, const char * key, size_t len, const uint8_t * stub, const uint8_t * value, size_t value_field, htr_value ** val )
 {
-    // key length
-    if ( len < 128 ) {
-        s[0] = ( unsigned char ) ( len << 1 );
-        s += 1;
-    } else {
-        /* The most significant bit is set to indicate that two bytes are
-         * being used to store the key length. */
-        * ( ( uint16_t* ) s ) = ( ( uint16_t ) len << 1 ) | 0x1;
-        s += 2;
-    }
+    s = key_header_write ( s, len, stub != NULL );
 
     // key
-    memcpy ( s, key, len * sizeof ( unsigned char ) );
-    s += len;
+    if ( stub != NULL ) {
+        memcpy ( s, stub, SLOT_STUB_SIZE );
+        s += SLOT_STUB_SIZE;
+    } else {
+        memcpy ( s, key, len * sizeof ( unsigned char ) );
+        s += len;
+    }
 
     // value
     *val = ( htr_value * ) s;
-    **val = 0;
-    s += sizeof ( htr_value );
+    if ( value == NULL ) {
+        memset ( s, 0, value_field );
+    } else {
+        memcpy ( s, value, value_field );
+    }
+    s += value_field;
 
     return s;
 }
 
 
+// Front coded slot keeps pairs in key order. Every pair is the length of the prefix shared with the previous key,
+// the length of the rest of the key (both are varints), the rest and the value, like in the block of the sorted image.
+
+typedef struct front_coded_position_t {
+    htr_slot pair;        // pair with the key or the first pair greater than the key, it is the end of slot if there is no such pair
+    bool     found;
+    size_t   shared;      // length of the prefix shared by the key with the previous pair
+    size_t   next_shared; // length of the prefix shared by the key with the greater pair
+} front_coded_position;
+
+// Keys are not decoded: matched is the length of the common prefix of the previous key and the key.
+// Previous key is less than the key, so the key with more shared bytes is less too and the key with less shared bytes is greater.
+static void front_coded_find ( htr_slot s, htr_slot end, const char * key, size_t len, size_t value_size, front_coded_position * position )
+{
+    size_t matched = 0, shared, k, m;
+    htr_slot pair;
+    position->found = false;
+    while ( s < end ) {
+        pair = s;
+        s = ( htr_slot ) varint_read ( s, &shared );
+        s = ( htr_slot ) varint_read ( s, &k );
+        if ( shared < matched ) {
+            position->pair        = pair;
+            position->shared      = matched;
+            position->next_shared = shared;
+            return;
+        }
+        if ( shared == matched ) {
+            for ( m = 0; m < k && matched + m < len && s[m] == ( uint8_t ) key[matched + m]; m++ );
+            if ( m == k && matched + m == len ) {
+                position->pair   = pair;
+                position->found  = true;
+                position->shared = matched;
+                return;
+            }
+            if ( matched + m == len || ( m < k && s[m] > ( uint8_t ) key[matched + m] ) ) {
+                position->pair        = pair;
+                position->shared      = matched;
+                position->next_shared = matched + m;
+                return;
+            }
+            matched += m;
+        }
+        s += k;
+        s += value_field_size ( s, value_size );
+    }
+    position->pair        = end;
+    position->shared      = matched;
+    position->next_shared = 0;
+}
+
+// value field of the front coded pair
+static inline
+htr_value * front_coded_value ( htr_slot pair )
+{
+    size_t shared, k;
+    pair = ( htr_slot ) varint_read ( pair, &shared );
+    pair = ( htr_slot ) varint_read ( pair, &k );
+    return ( htr_value * ) ( pair + k );
+}
+
+// Insert the key with empty value before the greater pair, that drops the bytes it shares with the key from its rest.
+// Returns the value field of the new pair or NULL if memory can't be allocated.
+static htr_value * front_coded_insert ( htr_table * T, size_t i, const char * key, size_t len, const front_coded_position * position )
+{
+    htr_slot slot    = T->slots[i];
+    size_t offset    = ( size_t ) ( position->pair - slot );
+    size_t old_size  = T->slots_sizes[i];
+    size_t rest      = len - position->shared;
+    size_t value     = value_empty_size ( T->value_size );
+    size_t pair_size = varint_size ( position->shared ) + varint_size ( rest ) + rest + value;
+
+    // old header, dropped bytes and new header of the greater pair
+    size_t old_header = 0, dropped = 0, new_header = 0, next_rest = 0;
+    if ( offset < old_size ) {
+        size_t shared, k;
+        const uint8_t * s = varint_read ( position->pair, &shared );
+        s = varint_read ( s, &k );
+        old_header = ( size_t ) ( s - position->pair );
+        dropped    = position->next_shared - shared;
+        next_rest  = k - dropped;
+        new_header = varint_size ( position->next_shared ) + varint_size ( next_rest );
+    }
+
+    size_t new_size = old_size + pair_size + new_header - old_header - dropped;
+    if ( new_size > old_size ) {
+        slot = htr_allocator_realloc ( T->allocator, slot, old_size, new_size );
+        if ( slot == NULL ) {
+            return NULL;
+        }
+        T->slots[i] = slot;
+    }
+    memmove ( slot + offset + pair_size + new_header, slot + offset + old_header + dropped, old_size - offset - old_header - dropped );
+
+    htr_slot s = slot + offset;
+    s = varint_write ( s, position->shared );
+    s = varint_write ( s, rest );
+    memcpy ( s, key + position->shared, rest );
+    s += rest;
+    htr_value * val = ( htr_value * ) s;
+    memset ( s, 0, value );
+    s += value;
+    if ( new_header > 0 ) {
+        s = varint_write ( s, position->next_shared );
+        varint_write ( s, next_rest );
+    }
+
+    T->slots_sizes[i] = new_size;
+    ++T->pairs_count;
+    return val;
+}
+
+// Delete the pair, the next pair takes the bytes it shared with the deleted key and not with the previous one.
+static void front_coded_delete ( htr_table * T, size_t i, htr_slot pair )
+{
+    htr_slot slot   = T->slots[i];
+    size_t offset   = ( size_t ) ( pair - slot );
+    size_t old_size = T->slots_sizes[i];
+
+    size_t shared, k;
+    htr_slot rest = ( htr_slot ) varint_read ( pair, &shared );
+    rest = ( htr_slot ) varint_read ( rest, &k );
+    htr_slot next = rest + k;
+    next += value_field_size ( next, T->value_size );
+    size_t next_offset = ( size_t ) ( next - slot );
+
+    if ( next_offset < old_size ) {
+        size_t next_shared, next_k;
+        htr_slot next_rest = ( htr_slot ) varint_read ( next, &next_shared );
+        next_rest = ( htr_slot ) varint_read ( next_rest, &next_k );
+        if ( next_shared > shared ) {
+            size_t added  = next_shared - shared;
+            size_t header = varint_size ( shared ) + varint_size ( next_k + added );
+            memmove ( pair + header, rest, added );
+            htr_slot s = varint_write ( pair, shared );
+            varint_write ( s, next_k + added );
+            memmove ( pair + header + added, next_rest, old_size - ( size_t ) ( next_rest - slot ) );
+            T->slots_sizes[i] = offset + header + added + old_size - ( size_t ) ( next_rest - slot );
+            --T->pairs_count;
+            return;
+        }
+    }
+    memmove ( pair, next, old_size - next_offset );
+    T->slots_sizes[i] = old_size - ( next_offset - offset );
+    --T->pairs_count;
+}
+
+static size_t common_length ( const char * a, size_t a_length, const char * b, size_t b_length )
+{
+    size_t n = a_length < b_length ? a_length : b_length, j;
+    for ( j = 0; j < n && a[j] == b[j]; j++ );
+    return j;
+}
+
+// Keys are taken in order, so they are appended to the new slots front coded against the last key of the slot.
+static void front_coded_expand ( htr_table * T, htr_hash_function hash_function )
+{
+    size_t new_n = 2 * T->slots_count;
+    size_t * slots_sizes   = htr_allocator_alloc ( T->allocator, new_n * sizeof ( size_t ) );
+    htr_slot * slots       = htr_allocator_alloc ( T->allocator, new_n * sizeof ( htr_slot ) );
+    const char ** last     = calloc ( new_n, sizeof ( const char * ) );
+    size_t * last_lengths  = calloc ( new_n, sizeof ( size_t ) );
+
+    htr_table_iterator i;
+    htr_table_iterator_init ( &i, T, true );
+
+    const char * key;
+    const uint8_t * v;
+    size_t len, h, shared, field, j;
+    memset ( slots_sizes, 0, new_n * sizeof ( size_t ) );
+    memset ( slots, 0, new_n * sizeof ( htr_slot ) );
+    uint8_t pass;
+    for ( pass = 0; pass < 2; pass++ ) {
+        if ( pass == 1 ) {
+            for ( j = 0; j < new_n; ++j ) {
+                slots[j] = slots_sizes[j] > 0 ? htr_allocator_alloc ( T->allocator, slots_sizes[j] ) : NULL;
+                slots_sizes[j]  = 0;
+                last_lengths[j] = 0;
+                last[j]         = NULL;
+            }
+            htr_table_iterator_reset ( &i, T );
+        }
+        while ( !htr_table_iterator_finished ( &i ) ) {
+            key    = htr_table_iterator_key ( &i, &len );
+            v      = ( const uint8_t * ) htr_table_iterator_val ( &i );
+            h      = hash_function ( ( const uint8_t * ) key, len ) % new_n;
+            shared = last[h] == NULL ? 0 : common_length ( last[h], last_lengths[h], key, len );
+            field  = value_field_size ( v, T->value_size );
+            if ( pass == 1 ) {
+                htr_slot s = slots[h] + slots_sizes[h];
+                s = varint_write ( s, shared );
+                s = varint_write ( s, len - shared );
+                memcpy ( s, key + shared, len - shared );
+                memcpy ( s + len - shared, v, field );
+            }
+            slots_sizes[h] += varint_size ( shared ) + varint_size ( len - shared ) + len - shared + field;
+            last[h]         = key;
+            last_lengths[h] = len;
+            htr_table_iterator_next ( &i );
+        }
+    }
+    htr_table_iterator_destroy ( &i );
+    free ( last );
+    free ( last_lengths );
+
+    for ( j = 0; j < T->slots_count; ++j ) htr_allocator_free ( T->allocator, T->slots[j], T->slots_sizes[j] );
+    htr_allocator_free ( T->allocator, T->slots, T->slots_count * sizeof ( htr_slot ) );
+    T->slots = slots;
+    htr_allocator_free ( T->allocator, T->slots_sizes, T->slots_count * sizeof ( size_t ) );
+    T->slots_sizes = slots_sizes;
+    T->slots_count = new_n;
+    T->max_pairs_count = ( size_t ) ( htr_table_max_load_factor * ( double ) T->slots_count );
+}
+
 static void htr_table_expand ( htr_table * T, htr_hash_function hash_function )
 {
+    if ( T->front_coded ) {
+        front_coded_expand ( T, hash_function );
+        return;
+    }
+
     // Resizing a table is essentially building a brand new one.
     // One little shortcut we can take on the memory allocation front is to figure out how much memory each slot needs in advance.
     size_t new_n = 2 * T->slots_count;
-    size_t* slots_sizes = malloc ( new_n * sizeof ( size_t ) );
+    size_t* slots_sizes = htr_allocator_alloc ( T->allocator, new_n * sizeof ( size_t ) );
     memset ( slots_sizes, 0, new_n * sizeof ( size_t ) );
 
-    const char* key;
-    size_t len = 0;
-    size_t m = 0;
-    htr_table_iterator * i = htr_table_iterator_begin ( T, false );
-    while ( !htr_table_iterator_finished ( i ) ) {
-        key = htr_table_iterator_key ( i, &len );
-        slots_sizes[hash_function ( key, len ) % new_n] +=
-            len + sizeof ( htr_value ) + ( len >= 128 ? 2 : 1 );
-
-        ++m;
-        htr_table_iterator_next ( i );
+    // Pairs are moved as they are, stubs keep the hash of their keys and their allocated keys are not copied.
+    size_t i, k, h;
+    bool stub;
+    htr_slot p, end, field, next;
+    for ( i = 0; i < T->slots_count; ++i ) {
+        p   = T->slots[i];
+        end = p + T->slots_sizes[i];
+        while ( p < end ) {
+            field = key_read ( p, &k, &stub );
+            h     = stub ? stub_hash ( field ) : hash_function ( field, k );
+            next  = slot_next ( p, T->value_size );
+            slots_sizes[h % new_n] += ( size_t ) ( next - p );
+            p = next;
+        }
     }
-    htr_table_iterator_free ( i );
 
 
     /* allocate slots */
-    htr_slot * slots = malloc ( new_n * sizeof ( htr_slot ) );
+    htr_slot * slots = htr_allocator_alloc ( T->allocator, new_n * sizeof ( htr_slot ) );
     size_t j;
     for ( j = 0; j < new_n; ++j ) {
         if ( slots_sizes[j] > 0 ) {
-            slots[j] = malloc ( slots_sizes[j] );
+            slots[j] = htr_allocator_alloc ( T->allocator, slots_sizes[j] );
         } else slots[j] = NULL;
     }
 
     /* rehash values. A few shortcuts can be taken here as well, as we know
      * there will be no collisions. Instead of the regular insertion routine,
-     * we keep track of the ends of every slot and simply insert keys.
+     * we keep track of the ends of every slot and simply copy pairs.
      * */
     htr_slot* slots_next = malloc ( new_n * sizeof ( htr_slot ) );
     memcpy ( slots_next, slots, new_n * sizeof ( htr_slot ) );
-    size_t h;
-    m = 0;
-    htr_value * u;
-    htr_value * v;
-    i = htr_table_iterator_begin ( T, false );
-    while ( !htr_table_iterator_finished ( i ) ) {
-
-        key = htr_table_iterator_key ( i, &len );
-        h = hash_function ( key, len ) % new_n;
-
-        slots_next[h] = ins_key ( slots_next[h], key, len, &u );
-        v = htr_table_iterator_val ( i );
-        *u = *v;
-
-        ++m;
-        htr_table_iterator_next ( i );
+    for ( i = 0; i < T->slots_count; ++i ) {
+        p   = T->slots[i];
+        end = p + T->slots_sizes[i];
+        while ( p < end ) {
+            field = key_read ( p, &k, &stub );
+            h     = ( stub ? stub_hash ( field ) : hash_function ( field, k ) ) % new_n;
+            next  = slot_next ( p, T->value_size );
+            memcpy ( slots_next[h], p, ( size_t ) ( next - p ) );
+            slots_next[h] += next - p;
+            p = next;
+        }
     }
-    htr_table_iterator_free ( i );
 
 
     free ( slots_next );
-    for ( j = 0; j < T->slots_count; ++j ) free ( T->slots[j] );
+    for ( j = 0; j < T->slots_count; ++j ) htr_allocator_free ( T->allocator, T->slots[j], T->slots_sizes[j] );
 
-    free ( T->slots );
+    htr_allocator_free ( T->allocator, T->slots, T->slots_count * sizeof ( htr_slot ) );
     T->slots = slots;
 
-    free ( T->slots_sizes );
+    htr_allocator_free ( T->allocator, T->slots_sizes, T->slots_count * sizeof ( size_t ) );
     T->slots_sizes = slots_sizes;
 
     T->slots_count = new_n;
@@ -198,47 +456,51 @@ static htr_value * get_key ( htr_table * T, htr_hash_function hash_function, con
     }
 
 
-    uint32_t i = hash_function ( key, len ) % T->slots_count;
-    size_t k;
-    htr_slot s;
+    uint32_t hash = hash_function ( key, len );
+    uint32_t i = hash % T->slots_count;
     htr_value * val;
 
-    /* search the array for our key */
-    s = T->slots[i];
-    while ( ( size_t ) ( s - T->slots[i] ) < T->slots_sizes[i] ) {
-        /* get the key length */
-        k = keylen ( s );
-        s += k < 128 ? 1 : 2;
-
-        /* skip keys that are longer than ours */
-        if ( k != len ) {
-            s += k + sizeof ( htr_value );
-            continue;
-        }
-
-        /* key found. */
-        if ( memcmp ( s, key, len ) == 0 ) {
-            return ( htr_value * ) ( s + len );
+    if ( T->front_coded ) {
+        front_coded_position position;
+        front_coded_find ( T->slots[i], T->slots[i] + T->slots_sizes[i], key, len, T->value_size, &position );
+        if ( position.found ) {
+            return front_coded_value ( position.pair );
         }
-        /* key not found. */
-        else {
-            s += k + sizeof ( htr_value );
-            continue;
+        if ( !insert_missing ) {
+            return NULL;
         }
+        T->lengths |= htr_table_length_bit ( len );
+        return front_coded_insert ( T, i, key, len, &position );
     }
 
+    /* search the array for our key */
+    htr_slot s = slot_find ( T->slots[i], T->slots[i] + T->slots_sizes[i], key, len, hash, T->value_size );
+    if ( s != NULL ) {
+        return ( htr_value * ) slot_value ( s );
+    }
 
     if ( insert_missing ) {
         /* the key was not found, so we must insert it. */
-        size_t new_size = T->slots_sizes[i];
-        new_size += 1 + ( len >= 128 ? 1 : 0 );  // key length
-        new_size += len * sizeof ( unsigned char ); // key
-        new_size += sizeof ( htr_value );          // value
+        size_t new_size = T->slots_sizes[i] + pair_size ( len, T->value_size );
+
+        /* long key is copied out of line */
+        uint8_t stub[SLOT_STUB_SIZE];
+        bool long_key = key_stub ( len );
+        if ( long_key ) {
+            uint8_t * data = htr_allocator_alloc ( T->allocator, len );
+            if ( data == NULL ) {
+                return NULL;
+            }
+            memcpy ( data, key, len );
+            stub_write ( stub, hash, data );
+            ++T->stubs_count;
+        }
 
-        T->slots[i] = realloc ( T->slots[i], new_size );
+        T->slots[i] = htr_allocator_realloc ( T->allocator, T->slots[i], T->slots_sizes[i], new_size );
 
         ++T->pairs_count;
-        ins_key ( T->slots[i] + T->slots_sizes[i], key, len, &val );
+        T->lengths |= htr_table_length_bit ( len );
+        ins_key ( T->slots[i] + T->slots_sizes[i], key, len, long_key ? stub : NULL, NULL, value_empty_size ( T->value_size ), &val );
         T->slots_sizes[i] = new_size;
 
         return val;
@@ -258,40 +520,76 @@ htr_value * htr_table_tryget ( htr_table * T, htr_hash_function hash_function, c
 }
 
 
-int htr_table_del ( htr_table * T, htr_hash_function hash_function, const char* key, size_t len )
+htr_value * htr_table_blob_resize ( htr_table * T, htr_hash_function hash_function, const char * key, size_t len, size_t size )
 {
+    uint8_t * field = ( uint8_t * ) get_key ( T, hash_function, key, len, true );
+    if ( field == NULL ) {
+        return NULL;
+    }
     uint32_t i = hash_function ( key, len ) % T->slots_count;
-    size_t k;
-    htr_slot s;
 
-    /* search the array for our key */
-    s = T->slots[i];
-    while ( ( size_t ) ( s - T->slots[i] ) < T->slots_sizes[i] ) {
-        /* get the key length */
-        k = keylen ( s );
-        s += k < 128 ? 1 : 2;
-
-        /* skip keys that are longer than ours */
-        if ( k != len ) {
-            s += k + sizeof ( htr_value );
-            continue;
+    size_t length;
+    size_t old_header = ( size_t ) ( varint_read ( field, &length ) - field );
+    size_t new_header = varint_size ( size );
+    size_t old_field  = old_header + length;
+    size_t new_field  = new_header + size;
+    size_t kept       = length < size ? length : size;
+    size_t offset     = ( size_t ) ( field - T->slots[i] );
+    size_t tail       = T->slots_sizes[i] - offset - old_field;
+
+    if ( new_field > old_field ) {
+        htr_slot slot = htr_allocator_realloc ( T->allocator, T->slots[i], T->slots_sizes[i], T->slots_sizes[i] + new_field - old_field );
+        if ( slot == NULL ) {
+            return NULL;
         }
+        T->slots[i] = slot;
+        field = slot + offset;
+        memmove ( field + new_field, field + old_field, tail );
+        memmove ( field + new_header, field + old_header, kept );
+        memset ( field + new_header + kept, 0, size - kept );
+    } else {
+        memmove ( field + new_header, field + old_header, kept );
+        memmove ( field + new_field, field + old_field, tail );
+    }
+    varint_write ( field, size );
+    T->slots_sizes[i] = T->slots_sizes[i] + new_field - old_field;
 
-        /* key found. */
-        if ( memcmp ( s, key, len ) == 0 ) {
-            /* move everything over, resize the array */
-            unsigned char* t = s + len + sizeof ( htr_value );
-            s -= k < 128 ? 1 : 2;
-            memmove ( s, t, T->slots_sizes[i] - ( size_t ) ( t - T->slots[i] ) );
-            T->slots_sizes[i] -= ( size_t ) ( t - s );
-            --T->pairs_count;
-            return 0;
+    return ( htr_value * ) field;
+}
+
+
+int htr_table_del ( htr_table * T, htr_hash_function hash_function, const char* key, size_t len )
+{
+    uint32_t hash = hash_function ( key, len );
+    uint32_t i = hash % T->slots_count;
+
+    if ( T->front_coded ) {
+        front_coded_position position;
+        front_coded_find ( T->slots[i], T->slots[i] + T->slots_sizes[i], key, len, T->value_size, &position );
+        if ( !position.found ) {
+            return -1;
         }
-        /* key not found. */
-        else {
-            s += k + sizeof ( htr_value );
-            continue;
+        front_coded_delete ( T, i, position.pair );
+        return 0;
+    }
+
+    /* search the array for our key */
+    htr_slot s = slot_find ( T->slots[i], T->slots[i] + T->slots_sizes[i], key, len, hash, T->value_size );
+    if ( s != NULL ) {
+        size_t k;
+        bool stub;
+        htr_slot field = key_read ( s, &k, &stub );
+        if ( stub ) {
+            htr_allocator_free ( T->allocator, ( void * ) key_data ( field, true ), k );
+            --T->stubs_count;
         }
+
+        /* move everything over, resize the array */
+        htr_slot t = slot_next ( s, T->value_size );
+        memmove ( s, t, T->slots_sizes[i] - ( size_t ) ( t - T->slots[i] ) );
+        T->slots_sizes[i] -= ( size_t ) ( t - s );
+        --T->pairs_count;
+        return 0;
     }
 
     // Key was not found. Do nothing.
@@ -299,252 +597,675 @@ int htr_table_del ( htr_table * T, htr_hash_function hash_function, const char*
 }
 
 
+// compare the first key of the block with the key
+static int block_cmp ( htr_slot s, const char * key, size_t len )
+{
+    size_t shared, k;
+    s = ( htr_slot ) varint_read ( s, &shared );
+    s = ( htr_slot ) varint_read ( s, &k );
+    int c = memcmp ( s, key, k < len ? k : len );
+    if ( c != 0 ) {
+        return c;
+    }
+    return k < len ? -1 : ( k > len ? 1 : 0 );
+}
 
-static int cmpkey ( const void* a_, const void* b_ )
+static htr_value * sorted_image_tryget ( const htr_table_image * image, const char * key, size_t len )
 {
-    htr_slot a = * ( htr_slot * ) a_;
-    htr_slot b = * ( htr_slot * ) b_;
+    htr_slot data = image_data ( image );
+
+    // the last block with the first key not greater than the key
+    size_t low = 0, high = image->slots_count, middle;
+    while ( low < high ) {
+        middle = low + ( high - low ) / 2;
+        if ( block_cmp ( data + image->offsets[middle], key, len ) <= 0 ) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if ( low == 0 ) {
+        return NULL;
+    }
 
-    size_t ka = keylen ( a ), kb = keylen ( b );
+    front_coded_position position;
+    front_coded_find ( data + image->offsets[low - 1], data + image->offsets[low], key, len, image->value_size, &position );
+    return position.found ? front_coded_value ( position.pair ) : NULL;
+}
 
-    a += ka < 128 ? 1 : 2;
-    b += kb < 128 ? 1 : 2;
+htr_value * htr_table_image_tryget ( const htr_table_image * image, htr_hash_function hash_function, const char * key, size_t len )
+{
+    if ( image->pairs_count == 0 ) {
+        return NULL;
+    }
+    if ( image->encoding == HTR_TABLE_IMAGE_SORTED ) {
+        return sorted_image_tryget ( image, key, len );
+    }
 
-    int c = memcmp ( a, b, ka < kb ? ka : kb );
-    return c == 0 ? ( int ) ka - ( int ) kb : c;
+    uint32_t hash = hash_function ( ( const uint8_t * ) key, len );
+    uint32_t i = hash % image->slots_count;
+    htr_slot data = image_data ( image );
+    htr_slot s = slot_find ( data + image->offsets[i], data + image->offsets[i + 1], key, len, hash, image->value_size );
+    if ( s == NULL ) {
+        return NULL;
+    }
+    return ( htr_value * ) slot_value ( s );
 }
 
 
-/* Sorted/unsorted iterators are kept private and exposed by passing the
-sorted flag to htr_table_iter_begin. */
 
-typedef struct htr_table_sorted_iter_t_ {
-    const htr_table * T; // parent
-    htr_slot * xs; // pointers to keys
-    size_t i; // current key
-} htr_table_sorted_iter_t;
+// Key of a pair with decoded length, so sorting never touches the length prefix again.
+// The cache keeps up to 8 bytes of the key at the current sorting depth (burstsort style),
+// most of the comparisons are made on it without dereferencing the key.
+typedef struct htr_table_sorted_key_t {
+    const uint8_t * key;
+    size_t          length;
+    uint64_t        cache;
+    const uint8_t * value;
+} htr_table_sorted_key;
 
+// partitions smaller than this are finished by insertion sort
+static const size_t SORT_INSERTION_THRESHOLD = 16;
 
-static htr_table_sorted_iter_t* htr_table_sorted_iter_begin ( const htr_table * T )
+// number of key bytes in the cache at the given depth
+static inline
+size_t cachelen ( const htr_table_sorted_key * x, size_t depth )
 {
-    htr_table_sorted_iter_t* i = malloc ( sizeof ( htr_table_sorted_iter_t ) );
-    i->T = T;
-    i->xs = malloc ( T->pairs_count * sizeof ( htr_slot ) );
-    i->i = 0;
+    size_t rest = x->length - depth;
+    return rest < sizeof ( uint64_t ) ? rest : sizeof ( uint64_t );
+}
 
-    htr_slot s;
-    size_t j, k, u;
-    for ( j = 0, u = 0; j < T->slots_count; ++j ) {
-        s = T->slots[j];
-        while ( s < T->slots[j] + T->slots_sizes[j] ) {
-            i->xs[u++] = s;
-            k = keylen ( s );
-            s += k < 128 ? 1 : 2;
-            s += k + sizeof ( htr_value );
+// big endian key bytes at the given depth, padded with zeros
+static inline
+void fillcache ( htr_table_sorted_key * xs, size_t n, size_t depth )
+{
+    size_t i, j, k;
+    for ( i = 0; i < n; i++ ) {
+        uint64_t cache = 0;
+        k = cachelen ( &xs[i], depth );
+        for ( j = 0; j < k; j++ ) {
+            cache = ( cache << 8 ) | xs[i].key[depth + j];
         }
+        xs[i].cache = k == 0 ? 0 : cache << ( 8 * ( sizeof ( uint64_t ) - k ) );
     }
-
-    qsort ( i->xs, T->pairs_count, sizeof ( htr_slot ), cmpkey );
-
-    return i;
 }
 
-
-static bool htr_table_sorted_iter_finished ( htr_table_sorted_iter_t* i )
+// compare caches, shorter key is less when padded bytes are equal
+static inline
+int cmpcache ( uint64_t a, size_t alen, uint64_t b, size_t blen )
 {
-    return i->i >= i->T->pairs_count;
+    if ( a != b ) {
+        return a < b ? -1 : 1;
+    }
+    return ( int ) alen - ( int ) blen;
 }
 
-
-static void htr_table_sorted_iter_next ( htr_table_sorted_iter_t* i )
+static inline
+void swapkeys ( htr_table_sorted_key * xs, size_t a, size_t b )
 {
-    if ( htr_table_sorted_iter_finished ( i ) ) return;
-    ++i->i;
+    htr_table_sorted_key t = xs[a];
+    xs[a] = xs[b];
+    xs[b] = t;
 }
 
-
-static void htr_table_sorted_iter_free ( htr_table_sorted_iter_t* i )
+// keys are known to share the first depth bytes and have valid caches
+static void insertion_sort ( htr_table_sorted_key * xs, size_t n, size_t depth )
 {
-    if ( i == NULL ) return;
-    free ( i->xs );
-    free ( i );
+    size_t i, j;
+    for ( i = 1; i < n; i++ ) {
+        htr_table_sorted_key x = xs[i];
+        size_t xlen = cachelen ( &x, depth );
+        for ( j = i; j > 0; j-- ) {
+            const htr_table_sorted_key * y = &xs[j - 1];
+            int c = cmpcache ( y->cache, cachelen ( y, depth ), x.cache, xlen );
+            if ( c == 0 && xlen == sizeof ( uint64_t ) ) {
+                size_t common = ( x.length < y->length ? x.length : y->length ) - depth;
+                c = memcmp ( y->key + depth, x.key + depth, common );
+                if ( c == 0 ) {
+                    c = y->length < x.length ? -1 : 1;
+                }
+            }
+            if ( c < 0 ) {
+                break;
+            }
+            xs[j] = xs[j - 1];
+        }
+        xs[j] = x;
+    }
 }
 
-
-static const char* htr_table_sorted_iter_key ( htr_table_sorted_iter_t* i, size_t* len )
+// Multikey quicksort of Bentley and Sedgewick, working on 8 cached bytes instead of a single character.
+// The equal partition proceeds with the next 8 bytes of the keys.
+static void multikey_sort ( htr_table_sorted_key * xs, size_t n, size_t depth )
 {
-    if ( htr_table_sorted_iter_finished ( i ) ) return NULL;
+    while ( n > SORT_INSERTION_THRESHOLD ) {
+        // median of three
+        htr_table_sorted_key * a = &xs[0];
+        htr_table_sorted_key * b = &xs[n / 2];
+        htr_table_sorted_key * c = &xs[n - 1];
+        size_t alen = cachelen ( a, depth ), blen = cachelen ( b, depth ), clen = cachelen ( c, depth );
+        htr_table_sorted_key * median;
+        if ( cmpcache ( a->cache, alen, b->cache, blen ) < 0 ) {
+            if ( cmpcache ( b->cache, blen, c->cache, clen ) < 0 ) {
+                median = b;
+            } else {
+                median = cmpcache ( a->cache, alen, c->cache, clen ) < 0 ? c : a;
+            }
+        } else {
+            if ( cmpcache ( a->cache, alen, c->cache, clen ) < 0 ) {
+                median = a;
+            } else {
+                median = cmpcache ( b->cache, blen, c->cache, clen ) < 0 ? c : b;
+            }
+        }
+        uint64_t pivot    = median->cache;
+        size_t pivot_len  = cachelen ( median, depth );
+
+        // [0, lt) < pivot, [lt, i) == pivot, [gt, n) > pivot
+        size_t lt = 0, i = 0, gt = n;
+        while ( i < gt ) {
+            int cmp = cmpcache ( xs[i].cache, cachelen ( &xs[i], depth ), pivot, pivot_len );
+            if ( cmp < 0 ) {
+                swapkeys ( xs, lt++, i++ );
+            } else if ( cmp > 0 ) {
+                swapkeys ( xs, i, --gt );
+            } else {
+                i++;
+            }
+        }
 
-    htr_slot s = i->xs[i->i];
-    *len = keylen ( s );
+        multikey_sort ( xs, lt, depth );
+        multikey_sort ( xs + gt, n - gt, depth );
 
-    return ( const char* ) ( s + ( *len < 128 ? 1 : 2 ) );
+        if ( pivot_len < sizeof ( uint64_t ) ) {
+            // all keys of the equal partition are ended
+            return;
+        }
+        xs    += lt;
+        n      = gt - lt;
+        depth += sizeof ( uint64_t );
+        fillcache ( xs, n, depth );
+    }
+    insertion_sort ( xs, n, depth );
 }
 
-
-static htr_value *  htr_table_sorted_iter_val ( htr_table_sorted_iter_t* i )
+// Iterator works both on the table and on the table image, these helpers hide the difference.
+static inline
+size_t iter_pairs_count ( const htr_table_iterator * i )
 {
-    if ( htr_table_sorted_iter_finished ( i ) ) return NULL;
+    return i->image == NULL ? i->table->pairs_count : i->image->pairs_count;
+}
 
-    htr_slot s = i->xs[i->i];
-    size_t k = keylen ( s );
+static inline
+size_t iter_value_size ( const htr_table_iterator * i )
+{
+    return i->image == NULL ? i->table->value_size : i->image->value_size;
+}
 
-    s += k < 128 ? 1 : 2;
-    s += k;
+static inline
+size_t iter_slots_count ( const htr_table_iterator * i )
+{
+    return i->image == NULL ? i->table->slots_count : i->image->slots_count;
+}
 
-    return ( htr_value * ) s;
+// returns the beginning of the slot and writes its end
+static inline
+htr_slot iter_slot ( const htr_table_iterator * i, size_t slot, htr_slot * end )
+{
+    htr_slot s;
+    if ( i->image == NULL ) {
+        s    = i->table->slots[slot];
+        *end = s + i->table->slots_sizes[slot];
+    } else {
+        s    = image_data ( i->image ) + i->image->offsets[slot];
+        *end = image_data ( i->image ) + i->image->offsets[slot + 1];
+    }
+    return s;
 }
 
+// sorted image is already ordered, it is iterated as unsorted
+static inline
+bool iter_sorts ( const htr_table_iterator * i )
+{
+    return i->sorted && ! ( i->image != NULL && i->front_coded );
+}
 
-typedef struct htr_table_unsorted_iter_t_ {
-    const htr_table * T; // parent
-    size_t i;           // slot index
-    htr_slot s;           // slot position
-} htr_table_unsorted_iter_t;
+static void iter_reserve_decoded ( htr_table_iterator * i, size_t size )
+{
+    if ( i->decoded_capacity < size ) {
+        size_t capacity = i->decoded_capacity == 0 ? 64 : i->decoded_capacity;
+        while ( capacity < size ) {
+            capacity *= 2;
+        }
+        i->decoded          = realloc ( i->decoded, capacity );
+        i->decoded_capacity = capacity;
+    }
+}
 
+// Keys of front coded table are decoded one after another into the buffer.
+static void htr_table_sorted_iter_decode ( htr_table_iterator * i )
+{
+    htr_slot s, end;
+    size_t j, k, u, shared, size = 0;
+    size_t slots_count = iter_slots_count ( i );
+    for ( j = 0; j < slots_count; ++j ) {
+        s = iter_slot ( i, j, &end );
+        while ( s < end ) {
+            s = ( htr_slot ) varint_read ( s, &shared );
+            s = ( htr_slot ) varint_read ( s, &k );
+            size += shared + k;
+            s += k;
+            s += value_field_size ( s, iter_value_size ( i ) );
+        }
+    }
+    iter_reserve_decoded ( i, size );
+
+    uint8_t * key = i->decoded;
+    for ( j = 0, u = 0; j < slots_count; ++j ) {
+        s = iter_slot ( i, j, &end );
+        while ( s < end ) {
+            s = ( htr_slot ) varint_read ( s, &shared );
+            s = ( htr_slot ) varint_read ( s, &k );
+            if ( shared > 0 ) {
+                memcpy ( key, i->keys[u - 1].key, shared );
+            }
+            memcpy ( key + shared, s, k );
+            i->keys[u].key    = key;
+            i->keys[u].length = shared + k;
+            key += shared + k;
+            s   += k;
+            i->keys[u].value  = s;
+            u++;
+            s += value_field_size ( s, iter_value_size ( i ) );
+        }
+    }
+}
 
-static htr_table_unsorted_iter_t* htr_table_unsorted_iter_begin ( const htr_table * T )
+// Collect keys of the table into the sorted keys buffer of the iterator and sort them.
+// The buffer is kept between tables, so it grows only to the size of the biggest table.
+static void htr_table_sorted_iter_reset ( htr_table_iterator * i )
 {
-    htr_table_unsorted_iter_t* i = malloc ( sizeof ( htr_table_unsorted_iter_t ) );
-    i->T = T;
+    size_t pairs_count = iter_pairs_count ( i );
 
-    for ( i->i = 0; i->i < i->T->slots_count; ++i->i ) {
-        i->s = T->slots[i->i];
-        if ( ( size_t ) ( i->s - T->slots[i->i] ) >= T->slots_sizes[i->i] ) continue;
-        break;
+    if ( i->keys_capacity < pairs_count ) {
+        size_t capacity = i->keys_capacity == 0 ? 16 : i->keys_capacity;
+        while ( capacity < pairs_count ) {
+            capacity *= 2;
+        }
+        free ( i->keys );
+        i->keys          = malloc ( capacity * sizeof ( htr_table_sorted_key ) );
+        i->keys_capacity = capacity;
     }
+    i->key = 0;
 
-    return i;
-}
+    htr_slot s, end;
+    size_t j, k, u;
+    bool stub;
+    size_t slots_count = iter_slots_count ( i );
+    for ( j = 0, u = 0; j < slots_count && !i->front_coded; ++j ) {
+        s = iter_slot ( i, j, &end );
+        while ( s < end ) {
+            s = key_read ( s, &k, &stub );
+            i->keys[u].key    = key_data ( s, stub );
+            i->keys[u].length = k;
+            s += key_field_size ( k, stub );
+            i->keys[u].value  = s;
+            u++;
+            s += value_field_size ( s, iter_value_size ( i ) );
+        }
+    }
 
+    if ( i->front_coded ) {
+        htr_table_sorted_iter_decode ( i );
+    }
 
-static bool htr_table_unsorted_iter_finished ( htr_table_unsorted_iter_t* i )
-{
-    return i->i >= i->T->slots_count;
+    fillcache ( i->keys, pairs_count, 0 );
+    multikey_sort ( i->keys, pairs_count, 0 );
 }
 
 
-static void htr_table_unsorted_iter_next ( htr_table_unsorted_iter_t* i )
+// move to the first not empty slot starting from the current one
+static void htr_table_unsorted_iter_skip ( htr_table_iterator * i )
 {
-    if ( htr_table_unsorted_iter_finished ( i ) ) return;
+    htr_slot end;
+    size_t slots_count = iter_slots_count ( i );
+    for ( ; i->slot < slots_count; ++i->slot ) {
+        i->position = iter_slot ( i, i->slot, &end );
+        if ( i->position == end ) continue;
+        break;
+    }
+}
 
-    /* get the key length */
-    size_t k = keylen ( i->s );
-    i->s += k < 128 ? 1 : 2;
 
-    /* skip to the next key */
-    i->s += k + sizeof ( htr_value );
+// decode front coded pair at the current position
+static void htr_table_unsorted_iter_decode ( htr_table_iterator * i )
+{
+    if ( i->slot >= iter_slots_count ( i ) ) {
+        return;
+    }
 
-    if ( ( size_t ) ( i->s - i->T->slots[i->i] ) >= i->T->slots_sizes[i->i] ) {
-        do {
-            ++i->i;
-        } while ( i->i < i->T->slots_count &&
-                  i->T->slots_sizes[i->i] == 0 );
+    size_t shared, k;
+    htr_slot s = ( htr_slot ) varint_read ( i->position, &shared );
+    s = ( htr_slot ) varint_read ( s, &k );
 
-        if ( i->i < i->T->slots_count ) i->s = i->T->slots[i->i];
-        else i->s = NULL;
-    }
+    iter_reserve_decoded ( i, shared + k );
+    memcpy ( i->decoded + shared, s, k );
+    i->decoded_length = shared + k;
+    i->value          = s + k;
 }
 
 
-static void htr_table_unsorted_iter_free ( htr_table_unsorted_iter_t* i )
+static void htr_table_unsorted_iter_reset ( htr_table_iterator * i )
 {
-    free ( i );
+    i->slot = 0;
+    htr_table_unsorted_iter_skip ( i );
+    if ( i->front_coded ) htr_table_unsorted_iter_decode ( i );
 }
 
 
-static const char* htr_table_unsorted_iter_key ( htr_table_unsorted_iter_t* i, size_t* len )
+static void htr_table_unsorted_iter_next ( htr_table_iterator * i )
 {
-    if ( htr_table_unsorted_iter_finished ( i ) ) return NULL;
-
-    htr_slot s = i->s;
-    size_t k;
-    if ( 0x1 & *s ) {
-        k = ( size_t ) ( * ( ( uint16_t* ) s ) ) >> 1;
-        s += 2;
+    if ( i->front_coded ) {
+        i->position = i->value + value_field_size ( i->value, iter_value_size ( i ) );
     } else {
-        k = ( size_t ) ( *s >> 1 );
-        s += 1;
+        i->position = slot_next ( i->position, iter_value_size ( i ) );
     }
 
-    *len = k;
-    return ( const char* ) s;
+    htr_slot end;
+    iter_slot ( i, i->slot, &end );
+    if ( i->position >= end ) {
+        ++i->slot;
+        htr_table_unsorted_iter_skip ( i );
+    }
+    if ( i->front_coded ) htr_table_unsorted_iter_decode ( i );
 }
 
 
-static htr_value * htr_table_unsorted_iter_val ( htr_table_unsorted_iter_t* i )
+void htr_table_iterator_init ( htr_table_iterator * i, const htr_table * T, bool sorted )
 {
-    if ( htr_table_unsorted_iter_finished ( i ) ) return NULL;
+    i->sorted           = sorted;
+    i->keys             = NULL;
+    i->keys_capacity    = 0;
+    i->decoded          = NULL;
+    i->decoded_capacity = 0;
+    htr_table_iterator_reset ( i, T );
+}
 
-    htr_slot s = i->s;
 
-    size_t k;
-    if ( 0x1 & *s ) {
-        k = ( size_t ) ( * ( ( uint16_t* ) s ) ) >> 1;
-        s += 2;
-    } else {
-        k = ( size_t ) ( *s >> 1 );
-        s += 1;
-    }
+void htr_table_iterator_reset ( htr_table_iterator * i, const htr_table * T )
+{
+    i->table       = T;
+    i->image       = NULL;
+    i->front_coded = T->front_coded;
+    if ( i->sorted ) htr_table_sorted_iter_reset ( i );
+    else           htr_table_unsorted_iter_reset ( i );
+}
 
-    s += k;
-    return ( htr_value * ) s;
+
+void htr_table_iterator_init_image ( htr_table_iterator * i, const htr_table_image * image, bool sorted )
+{
+    i->sorted           = sorted;
+    i->keys             = NULL;
+    i->keys_capacity    = 0;
+    i->decoded          = NULL;
+    i->decoded_capacity = 0;
+    htr_table_iterator_reset_image ( i, image );
+}
+
+
+void htr_table_iterator_reset_image ( htr_table_iterator * i, const htr_table_image * image )
+{
+    i->table       = NULL;
+    i->image       = image;
+    i->front_coded = image->encoding == HTR_TABLE_IMAGE_SORTED;
+    if ( iter_sorts ( i ) ) htr_table_sorted_iter_reset ( i );
+    else           htr_table_unsorted_iter_reset ( i );
 }
 
 
-struct htr_table_iterator_t {
-    bool sorted;
-    union {
-        htr_table_unsorted_iter_t* unsorted;
-        htr_table_sorted_iter_t* sorted;
-    } i;
-};
+void htr_table_iterator_destroy ( htr_table_iterator * i )
+{
+    free ( i->keys );
+    i->keys          = NULL;
+    i->keys_capacity = 0;
+    free ( i->decoded );
+    i->decoded          = NULL;
+    i->decoded_capacity = 0;
+}
 
 
 htr_table_iterator * htr_table_iterator_begin ( const htr_table * T, bool sorted )
 {
     htr_table_iterator * i = malloc ( sizeof ( htr_table_iterator ) );
-    i->sorted = sorted;
-    if ( sorted ) i->i.sorted   = htr_table_sorted_iter_begin ( T );
-    else        i->i.unsorted = htr_table_unsorted_iter_begin ( T );
+    htr_table_iterator_init ( i, T, sorted );
     return i;
 }
 
 
 void htr_table_iterator_next ( htr_table_iterator * i )
 {
-    if ( i->sorted ) htr_table_sorted_iter_next ( i->i.sorted );
-    else           htr_table_unsorted_iter_next ( i->i.unsorted );
+    if ( htr_table_iterator_finished ( i ) ) return;
+
+    if ( iter_sorts ( i ) ) ++i->key;
+    else                  htr_table_unsorted_iter_next ( i );
 }
 
 
 bool htr_table_iterator_finished ( htr_table_iterator * i )
 {
-    if ( i->sorted ) return htr_table_sorted_iter_finished ( i->i.sorted );
-    else           return htr_table_unsorted_iter_finished ( i->i.unsorted );
+    if ( iter_sorts ( i ) ) return i->key >= iter_pairs_count ( i );
+    else                  return i->slot >= iter_slots_count ( i );
 }
 
 
 void htr_table_iterator_free ( htr_table_iterator * i )
 {
     if ( i == NULL ) return;
-    if ( i->sorted ) htr_table_sorted_iter_free ( i->i.sorted );
-    else           htr_table_unsorted_iter_free ( i->i.unsorted );
+    htr_table_iterator_destroy ( i );
     free ( i );
 }
 
 
 const char* htr_table_iterator_key ( htr_table_iterator * i, size_t* len )
 {
-    if ( i->sorted ) return htr_table_sorted_iter_key ( i->i.sorted, len );
-    else           return htr_table_unsorted_iter_key ( i->i.unsorted, len );
+    if ( htr_table_iterator_finished ( i ) ) return NULL;
+
+    if ( iter_sorts ( i ) ) {
+        *len = i->keys[i->key].length;
+        return ( const char * ) i->keys[i->key].key;
+    }
+    if ( i->front_coded ) {
+        *len = i->decoded_length;
+        return ( const char * ) i->decoded;
+    }
+
+    bool stub;
+    htr_slot field = key_read ( i->position, len, &stub );
+    return ( const char * ) key_data ( field, stub );
 }
 
 
 htr_value * htr_table_iterator_val ( htr_table_iterator * i )
 {
-    if ( i->sorted ) return htr_table_sorted_iter_val ( i->i.sorted );
-    else           return htr_table_unsorted_iter_val ( i->i.unsorted );
+    if ( htr_table_iterator_finished ( i ) ) return NULL;
+
+    if ( iter_sorts ( i ) ) {
+        return ( htr_value * ) i->keys[i->key].value;
+    }
+    if ( i->front_coded ) {
+        return ( htr_value * ) i->value;
+    }
+
+    return ( htr_value * ) slot_value ( i->position );
+}
+
+static htr_table_image * image_alloc ( const htr_table * T, uint8_t encoding, size_t slots_count, size_t data_size, size_t * size )
+{
+    if ( data_size > UINT32_MAX || slots_count > UINT32_MAX ) {
+        // offsets are 32 bit
+        errno = EFBIG;
+        return NULL;
+    }
+    *size = sizeof ( htr_table_image ) + ( slots_count + 1 ) * sizeof ( uint32_t ) + data_size;
+    htr_table_image * image = malloc ( *size );
+    if ( image == NULL ) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    image->flag        = T->flag;
+    image->c0          = T->c0;
+    image->c1          = T->c1;
+    image->encoding    = encoding;
+    image->slots_count = ( uint32_t ) slots_count;
+    image->pairs_count = ( uint32_t ) T->pairs_count;
+    image->value_size  = T->value_size;
+    image->lengths     = T->lengths;
+    image->offsets[0]  = 0;
+    return image;
+}
+
+// Pairs are rehashed into the slots of image, so it has no empty slots left from the growth of the table.
+static htr_table_image * hashed_image_new ( const htr_table * T, htr_hash_function hash_function, size_t * size )
+{
+    size_t slots_count = ( T->pairs_count + IMAGE_PAIRS_PER_SLOT - 1 ) / IMAGE_PAIRS_PER_SLOT;
+    size_t data_size = 0, j;
+    for ( j = 0; j < T->slots_count; j++ ) {
+        data_size += T->slots_sizes[j];
+    }
+
+    // image keeps long keys inline in place of their stubs and decodes front coded keys, so pairs are measured again
+    if ( T->stubs_count > 0 || T->front_coded ) {
+        htr_table_iterator i;
+        htr_table_iterator_init ( &i, T, false );
+        size_t len;
+        for ( data_size = 0; !htr_table_iterator_finished ( &i ); htr_table_iterator_next ( &i ) ) {
+            htr_table_iterator_key ( &i, &len );
+            data_size += key_header_size ( len, false ) + len + value_field_size ( ( const uint8_t * ) htr_table_iterator_val ( &i ), T->value_size );
+        }
+        htr_table_iterator_destroy ( &i );
+    }
+
+    htr_table_image * image = image_alloc ( T, HTR_TABLE_IMAGE_HASHED, slots_count, data_size, size );
+    if ( image == NULL || slots_count == 0 ) {
+        return image;
+    }
+
+    // offsets are counted into the next entries at first, then they are moved while pairs are placed
+    memset ( image->offsets, 0, ( slots_count + 1 ) * sizeof ( uint32_t ) );
+
+    htr_table_iterator i;
+    htr_table_iterator_init ( &i, T, false );
+
+    const char * key;
+    const uint8_t * v;
+    size_t len, h;
+    while ( !htr_table_iterator_finished ( &i ) ) {
+        key = htr_table_iterator_key ( &i, &len );
+        v   = ( const uint8_t * ) htr_table_iterator_val ( &i );
+        h   = hash_function ( ( const uint8_t * ) key, len ) % slots_count;
+        image->offsets[h + 1] += ( uint32_t ) ( key_header_size ( len, false ) + len + value_field_size ( v, T->value_size ) );
+        htr_table_iterator_next ( &i );
+    }
+    for ( j = 0; j < slots_count; j++ ) {
+        image->offsets[j + 1] += image->offsets[j];
+    }
+
+    // place pairs at the beginnings of slots, so every offset is moved to the end of its slot
+    htr_slot data = image_data ( image );
+    htr_value * value;
+    htr_table_iterator_reset ( &i, T );
+    while ( !htr_table_iterator_finished ( &i ) ) {
+        key = htr_table_iterator_key ( &i, &len );
+        h   = hash_function ( ( const uint8_t * ) key, len ) % slots_count;
+        v   = ( const uint8_t * ) htr_table_iterator_val ( &i );
+        htr_slot s = ins_key ( data + image->offsets[h], key, len, NULL, v, value_field_size ( v, T->value_size ), &value );
+        image->offsets[h] = ( uint32_t ) ( s - data );
+        htr_table_iterator_next ( &i );
+    }
+    htr_table_iterator_destroy ( &i );
+
+    // now offsets[h] is the beginning of the slot h + 1
+    for ( j = slots_count; j > 0; j-- ) {
+        image->offsets[j] = image->offsets[j - 1];
+    }
+    image->offsets[0] = 0;
+
+    return image;
+}
+
+static inline
+size_t common_prefix ( const htr_table_sorted_key * a, const htr_table_sorted_key * b )
+{
+    size_t n = a->length < b->length ? a->length : b->length, j;
+    for ( j = 0; j < n && a->key[j] == b->key[j]; j++ );
+    return j;
+}
+
+static htr_table_image * sorted_image_new ( const htr_table * T, size_t * size )
+{
+    htr_table_iterator i;
+    htr_table_iterator_init ( &i, T, true );
+
+    size_t n = T->pairs_count, shared, j;
+    size_t blocks_count = ( n + IMAGE_PAIRS_PER_BLOCK - 1 ) / IMAGE_PAIRS_PER_BLOCK;
+    size_t data_size    = 0;
+    for ( j = 0; j < n; j++ ) {
+        shared     = j % IMAGE_PAIRS_PER_BLOCK == 0 ? 0 : common_prefix ( &i.keys[j - 1], &i.keys[j] );
+        data_size += varint_size ( shared ) + varint_size ( i.keys[j].length - shared ) + i.keys[j].length - shared +
+                     value_field_size ( i.keys[j].value, T->value_size );
+    }
+
+    htr_table_image * image = image_alloc ( T, HTR_TABLE_IMAGE_SORTED, blocks_count, data_size, size );
+    if ( image != NULL ) {
+        htr_slot data = image_data ( image );
+        htr_slot s    = data;
+        for ( j = 0; j < n; j++ ) {
+            if ( j % IMAGE_PAIRS_PER_BLOCK == 0 ) {
+                image->offsets[j / IMAGE_PAIRS_PER_BLOCK] = ( uint32_t ) ( s - data );
+                shared = 0;
+            } else {
+                shared = common_prefix ( &i.keys[j - 1], &i.keys[j] );
+            }
+            s = varint_write ( s, shared );
+            s = varint_write ( s, i.keys[j].length - shared );
+            memcpy ( s, i.keys[j].key + shared, i.keys[j].length - shared );
+            s += i.keys[j].length - shared;
+            size_t field = value_field_size ( i.keys[j].value, T->value_size );
+            memcpy ( s, i.keys[j].value, field );
+            s += field;
+        }
+        image->offsets[blocks_count] = ( uint32_t ) data_size;
+    }
+
+    htr_table_iterator_destroy ( &i );
+    return image;
+}
+
+// The maximum of values is exact in the image, since it is not changed anymore.
+static htr_value table_max ( const htr_table * T )
+{
+    htr_value max = 0, value;
+    if ( T->value_size == HTR_VALUE_BLOB ) {
+        return max;
+    }
+    htr_table_iterator i;
+    htr_table_iterator_init ( &i, T, false );
+    while ( !htr_table_iterator_finished ( &i ) ) {
+        value = value_load ( ( const uint8_t * ) htr_table_iterator_val ( &i ), T->value_size );
+        if ( value > max ) max = value;
+        htr_table_iterator_next ( &i );
+    }
+    htr_table_iterator_destroy ( &i );
+    return max;
+}
+
+htr_table_image * htr_table_image_new ( const htr_table * T, htr_hash_function hash_function, uint8_t encoding, size_t * size )
+{
+    htr_table_image * image = encoding == HTR_TABLE_IMAGE_SORTED ? sorted_image_new ( T, size ) : hashed_image_new ( T, hash_function, size );
+    if ( image != NULL ) {
+        image->max = table_max ( T );
+    }
+    return image;
 }
 
 extern inline
@@ -12,26 +12,75 @@
 
 #include <stdbool.h>
 #include "common.h"
+#include "allocator.h"
 
 typedef struct htr_table_t {
     // these fields are reserved for htr to fiddle with
     uint8_t flag;
     uint8_t c0;
     uint8_t c1;
+    // size of values, it is 0, 1, 2, 4, 8 bytes or HTR_VALUE_BLOB and may be changed only while table is empty
+    uint8_t value_size;
+    // slots keep pairs in key order and front code them like blocks of sorted image, may be changed only while table is empty
+    bool front_coded;
 
     size_t pairs_count;
     size_t max_pairs_count; // number of stored pairs before resize
+    // bits of the lengths of inserted keys (htr_table_length_bit), they are not cleared by delete
+    uint64_t lengths;
+    // not less than any value of the table, it is maintained by the trie
+    htr_value max;
+    size_t stubs_count;     // number of long keys stored out of line
 
     htr_slot * slots;
     size_t *   slots_sizes;
     size_t     slots_count;
+
+    // allocator of the table, its slots and out of line keys, NULL for malloc
+    const htr_allocator * allocator;
 } htr_table;
 
+// Position independent image of the table, it is a part of the saved trie.
+// Offsets of slots are relative to the end of offsets array, slots are stored one after another.
+// Hashed image is an array hash table with the number of slots fitted to its pairs, slots have the same layout as slots of the table.
+// Sorted image holds pairs in key order and front codes them: every pair is the length of the prefix shared with the previous key,
+// the length of the rest of the key (both are varints), the rest and the value. Its slots are blocks of pairs, which start with full key,
+// so lookup makes binary search on the first keys of blocks and decodes a single block.
+typedef struct htr_table_image_t {
+    uint8_t  flag;
+    uint8_t  c0;
+    uint8_t  c1;
+    uint8_t  encoding;
+    uint32_t slots_count;
+    uint32_t pairs_count;
+    uint8_t  value_size;
+    uint8_t  reserved[3];
+    uint64_t  lengths; // bits of key lengths like in the table
+    htr_value max;     // the maximum of values, 0 for blob values
+    uint32_t offsets[]; // slots_count + 1
+} htr_table_image;
+
+static const uint8_t HTR_TABLE_IMAGE_HASHED = 0;
+static const uint8_t HTR_TABLE_IMAGE_SORTED = 1;
+
+// Bit of the key length, lengths from 63 share the last bit.
+// Table has no keys of the length if its bit is not set, so the lookup may be skipped.
+static inline
+uint64_t htr_table_length_bit ( size_t len )
+{
+    return ( uint64_t ) 1 << ( len < 63 ? len : 63 );
+}
+
 extern const double htr_table_max_load_factor;
 extern const size_t htr_table_initial_size;
+// number of slots for the front coded table
+extern const size_t htr_table_front_coded_size;
 
 htr_table * htr_table_new_n ( size_t n );
 
+// Table with n slots allocated by the allocator, see allocator.h.
+htr_table * htr_table_new_allocator ( size_t n, const htr_allocator * allocator );
+
 inline
 htr_table * htr_table_new ()
 {
@@ -47,6 +96,9 @@ size_t htr_table_size ( const htr_table * table )
     return table->pairs_count;
 }
 
+// Values narrower than htr_value are stored in place of the value that is returned by pointer, only value_size bytes may be accessed.
+// For blob values pointer refers to the value field: varint length and bytes of the blob.
+
 // Find the given key in the table, inserting it if it does not exist, and returning a pointer to it's key.
 // This pointer is not guaranteed to be valid after additional calls to htr_table_get, htr_table_del, htr_table_clear, or other functions that modifies the table.
 htr_value * htr_table_get ( htr_table * table, htr_hash_function hash_function, const char * key, size_t len );
@@ -56,6 +108,41 @@ htr_value * htr_table_tryget ( htr_table * table, htr_hash_function hash_functio
 
 int htr_table_del ( htr_table * table, htr_hash_function hash_function, const char * key, size_t len );
 
+// Find the given key in the table with HTR_VALUE_BLOB values, inserting it if it does not exist, and resize its blob.
+// First bytes of the blob are kept, new bytes are zeroed. Returns pointer to the value field or NULL if memory can't be allocated.
+htr_value * htr_table_blob_resize ( htr_table * table, htr_hash_function hash_function, const char * key, size_t len, size_t size );
+
+// Build the image of the table with the given encoding in the buffer allocated by malloc and write its size.
+// Returns NULL if memory can't be allocated (errno is ENOMEM) or the image is too big for 32 bit offsets (errno is EFBIG).
+htr_table_image * htr_table_image_new ( const htr_table * table, htr_hash_function hash_function, uint8_t encoding, size_t * size );
+
+// Find a given key in the table image, returning a NULL pointer if it does not exist.
+htr_value * htr_table_image_tryget ( const htr_table_image * image, htr_hash_function hash_function, const char * key, size_t len );
+
+// Iterator is declared here only to be embedded into other structures or placed on the stack.
+// Its fields are private.
+struct htr_table_iterator_t {
+    const htr_table *       table;
+    const htr_table_image * image; // table is NULL when iterating image
+    bool                    sorted;
+
+    // unsorted position
+    size_t   slot;
+    htr_slot position;
+
+    // sorted image is iterated in place, its keys are decoded into the buffer, that is reused after reset
+    bool      front_coded;
+    uint8_t * decoded;
+    size_t    decoded_capacity;
+    size_t    decoded_length;
+    htr_slot  value;
+
+    // sorted keys, buffer is reused after reset
+    struct htr_table_sorted_key_t * keys;
+    size_t                          keys_capacity;
+    size_t                          key;
+};
+
 htr_table_iterator * htr_table_iterator_begin    ( const htr_table *, bool sorted );
 void                 htr_table_iterator_next     ( htr_table_iterator * );
 bool                 htr_table_iterator_finished ( htr_table_iterator * );
@@ -63,4 +150,13 @@ void                 htr_table_iterator_free     ( htr_table_iterator * );
 const char *         htr_table_iterator_key      ( htr_table_iterator *, size_t * len );
 htr_value *          htr_table_iterator_val      ( htr_table_iterator * );
 
+// Allocation free variant of begin and free for embedded iterator.
+// Reset moves iterator to the beginning of other table, sorted keys buffer is reused, so iterating many tables allocates only while buffer grows.
+void htr_table_iterator_init    ( htr_table_iterator *, const htr_table *, bool sorted );
+void htr_table_iterator_reset   ( htr_table_iterator *, const htr_table * );
+void htr_table_iterator_destroy ( htr_table_iterator * );
+
+void htr_table_iterator_init_image  ( htr_table_iterator *, const htr_table_image *, bool sorted );
+void htr_table_iterator_reset_image ( htr_table_iterator *, const htr_table_image * );
+
 #endif
@@ -3,61 +3,48 @@
 // Copyright (c) 2013 by Andrew Aladjev <aladjev.andrew@gmail.com>
 
 #include "trie.h"
+#include "encoder.h"
+#include "allocator.h"
 #include "table.h"
+#include "node.h"
+#include "slot.h"
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #include <talloc2/tree.h>
 #include <talloc2/ext/destructor.h>
 
 #define HT_UNUSED(x) x=x
 
-// maximum number of keys that may be stored in a bucket before it is burst
-static const size_t MAX_BUCKET_SIZE = 16384;
-#define NODE_MAXCHAR 0xff // 0x7f for 7-bit ASCII
-#define NODE_CHILDS (NODE_MAXCHAR+1)
-
-static const uint8_t NODE_TYPE_TRIE          = 1;
-static const uint8_t NODE_TYPE_PURE_BUCKET   = 1 << 1;
-static const uint8_t NODE_TYPE_HYBRID_BUCKET = 1 << 2;
-static const uint8_t NODE_HAS_VAL            = 1 << 3;
-
-// Node's may be trie nodes or buckets. This union allows us to keep non-specific pointer.
-typedef union htr_node_ptr_t {
-    htr_table *              table;
-    struct htr_trie_node_t * trie_node;
-    uint8_t *                flag;
-} htr_node_ptr;
-
-struct htr_t {
-    htr_node_ptr      root;
-    size_t            pairs_count;
-    htr_hash_function hash_function;
-};
-
-typedef struct htr_trie_node_t {
-    uint8_t flag;
+// Maximum number of keys that may be stored in a bucket before it is burst.
+// It is a build option: small buckets make deeper tries with faster lookups, large buckets save memory of trie nodes.
+#ifndef HTR_MAX_BUCKET_SIZE
+#define HTR_MAX_BUCKET_SIZE 16384
+#endif
+static const size_t MAX_BUCKET_SIZE = HTR_MAX_BUCKET_SIZE;
 
-    // the value for the key that is consumed on a trie node
-    htr_value value;
+// encoded keys up to this size are kept on the stack
+#define HTR_ENCODED_INLINE_KEY 256
 
-    // Map a character to either a htr_trie_node_t or a htr_table_t.
-    // The first byte must be examined to determine which.
-    htr_node_ptr xs[NODE_CHILDS];
-} htr_trie_node;
+// trie node has a pointer for every child of the trie
+static inline
+size_t trie_node_size ( const htr * trie )
+{
+    return sizeof ( htr_trie_node ) + trie->childs * sizeof ( htr_node_ptr );
+}
 
 // Create a new trie node with all pointer pointing to the given child (which can be NULL).
 static htr_trie_node * alloc_trie_node ( htr * trie, htr_node_ptr child )
 {
-    htr_trie_node * node = malloc ( sizeof ( htr_trie_node ) );
+    htr_trie_node * node = htr_allocator_alloc ( trie->allocator, trie_node_size ( trie ) );
     node->flag = NODE_TYPE_TRIE;
     node->value  = 0;
-
-    /* pass trie to allow custom allocator for trie. */
-    HT_UNUSED ( trie ); /* unused now */
+    node->max    = 0;
+    node->count  = 0;
 
     size_t i;
-    for ( i = 0; i < NODE_CHILDS; ++i ) node->xs[i] = child;
+    for ( i = 0; i < trie->childs; ++i ) node->xs[i] = child;
     return node;
 }
 
@@ -78,15 +65,31 @@ htr_node_ptr consume ( htr_node_ptr * p, const char ** k, size_t * l, unsigned b
     return node;
 }
 
-// use node value and return pointer to it
+// use node value and return pointer to it, empty blob is allocated for the new blob value
 static inline
 htr_value * useval ( htr * trie, htr_node_ptr node )
 {
     if ( ! ( node.trie_node->flag & NODE_HAS_VAL ) ) {
+        if ( trie->value_size == HTR_VALUE_BLOB ) {
+            uint8_t * blob = htr_allocator_alloc ( trie->allocator, value_empty_size ( HTR_VALUE_BLOB ) );
+            if ( blob == NULL ) {
+                return NULL;
+            }
+            memset ( blob, 0, value_empty_size ( HTR_VALUE_BLOB ) );
+            node.trie_node->value = ( htr_value ) ( uintptr_t ) blob;
+        }
         node.trie_node->flag |= NODE_HAS_VAL;
         trie->pairs_count++;
     }
-    return &node.trie_node->value;
+    return node_value ( trie, node );
+}
+
+// free blob value of the trie node
+static inline
+void node_blob_free ( const htr * trie, htr_node_ptr node )
+{
+    uint8_t * field = ( uint8_t * ) ( uintptr_t ) node.trie_node->value;
+    htr_allocator_free ( trie->allocator, field, value_field_size ( field, HTR_VALUE_BLOB ) );
 }
 
 // clear node value if exists
@@ -96,18 +99,48 @@ int clear_value ( htr * trie, htr_node_ptr node )
     if ( ! ( node.trie_node->flag & NODE_HAS_VAL ) ) {
         return -1;
     }
+    if ( trie->value_size == HTR_VALUE_BLOB ) {
+        node_blob_free ( trie, node );
+    }
     node.trie_node->flag &= ~NODE_HAS_VAL;
     node.trie_node->value = 0;
     trie->pairs_count--;
     return 0;
 }
 
+// Resize blob of the trie node keeping its first bytes, returns pointer to the new value field or NULL.
+static htr_value * node_blob_resize ( const htr * T, htr_node_ptr node, size_t size )
+{
+    uint8_t * field = ( uint8_t * ) ( uintptr_t ) node.trie_node->value;
+    size_t length;
+    const uint8_t * data = varint_read ( field, &length );
+
+    size_t header = varint_size ( size );
+    uint8_t * blob = htr_allocator_alloc ( T->allocator, header + size );
+    if ( blob == NULL ) {
+        return NULL;
+    }
+    size_t kept = length < size ? length : size;
+    varint_write ( blob, size );
+    memcpy ( blob + header, data, kept );
+    memset ( blob + header + kept, 0, size - kept );
+
+    node_blob_free ( T, node );
+    node.trie_node->value = ( htr_value ) ( uintptr_t ) blob;
+    return ( htr_value * ) blob;
+}
+
 // find node in trie
 static htr_node_ptr hattrie_find ( htr* T, const char **key, size_t *len )
 {
     htr_node_ptr parent = T->root;
 
-    if ( *len == 0 ) return parent;
+    if ( *len == 0 ) {
+        if ( ! ( parent.trie_node->flag & NODE_HAS_VAL ) ) {
+            parent.flag = NULL;
+        }
+        return parent;
+    }
 
     htr_node_ptr node = consume ( &parent, key, len, 1 );
 
@@ -130,18 +163,21 @@ static htr_node_ptr hattrie_find ( htr* T, const char **key, size_t *len )
 }
 
 static inline
-void htr_free_node ( htr_node_ptr node )
+void htr_free_node ( const htr * T, htr_node_ptr node )
 {
     if ( *node.flag & NODE_TYPE_TRIE ) {
+        if ( T->value_size == HTR_VALUE_BLOB && node.trie_node->flag & NODE_HAS_VAL ) {
+            node_blob_free ( T, node );
+        }
         size_t i;
-        for ( i = 0; i < NODE_CHILDS; ++i ) {
+        for ( i = 0; i < T->childs; ++i ) {
             if ( i > 0 && node.trie_node->xs[i].trie_node == node.trie_node->xs[i - 1].trie_node ) continue;
 
             /* XXX: recursion might not be the best choice here. It is possible
              * to build a very deep trie. */
-            if ( node.trie_node->xs[i].trie_node ) htr_free_node ( node.trie_node->xs[i] );
+            if ( node.trie_node->xs[i].trie_node ) htr_free_node ( T, node.trie_node->xs[i] );
         }
-        free ( node.trie_node );
+        htr_allocator_free ( T->allocator, node.trie_node, trie_node_size ( T ) );
     } else {
         htr_table_free ( node.table );
     }
@@ -151,12 +187,41 @@ static
 uint8_t htr_free ( void * child_data, void * user_data )
 {
     htr * trie = child_data;
-    htr_free_node ( trie->root );
+    htr_free_node ( trie, trie->root );
     return 0;
 }
 
 htr * htr_new ( void * ctx, htr_hash_function hash_function )
 {
+    return htr_new_sized ( ctx, hash_function, sizeof ( htr_value ) );
+}
+
+// New bucket for the values of the trie, front coded bucket has less slots.
+static htr_table * new_table ( const htr * T, size_t slots_count )
+{
+    htr_table * table = htr_table_new_allocator ( T->front_coded ? htr_table_front_coded_size : slots_count, T->allocator );
+    table->value_size  = ( uint8_t ) T->value_size;
+    table->front_coded = T->front_coded;
+    return table;
+}
+
+// Root is a trie node with the single hybrid bucket for all characters.
+static htr_trie_node * new_root ( htr * T )
+{
+    htr_node_ptr node;
+    node.table = new_table ( T, htr_table_initial_size );
+    node.table->flag = NODE_TYPE_HYBRID_BUCKET;
+    node.table->c0   = 0x00;
+    node.table->c1   = ( uint8_t ) ( T->childs - 1 );
+    return alloc_trie_node ( T, node );
+}
+
+htr * htr_new_sized ( void * ctx, htr_hash_function hash_function, size_t value_size )
+{
+    if ( value_size != 0 && value_size != 1 && value_size != 2 && value_size != 4 && value_size != 8 && value_size != HTR_VALUE_BLOB ) {
+        return NULL;
+    }
+
     htr * trie = talloc ( ctx, sizeof ( htr ) );
     if ( trie == NULL ) {
         return NULL;
@@ -167,18 +232,124 @@ htr * htr_new ( void * ctx, htr_hash_function hash_function )
     }
     trie->pairs_count   = 0;
     trie->hash_function = hash_function;
-
-    htr_table * table = htr_table_new ();
-    htr_node_ptr node;
-    node.table = table;
-    node.table->flag = NODE_TYPE_HYBRID_BUCKET;
-    node.table->c0 = 0x00;
-    node.table->c1 = NODE_MAXCHAR;
-    trie->root.trie_node = alloc_trie_node ( trie, node );
+    trie->value_size    = value_size;
+    trie->image         = NULL;
+    trie->image_size    = 0;
+    trie->log           = NULL;
+    trie->front_coded   = false;
+    trie->scored        = false;
+    trie->counted       = false;
+    trie->encoder       = NULL;
+    trie->childs        = NODE_CHILDS;
+    trie->allocator     = NULL;
+    trie->root.trie_node = new_root ( trie );
 
     return trie;
 }
 
+int htr_set_front_coded ( htr * T, bool front_coded )
+{
+    if ( T->image != NULL || T->pairs_count != 0 ) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ( T->front_coded == front_coded ) {
+        return 0;
+    }
+    // empty trie may still have the nodes left by deleted keys
+    htr_free_node ( T, T->root );
+    T->front_coded    = front_coded;
+    T->root.trie_node = new_root ( T );
+    return 0;
+}
+
+int htr_set_scored ( htr * T, bool scored )
+{
+    if ( T->image != NULL || T->pairs_count != 0 || T->value_size == HTR_VALUE_BLOB ) {
+        errno = EINVAL;
+        return -1;
+    }
+    // maximums of nodes left by deleted keys are kept
+    T->scored = scored;
+    return 0;
+}
+
+int htr_set_counted ( htr * T, bool counted )
+{
+    if ( T->image != NULL || T->pairs_count != 0 ) {
+        errno = EINVAL;
+        return -1;
+    }
+    // empty trie may still have the nodes left by deleted keys, their counts are 0
+    T->counted = counted;
+    return 0;
+}
+
+int htr_set_allocator ( htr * T, const htr_allocator * allocator )
+{
+    if ( T->image != NULL || T->pairs_count != 0 ) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ( T->allocator == allocator ) {
+        return 0;
+    }
+    // empty trie may still have the nodes left by deleted keys, they are freed by the old allocator
+    htr_free_node ( T, T->root );
+    T->allocator      = allocator;
+    T->root.trie_node = new_root ( T );
+    return 0;
+}
+
+int htr_set_encoder ( htr * T, const htr_encoder * encoder )
+{
+    if ( T->image != NULL || T->pairs_count != 0 ) {
+        errno = EINVAL;
+        return -1;
+    }
+    htr_encoder * copy = NULL;
+    if ( encoder != NULL ) {
+        copy = htr_encoder_load ( T, htr_encoder_lengths ( encoder ) );
+        if ( copy == NULL ) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    if ( T->encoder != NULL ) {
+        talloc_free ( T->encoder );
+    }
+    T->encoder = copy;
+
+    // nodes are built again for the size of the alphabet, empty trie may still have the nodes left by deleted keys
+    size_t alphabet = copy != NULL ? htr_encoder_alphabet_size ( copy ) : 0;
+    unsigned int childs = alphabet != 0 ? ( unsigned int ) alphabet : NODE_CHILDS;
+    if ( T->childs != childs ) {
+        htr_free_node ( T, T->root );
+        T->childs         = childs;
+        T->root.trie_node = new_root ( T );
+    }
+    return 0;
+}
+
+// Copy the pair into the new bucket, maximum of the bucket of scored trie is computed again from the copied values.
+static void copy_pair ( htr * T, htr_table * table, const char * key, size_t len, const htr_value * u )
+{
+    if ( T->scored ) {
+        htr_value value = value_load ( ( const uint8_t * ) u, T->value_size );
+        if ( table->max < value ) {
+            table->max = value;
+        }
+    }
+    if ( T->value_size == HTR_VALUE_BLOB ) {
+        size_t size;
+        const uint8_t * data = varint_read ( ( const uint8_t * ) u, &size );
+        uint8_t * v = ( uint8_t * ) htr_table_blob_resize ( table, T->hash_function, key, len, size );
+        memcpy ( v + varint_size ( size ), data, size );
+    } else {
+        memcpy ( htr_table_get ( table, T->hash_function, key, len ), u, T->value_size );
+    }
+}
+
 /* Perform one split operation on the given node with the given parent.
  */
 static void hattrie_split ( htr * T, htr_node_ptr parent, htr_node_ptr node )
@@ -186,18 +357,27 @@ static void hattrie_split ( htr * T, htr_node_ptr parent, htr_node_ptr node )
     if ( *node.flag & NODE_TYPE_PURE_BUCKET ) {
         /* turn the pure bucket into a hybrid bucket */
         parent.trie_node->xs[node.table->c0].trie_node = alloc_trie_node ( T, node );
+        parent.trie_node->xs[node.table->c0].trie_node->max   = node.table->max;
+        parent.trie_node->xs[node.table->c0].trie_node->count = htr_table_size ( node.table );
 
         /* if the bucket had an empty key, move it to the new trie node */
         htr_value * val = htr_table_tryget ( node.table, T->hash_function, NULL, 0 );
         if ( val ) {
-            parent.trie_node->xs[node.table->c0].trie_node->value = *val;
-            parent.trie_node->xs[node.table->c0].trie_node->flag  |= NODE_HAS_VAL;
-            *val = 0;
+            htr_trie_node * trie_node = parent.trie_node->xs[node.table->c0].trie_node;
+            if ( T->value_size == HTR_VALUE_BLOB ) {
+                size_t size = value_field_size ( ( const uint8_t * ) val, T->value_size );
+                uint8_t * blob = htr_allocator_alloc ( T->allocator, size );
+                memcpy ( blob, val, size );
+                trie_node->value = ( htr_value ) ( uintptr_t ) blob;
+            } else {
+                memcpy ( &trie_node->value, val, T->value_size );
+            }
+            trie_node->flag |= NODE_HAS_VAL;
             htr_table_del ( node.table, T->hash_function, NULL, 0 );
         }
 
         node.table->c0   = 0x00;
-        node.table->c1   = NODE_MAXCHAR;
+        node.table->c1   = ( uint8_t ) ( T->childs - 1 );
         node.table->flag = NODE_TYPE_HYBRID_BUCKET;
 
         return;
@@ -211,13 +391,13 @@ static void hattrie_split ( htr * T, htr_node_ptr parent, htr_node_ptr node )
     size_t len;
     const char* key;
 
-    htr_table_iterator * i = htr_table_iterator_begin ( node.table, false );
-    while ( !htr_table_iterator_finished ( i ) ) {
-        key = htr_table_iterator_key ( i, &len );
+    htr_table_iterator i;
+    htr_table_iterator_init ( &i, node.table, false );
+    while ( !htr_table_iterator_finished ( &i ) ) {
+        key = htr_table_iterator_key ( &i, &len );
         cs[ ( unsigned char ) key[0]] += 1;
-        htr_table_iterator_next ( i );
+        htr_table_iterator_next ( &i );
     }
-    htr_table_iterator_free ( i );
 
     /* choose a split point */
     unsigned int left_m, right_m, all_m;
@@ -253,7 +433,7 @@ static void hattrie_split ( htr * T, htr_node_ptr parent, htr_node_ptr node )
             num_slots *= 2 );
 
     htr_node_ptr left, right;
-    left.table  = htr_table_new_n ( num_slots );
+    left.table  = new_table ( T, num_slots );
     left.table->c0   = node.table->c0;
     left.table->c1   = j;
     left.table->flag = left.table->c0 == left.table->c1 ?
@@ -264,7 +444,7 @@ static void hattrie_split ( htr * T, htr_node_ptr parent, htr_node_ptr node )
             ( double ) right_m > htr_table_max_load_factor * ( double ) num_slots;
             num_slots *= 2 );
 
-    right.table = htr_table_new_n ( num_slots );
+    right.table = new_table ( T, num_slots );
     right.table->c0   = j + 1;
     right.table->c1   = node.table->c1;
     right.table->flag = right.table->c0 == right.table->c1 ?
@@ -281,80 +461,86 @@ static void hattrie_split ( htr * T, htr_node_ptr parent, htr_node_ptr node )
 
     /* distribute keys to the new left or right node */
     htr_value * u;
-    htr_value * v;
-    i = htr_table_iterator_begin ( node.table, false );
-    while ( !htr_table_iterator_finished ( i ) ) {
-        key = htr_table_iterator_key ( i, &len );
-        u   = htr_table_iterator_val ( i );
+    htr_table_iterator_reset ( &i, node.table );
+    while ( !htr_table_iterator_finished ( &i ) ) {
+        key = htr_table_iterator_key ( &i, &len );
+        u   = htr_table_iterator_val ( &i );
 
         /* left */
         if ( ( unsigned char ) key[0] <= j ) {
             if ( *left.flag & NODE_TYPE_PURE_BUCKET ) {
-                v = htr_table_get ( left.table, T->hash_function, key + 1, len - 1 );
+                copy_pair ( T, left.table, key + 1, len - 1, u );
             } else {
-                v = htr_table_get ( left.table, T->hash_function, key, len );
+                copy_pair ( T, left.table, key, len, u );
             }
-            *v = *u;
         }
 
         /* right */
         else {
             if ( *right.flag & NODE_TYPE_PURE_BUCKET ) {
-                v = htr_table_get ( right.table, T->hash_function, key + 1, len - 1 );
+                copy_pair ( T, right.table, key + 1, len - 1, u );
             } else {
-                v = htr_table_get ( right.table, T->hash_function, key, len );
+                copy_pair ( T, right.table, key, len, u );
             }
-            *v = *u;
         }
 
-        htr_table_iterator_next ( i );
+        htr_table_iterator_next ( &i );
     }
 
-    htr_table_iterator_free ( i );
+    htr_table_iterator_destroy ( &i );
     htr_table_free ( node.table );
 }
 
-htr_value * htr_get ( htr * T, const char* key, size_t len )
+// Use value of the key consumed on the trie node, blob is resized if needed.
+static inline
+htr_value * node_useval ( htr * T, htr_node_ptr node, bool resize, size_t size )
 {
-    htr_node_ptr parent = T->root;
+    htr_value * val = useval ( T, node );
+    if ( val != NULL && resize ) {
+        return node_blob_resize ( T, node, size );
+    }
+    return val;
+}
 
-    if ( len == 0 ) return &parent.trie_node->value;
+// Values of trie nodes and buckets are accessed by value_load and value_store, so they may be narrower than htr_value.
+// Blob value is resized to the given size if resize is true.
+// Key is looked up below the given trie node of the mutable trie, its first char selects the child of node.
+static htr_value * node_get ( htr * T, htr_node_ptr parent, const char* key, size_t len, bool resize, size_t size )
+{
+    if ( len == 0 ) return node_useval ( T, parent, resize, size );
 
     /* consume all trie nodes, now parent must be trie and child anything */
-    htr_node_ptr node = consume ( &parent, &key, &len, 0 );
+    htr_node_ptr node = consume ( &parent, &key, &len, 1 );
 
     /* if the key has been consumed on a trie node, use its value */
-    if ( len == 0 ) {
-        if ( *node.flag & NODE_TYPE_TRIE ) {
-            return useval ( T, node );
-        } else if ( *node.flag & NODE_TYPE_HYBRID_BUCKET ) {
-            return useval ( T, parent );
-        }
+    if ( *node.flag & NODE_TYPE_TRIE ) {
+        return node_useval ( T, node, resize, size );
     }
 
-
     /* preemptively split the bucket if it is full */
     while ( htr_table_size ( node.table ) >= MAX_BUCKET_SIZE ) {
         hattrie_split ( T, parent, node );
 
         /* after the split, the node pointer is invalidated, so we search from
          * the parent again. */
-        node = consume ( &parent, &key, &len, 0 );
+        node = consume ( &parent, &key, &len, 1 );
 
         /* if the key has been consumed on a trie node, use its value */
-        if ( len == 0 ) {
-            if ( *node.flag & NODE_TYPE_TRIE ) {
-                return useval ( T, node );
-            } else if ( *node.flag & NODE_TYPE_HYBRID_BUCKET ) {
-                return useval ( T, parent );
-            }
+        if ( *node.flag & NODE_TYPE_TRIE ) {
+            return node_useval ( T, node, resize, size );
         }
     }
 
+    /* pure bucket holds only key suffixes, skip current char */
+    if ( *node.flag & NODE_TYPE_PURE_BUCKET ) {
+        key += 1;
+        len -= 1;
+    }
+
     size_t m_old = node.table->pairs_count;
     htr_value * val;
-    if ( *node.flag & NODE_TYPE_PURE_BUCKET ) {
-        val = htr_table_get ( node.table, T->hash_function, key + 1, len - 1 );
+    if ( resize ) {
+        val = htr_table_blob_resize ( node.table, T->hash_function, key, len, size );
     } else {
         val = htr_table_get ( node.table, T->hash_function, key, len );
     }
@@ -363,9 +549,42 @@ htr_value * htr_get ( htr * T, const char* key, size_t len )
     return val;
 }
 
+// Change counts of trie nodes on the path of the encoded key that is inserted or deleted.
+static void count_encoded_key ( htr * T, const char * key, size_t len, bool inserted )
+{
+    htr_node_ptr node = T->root;
+    while ( *node.flag & NODE_TYPE_TRIE ) {
+        if ( inserted ) node.trie_node->count++;
+        else            node.trie_node->count--;
+        if ( len == 0 ) {
+            return;
+        }
+        node = node.trie_node->xs[( unsigned char ) *key];
+        key++;
+        len--;
+    }
+}
 
-htr_value * htr_tryget ( htr * T, const char* key, size_t len )
+static htr_value * get_encoded_key ( htr * T, const char* key, size_t len, bool resize, size_t size )
 {
+    /* mapped trie is read only */
+    if ( T->image != NULL ) return NULL;
+
+    size_t pairs_count = T->pairs_count;
+    htr_value * value = node_get ( T, T->root, key, len, resize, size );
+    if ( T->counted && T->pairs_count != pairs_count ) {
+        count_encoded_key ( T, key, len, true );
+    }
+    return value;
+}
+
+
+static htr_value * tryget_encoded_key ( htr * T, const char* key, size_t len )
+{
+    if ( T->image != NULL ) {
+        return htr_image_tryget ( T, key, len );
+    }
+
     /* find node for given key */
     htr_node_ptr node = hattrie_find ( T, &key, &len );
     if ( node.flag == NULL ) {
@@ -374,258 +593,2688 @@ htr_value * htr_tryget ( htr * T, const char* key, size_t len )
 
     /* if the trie node consumes value, use it */
     if ( *node.flag & NODE_TYPE_TRIE ) {
-        return &node.trie_node->value;
+        return node_value ( T, node );
     }
 
     return htr_table_tryget ( node.table, T->hash_function, key, len );
 }
 
 
-int htr_del ( htr * T, const char* key, size_t len )
+static inline
+void release_key ( const char * encoded, const char * key, const uint8_t * buffer )
 {
-    htr_node_ptr parent = T->root;
-
-    /* find node for deletion */
-    htr_node_ptr node = hattrie_find ( T, &key, &len );
-    if ( node.flag == NULL ) {
-        return -1;
+    if ( encoded != key && encoded != ( const char * ) buffer ) {
+        free ( ( void * ) encoded );
     }
+}
 
-    /* if consumed on a trie node, clear the value */
-    if ( *node.flag & NODE_TYPE_TRIE ) {
-        return clear_value ( T, node );
+// Keys of trie with encoder are encoded into the buffer on the stack, it is allocated only for long keys.
+// Returns the key itself if trie has no encoder or NULL if memory can't be allocated or key has a byte out of the alphabet with EINVAL.
+static const char * encode_key ( const htr * T, const char * key, size_t * len, uint8_t * buffer )
+{
+    if ( T->encoder == NULL ) {
+        return key;
     }
-
-    /* remove from bucket */
-    size_t m_old = htr_table_size ( node.table );
-    int ret =  htr_table_del ( node.table, T->hash_function, key, len );
-    T->pairs_count -= ( m_old - htr_table_size ( node.table ) );
-
-    /* merge empty buckets */
-    /*! \todo */
-
-    return ret;
+    size_t size = htr_encoded_size_max ( *len );
+    uint8_t * encoded = size > HTR_ENCODED_INLINE_KEY ? malloc ( size ) : buffer;
+    if ( encoded == NULL ) {
+        return NULL;
+    }
+    size = htr_encode ( T->encoder, key, *len, true, encoded );
+    if ( size == SIZE_MAX ) {
+        release_key ( ( const char * ) encoded, key, buffer );
+        errno = EINVAL;
+        return NULL;
+    }
+    *len = size;
+    return ( const char * ) encoded;
 }
 
+static htr_value * get_key ( htr * T, const char * key, size_t len, bool resize, size_t size )
+{
+    uint8_t buffer[HTR_ENCODED_INLINE_KEY];
+    const char * encoded = encode_key ( T, key, &len, buffer );
+    if ( encoded == NULL ) {
+        return NULL;
+    }
+    htr_value * value = get_encoded_key ( T, encoded, len, resize, size );
+    release_key ( encoded, key, buffer );
+    return value;
+}
 
-/* plan for iteration:
- * This is tricky, as we have no parent pointers currently, and I would like to
- * avoid adding them. That means maintaining a stack
- *
- */
-
-typedef struct hattrie_node_stack_t_ {
-    unsigned char   c;
-    size_t level;
-
-    htr_node_ptr node;
-    struct hattrie_node_stack_t_* next;
-
-} hattrie_node_stack_t;
+static htr_value * tryget_key ( htr * T, const char * key, size_t len )
+{
+    uint8_t buffer[HTR_ENCODED_INLINE_KEY];
+    const char * encoded = encode_key ( T, key, &len, buffer );
+    if ( encoded == NULL ) {
+        return NULL;
+    }
+    htr_value * value = tryget_encoded_key ( T, encoded, len );
+    release_key ( encoded, key, buffer );
+    return value;
+}
 
 
-struct htr_iterator_t {
-    char* key;
-    size_t keysize; // space reserved for the key
-    size_t level;
+htr_value * htr_get ( htr * T, const char* key, size_t len )
+{
+    if ( T->value_size != sizeof ( htr_value ) || T->scored ) return NULL;
+    return get_key ( T, key, len, false, 0 );
+}
 
-    /* keep track of keys stored in trie nodes */
-    bool    has_nil_key;
-    htr_value nil_val;
 
-    const htr * T;
-    bool sorted;
-    htr_table_iterator * i;
-    hattrie_node_stack_t* stack;
-};
+htr_value * htr_tryget ( htr * T, const char* key, size_t len )
+{
+    if ( T->value_size != sizeof ( htr_value ) ) return NULL;
+    return tryget_key ( T, key, len );
+}
 
 
-static void htr_iterator_pushchar ( htr_iterator * i, size_t level, char c )
+// Find the longest prefix of key in the bucket, prefixes are not shorter than first.
+static const htr_value * bucket_longest_prefix ( const htr * T, htr_node_ptr node, const char * key, size_t len, size_t level, size_t first, size_t * matched )
 {
-    if ( i->keysize < level ) {
-        i->keysize *= 2;
-        i->key = realloc ( i->key, i->keysize * sizeof ( char ) );
+    if ( node_table_size ( T, node ) == 0 ) {
+        return NULL;
+    }
+    // lengths of keys in the bucket skip most of lookups
+    uint64_t lengths = T->image != NULL ? node.table_image->lengths : node.table->lengths;
+    size_t length = len;
+    while ( true ) {
+        const htr_value * value = NULL;
+        if ( lengths & htr_table_length_bit ( length - level ) ) {
+            value = T->image != NULL ?
+                    htr_table_image_tryget ( node.table_image, T->hash_function, key + level, length - level ) :
+                    htr_table_tryget ( node.table, T->hash_function, key + level, length - level );
+        }
+        if ( value != NULL ) {
+            *matched = length;
+            return value;
+        }
+        if ( length == first ) {
+            return NULL;
+        }
+        length--;
     }
+}
 
-    if ( level > 0 ) {
-        i->key[level - 1] = c;
+// Values of trie nodes are recorded while key is consumed, prefixes that end in the bucket are looked up from the longest one.
+static const htr_value * longest_prefix ( const htr * T, const char * key, size_t len, size_t * matched )
+{
+    const htr_value * result = NULL;
+    htr_node_ptr node = T->root;
+    size_t level = 0;
+    while ( *node.flag & NODE_TYPE_TRIE ) {
+        if ( *node.flag & NODE_HAS_VAL ) {
+            result   = node_value ( T, node );
+            *matched = level;
+        }
+        if ( level == len ) {
+            return result;
+        }
+        node = node_child ( T, node, ( unsigned char ) key[level] );
+        if ( *node.flag & ( NODE_TYPE_TRIE | NODE_TYPE_PURE_BUCKET ) ) {
+            level++;
+        }
     }
 
-    i->level = level;
+    // empty suffix of hybrid bucket is the value of its parent
+    size_t first = *node.flag & NODE_TYPE_PURE_BUCKET ? level : level + 1;
+    const htr_value * value = bucket_longest_prefix ( T, node, key, len, level, first, matched );
+    return value != NULL ? value : result;
 }
 
-
-static void htr_iterator_nextnode ( htr_iterator * i )
+// Key of trie with encoder is not a prefix of longer keys after encoding, so every prefix is looked up.
+static const htr_value * longest_encoded_prefix ( htr * T, const char * key, size_t len, size_t * matched )
 {
-    if ( i->stack == NULL ) return;
+    size_t length = len;
+    while ( true ) {
+        const htr_value * value = tryget_key ( T, key, length );
+        if ( value != NULL ) {
+            *matched = length;
+            return value;
+        }
+        if ( length == 0 ) {
+            return NULL;
+        }
+        length--;
+    }
+}
 
-    /* pop the stack */
-    htr_node_ptr node;
-    hattrie_node_stack_t* next;
-    unsigned char   c;
-    size_t level;
+int htr_longest_prefix ( htr * T, const char * key, size_t len, size_t * matched, htr_value * value )
+{
+    if ( value != NULL && T->value_size == HTR_VALUE_BLOB ) return -1;
 
-    node  = i->stack->node;
-    next  = i->stack->next;
-    c     = i->stack->c;
-    level = i->stack->level;
+    size_t length;
+    const htr_value * u = T->encoder != NULL ? longest_encoded_prefix ( T, key, len, &length ) : longest_prefix ( T, key, len, &length );
+    if ( u == NULL ) {
+        return -1;
+    }
+    if ( matched != NULL ) {
+        *matched = length;
+    }
+    if ( value != NULL ) {
+        *value = value_load ( ( const uint8_t * ) u, T->value_size );
+    }
+    return 0;
+}
 
-    free ( i->stack );
-    i->stack = next;
+// Keys of the batch are consumed by turns, so the next trie node of every key is prefetched while other keys are consumed.
+static const size_t HTR_BATCH_SIZE = 8;
 
-    if ( *node.flag & NODE_TYPE_TRIE ) {
-        htr_iterator_pushchar ( i, level, c );
+typedef struct htr_batch_lookup_t {
+    htr_node_ptr      node;
+    size_t            level;
+    const htr_value * result;
+    size_t            matched;
+} htr_batch_lookup;
 
-        if ( node.trie_node->flag & NODE_HAS_VAL ) {
-            i->has_nil_key = true;
-            i->nil_val = node.trie_node->value;
+size_t htr_longest_prefix_batch ( htr * T, const char * const * keys, const size_t * lengths, size_t count, size_t * matched, htr_value * values )
+{
+    if ( values != NULL && T->value_size == HTR_VALUE_BLOB ) return 0;
+
+    htr_batch_lookup lookups[HTR_BATCH_SIZE];
+    size_t found = 0, start, i;
+    for ( start = 0; start < count; start += HTR_BATCH_SIZE ) {
+        size_t size = count - start < HTR_BATCH_SIZE ? count - start : HTR_BATCH_SIZE;
+        for ( i = 0; i < size; i++ ) {
+            lookups[i].node   = T->root;
+            lookups[i].level  = 0;
+            lookups[i].result = NULL;
         }
 
-        /* push all child nodes from right to left */
-        int j;
-        for ( j = NODE_MAXCHAR; j >= 0; --j ) {
-
-            /* skip repeated pointers to hybrid bucket */
-            if ( j < NODE_MAXCHAR && node.trie_node->xs[j].trie_node == node.trie_node->xs[j + 1].trie_node ) continue;
-
-            // push stack
-            next = i->stack;
-            i->stack = malloc ( sizeof ( hattrie_node_stack_t ) );
-            i->stack->node  = node.trie_node->xs[j];
-            i->stack->next  = next;
-            i->stack->level = level + 1;
-            i->stack->c     = ( unsigned char ) j;
-        }
-    } else {
-        if ( *node.flag & NODE_TYPE_PURE_BUCKET ) {
-            htr_iterator_pushchar ( i, level, c );
+        if ( T->encoder != NULL ) {
+            for ( i = 0; i < size; i++ ) {
+                lookups[i].result = longest_encoded_prefix ( T, keys[start + i], lengths[start + i], &lookups[i].matched );
+            }
         } else {
-            i->level = level - 1;
+            size_t active = size;
+            while ( active > 0 ) {
+                active = 0;
+                for ( i = 0; i < size; i++ ) {
+                    htr_batch_lookup * l = &lookups[i];
+                    if ( l->node.flag == NULL || ! ( *l->node.flag & NODE_TYPE_TRIE ) ) {
+                        continue;
+                    }
+                    const char * key = keys[start + i];
+                    size_t len = lengths[start + i];
+                    if ( *l->node.flag & NODE_HAS_VAL ) {
+                        l->result  = node_value ( T, l->node );
+                        l->matched = l->level;
+                    }
+                    if ( l->level == len ) {
+                        l->node.flag = NULL;
+                        continue;
+                    }
+                    l->node = node_child ( T, l->node, ( unsigned char ) key[l->level] );
+                    __builtin_prefetch ( l->node.flag );
+                    if ( *l->node.flag & ( NODE_TYPE_TRIE | NODE_TYPE_PURE_BUCKET ) ) {
+                        l->level++;
+                    }
+                    active++;
+                }
+            }
+            for ( i = 0; i < size; i++ ) {
+                htr_batch_lookup * l = &lookups[i];
+                if ( l->node.flag == NULL ) {
+                    continue;
+                }
+                size_t first = *l->node.flag & NODE_TYPE_PURE_BUCKET ? l->level : l->level + 1;
+                const htr_value * value = bucket_longest_prefix ( T, l->node, keys[start + i], lengths[start + i], l->level, first, &l->matched );
+                if ( value != NULL ) {
+                    l->result = value;
+                }
+            }
         }
 
-        i->i = htr_table_iterator_begin ( node.table, i->sorted );
+        for ( i = 0; i < size; i++ ) {
+            if ( lookups[i].result == NULL ) {
+                matched[start + i] = SIZE_MAX;
+                continue;
+            }
+            matched[start + i] = lookups[i].matched;
+            if ( values != NULL ) {
+                values[start + i] = value_load ( ( const uint8_t * ) lookups[i].result, T->value_size );
+            }
+            found++;
+        }
     }
+    return found;
 }
 
 
-htr_iterator * htr_iterator_begin ( const htr * T, bool sorted )
+bool htr_contains ( htr * T, const char * key, size_t len )
 {
-    htr_iterator * i = malloc ( sizeof ( htr_iterator ) );
-    i->T = T;
-    i->sorted = sorted;
-    i->i = NULL;
-    i->keysize = 16;
-    i->key = malloc ( i->keysize * sizeof ( char ) );
-    i->level   = 0;
-    i->has_nil_key = false;
-    i->nil_val     = 0;
-
-    i->stack = malloc ( sizeof ( hattrie_node_stack_t ) );
-    i->stack->next   = NULL;
-    i->stack->node   = T->root;
-    i->stack->c      = '\0';
-    i->stack->level  = 0;
+    return tryget_key ( T, key, len ) != NULL;
+}
 
 
-    while ( ( ( i->i == NULL || htr_table_iterator_finished ( i->i ) ) && !i->has_nil_key ) &&
-            i->stack != NULL ) {
+int htr_read ( htr * T, const char * key, size_t len, htr_value * value )
+{
+    if ( T->value_size == HTR_VALUE_BLOB ) return -1;
 
-        htr_table_iterator_free ( i->i );
-        i->i = NULL;
-        htr_iterator_nextnode ( i );
+    htr_value * u = tryget_key ( T, key, len );
+    if ( u == NULL ) {
+        return -1;
     }
+    *value = value_load ( ( const uint8_t * ) u, T->value_size );
+    return 0;
+}
+
 
-    if ( i->i != NULL && htr_table_iterator_finished ( i->i ) ) {
-        htr_table_iterator_free ( i->i );
-        i->i = NULL;
+int htr_insert ( htr * T, const char * key, size_t len )
+{
+    size_t pairs_count = T->pairs_count;
+    if ( get_key ( T, key, len, false, 0 ) == NULL ) {
+        return -1;
+    }
+    if ( T->pairs_count == pairs_count ) {
+        return 0;
     }
 
-    return i;
+    if ( T->log != NULL ) {
+        int result = T->value_size == HTR_VALUE_BLOB ?
+                     htr_log_append_blob ( T->log, key, len, NULL, 0 ) :
+                     htr_log_append ( T->log, HTR_LOG_SET, key, len, 0 );
+        if ( result != 0 ) {
+            return -1;
+        }
+    }
+    return 1;
 }
 
 
-void htr_iterator_next ( htr_iterator * i )
+// Raise maximums of trie nodes and the bucket on the path of the encoded key.
+static void score_encoded_key ( htr * T, const char * key, size_t len, htr_value value )
 {
-    if ( htr_iterator_finished ( i ) ) return;
-
-    if ( i->i != NULL && !htr_table_iterator_finished ( i->i ) ) {
-        htr_table_iterator_next ( i->i );
-    } else if ( i->has_nil_key ) {
-        i->has_nil_key = false;
-        i->nil_val = 0;
-        htr_iterator_nextnode ( i );
+    htr_node_ptr node = T->root;
+    while ( *node.flag & NODE_TYPE_TRIE ) {
+        if ( node.trie_node->max < value ) {
+            node.trie_node->max = value;
+        }
+        if ( len == 0 ) {
+            return;
+        }
+        node = node.trie_node->xs[( unsigned char ) *key];
+        if ( *node.flag & ( NODE_TYPE_TRIE | NODE_TYPE_PURE_BUCKET ) ) {
+            key++;
+            len--;
+        }
     }
+    if ( node.table->max < value ) {
+        node.table->max = value;
+    }
+}
 
-    while ( ( ( i->i == NULL || htr_table_iterator_finished ( i->i ) ) && !i->has_nil_key ) &&
-            i->stack != NULL ) {
+int htr_set ( htr * T, const char * key, size_t len, htr_value value )
+{
+    if ( T->value_size == HTR_VALUE_BLOB ) return -1;
 
-        htr_table_iterator_free ( i->i );
-        i->i = NULL;
-        htr_iterator_nextnode ( i );
+    uint8_t buffer[HTR_ENCODED_INLINE_KEY];
+    size_t size = len;
+    const char * encoded = encode_key ( T, key, &size, buffer );
+    if ( encoded == NULL ) {
+        return -1;
+    }
+    htr_value * u = get_encoded_key ( T, encoded, size, false, 0 );
+    if ( u != NULL ) {
+        value_store ( ( uint8_t * ) u, T->value_size, value );
+        if ( T->scored ) {
+            score_encoded_key ( T, encoded, size, value );
+        }
+    }
+    release_key ( encoded, key, buffer );
+    if ( u == NULL ) {
+        return -1;
     }
 
-    if ( i->i != NULL && htr_table_iterator_finished ( i->i ) ) {
-        htr_table_iterator_free ( i->i );
-        i->i = NULL;
+    if ( T->log != NULL ) {
+        return htr_log_append ( T->log, HTR_LOG_SET, key, len, value );
     }
+    return 0;
 }
 
 
-bool htr_iterator_finished ( htr_iterator * i )
+void * htr_blob_resize ( htr * T, const char * key, size_t len, size_t size )
 {
-    return i->stack == NULL && i->i == NULL && !i->has_nil_key;
+    if ( T->value_size != HTR_VALUE_BLOB ) return NULL;
+
+    uint8_t * field = ( uint8_t * ) get_key ( T, key, len, true, size );
+    if ( field == NULL ) {
+        return NULL;
+    }
+    return field + varint_size ( size );
 }
 
 
-void htr_iterator_free ( htr_iterator * i )
+int htr_blob_set ( htr * T, const char * key, size_t len, const void * data, size_t size )
 {
-    if ( i == NULL ) return;
-    if ( i->i ) htr_table_iterator_free ( i->i );
-
-    hattrie_node_stack_t* next;
-    while ( i->stack ) {
-        next = i->stack->next;
-        free ( i->stack );
-        i->stack = next;
+    void * blob = htr_blob_resize ( T, key, len, size );
+    if ( blob == NULL ) {
+        return -1;
     }
+    memcpy ( blob, data, size );
 
-    free ( i->key );
-    free ( i );
+    if ( T->log != NULL ) {
+        return htr_log_append_blob ( T->log, key, len, data, size );
+    }
+    return 0;
 }
 
 
-const char* htr_iterator_key ( htr_iterator * i, size_t* len )
+const void * htr_blob_get ( htr * T, const char * key, size_t len, size_t * size )
 {
-    if ( htr_iterator_finished ( i ) ) return NULL;
+    if ( T->value_size != HTR_VALUE_BLOB ) return NULL;
 
-    size_t sublen;
-    const char* subkey;
+    htr_value * field = tryget_key ( T, key, len );
+    if ( field == NULL ) {
+        return NULL;
+    }
+    return htr_blob_data ( field, size );
+}
 
-    if ( i->has_nil_key ) {
-        subkey = NULL;
-        sublen = 0;
-    } else subkey = htr_table_iterator_key ( i->i, &sublen );
 
-    if ( i->keysize < i->level + sublen + 1 ) {
-        while ( i->keysize < i->level + sublen + 1 ) i->keysize *= 2;
-        i->key = realloc ( i->key, i->keysize * sizeof ( char ) );
+const void * htr_blob_data ( const htr_value * field, size_t * size )
+{
+    return varint_read ( ( const uint8_t * ) field, size );
+}
+
+
+static int del_encoded_key ( htr * T, const char* key, size_t len )
+{
+    /* find node for deletion */
+    const char * path = key;
+    size_t path_length = len;
+    htr_node_ptr node = hattrie_find ( T, &key, &len );
+    if ( node.flag == NULL ) {
+        return -1;
+    }
+
+    /* if consumed on a trie node, clear the value */
+    int ret;
+    if ( *node.flag & NODE_TYPE_TRIE ) {
+        ret = clear_value ( T, node );
+    } else {
+        /* remove from bucket */
+        size_t m_old = htr_table_size ( node.table );
+        ret = htr_table_del ( node.table, T->hash_function, key, len );
+        T->pairs_count -= ( m_old - htr_table_size ( node.table ) );
+    }
+    if ( ret == 0 && T->counted ) {
+        count_encoded_key ( T, path, path_length, false );
     }
 
-    memcpy ( i->key + i->level, subkey, sublen );
-    i->key[i->level + sublen] = '\0';
+    /* merge empty buckets */
+    /*! \todo */
 
-    *len = i->level + sublen;
-    return i->key;
+    return ret;
 }
 
 
-htr_value * htr_iterator_val ( htr_iterator * i )
+static int del_key ( htr * T, const char * key, size_t len )
+{
+    uint8_t buffer[HTR_ENCODED_INLINE_KEY];
+    const char * encoded = encode_key ( T, key, &len, buffer );
+    if ( encoded == NULL ) {
+        return -1;
+    }
+    int ret = del_encoded_key ( T, encoded, len );
+    release_key ( encoded, key, buffer );
+    return ret;
+}
+
+
+int htr_del ( htr * T, const char* key, size_t len )
+{
+    if ( T->image != NULL ) {
+        return -1;
+    }
+
+    int ret = del_key ( T, key, len );
+    if ( ret == 0 && T->log != NULL ) {
+        return htr_log_append ( T->log, HTR_LOG_DEL, key, len, 0 );
+    }
+    return ret;
+}
+
+
+/* Merge moves the structure of src into dst.
+ * Trie nodes are merged recursively, subtrees and buckets that meet only empty buckets of dst are grafted as is,
+ * other buckets of src are merged pair by pair. Bucket of dst that meets trie node of src is burst until the char has its own trie node.
+ */
+
+typedef struct htr_merge_t {
+    htr *              dst;
+    htr_merge_callback combine;
+    void *             data;
+
+    // pairs of src that are found in dst
+    size_t overlaps;
+    int    error;
+
+    // pure bucket key with its char
+    char * key;
+    size_t keysize;
+} htr_merge_state;
+
+static inline
+htr_value merge_values ( htr_merge_state * m, htr_value dst, htr_value src )
+{
+    return m->combine != NULL ? m->combine ( dst, src, m->data ) : src;
+}
+
+// Set the type of bucket after the change of its range.
+static inline
+void set_range ( htr_table * table, unsigned int c0, unsigned int c1 )
+{
+    table->c0   = ( uint8_t ) c0;
+    table->c1   = ( uint8_t ) c1;
+    table->flag = c0 == c1 ? NODE_TYPE_PURE_BUCKET : NODE_TYPE_HYBRID_BUCKET;
+}
+
+// Replace the children of parent from a to b by the node, they must be empty buckets.
+// Buckets inside the range are freed, buckets crossing its bounds are cut.
+static void graft ( htr * T, htr_node_ptr parent, unsigned int a, unsigned int b, htr_node_ptr node )
+{
+    unsigned int c = a, k;
+    while ( c <= b ) {
+        htr_table * table = parent.trie_node->xs[c].table;
+        unsigned int c0 = table->c0, c1 = table->c1;
+        if ( c0 < a && c1 > b ) {
+            htr_node_ptr right;
+            right.table = new_table ( T, htr_table_initial_size );
+            set_range ( right.table, b + 1, c1 );
+            for ( k = b + 1; k <= c1; k++ ) parent.trie_node->xs[k] = right;
+            set_range ( table, c0, a - 1 );
+        } else if ( c0 < a ) {
+            set_range ( table, c0, a - 1 );
+        } else if ( c1 > b ) {
+            set_range ( table, b + 1, c1 );
+        } else {
+            htr_table_free ( table );
+        }
+        c = c1 + 1;
+    }
+    for ( c = a; c <= b; c++ ) parent.trie_node->xs[c] = node;
+}
+
+// Merge the pair of src into the subtree of dst trie node, key starts with the char of its child.
+static void merge_pair ( htr_merge_state * m, htr_node_ptr node, const char * key, size_t len, const htr_value * u )
+{
+    htr * T = m->dst;
+    size_t pairs_count = T->pairs_count;
+    htr_value * v;
+    if ( T->value_size == HTR_VALUE_BLOB ) {
+        size_t size;
+        const uint8_t * data = varint_read ( ( const uint8_t * ) u, &size );
+        v = node_get ( T, node, key, len, true, size );
+        if ( v != NULL ) {
+            memcpy ( ( uint8_t * ) v + varint_size ( size ), data, size );
+        }
+    } else {
+        v = node_get ( T, node, key, len, false, 0 );
+        if ( v != NULL ) {
+            htr_value value = value_load ( ( const uint8_t * ) u, T->value_size );
+            if ( T->pairs_count == pairs_count ) {
+                value = merge_values ( m, value_load ( ( const uint8_t * ) v, T->value_size ), value );
+            }
+            value_store ( ( uint8_t * ) v, T->value_size, value );
+        }
+    }
+    if ( v == NULL ) {
+        m->error = ENOMEM;
+    } else if ( T->pairs_count == pairs_count ) {
+        m->overlaps++;
+    }
+}
+
+// Merge pairs of the bucket of src with chars from c0 into the subtree of dst trie node and free the bucket.
+static void merge_table ( htr_merge_state * m, htr_node_ptr node, htr_table * table )
+{
+    bool pure = table->flag & NODE_TYPE_PURE_BUCKET;
+    size_t len;
+    const char * key;
+
+    htr_table_iterator i;
+    htr_table_iterator_init ( &i, table, false );
+    while ( !htr_table_iterator_finished ( &i ) ) {
+        key = htr_table_iterator_key ( &i, &len );
+        if ( pure ) {
+            if ( m->keysize < len + 1 ) {
+                while ( m->keysize < len + 1 ) m->keysize *= 2;
+                m->key = realloc ( m->key, m->keysize );
+            }
+            m->key[0] = ( char ) table->c0;
+            memcpy ( m->key + 1, key, len );
+            merge_pair ( m, node, m->key, len + 1, htr_table_iterator_val ( &i ) );
+        } else {
+            merge_pair ( m, node, key, len, htr_table_iterator_val ( &i ) );
+        }
+        htr_table_iterator_next ( &i );
+    }
+    htr_table_iterator_destroy ( &i );
+    htr_table_free ( table );
+}
+
+// Move the value and children of src trie node into dst trie node, src node is freed.
+static void merge_node ( htr_merge_state * m, htr_node_ptr dst, htr_node_ptr src )
+{
+    htr * T = m->dst;
+    if ( *src.flag & NODE_HAS_VAL ) {
+        if ( ! ( *dst.flag & NODE_HAS_VAL ) ) {
+            dst.trie_node->value = src.trie_node->value;
+            dst.trie_node->flag |= NODE_HAS_VAL;
+        } else {
+            m->overlaps++;
+            if ( T->value_size == HTR_VALUE_BLOB ) {
+                node_blob_free ( T, dst );
+                dst.trie_node->value = src.trie_node->value;
+            } else {
+                htr_value value = merge_values (
+                                      m,
+                                      value_load ( ( const uint8_t * ) &dst.trie_node->value, T->value_size ),
+                                      value_load ( ( const uint8_t * ) &src.trie_node->value, T->value_size )
+                                  );
+                value_store ( ( uint8_t * ) &dst.trie_node->value, T->value_size, value );
+            }
+        }
+    }
+
+    unsigned int c = 0, b, k;
+    while ( c < T->childs ) {
+        htr_node_ptr child = src.trie_node->xs[c];
+
+        if ( *child.flag & NODE_TYPE_TRIE ) {
+            htr_node_ptr node = dst.trie_node->xs[c];
+            while ( ! ( *node.flag & NODE_TYPE_TRIE ) && htr_table_size ( node.table ) != 0 ) {
+                hattrie_split ( T, dst, node );
+                node = dst.trie_node->xs[c];
+            }
+            if ( *node.flag & NODE_TYPE_TRIE ) {
+                merge_node ( m, node, child );
+            } else {
+                graft ( T, dst, c, c, child );
+            }
+            c++;
+            continue;
+        }
+
+        b = child.table->c1;
+        if ( htr_table_size ( child.table ) == 0 ) {
+            htr_table_free ( child.table );
+        } else {
+            bool empty = true;
+            for ( k = c; k <= b && empty; k++ ) {
+                htr_node_ptr node = dst.trie_node->xs[k];
+                empty = ! ( *node.flag & NODE_TYPE_TRIE ) && htr_table_size ( node.table ) == 0;
+            }
+            if ( empty ) {
+                graft ( T, dst, c, b, child );
+            } else {
+                merge_table ( m, dst, child.table );
+            }
+        }
+        c = b + 1;
+    }
+    htr_allocator_free ( T->allocator, src.trie_node, trie_node_size ( T ) );
+}
+
+// Tries of the same layout may exchange their nodes and buckets.
+static bool merge_compatible ( const htr * dst, const htr * src )
+{
+    // values of scored or counted dst are set one by one to keep maximums and counts
+    if (
+        dst->log != NULL || dst->scored || dst->counted || dst->hash_function != src->hash_function || dst->front_coded != src->front_coded ||
+        dst->allocator != src->allocator
+    ) {
+        return false;
+    }
+    return htr_encoder_equal ( dst->encoder, src->encoder );
+}
+
+static int merge_walk_pair ( const htr_key_view * view, htr_value * value, void * data )
+{
+    htr_merge_state * m = data;
+    htr * T = m->dst;
+    size_t len = view->prefix_length + view->suffix_length;
+    if ( m->keysize < len ) {
+        while ( m->keysize < len ) m->keysize *= 2;
+        m->key = realloc ( m->key, m->keysize );
+    }
+    memcpy ( m->key, view->prefix, view->prefix_length );
+    memcpy ( m->key + view->prefix_length, view->suffix, view->suffix_length );
+
+    int result;
+    htr_value old;
+    if ( T->value_size == HTR_VALUE_BLOB ) {
+        size_t size;
+        const void * blob = htr_blob_data ( value, &size );
+        result = htr_blob_set ( T, m->key, len, blob, size );
+    } else if ( htr_read ( T, m->key, len, &old ) == 0 ) {
+        result = htr_set ( T, m->key, len, merge_values ( m, old, *value ) );
+    } else {
+        result = htr_set ( T, m->key, len, *value );
+    }
+    if ( result != 0 ) {
+        m->error = errno != 0 ? errno : ENOMEM;
+    }
+    return 0;
+}
+
+int htr_merge ( htr * dst, htr * src, htr_merge_callback combine, void * data )
+{
+    if ( dst == src || dst->image != NULL || src->image != NULL || src->log != NULL || dst->value_size != src->value_size ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    htr_merge_state m;
+    m.dst      = dst;
+    m.combine  = combine;
+    m.data     = data;
+    m.overlaps = 0;
+    m.error    = 0;
+    m.keysize  = 64;
+    m.key      = malloc ( m.keysize );
+
+    if ( merge_compatible ( dst, src ) ) {
+        size_t pairs_count = dst->pairs_count + src->pairs_count;
+        merge_node ( &m, dst->root, src->root );
+        dst->pairs_count = pairs_count - m.overlaps;
+    } else {
+        // keys are decoded and inserted again, logged trie logs every change
+        errno = 0;
+        htr_walk ( src, "", 0, false, merge_walk_pair, &m );
+        htr_free_node ( src, src->root );
+    }
+    free ( m.key );
+
+    src->root.trie_node = new_root ( src );
+    src->pairs_count    = 0;
+
+    if ( m.error != 0 ) {
+        errno = m.error;
+        return -1;
+    }
+    return 0;
+}
+
+
+/* plan for iteration:
+ * This is tricky, as we have no parent pointers currently, and I would like to
+ * avoid adding them. That means maintaining a stack of trie nodes with the next
+ * child to visit in each of them.
+ */
+
+static inline
+htr_iterator_frame * iterator_frames ( htr_iterator * i )
+{
+    return i->frames_capacity > HTR_ITERATOR_INLINE_FRAMES ? i->frames : i->inline_frames;
+}
+
+static inline
+char * iterator_key ( htr_iterator * i )
+{
+    return i->keysize > HTR_ITERATOR_INLINE_KEY ? i->key : i->inline_key;
+}
+
+static void htr_iterator_reserve_key ( htr_iterator * i, size_t size )
+{
+    if ( i->keysize >= size ) {
+        return;
+    }
+
+    size_t keysize = i->keysize;
+    while ( keysize < size ) keysize *= 2;
+
+    if ( i->keysize > HTR_ITERATOR_INLINE_KEY ) {
+        i->key = realloc ( i->key, keysize * sizeof ( char ) );
+    } else {
+        i->key = malloc ( keysize * sizeof ( char ) );
+        memcpy ( i->key, i->inline_key, i->keysize );
+    }
+    i->keysize = keysize;
+}
+
+static void htr_iterator_pushchar ( htr_iterator * i, size_t level, char c )
+{
+    htr_iterator_reserve_key ( i, level );
+
+    if ( level > 0 ) {
+        iterator_key ( i ) [level - 1] = c;
+    }
+
+    i->level = level;
+}
+
+static void htr_iterator_pushnode ( htr_iterator * i, htr_node_ptr node, size_t level )
+{
+    if ( i->frames_count == i->frames_capacity ) {
+        size_t capacity = i->frames_capacity * 2;
+        if ( i->frames_capacity > HTR_ITERATOR_INLINE_FRAMES ) {
+            i->frames = realloc ( i->frames, capacity * sizeof ( htr_iterator_frame ) );
+        } else {
+            i->frames = malloc ( capacity * sizeof ( htr_iterator_frame ) );
+            memcpy ( i->frames, i->inline_frames, i->frames_count * sizeof ( htr_iterator_frame ) );
+        }
+        i->frames_capacity = capacity;
+    }
+
+    htr_iterator_frame * frame = &iterator_frames ( i ) [i->frames_count++];
+    frame->node  = node.flag;
+    frame->level = level;
+    frame->next  = 0;
+
+    if ( *node.flag & NODE_HAS_VAL ) {
+        i->has_nil_key = true;
+        i->nil_val     = node_value ( i->T, node );
+    }
+}
+
+// Start iteration of the bucket, table iterator is reused.
+static void reset_table_iterator ( const htr * T, htr_node_ptr node, htr_table_iterator * i, bool * has_table, bool sorted )
+{
+    if ( T->image != NULL ) {
+        if ( *has_table ) htr_table_iterator_reset_image ( i, node.table_image );
+        else            htr_table_iterator_init_image ( i, node.table_image, sorted );
+    } else {
+        if ( *has_table ) htr_table_iterator_reset ( i, node.table );
+        else            htr_table_iterator_init ( i, node.table, sorted );
+    }
+    *has_table = true;
+}
+
+// Move to the next child of the trie node on the top of the stack.
+static void htr_iterator_nextnode ( htr_iterator * i )
+{
+    while ( i->frames_count > 0 ) {
+        htr_iterator_frame * frame = &iterator_frames ( i ) [i->frames_count - 1];
+        if ( frame->next >= i->T->childs ) {
+            i->frames_count--;
+            continue;
+        }
+
+        htr_node_ptr parent;
+        parent.flag = ( uint8_t * ) frame->node;
+        unsigned int c     = frame->next;
+        size_t       level = frame->level + 1;
+        htr_node_ptr node  = node_child ( i->T, parent, c );
+
+        /* skip repeated pointers to hybrid bucket */
+        do {
+            frame->next++;
+        } while ( frame->next < i->T->childs && node_child ( i->T, parent, frame->next ).flag == node.flag );
+
+        if ( *node.flag & NODE_TYPE_TRIE ) {
+            htr_iterator_pushchar ( i, level, ( char ) c );
+            htr_iterator_pushnode ( i, node, level );
+            if ( i->has_nil_key ) {
+                return;
+            }
+            continue;
+        }
+
+        if ( node_table_size ( i->T, node ) == 0 ) {
+            continue;
+        }
+
+        if ( *node.flag & NODE_TYPE_PURE_BUCKET ) {
+            htr_iterator_pushchar ( i, level, ( char ) c );
+        } else {
+            i->level = level - 1;
+        }
+
+        reset_table_iterator ( i->T, node, &i->table_iterator, &i->has_table, i->sorted );
+        return;
+    }
+}
+
+
+void htr_iterator_init ( htr_iterator * i, const htr * T, bool sorted )
+{
+    i->T         = T;
+    i->sorted    = sorted;
+    i->has_table = false;
+    i->key       = NULL;
+    i->keysize   = HTR_ITERATOR_INLINE_KEY;
+    i->level     = 0;
+
+    i->has_nil_key = false;
+    i->nil_val     = NULL;
+
+    i->frames          = NULL;
+    i->frames_count    = 0;
+    i->frames_capacity = HTR_ITERATOR_INLINE_FRAMES;
+
+    i->decoded          = NULL;
+    i->decoded_capacity = 0;
+
+    htr_iterator_pushnode ( i, T->root, 0 );
+    if ( !i->has_nil_key ) {
+        htr_iterator_nextnode ( i );
+    }
+}
+
+
+void htr_iterator_destroy ( htr_iterator * i )
+{
+    if ( i->has_table ) {
+        htr_table_iterator_destroy ( &i->table_iterator );
+    }
+    if ( i->frames_capacity > HTR_ITERATOR_INLINE_FRAMES ) {
+        free ( i->frames );
+    }
+    if ( i->keysize > HTR_ITERATOR_INLINE_KEY ) {
+        free ( i->key );
+    }
+    free ( i->decoded );
+}
+
+
+htr_iterator * htr_iterator_begin ( const htr * T, bool sorted )
+{
+    htr_iterator * i = malloc ( sizeof ( htr_iterator ) );
+    htr_iterator_init ( i, T, sorted );
+    return i;
+}
+
+
+void htr_iterator_next ( htr_iterator * i )
 {
+    if ( htr_iterator_finished ( i ) ) return;
+
     if ( i->has_nil_key ) {
-        return &i->nil_val;
+        i->has_nil_key = false;
+        i->nil_val     = NULL;
+    } else {
+        htr_table_iterator_next ( &i->table_iterator );
+        if ( !htr_table_iterator_finished ( &i->table_iterator ) ) {
+            return;
+        }
+    }
+
+    htr_iterator_nextnode ( i );
+}
+
+
+bool htr_iterator_finished ( htr_iterator * i )
+{
+    return i->frames_count == 0 && !i->has_nil_key &&
+           ( !i->has_table || htr_table_iterator_finished ( &i->table_iterator ) );
+}
+
+
+void htr_iterator_free ( htr_iterator * i )
+{
+    if ( i == NULL ) return;
+    htr_iterator_destroy ( i );
+    free ( i );
+}
+
+
+// Decode the key into the buffer growing it for the decoded length, buffer is terminated by zero.
+static const char * decode_key ( const htr * T, const char * key, size_t size, char ** buffer, size_t * capacity, size_t * len )
+{
+    size_t length = htr_decode ( T->encoder, ( const uint8_t * ) key, size, *buffer, *capacity );
+    if ( length + 1 > *capacity ) {
+        *capacity = length + 1 < 64 ? 64 : length + 1;
+        free ( *buffer );
+        *buffer = malloc ( *capacity );
+        htr_decode ( T->encoder, ( const uint8_t * ) key, size, *buffer, *capacity );
     }
+    ( *buffer ) [length] = '\0';
+    *len = length;
+    return *buffer;
+}
 
+
+const char* htr_iterator_key ( htr_iterator * i, size_t* len )
+{
     if ( htr_iterator_finished ( i ) ) return NULL;
 
-    return htr_table_iterator_val ( i->i );
+    size_t sublen;
+    const char* subkey;
+
+    if ( i->has_nil_key ) {
+        subkey = "";
+        sublen = 0;
+    } else subkey = htr_table_iterator_key ( &i->table_iterator, &sublen );
+
+    htr_iterator_reserve_key ( i, i->level + sublen + 1 );
+
+    char * key = iterator_key ( i );
+    memcpy ( key + i->level, subkey, sublen );
+    key[i->level + sublen] = '\0';
+
+    *len = i->level + sublen;
+    if ( i->T->encoder != NULL ) {
+        return decode_key ( i->T, key, *len, &i->decoded, &i->decoded_capacity, len );
+    }
+    return key;
+}
+
+
+void htr_iterator_key_view ( htr_iterator * i, htr_key_view * view )
+{
+    if ( htr_iterator_finished ( i ) ) {
+        view->prefix        = NULL;
+        view->prefix_length = 0;
+        view->suffix        = NULL;
+        view->suffix_length = 0;
+        return;
+    }
+
+    if ( i->T->encoder != NULL ) {
+        view->prefix        = htr_iterator_key ( i, &view->prefix_length );
+        view->suffix        = "";
+        view->suffix_length = 0;
+        return;
+    }
+
+    view->prefix        = iterator_key ( i );
+    view->prefix_length = i->level;
+
+    if ( i->has_nil_key ) {
+        view->suffix        = "";
+        view->suffix_length = 0;
+    } else {
+        view->suffix = htr_table_iterator_key ( &i->table_iterator, &view->suffix_length );
+    }
+}
+
+
+htr_value * htr_iterator_val ( htr_iterator * i )
+{
+    if ( i->T->value_size != sizeof ( htr_value ) ) return NULL;
+
+    if ( i->has_nil_key ) {
+        return i->nil_val;
+    }
+
+    if ( htr_iterator_finished ( i ) ) return NULL;
+
+    return htr_table_iterator_val ( &i->table_iterator );
+}
+
+
+htr_value htr_iterator_value ( htr_iterator * i )
+{
+    const uint8_t * value;
+    if ( i->has_nil_key ) {
+        value = ( const uint8_t * ) i->nil_val;
+    } else if ( htr_iterator_finished ( i ) ) {
+        return 0;
+    } else {
+        value = ( const uint8_t * ) htr_table_iterator_val ( &i->table_iterator );
+    }
+    if ( i->T->value_size == HTR_VALUE_BLOB ) {
+        return 0;
+    }
+    return value_load ( value, i->T->value_size );
+}
+
+
+const void * htr_iterator_blob ( htr_iterator * i, size_t * size )
+{
+    const htr_value * field;
+    if ( i->T->value_size != HTR_VALUE_BLOB ) {
+        return NULL;
+    } else if ( i->has_nil_key ) {
+        field = i->nil_val;
+    } else if ( htr_iterator_finished ( i ) ) {
+        return NULL;
+    } else {
+        field = htr_table_iterator_val ( &i->table_iterator );
+    }
+    return htr_blob_data ( field, size );
+}
+
+
+/* Walk is a push style alternative to the iterator.
+ * Trie nodes are visited recursively and unsorted buckets are scanned directly
+ * without per key state machine.
+ */
+
+typedef struct htr_walk_t {
+    const htr *       T;
+    htr_walk_callback callback;
+    void *            data;
+    bool              sorted;
+
+    // key prefix consumed by trie nodes
+    char * key;
+    size_t keysize;
+
+    // keys in the first bucket must start with the rest of the prefix
+    const char * filter;
+    size_t       filter_length;
+
+    bool               has_table;
+    htr_table_iterator table_iterator;
+
+    // copy of narrow value passed to callback
+    htr_value value;
+
+    // keys of trie with encoder are joined and decoded, prefix of the walk is checked on decoded keys
+    const char * prefix;
+    size_t       prefix_length;
+    char *       encoded;
+    size_t       encoded_capacity;
+    char *       decoded;
+    size_t       decoded_capacity;
+
+    // set operations visit pairs of the first trie that are found (or not found) below the trie node of other trie,
+    // the key is looked up from probe_level of the walked key
+    const htr *  other;
+    htr_node_ptr probe;
+    size_t       probe_level;
+    bool         found;
+    char *       probe_key;
+    size_t       probe_capacity;
+} htr_walk_state;
+
+static void htr_walk_pushchar ( htr_walk_state * w, size_t level, char c )
+{
+    if ( w->keysize < level ) {
+        while ( w->keysize < level ) w->keysize *= 2;
+        w->key = realloc ( w->key, w->keysize * sizeof ( char ) );
+    }
+    w->key[level - 1] = c;
+}
+
+static int htr_walk_decoded ( htr_walk_state * w, htr_key_view * view, htr_value * value )
+{
+    size_t size = view->prefix_length + view->suffix_length, length;
+    if ( w->encoded_capacity < size ) {
+        w->encoded_capacity = size;
+        w->encoded          = realloc ( w->encoded, size );
+    }
+    memcpy ( w->encoded, view->prefix, view->prefix_length );
+    memcpy ( w->encoded + view->prefix_length, view->suffix, view->suffix_length );
+
+    const char * key = decode_key ( w->T, w->encoded, size, &w->decoded, &w->decoded_capacity, &length );
+    if ( length < w->prefix_length || memcmp ( key, w->prefix, w->prefix_length ) != 0 ) {
+        return 0;
+    }
+    htr_key_view decoded;
+    decoded.prefix        = key;
+    decoded.prefix_length = length;
+    decoded.suffix        = "";
+    decoded.suffix_length = 0;
+    return w->callback ( &decoded, value, w->data );
+}
+
+static bool htr_walk_probe ( htr_walk_state * w, const htr_key_view * view );
+
+static inline
+int htr_walk_value ( htr_walk_state * w, htr_key_view * view, htr_value * value )
+{
+    if ( w->probe.flag != NULL && htr_walk_probe ( w, view ) != w->found ) {
+        return 0;
+    }
+    if ( w->T->value_size != sizeof ( htr_value ) && w->T->value_size != HTR_VALUE_BLOB ) {
+        w->value = value_load ( ( const uint8_t * ) value, w->T->value_size );
+        value    = &w->value;
+    }
+    if ( w->T->encoder != NULL ) {
+        return htr_walk_decoded ( w, view, value );
+    }
+    return w->callback ( view, value, w->data );
+}
+
+static inline
+int htr_walk_pair ( htr_walk_state * w, htr_key_view * view, const uint8_t * key, size_t length, htr_value * value )
+{
+    if ( length < w->filter_length || memcmp ( key, w->filter, w->filter_length ) != 0 ) {
+        return 0;
+    }
+    view->suffix        = ( const char * ) key;
+    view->suffix_length = length;
+    return htr_walk_value ( w, view, value );
+}
+
+static int htr_walk_slot ( htr_walk_state * w, htr_key_view * view, htr_slot s, htr_slot end )
+{
+    int ret;
+    size_t k;
+    bool stub;
+    while ( s < end ) {
+        s   = key_read ( s, &k, &stub );
+        ret = htr_walk_pair ( w, view, key_data ( s, stub ), k, ( htr_value * ) ( s + key_field_size ( k, stub ) ) );
+        if ( ret != 0 ) {
+            return ret;
+        }
+        s += key_field_size ( k, stub );
+        s += value_field_size ( s, w->T->value_size );
+    }
+    return 0;
+}
+
+static int htr_walk_table ( htr_walk_state * w, htr_node_ptr node, size_t level )
+{
+    htr_key_view view;
+    view.prefix        = w->key;
+    view.prefix_length = level;
+
+    int ret;
+    size_t i;
+    // front coded table and image are decoded by the iterator
+    bool front_coded = w->T->image != NULL ? node.table_image->encoding == HTR_TABLE_IMAGE_SORTED : node.table->front_coded;
+    if ( w->sorted || front_coded ) {
+        reset_table_iterator ( w->T, node, &w->table_iterator, &w->has_table, w->sorted );
+
+        size_t length;
+        const char * key;
+        while ( !htr_table_iterator_finished ( &w->table_iterator ) ) {
+            key = htr_table_iterator_key ( &w->table_iterator, &length );
+            ret = htr_walk_pair ( w, &view, ( const uint8_t * ) key, length, htr_table_iterator_val ( &w->table_iterator ) );
+            if ( ret != 0 ) {
+                return ret;
+            }
+            htr_table_iterator_next ( &w->table_iterator );
+        }
+        return 0;
+    }
+
+    if ( w->T->image != NULL ) {
+        const htr_table_image * image = node.table_image;
+        htr_slot data = ( htr_slot ) ( image->offsets + image->slots_count + 1 );
+        for ( i = 0; i < image->slots_count; i++ ) {
+            ret = htr_walk_slot ( w, &view, data + image->offsets[i], data + image->offsets[i + 1] );
+            if ( ret != 0 ) {
+                return ret;
+            }
+        }
+        return 0;
+    }
+
+    const htr_table * table = node.table;
+    for ( i = 0; i < table->slots_count; i++ ) {
+        ret = htr_walk_slot ( w, &view, table->slots[i], table->slots[i] + table->slots_sizes[i] );
+        if ( ret != 0 ) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static int htr_walk_node ( htr_walk_state * w, htr_node_ptr node, size_t level )
+{
+    int ret;
+
+    if ( *node.flag & NODE_HAS_VAL ) {
+        htr_key_view view;
+        view.prefix        = w->key;
+        view.prefix_length = level;
+        view.suffix        = "";
+        view.suffix_length = 0;
+        ret = htr_walk_value ( w, &view, node_value ( w->T, node ) );
+        if ( ret != 0 ) {
+            return ret;
+        }
+    }
+
+    size_t c;
+    htr_node_ptr child, prev;
+    prev.flag = NULL;
+    for ( c = 0; c < w->T->childs; c++ ) {
+        child = node_child ( w->T, node, ( unsigned char ) c );
+
+        /* skip repeated pointers to hybrid bucket */
+        if ( child.flag == prev.flag ) continue;
+        prev = child;
+
+        if ( *child.flag & NODE_TYPE_TRIE ) {
+            htr_walk_pushchar ( w, level + 1, ( char ) c );
+            ret = htr_walk_node ( w, child, level + 1 );
+        } else if ( node_table_size ( w->T, child ) == 0 ) {
+            continue;
+        } else if ( *child.flag & NODE_TYPE_PURE_BUCKET ) {
+            htr_walk_pushchar ( w, level + 1, ( char ) c );
+            ret = htr_walk_table ( w, child, level + 1 );
+        } else {
+            ret = htr_walk_table ( w, child, level );
+        }
+        if ( ret != 0 ) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static void htr_walk_init ( htr_walk_state * w, const htr * T, bool sorted, htr_walk_callback callback, void * data, size_t keysize )
+{
+    w->T             = T;
+    w->callback      = callback;
+    w->data          = data;
+    w->sorted        = sorted;
+    w->keysize       = keysize < 16 ? 16 : keysize;
+    w->key           = malloc ( w->keysize * sizeof ( char ) );
+    w->filter        = NULL;
+    w->filter_length = 0;
+    w->has_table     = false;
+
+    w->prefix           = "";
+    w->prefix_length    = 0;
+    w->encoded          = NULL;
+    w->encoded_capacity = 0;
+    w->decoded          = NULL;
+    w->decoded_capacity = 0;
+
+    w->other          = NULL;
+    w->probe.flag     = NULL;
+    w->probe_level    = 0;
+    w->found          = true;
+    w->probe_key      = NULL;
+    w->probe_capacity = 0;
+}
+
+static void htr_walk_destroy ( htr_walk_state * w )
+{
+    if ( w->has_table ) {
+        htr_table_iterator_destroy ( &w->table_iterator );
+    }
+    free ( w->key );
+    free ( w->encoded );
+    free ( w->decoded );
+    free ( w->probe_key );
+}
+
+int htr_walk ( const htr * T, const char * prefix, size_t length, bool sorted, htr_walk_callback callback, void * data )
+{
+    // encoded prefix is cut to its full bytes, so the walk may visit more keys, they are filtered after decoding
+    const char * original = prefix;
+    size_t original_length = length;
+    char * encoded_prefix = NULL;
+    if ( T->encoder != NULL && length > 0 ) {
+        encoded_prefix = malloc ( htr_encoded_size_max ( length ) );
+        length = htr_encode ( T->encoder, prefix, length, false, ( uint8_t * ) encoded_prefix );
+        prefix = encoded_prefix;
+        if ( length == SIZE_MAX ) {
+            // no key has a byte out of the alphabet
+            free ( encoded_prefix );
+            return 0;
+        }
+    }
+
+    htr_walk_state w;
+    htr_walk_init ( &w, T, sorted, callback, data, length );
+    w.prefix        = original;
+    w.prefix_length = original_length;
+
+    int ret;
+    htr_node_ptr parent = T->root;
+    if ( length == 0 ) {
+        ret = htr_walk_node ( &w, parent, 0 );
+    } else {
+        const char * rest = prefix;
+        size_t rest_length = length;
+        htr_node_ptr node = node_consume ( T, &parent, &rest, &rest_length, 1 );
+
+        /* prefix consumed by trie nodes up to the node */
+        size_t level = length - rest_length;
+        memcpy ( w.key, prefix, level );
+
+        if ( *node.flag & NODE_TYPE_TRIE ) {
+            w.key[level] = rest[0];
+            ret = htr_walk_node ( &w, node, length );
+        } else {
+            if ( *node.flag & NODE_TYPE_PURE_BUCKET ) {
+                w.key[level] = rest[0];
+                level++;
+                rest++;
+                rest_length--;
+            }
+            w.filter        = rest;
+            w.filter_length = rest_length;
+            ret = htr_walk_table ( &w, node, level );
+        }
+    }
+
+    htr_walk_destroy ( &w );
+    free ( encoded_prefix );
+    return ret;
+}
+
+
+/* Set operations descend trie nodes of both tries in lockstep.
+ * Subtree of the first trie that meets empty bucket of the other one is skipped or visited as a whole,
+ * pairs of subtrees and buckets that meet keys of the other trie are probed below its last common trie node.
+ */
+
+// Find the key below the trie node of any trie, its first char selects the child of node.
+static const htr_value * node_tryget ( const htr * T, htr_node_ptr node, const char * key, size_t len )
+{
+    while ( *node.flag & NODE_TYPE_TRIE ) {
+        if ( len == 0 ) {
+            return *node.flag & NODE_HAS_VAL ? node_value ( T, node ) : NULL;
+        }
+        node = node_child ( T, node, ( unsigned char ) *key );
+        if ( *node.flag & ( NODE_TYPE_TRIE | NODE_TYPE_PURE_BUCKET ) ) {
+            key++;
+            len--;
+        }
+    }
+    if ( T->image != NULL ) {
+        return htr_table_image_tryget ( node.table_image, T->hash_function, key, len );
+    }
+    return htr_table_tryget ( node.table, T->hash_function, key, len );
+}
+
+// Key of the visited pair is looked up in the other trie from the probe node.
+static bool htr_walk_probe ( htr_walk_state * w, const htr_key_view * view )
+{
+    size_t prefix_length = view->prefix_length - w->probe_level;
+    size_t length        = prefix_length + view->suffix_length;
+    if ( w->probe_capacity < length ) {
+        w->probe_capacity = length;
+        w->probe_key      = realloc ( w->probe_key, length );
+    }
+    memcpy ( w->probe_key, view->prefix + w->probe_level, prefix_length );
+    memcpy ( w->probe_key + prefix_length, view->suffix, view->suffix_length );
+    return node_tryget ( w->other, w->probe, w->probe_key, length ) != NULL;
+}
+
+static inline
+bool is_empty_bucket ( const htr * T, htr_node_ptr node )
+{
+    return ! ( *node.flag & NODE_TYPE_TRIE ) && node_table_size ( T, node ) == 0;
+}
+
+// Visit pairs of the child subtree or bucket of the first trie, they are probed below the trie node of other trie if needed.
+static int htr_set_child ( htr_walk_state * w, htr_node_ptr node, htr_node_ptr other, unsigned int c0, unsigned int c1, size_t level )
+{
+    // other trie has no keys with these chars
+    bool empty = true;
+    unsigned int c;
+    for ( c = c0; c <= c1 && empty; c++ ) {
+        empty = is_empty_bucket ( w->other, node_child ( w->other, other, ( unsigned char ) c ) );
+    }
+    if ( empty && w->found ) {
+        return 0;
+    }
+
+    htr_node_ptr probe = w->probe;
+    if ( !empty ) {
+        w->probe       = other;
+        w->probe_level = level;
+    }
+
+    int ret;
+    htr_node_ptr child = node_child ( w->T, node, ( unsigned char ) c0 );
+    if ( *child.flag & NODE_TYPE_TRIE ) {
+        ret = htr_walk_node ( w, child, level + 1 );
+    } else if ( *child.flag & NODE_TYPE_PURE_BUCKET ) {
+        ret = htr_walk_table ( w, child, level + 1 );
+    } else {
+        ret = htr_walk_table ( w, child, level );
+    }
+    w->probe = probe;
+    return ret;
+}
+
+static int htr_set_node ( htr_walk_state * w, htr_node_ptr node, htr_node_ptr other, size_t level )
+{
+    int ret;
+
+    if ( *node.flag & NODE_HAS_VAL && ( ( *other.flag & NODE_HAS_VAL ) != 0 ) == w->found ) {
+        htr_key_view view;
+        view.prefix        = w->key;
+        view.prefix_length = level;
+        view.suffix        = "";
+        view.suffix_length = 0;
+        ret = htr_walk_value ( w, &view, node_value ( w->T, node ) );
+        if ( ret != 0 ) {
+            return ret;
+        }
+    }
+
+    unsigned int c = 0, c1;
+    while ( c < w->T->childs ) {
+        htr_node_ptr child = node_child ( w->T, node, ( unsigned char ) c );
+        htr_node_ptr other_child = node_child ( w->other, other, ( unsigned char ) c );
+
+        /* skip repeated pointers to hybrid bucket */
+        for ( c1 = c; c1 + 1 < w->T->childs && node_child ( w->T, node, ( unsigned char ) ( c1 + 1 ) ).flag == child.flag; c1++ );
+
+        ret = 0;
+        if ( *child.flag & NODE_TYPE_TRIE ) {
+            htr_walk_pushchar ( w, level + 1, ( char ) c );
+            if ( *other_child.flag & NODE_TYPE_TRIE ) {
+                ret = htr_set_node ( w, child, other_child, level + 1 );
+            } else {
+                ret = htr_set_child ( w, node, other, c, c, level );
+            }
+        } else if ( node_table_size ( w->T, child ) != 0 ) {
+            if ( *child.flag & NODE_TYPE_PURE_BUCKET ) {
+                htr_walk_pushchar ( w, level + 1, ( char ) c );
+            }
+            ret = htr_set_child ( w, node, other, c, c1, level );
+        }
+        if ( ret != 0 ) {
+            return ret;
+        }
+        c = c1 + 1;
+    }
+    return 0;
+}
+
+// Keys of the first trie are decoded and looked up in the other trie.
+static int htr_set_decoded_pair ( const htr_key_view * view, htr_value * value, void * data )
+{
+    htr_walk_state * w = data;
+    size_t len = view->prefix_length + view->suffix_length;
+    if ( w->probe_capacity < len ) {
+        w->probe_capacity = len;
+        w->probe_key      = realloc ( w->probe_key, len );
+    }
+    memcpy ( w->probe_key, view->prefix, view->prefix_length );
+    memcpy ( w->probe_key + view->prefix_length, view->suffix, view->suffix_length );
+    if ( ( tryget_key ( ( htr * ) w->other, w->probe_key, len ) != NULL ) != w->found ) {
+        return 0;
+    }
+    return w->callback ( view, value, w->data );
+}
+
+static int htr_set_walk ( const htr * a, const htr * b, bool found, bool sorted, htr_walk_callback callback, void * data )
+{
+    htr_walk_state w;
+    htr_walk_init ( &w, a, sorted, callback, data, 0 );
+    w.other = b;
+    w.found = found;
+
+    int ret;
+    if ( htr_encoder_equal ( a->encoder, b->encoder ) ) {
+        ret = htr_set_node ( &w, a->root, b->root, 0 );
+    } else {
+        ret = htr_walk ( a, "", 0, sorted, htr_set_decoded_pair, &w );
+    }
+    htr_walk_destroy ( &w );
+    return ret;
+}
+
+int htr_intersect ( const htr * a, const htr * b, bool sorted, htr_walk_callback callback, void * data )
+{
+    return htr_set_walk ( a, b, true, sorted, callback, data );
+}
+
+int htr_difference ( const htr * a, const htr * b, bool sorted, htr_walk_callback callback, void * data )
+{
+    return htr_set_walk ( a, b, false, sorted, callback, data );
+}
+
+int htr_collect ( const htr_key_view * view, htr_value * value, void * data )
+{
+    htr * T = data;
+    size_t len = view->prefix_length + view->suffix_length;
+    char inline_key[HTR_ENCODED_INLINE_KEY];
+    char * key = len > HTR_ENCODED_INLINE_KEY ? malloc ( len ) : inline_key;
+    if ( key == NULL ) {
+        return -1;
+    }
+    memcpy ( key, view->prefix, view->prefix_length );
+    memcpy ( key + view->prefix_length, view->suffix, view->suffix_length );
+
+    int result;
+    if ( T->value_size == HTR_VALUE_BLOB ) {
+        size_t size;
+        const void * blob = htr_blob_data ( value, &size );
+        result = htr_blob_set ( T, key, len, blob, size );
+    } else {
+        result = htr_set ( T, key, len, *value );
+    }
+    if ( key != inline_key ) {
+        free ( key );
+    }
+    return result;
+}
+
+
+/* Fuzzy search and pattern matching step an automaton through chars of the walked key.
+ * Automaton keeps its state for every level of the key, the state of the next char is computed from the state of its parent.
+ * Subtree is pruned when its state can't accept any key, pure bucket is pruned by its char,
+ * hybrid bucket when all chars of its range are rejected. Keys in buckets continue states of the node.
+ */
+
+typedef struct htr_automaton_t htr_automaton;
+
+struct htr_automaton_t {
+    htr_walk_state w;
+
+    // compute the state of level + 1 from the state of level, returns false if no key starting with the chars may be accepted
+    bool ( * step ) ( htr_automaton * a, size_t level, unsigned char c );
+    bool ( * accept ) ( htr_automaton * a, size_t level );
+
+    // state_size bytes for every level
+    uint8_t * states;
+    size_t    state_size;
+    size_t    states_count;
+};
+
+static void automaton_init ( htr_automaton * a, const htr * T, htr_walk_callback callback, void * data, size_t keysize, size_t state_size )
+{
+    htr_walk_init ( &a->w, T, false, callback, data, keysize );
+    a->state_size   = state_size;
+    a->states_count = 16;
+    a->states       = malloc ( a->states_count * state_size );
+}
+
+static void automaton_destroy ( htr_automaton * a )
+{
+    free ( a->states );
+    htr_walk_destroy ( &a->w );
+}
+
+static inline
+void * automaton_state ( htr_automaton * a, size_t level )
+{
+    if ( level >= a->states_count ) {
+        size_t count = a->states_count;
+        while ( count <= level ) count *= 2;
+        a->states       = realloc ( a->states, count * a->state_size );
+        a->states_count = count;
+    }
+    return a->states + level * a->state_size;
+}
+
+static int automaton_pair ( htr_automaton * a, htr_key_view * view, const uint8_t * key, size_t length, htr_value * value )
+{
+    size_t level = view->prefix_length, i;
+    for ( i = 0; i < length; i++ ) {
+        if ( !a->step ( a, level + i, key[i] ) ) {
+            return 0;
+        }
+    }
+    if ( !a->accept ( a, level + length ) ) {
+        return 0;
+    }
+    return htr_walk_pair ( &a->w, view, key, length, value );
+}
+
+static int automaton_slot ( htr_automaton * a, htr_key_view * view, htr_slot s, htr_slot end )
+{
+    int ret;
+    size_t k;
+    bool stub;
+    while ( s < end ) {
+        s   = key_read ( s, &k, &stub );
+        ret = automaton_pair ( a, view, key_data ( s, stub ), k, ( htr_value * ) ( s + key_field_size ( k, stub ) ) );
+        if ( ret != 0 ) {
+            return ret;
+        }
+        s += key_field_size ( k, stub );
+        s += value_field_size ( s, a->w.T->value_size );
+    }
+    return 0;
+}
+
+// Keys of the bucket are scanned like htr_walk_table does.
+static int automaton_table ( htr_automaton * a, htr_node_ptr node, size_t level )
+{
+    htr_walk_state * w = &a->w;
+    htr_key_view view;
+    view.prefix        = w->key;
+    view.prefix_length = level;
+
+    int ret;
+    size_t i;
+    bool front_coded = w->T->image != NULL ? node.table_image->encoding == HTR_TABLE_IMAGE_SORTED : node.table->front_coded;
+    if ( front_coded ) {
+        reset_table_iterator ( w->T, node, &w->table_iterator, &w->has_table, false );
+
+        size_t length;
+        const char * key;
+        while ( !htr_table_iterator_finished ( &w->table_iterator ) ) {
+            key = htr_table_iterator_key ( &w->table_iterator, &length );
+            ret = automaton_pair ( a, &view, ( const uint8_t * ) key, length, htr_table_iterator_val ( &w->table_iterator ) );
+            if ( ret != 0 ) {
+                return ret;
+            }
+            htr_table_iterator_next ( &w->table_iterator );
+        }
+        return 0;
+    }
+
+    if ( w->T->image != NULL ) {
+        const htr_table_image * image = node.table_image;
+        htr_slot data = ( htr_slot ) ( image->offsets + image->slots_count + 1 );
+        for ( i = 0; i < image->slots_count; i++ ) {
+            ret = automaton_slot ( a, &view, data + image->offsets[i], data + image->offsets[i + 1] );
+            if ( ret != 0 ) {
+                return ret;
+            }
+        }
+        return 0;
+    }
+
+    const htr_table * table = node.table;
+    for ( i = 0; i < table->slots_count; i++ ) {
+        ret = automaton_slot ( a, &view, table->slots[i], table->slots[i] + table->slots_sizes[i] );
+        if ( ret != 0 ) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static int automaton_node ( htr_automaton * a, htr_node_ptr node, size_t level )
+{
+    htr_walk_state * w = &a->w;
+    int ret;
+
+    if ( *node.flag & NODE_HAS_VAL && a->accept ( a, level ) ) {
+        htr_key_view view;
+        view.prefix        = w->key;
+        view.prefix_length = level;
+        view.suffix        = "";
+        view.suffix_length = 0;
+        ret = htr_walk_value ( w, &view, node_value ( w->T, node ) );
+        if ( ret != 0 ) {
+            return ret;
+        }
+    }
+
+    unsigned int c = 0, c1, k;
+    while ( c < w->T->childs ) {
+        htr_node_ptr child = node_child ( w->T, node, ( unsigned char ) c );
+        for ( c1 = c; c1 + 1 < w->T->childs && node_child ( w->T, node, ( unsigned char ) ( c1 + 1 ) ).flag == child.flag; c1++ );
+
+        ret = 0;
+        if ( *child.flag & NODE_TYPE_TRIE ) {
+            if ( a->step ( a, level, ( unsigned char ) c ) ) {
+                htr_walk_pushchar ( w, level + 1, ( char ) c );
+                ret = automaton_node ( a, child, level + 1 );
+            }
+        } else if ( node_table_size ( w->T, child ) == 0 ) {
+            // nothing to scan
+        } else if ( *child.flag & NODE_TYPE_PURE_BUCKET ) {
+            if ( a->step ( a, level, ( unsigned char ) c ) ) {
+                htr_walk_pushchar ( w, level + 1, ( char ) c );
+                ret = automaton_table ( a, child, level + 1 );
+            }
+        } else {
+            for ( k = c; k <= c1 && !a->step ( a, level, ( unsigned char ) k ); k++ );
+            if ( k <= c1 ) {
+                ret = automaton_table ( a, child, level );
+            }
+        }
+        if ( ret != 0 ) {
+            return ret;
+        }
+        c = c1 + 1;
+    }
+    return 0;
+}
+
+// Keys of trie with encoder are decoded, so every key is stepped from the start.
+static int automaton_decoded_pair ( const htr_key_view * view, htr_value * value, void * data )
+{
+    htr_automaton * a = data;
+    size_t level = 0, i;
+    for ( i = 0; i < view->prefix_length; i++, level++ ) {
+        if ( !a->step ( a, level, ( unsigned char ) view->prefix[i] ) ) {
+            return 0;
+        }
+    }
+    for ( i = 0; i < view->suffix_length; i++, level++ ) {
+        if ( !a->step ( a, level, ( unsigned char ) view->suffix[i] ) ) {
+            return 0;
+        }
+    }
+    if ( !a->accept ( a, level ) ) {
+        return 0;
+    }
+    return a->w.callback ( view, value, a->w.data );
+}
+
+// Visit keys accepted by automaton, its state of level 0 is set.
+// Keys must start with the prefix, trie nodes of the prefix are consumed without branching like in htr_walk.
+static int automaton_walk ( htr_automaton * a, const char * prefix, size_t length )
+{
+    const htr * T = a->w.T;
+    if ( T->encoder != NULL ) {
+        return htr_walk ( T, prefix, length, false, automaton_decoded_pair, a );
+    }
+    if ( length == 0 ) {
+        return automaton_node ( a, T->root, 0 );
+    }
+
+    htr_node_ptr parent = T->root;
+    const char * rest = prefix;
+    size_t rest_length = length;
+    htr_node_ptr node = node_consume ( T, &parent, &rest, &rest_length, 1 );
+
+    /* prefix consumed by trie nodes up to the node */
+    size_t level = length - rest_length, i;
+    for ( i = 0; i < level; i++ ) {
+        htr_walk_pushchar ( &a->w, i + 1, prefix[i] );
+        if ( !a->step ( a, i, ( unsigned char ) prefix[i] ) ) {
+            return 0;
+        }
+    }
+
+    if ( *node.flag & ( NODE_TYPE_TRIE | NODE_TYPE_PURE_BUCKET ) ) {
+        htr_walk_pushchar ( &a->w, level + 1, rest[0] );
+        if ( !a->step ( a, level, ( unsigned char ) rest[0] ) ) {
+            return 0;
+        }
+        if ( *node.flag & NODE_TYPE_TRIE ) {
+            return automaton_node ( a, node, level + 1 );
+        }
+        return automaton_table ( a, node, level + 1 );
+    }
+    // rest of the prefix is checked by automaton
+    return automaton_table ( a, node, level );
+}
+
+
+/* Fuzzy search keeps the row of the Levenshtein table for every level of the walked key.
+ * Distances above the limit can't get back, so only the band of cells j with |j - level| <= max_distance is computed,
+ * cells outside of the band are max_distance + 1.
+ */
+
+typedef struct htr_fuzzy_t {
+    htr_automaton   a;
+    const uint8_t * query;
+    size_t          length;
+    size_t          max_distance;
+} htr_fuzzy_state;
+
+static bool fuzzy_step ( htr_automaton * a, size_t level, unsigned char c )
+{
+    htr_fuzzy_state * f = ( htr_fuzzy_state * ) a;
+    size_t * next = automaton_state ( a, level + 1 );
+    const size_t * row = automaton_state ( a, level );
+    size_t limit = f->max_distance + 1;
+    size_t row_high = level + f->max_distance;
+    size_t low  = level + 1 > f->max_distance ? level + 1 - f->max_distance : 0;
+    size_t high = level + 1 + f->max_distance < f->length ? level + 1 + f->max_distance : f->length;
+    size_t j, left = limit, least = limit;
+    if ( low == 0 ) {
+        left = least = next[0] = level + 1;
+        low = 1;
+    }
+    for ( j = low; j <= high; j++ ) {
+        size_t d = row[j - 1] + ( f->query[j - 1] != c );
+        if ( j <= row_high && row[j] + 1 < d ) d = row[j] + 1;
+        if ( left + 1 < d )                    d = left + 1;
+        if ( d > limit )                       d = limit;
+        next[j] = left = d;
+        if ( d < least ) least = d;
+    }
+    return least <= f->max_distance;
+}
+
+static bool fuzzy_accept ( htr_automaton * a, size_t level )
+{
+    htr_fuzzy_state * f = ( htr_fuzzy_state * ) a;
+    if ( level > f->length + f->max_distance || f->length > level + f->max_distance ) {
+        return false;
+    }
+    return ( ( const size_t * ) automaton_state ( a, level ) ) [f->length] <= f->max_distance;
+}
+
+int htr_fuzzy_search ( const htr * T, const char * query, size_t length, size_t max_distance, htr_walk_callback callback, void * data )
+{
+    htr_fuzzy_state f;
+    automaton_init ( &f.a, T, callback, data, 0, ( length + 1 ) * sizeof ( size_t ) );
+    f.a.step       = fuzzy_step;
+    f.a.accept     = fuzzy_accept;
+    f.query        = ( const uint8_t * ) query;
+    f.length       = length;
+    f.max_distance = max_distance < SIZE_MAX / 2 ? max_distance : SIZE_MAX / 2; // bounds of the band don't overflow
+
+    // distances of the empty key
+    size_t * row = automaton_state ( &f.a, 0 ), j;
+    for ( j = 0; j <= length; j++ ) {
+        row[j] = j;
+    }
+
+    int ret = automaton_walk ( &f.a, "", 0 );
+    automaton_destroy ( &f.a );
+    return ret;
+}
+
+
+/* Pattern is compiled to the list of elements, every element matches a set of chars, star element matches any number of them.
+ * Set of positions in the list is the state of NFA, position of the star includes the next position.
+ * Sets are turned into DFA states on the first visit, so every char of the walked keys costs one lookup in the table of transitions.
+ */
+
+typedef struct htr_glob_element_t {
+    uint64_t chars[4];
+    bool     star;
+} htr_glob_element;
+
+typedef struct htr_glob_t {
+    htr_automaton      a;
+    htr_glob_element * elements;
+    size_t             count;
+    size_t             words; // count + 1 positions
+
+    // sets of positions for DFA states, the first state is the empty set
+    uint64_t * sets;
+    // 256 transitions for every state, -1 if it is not known yet
+    int32_t *  next;
+    size_t     states_count;
+    size_t     states_capacity;
+    // open addressing index of sets, it has state + 1 or 0
+    uint32_t * index;
+    size_t     index_capacity;
+} htr_glob_state;
+
+static inline
+void glob_add ( htr_glob_element * e, unsigned char c )
+{
+    e->chars[c >> 6] |= ( uint64_t ) 1 << ( c & 63 );
+}
+
+static inline
+bool glob_has ( const htr_glob_element * e, unsigned char c )
+{
+    return ( e->chars[c >> 6] >> ( c & 63 ) ) & 1;
+}
+
+// Parse class after "[", returns the length of class or 0 if it is not closed.
+static size_t glob_class ( htr_glob_element * e, const char * pattern, size_t length )
+{
+    size_t i = 0;
+    bool negate = false;
+    if ( i < length && ( pattern[i] == '!' || pattern[i] == '^' ) ) {
+        negate = true;
+        i++;
+    }
+    size_t first = i;
+    while ( i < length && ( pattern[i] != ']' || i == first ) ) {
+        unsigned char low = ( unsigned char ) pattern[i++];
+        if ( low == '\\' && i < length ) {
+            low = ( unsigned char ) pattern[i++];
+        }
+        unsigned char high = low;
+        if ( i + 1 < length && pattern[i] == '-' && pattern[i + 1] != ']' ) {
+            high = ( unsigned char ) pattern[i + 1];
+            i += 2;
+            if ( high == '\\' && i < length ) {
+                high = ( unsigned char ) pattern[i++];
+            }
+        }
+        unsigned int c;
+        for ( c = low; c <= high; c++ ) {
+            glob_add ( e, ( unsigned char ) c );
+        }
+    }
+    if ( i == length ) {
+        return 0;
+    }
+    if ( negate ) {
+        size_t k;
+        for ( k = 0; k < 4; k++ ) {
+            e->chars[k] = ~e->chars[k];
+        }
+    }
+    return i + 1;
+}
+
+// Compile the pattern, literal prefix of the pattern is copied to the prefix.
+static void glob_compile ( htr_glob_state * g, const char * pattern, size_t length, char * prefix, size_t * prefix_length )
+{
+    g->elements = malloc ( ( length + 1 ) * sizeof ( htr_glob_element ) );
+    g->count    = 0;
+    *prefix_length = 0;
+    bool literal = true;
+
+    size_t i = 0;
+    while ( i < length ) {
+        htr_glob_element * e = &g->elements[g->count];
+        memset ( e, 0, sizeof ( htr_glob_element ) );
+        char c = pattern[i++];
+        if ( c == '*' ) {
+            // repeated stars are the same star
+            if ( g->count > 0 && g->elements[g->count - 1].star ) {
+                continue;
+            }
+            memset ( e->chars, 0xff, sizeof ( e->chars ) );
+            e->star = true;
+            literal = false;
+        } else if ( c == '?' ) {
+            memset ( e->chars, 0xff, sizeof ( e->chars ) );
+            literal = false;
+        } else {
+            size_t size;
+            if ( c == '[' && ( size = glob_class ( e, pattern + i, length - i ) ) != 0 ) {
+                i += size;
+                literal = false;
+            } else {
+                // unclosed class is a literal "["
+                if ( c == '\\' && i < length ) {
+                    c = pattern[i++];
+                }
+                glob_add ( e, ( unsigned char ) c );
+                if ( literal ) {
+                    prefix[( *prefix_length )++] = c;
+                }
+            }
+        }
+        g->count++;
+    }
+    g->words = g->count / 64 + 1;
+}
+
+static inline
+void glob_set ( uint64_t * set, size_t position )
+{
+    set[position >> 6] |= ( uint64_t ) 1 << ( position & 63 );
+}
+
+static inline
+const uint64_t * glob_state_set ( const htr_glob_state * g, uint32_t state )
+{
+    return g->sets + state * g->words;
+}
+
+// Find the DFA state of the set or add it.
+static uint32_t glob_intern ( htr_glob_state * g, const uint64_t * set )
+{
+    size_t size = g->words * sizeof ( uint64_t );
+    uint32_t hash = g->a.w.T->hash_function ( ( const uint8_t * ) set, size );
+    size_t mask = g->index_capacity - 1, i;
+    for ( i = hash & mask; g->index[i] != 0; i = ( i + 1 ) & mask ) {
+        if ( memcmp ( glob_state_set ( g, g->index[i] - 1 ), set, size ) == 0 ) {
+            return g->index[i] - 1;
+        }
+    }
+
+    if ( g->states_count == g->states_capacity ) {
+        g->states_capacity *= 2;
+        g->sets = realloc ( g->sets, g->states_capacity * size );
+        g->next = realloc ( g->next, g->states_capacity * NODE_CHILDS * sizeof ( int32_t ) );
+    }
+    uint32_t state = ( uint32_t ) g->states_count++;
+    memcpy ( g->sets + state * g->words, set, size );
+    memset ( g->next + state * NODE_CHILDS, 0xff, NODE_CHILDS * sizeof ( int32_t ) );
+    g->index[i] = state + 1;
+
+    // index is at most half full
+    if ( g->states_count * 2 > g->index_capacity ) {
+        free ( g->index );
+        g->index_capacity *= 2;
+        g->index = calloc ( g->index_capacity, sizeof ( uint32_t ) );
+        uint32_t k;
+        for ( k = 0; k < g->states_count; k++ ) {
+            hash = g->a.w.T->hash_function ( ( const uint8_t * ) glob_state_set ( g, k ), size );
+            for ( i = hash & ( g->index_capacity - 1 ); g->index[i] != 0; i = ( i + 1 ) & ( g->index_capacity - 1 ) );
+            g->index[i] = k + 1;
+        }
+    }
+    return state;
+}
+
+// Step NFA from the set of the state.
+static uint32_t glob_transition ( htr_glob_state * g, uint32_t state, unsigned char c )
+{
+    uint64_t * next = calloc ( g->words, sizeof ( uint64_t ) );
+    size_t k;
+    for ( k = 0; k < g->words; k++ ) {
+        uint64_t bits = glob_state_set ( g, state ) [k];
+        while ( bits != 0 ) {
+            size_t position = k * 64 + ( size_t ) __builtin_ctzll ( bits );
+            bits &= bits - 1;
+            if ( position == g->count || !glob_has ( &g->elements[position], c ) ) {
+                continue;
+            }
+            if ( g->elements[position].star ) {
+                glob_set ( next, position );
+                glob_set ( next, position + 1 );
+            } else {
+                glob_set ( next, position + 1 );
+                // star after the matched char may match nothing
+                if ( position + 1 < g->count && g->elements[position + 1].star ) {
+                    glob_set ( next, position + 2 );
+                }
+            }
+        }
+    }
+    uint32_t result = glob_intern ( g, next );
+    g->next[state * NODE_CHILDS + c] = ( int32_t ) result;
+    free ( next );
+    return result;
+}
+
+static bool glob_step ( htr_automaton * a, size_t level, unsigned char c )
+{
+    htr_glob_state * g = ( htr_glob_state * ) a;
+    uint32_t * next = automaton_state ( a, level + 1 );
+    uint32_t state  = * ( const uint32_t * ) automaton_state ( a, level );
+    int32_t result  = g->next[state * NODE_CHILDS + c];
+    *next = result >= 0 ? ( uint32_t ) result : glob_transition ( g, state, c );
+    return *next != 0;
+}
+
+static bool glob_accept ( htr_automaton * a, size_t level )
+{
+    htr_glob_state * g = ( htr_glob_state * ) a;
+    const uint64_t * set = glob_state_set ( g, * ( const uint32_t * ) automaton_state ( a, level ) );
+    return ( set[g->count >> 6] >> ( g->count & 63 ) ) & 1;
+}
+
+int htr_match ( const htr * T, const char * pattern, size_t length, htr_walk_callback callback, void * data )
+{
+    htr_glob_state g;
+    char * prefix = malloc ( length + 1 );
+    size_t prefix_length;
+    glob_compile ( &g, pattern, length, prefix, &prefix_length );
+
+    g.states_count    = 0;
+    g.states_capacity = 16;
+    g.sets            = malloc ( g.states_capacity * g.words * sizeof ( uint64_t ) );
+    g.next            = malloc ( g.states_capacity * NODE_CHILDS * sizeof ( int32_t ) );
+    g.index_capacity  = 64;
+    g.index           = calloc ( g.index_capacity, sizeof ( uint32_t ) );
+
+    automaton_init ( &g.a, T, callback, data, prefix_length + 1, sizeof ( uint32_t ) );
+    g.a.step   = glob_step;
+    g.a.accept = glob_accept;
+
+    // empty set is the state 0, the set of the empty key has the first position, leading star may match nothing
+    uint64_t * set = calloc ( g.words, sizeof ( uint64_t ) );
+    glob_intern ( &g, set );
+    glob_set ( set, 0 );
+    if ( g.count > 0 && g.elements[0].star ) {
+        glob_set ( set, 1 );
+    }
+    * ( uint32_t * ) automaton_state ( &g.a, 0 ) = glob_intern ( &g, set );
+    free ( set );
+
+    int ret = automaton_walk ( &g.a, prefix, prefix_length );
+    automaton_destroy ( &g.a );
+    free ( g.elements );
+    free ( g.sets );
+    free ( g.next );
+    free ( g.index );
+    free ( prefix );
+    return ret;
+}
+
+
+/* Top-k is the best-first search: queue holds trie nodes and buckets by the maximum of their values and pairs by their values.
+ * Pair on the top of the queue is not less than any value left, so pairs are visited in descending order and the search stops after k pairs.
+ * Bucket is scanned for its best pairs that are still needed. Mutable trie that is not scored has no maximums, so all its nodes are opened.
+ */
+
+typedef struct htr_topk_entry_t {
+    htr_value         bound;
+    htr_node_ptr      node;  // flag is NULL for pair
+    const htr_value * value; // value field of the pair
+    size_t            key;   // offset of the key in keys of the search
+    size_t            length;
+} htr_topk_entry;
+
+typedef struct htr_topk_t {
+    htr_walk_state w;
+    size_t         k;
+    size_t         visited;
+
+    // keys of entries, they are referred by offsets
+    char * keys;
+    size_t keys_size;
+    size_t keys_capacity;
+
+    // binary heap of entries with the maximum bound on the top
+    htr_topk_entry * queue;
+    size_t           queue_size;
+    size_t           queue_capacity;
+
+    // best pairs of the scanned bucket, binary heap with the minimum value on the top
+    htr_topk_entry * best;
+    size_t           best_size;
+    size_t           best_capacity;
+
+    // original callback and data
+    htr_walk_callback callback;
+    void *            data;
+} htr_topk_state;
+
+// Pair goes before subtree with the same bound, so visited pairs are not delayed.
+static inline
+bool topk_before ( const htr_topk_entry * a, const htr_topk_entry * b )
+{
+    if ( a->bound != b->bound ) {
+        return a->bound > b->bound;
+    }
+    return a->node.flag == NULL && b->node.flag != NULL;
+}
+
+static void topk_sift_up ( htr_topk_entry * heap, size_t i, bool max )
+{
+    htr_topk_entry entry = heap[i];
+    while ( i > 0 ) {
+        size_t parent = ( i - 1 ) / 2;
+        if ( max ? !topk_before ( &entry, &heap[parent] ) : entry.bound >= heap[parent].bound ) {
+            break;
+        }
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = entry;
+}
+
+static void topk_sift_down ( htr_topk_entry * heap, size_t size, size_t i, bool max )
+{
+    htr_topk_entry entry = heap[i];
+    while ( true ) {
+        size_t child = 2 * i + 1;
+        if ( child >= size ) {
+            break;
+        }
+        if ( child + 1 < size && ( max ? topk_before ( &heap[child + 1], &heap[child] ) : heap[child + 1].bound < heap[child].bound ) ) {
+            child++;
+        }
+        if ( max ? !topk_before ( &heap[child], &entry ) : heap[child].bound >= entry.bound ) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = entry;
+}
+
+// Copy the key into keys of the search, returns its offset.
+static size_t topk_key ( htr_topk_state * t, size_t prefix, size_t prefix_length, const char * suffix, size_t suffix_length )
+{
+    size_t length = prefix_length + suffix_length;
+    if ( t->keys_size + length > t->keys_capacity ) {
+        while ( t->keys_size + length > t->keys_capacity ) t->keys_capacity *= 2;
+        t->keys = realloc ( t->keys, t->keys_capacity );
+    }
+    size_t offset = t->keys_size;
+    memmove ( t->keys + offset, t->keys + prefix, prefix_length );
+    memcpy ( t->keys + offset + prefix_length, suffix, suffix_length );
+    t->keys_size += length;
+    return offset;
+}
+
+static void topk_push ( htr_topk_state * t, htr_value bound, htr_node_ptr node, const htr_value * value, size_t key, size_t length )
+{
+    if ( t->queue_size == t->queue_capacity ) {
+        t->queue_capacity *= 2;
+        t->queue = realloc ( t->queue, t->queue_capacity * sizeof ( htr_topk_entry ) );
+    }
+    htr_topk_entry * entry = &t->queue[t->queue_size];
+    entry->bound  = bound;
+    entry->node   = node;
+    entry->value  = value;
+    entry->key    = key;
+    entry->length = length;
+    topk_sift_up ( t->queue, t->queue_size++, true );
+}
+
+static htr_value topk_bound ( const htr * T, htr_node_ptr node )
+{
+    if ( T->image != NULL ) {
+        return *node.flag & NODE_TYPE_TRIE ? node.image_node->max : node.table_image->max;
+    }
+    if ( !T->scored ) {
+        return UINT64_MAX;
+    }
+    return *node.flag & NODE_TYPE_TRIE ? node.trie_node->max : node.table->max;
+}
+
+// Keys of trie with encoder are walked with the prefix cut to its full bytes, so the rest of the prefix is checked on decoded keys.
+static bool topk_decoded_prefix ( htr_topk_state * t, size_t key, size_t prefix_length, const char * suffix, size_t suffix_length )
+{
+    htr_walk_state * w = &t->w;
+    if ( w->T->encoder == NULL || w->prefix_length == 0 ) {
+        return true;
+    }
+    size_t size = prefix_length + suffix_length, length;
+    if ( w->encoded_capacity < size ) {
+        w->encoded_capacity = size;
+        w->encoded          = realloc ( w->encoded, size );
+    }
+    memcpy ( w->encoded, t->keys + key, prefix_length );
+    memcpy ( w->encoded + prefix_length, suffix, suffix_length );
+    const char * decoded = decode_key ( w->T, w->encoded, size, &w->decoded, &w->decoded_capacity, &length );
+    return length >= w->prefix_length && memcmp ( decoded, w->prefix, w->prefix_length ) == 0;
+}
+
+// Keep the best pairs of the bucket that are still needed and push them to the queue.
+static void topk_table ( htr_topk_state * t, htr_node_ptr node, size_t key, size_t level, const char * filter, size_t filter_length )
+{
+    htr_walk_state * w = &t->w;
+    size_t needed = t->k - t->visited, i;
+    t->best_size  = 0;
+
+    reset_table_iterator ( w->T, node, &w->table_iterator, &w->has_table, false );
+    while ( !htr_table_iterator_finished ( &w->table_iterator ) ) {
+        size_t length;
+        const char * suffix = htr_table_iterator_key ( &w->table_iterator, &length );
+        const htr_value * field = htr_table_iterator_val ( &w->table_iterator );
+        htr_value value = value_load ( ( const uint8_t * ) field, w->T->value_size );
+
+        // key of front coded bucket is decoded into the iterator, so it is copied before the next one
+        if ( ( t->best_size == needed && value <= t->best[0].bound ) ||
+                length < filter_length || memcmp ( suffix, filter, filter_length ) != 0 || !topk_decoded_prefix ( t, key, level, suffix, length ) ) {
+            htr_table_iterator_next ( &w->table_iterator );
+            continue;
+        }
+        htr_topk_entry entry;
+        entry.bound     = value;
+        entry.node.flag = NULL;
+        entry.value     = field;
+        entry.key       = topk_key ( t, key, level, suffix, length );
+        entry.length    = level + length;
+        if ( t->best_size < needed ) {
+            if ( t->best_size == t->best_capacity ) {
+                t->best_capacity *= 2;
+                t->best = realloc ( t->best, t->best_capacity * sizeof ( htr_topk_entry ) );
+            }
+            t->best[t->best_size] = entry;
+            topk_sift_up ( t->best, t->best_size++, false );
+        } else {
+            t->best[0] = entry;
+            topk_sift_down ( t->best, t->best_size, 0, false );
+        }
+        htr_table_iterator_next ( &w->table_iterator );
+    }
+
+    for ( i = 0; i < t->best_size; i++ ) {
+        topk_push ( t, t->best[i].bound, t->best[i].node, t->best[i].value, t->best[i].key, t->best[i].length );
+    }
+}
+
+// Push the value and children of the trie node.
+static void topk_node ( htr_topk_state * t, htr_node_ptr node, size_t key, size_t level )
+{
+    const htr * T = t->w.T;
+    htr_node_ptr none;
+    none.flag = NULL;
+    if ( *node.flag & NODE_HAS_VAL ) {
+        const htr_value * field = node_value ( T, node );
+        topk_push ( t, value_load ( ( const uint8_t * ) field, T->value_size ), none, field, key, level );
+    }
+
+    unsigned int c;
+    htr_node_ptr child, prev;
+    prev.flag = NULL;
+    for ( c = 0; c < T->childs; c++ ) {
+        child = node_child ( T, node, ( unsigned char ) c );
+        if ( child.flag == prev.flag ) continue;
+        prev = child;
+
+        if ( is_empty_bucket ( T, child ) ) {
+            continue;
+        }
+        char ch = ( char ) c;
+        if ( *child.flag & ( NODE_TYPE_TRIE | NODE_TYPE_PURE_BUCKET ) ) {
+            topk_push ( t, topk_bound ( T, child ), child, NULL, topk_key ( t, key, level, &ch, 1 ), level + 1 );
+        } else {
+            topk_push ( t, topk_bound ( T, child ), child, NULL, key, level );
+        }
+    }
+}
+
+static int topk_visit ( const htr_key_view * view, htr_value * value, void * data )
+{
+    htr_topk_state * t = data;
+    t->visited++;
+    return t->callback ( view, value, t->data );
+}
+
+int htr_topk_prefix ( const htr * T, const char * prefix, size_t length, size_t k, htr_walk_callback callback, void * data )
+{
+    if ( T->value_size == HTR_VALUE_BLOB ) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ( k == 0 ) {
+        return 0;
+    }
+
+    // encoded prefix is cut to its full bytes like in htr_walk
+    const char * original = prefix;
+    size_t original_length = length;
+    char * encoded_prefix = NULL;
+    if ( T->encoder != NULL && length > 0 ) {
+        encoded_prefix = malloc ( htr_encoded_size_max ( length ) );
+        length = htr_encode ( T->encoder, prefix, length, false, ( uint8_t * ) encoded_prefix );
+        prefix = encoded_prefix;
+        if ( length == SIZE_MAX ) {
+            free ( encoded_prefix );
+            return 0;
+        }
+    }
+
+    htr_topk_state t;
+    htr_walk_init ( &t.w, T, false, topk_visit, &t, 0 );
+    t.w.prefix        = original;
+    t.w.prefix_length = original_length;
+    t.k               = k;
+    t.visited         = 0;
+    t.callback        = callback;
+    t.data            = data;
+    t.keys_capacity   = length + 64;
+    t.keys            = malloc ( t.keys_capacity );
+    t.keys_size       = 0;
+    t.queue_capacity  = 64;
+    t.queue           = malloc ( t.queue_capacity * sizeof ( htr_topk_entry ) );
+    t.queue_size      = 0;
+    t.best_capacity   = k < 64 ? k : 64;
+    t.best            = malloc ( t.best_capacity * sizeof ( htr_topk_entry ) );
+    t.best_size       = 0;
+
+    // prefix is consumed like in htr_walk, the bucket of the prefix filters keys by the rest of the prefix
+    memcpy ( t.keys, prefix, length );
+    t.keys_size = length;
+    htr_node_ptr parent = T->root;
+    if ( length == 0 ) {
+        topk_node ( &t, parent, 0, 0 );
+    } else {
+        const char * rest = prefix;
+        size_t rest_length = length;
+        htr_node_ptr node = node_consume ( T, &parent, &rest, &rest_length, 1 );
+        size_t level = length - rest_length;
+
+        if ( *node.flag & NODE_TYPE_TRIE ) {
+            topk_node ( &t, node, 0, length );
+        } else if ( *node.flag & NODE_TYPE_PURE_BUCKET ) {
+            topk_table ( &t, node, 0, level + 1, rest + 1, rest_length - 1 );
+        } else {
+            topk_table ( &t, node, 0, level, rest, rest_length );
+        }
+    }
+
+    int ret = 0;
+    while ( t.queue_size > 0 && t.visited < k && ret == 0 ) {
+        htr_topk_entry entry = t.queue[0];
+        t.queue[0] = t.queue[--t.queue_size];
+        if ( t.queue_size > 0 ) {
+            topk_sift_down ( t.queue, t.queue_size, 0, true );
+        }
+
+        if ( entry.node.flag == NULL ) {
+            htr_key_view view;
+            view.prefix        = t.keys + entry.key;
+            view.prefix_length = entry.length;
+            view.suffix        = "";
+            view.suffix_length = 0;
+            ret = htr_walk_value ( &t.w, &view, ( htr_value * ) entry.value );
+        } else if ( *entry.node.flag & NODE_TYPE_TRIE ) {
+            topk_node ( &t, entry.node, entry.key, entry.length );
+        } else {
+            topk_table ( &t, entry.node, entry.key, entry.length, "", 0 );
+        }
+    }
+
+    free ( t.keys );
+    free ( t.queue );
+    free ( t.best );
+    htr_walk_destroy ( &t.w );
+    free ( encoded_prefix );
+    return ret;
+}
+
+
+/* Order statistics sum the numbers of keys below trie nodes: counted trie and image keep them, other mutable tries count their subtrees.
+ * Rank of the key adds numbers of children before the chars of the key, so only the bucket of the key is scanned.
+ * Keys of trie with encoder are ranked by their codes, that are ordered like the keys.
+ */
+
+// Number of keys below the node.
+static size_t node_count ( const htr * T, htr_node_ptr node )
+{
+    if ( ! ( *node.flag & NODE_TYPE_TRIE ) ) {
+        return node_table_size ( T, node );
+    }
+    if ( T->image != NULL ) {
+        return ( size_t ) node.image_node->count;
+    }
+    if ( T->counted ) {
+        return node.trie_node->count;
+    }
+
+    size_t count = *node.flag & NODE_HAS_VAL ? 1 : 0;
+    unsigned int c;
+    htr_node_ptr child, prev;
+    prev.flag = NULL;
+    for ( c = 0; c < T->childs; c++ ) {
+        child = node.trie_node->xs[c];
+        if ( child.flag == prev.flag ) continue;
+        prev = child;
+        count += node_count ( T, child );
+    }
+    return count;
+}
+
+// Number of keys of the bucket that start with the key if prefix is true or that are less than the key otherwise.
+static size_t table_count ( const htr * T, htr_node_ptr node, const char * key, size_t len, bool prefix )
+{
+    htr_table_iterator it;
+    bool has_table = false;
+    reset_table_iterator ( T, node, &it, &has_table, false );
+
+    size_t count = 0, length;
+    while ( !htr_table_iterator_finished ( &it ) ) {
+        const char * other = htr_table_iterator_key ( &it, &length );
+        int result = memcmp ( other, key, length < len ? length : len );
+        if ( prefix ? length >= len && result == 0 : result < 0 || ( result == 0 && length < len ) ) {
+            count++;
+        }
+        htr_table_iterator_next ( &it );
+    }
+    htr_table_iterator_destroy ( &it );
+    return count;
+}
+
+static size_t rank_encoded_key ( const htr * T, const char * key, size_t len )
+{
+    size_t rank = 0;
+    htr_node_ptr node = T->root, child, other, prev;
+    while ( *node.flag & NODE_TYPE_TRIE ) {
+        if ( len == 0 ) {
+            return rank;
+        }
+        // the key of the node is less than any longer key
+        if ( *node.flag & NODE_HAS_VAL ) {
+            rank++;
+        }
+
+        // hybrid bucket of the char is scanned with the whole key, so it is not counted here
+        unsigned char c = ( unsigned char ) *key;
+        unsigned int x;
+        child     = node_child ( T, node, c );
+        prev.flag = NULL;
+        for ( x = 0; x < c; x++ ) {
+            other = node_child ( T, node, ( unsigned char ) x );
+            if ( other.flag == prev.flag || other.flag == child.flag ) continue;
+            prev = other;
+            rank += node_count ( T, other );
+        }
+
+        if ( *child.flag & ( NODE_TYPE_TRIE | NODE_TYPE_PURE_BUCKET ) ) {
+            key++;
+            len--;
+        }
+        node = child;
+    }
+    return rank + table_count ( T, node, key, len, false );
+}
+
+size_t htr_rank ( const htr * T, const char * key, size_t len )
+{
+    uint8_t buffer[HTR_ENCODED_INLINE_KEY];
+    const char * encoded = encode_key ( T, key, &len, buffer );
+    if ( encoded == NULL ) {
+        return SIZE_MAX;
+    }
+    size_t rank = rank_encoded_key ( T, encoded, len );
+    release_key ( encoded, key, buffer );
+    return rank;
+}
+
+// Keys starting with the prefix of trie with encoder are the keys from the prefix up to the next string after all of them.
+static size_t count_encoded_prefix ( const htr * T, const char * prefix, size_t length )
+{
+    size_t below = htr_rank ( T, prefix, length );
+    if ( below == SIZE_MAX ) {
+        return SIZE_MAX;
+    }
+
+    size_t upper_length = length;
+    while ( upper_length > 0 && ( unsigned char ) prefix[upper_length - 1] == NODE_MAXCHAR ) {
+        upper_length--;
+    }
+    if ( upper_length == 0 ) {
+        return T->pairs_count - below;
+    }
+    char * upper = malloc ( upper_length );
+    if ( upper == NULL ) {
+        return SIZE_MAX;
+    }
+    memcpy ( upper, prefix, upper_length );
+    upper[upper_length - 1] = ( char ) ( ( unsigned char ) upper[upper_length - 1] + 1 );
+    size_t above = htr_rank ( T, upper, upper_length );
+    free ( upper );
+    return above == SIZE_MAX ? SIZE_MAX : above - below;
+}
+
+// Prefix of stored keys is counted on the node or bucket, where it is consumed.
+static size_t count_prefix ( const htr * T, const char * prefix, size_t length )
+{
+    htr_node_ptr parent = T->root;
+    htr_node_ptr node = node_consume ( T, &parent, &prefix, &length, 1 );
+    if ( *node.flag & NODE_TYPE_TRIE ) {
+        return node_count ( T, node );
+    }
+    if ( *node.flag & NODE_TYPE_PURE_BUCKET ) {
+        prefix++;
+        length--;
+    }
+    return table_count ( T, node, prefix, length, true );
+}
+
+size_t htr_count_prefix ( const htr * T, const char * prefix, size_t length )
+{
+    if ( length == 0 ) {
+        return T->pairs_count;
+    }
+    if ( T->encoder != NULL && htr_encoder_alphabet_size ( T->encoder ) == 0 ) {
+        return count_encoded_prefix ( T, prefix, length );
+    }
+
+    // alphabet encoder keeps prefixes of keys, so the encoded prefix is counted as is
+    uint8_t buffer[HTR_ENCODED_INLINE_KEY];
+    const char * encoded = encode_key ( T, prefix, &length, buffer );
+    if ( encoded == NULL ) {
+        return errno == EINVAL ? 0 : SIZE_MAX;
+    }
+    size_t count = count_prefix ( T, encoded, length );
+    release_key ( encoded, prefix, buffer );
+    return count;
+}
+
+typedef struct htr_select_state_t {
+    htr_walk_state w;
+    size_t         skip;  // keys left before the first visited one
+    size_t         count; // keys left to visit
+} htr_select_state;
+
+static int select_table ( htr_select_state * s, htr_node_ptr node, size_t level )
+{
+    htr_walk_state * w = &s->w;
+    htr_key_view view;
+    view.prefix        = w->key;
+    view.prefix_length = level;
+
+    // only the bucket of the first visited key is sorted to be skipped partly
+    size_t size = node_table_size ( w->T, node );
+    if ( s->skip >= size ) {
+        s->skip -= size;
+        return 0;
+    }
+    reset_table_iterator ( w->T, node, &w->table_iterator, &w->has_table, true );
+
+    size_t length;
+    while ( !htr_table_iterator_finished ( &w->table_iterator ) && s->count > 0 ) {
+        if ( s->skip > 0 ) {
+            s->skip--;
+        } else {
+            view.suffix        = htr_table_iterator_key ( &w->table_iterator, &length );
+            view.suffix_length = length;
+            s->count--;
+            int ret = htr_walk_value ( w, &view, htr_table_iterator_val ( &w->table_iterator ) );
+            if ( ret != 0 ) {
+                return ret;
+            }
+        }
+        htr_table_iterator_next ( &w->table_iterator );
+    }
+    return 0;
+}
+
+static int select_node ( htr_select_state * s, htr_node_ptr node, size_t level )
+{
+    htr_walk_state * w = &s->w;
+    int ret;
+
+    if ( *node.flag & NODE_HAS_VAL ) {
+        if ( s->skip > 0 ) {
+            s->skip--;
+        } else {
+            htr_key_view view;
+            view.prefix        = w->key;
+            view.prefix_length = level;
+            view.suffix        = "";
+            view.suffix_length = 0;
+            s->count--;
+            ret = htr_walk_value ( w, &view, node_value ( w->T, node ) );
+            if ( ret != 0 ) {
+                return ret;
+            }
+        }
+    }
+
+    size_t c;
+    htr_node_ptr child, prev;
+    prev.flag = NULL;
+    for ( c = 0; c < w->T->childs && s->count > 0; c++ ) {
+        child = node_child ( w->T, node, ( unsigned char ) c );
+        if ( child.flag == prev.flag ) continue;
+        prev = child;
+
+        // subtrees before the first visited key are skipped by their counts
+        if ( s->skip > 0 ) {
+            size_t count = node_count ( w->T, child );
+            if ( s->skip >= count ) {
+                s->skip -= count;
+                continue;
+            }
+        }
+
+        if ( *child.flag & NODE_TYPE_TRIE ) {
+            htr_walk_pushchar ( w, level + 1, ( char ) c );
+            ret = select_node ( s, child, level + 1 );
+        } else if ( *child.flag & NODE_TYPE_PURE_BUCKET ) {
+            htr_walk_pushchar ( w, level + 1, ( char ) c );
+            ret = select_table ( s, child, level + 1 );
+        } else {
+            ret = select_table ( s, child, level );
+        }
+        if ( ret != 0 ) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+int htr_select ( const htr * T, size_t index, size_t count, htr_walk_callback callback, void * data )
+{
+    if ( index >= T->pairs_count || count == 0 ) {
+        return 0;
+    }
+
+    htr_select_state s;
+    htr_walk_init ( &s.w, T, true, callback, data, 0 );
+    s.skip  = index;
+    s.count = count;
+    int ret = select_node ( &s, T->root, 0 );
+    htr_walk_destroy ( &s.w );
+    return ret;
 }
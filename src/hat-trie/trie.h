@@ -11,6 +11,7 @@
 #define HTR_HATTRIE_H
 
 #include "common.h"
+#include "table.h"
 #include <stdbool.h>
 
 typedef struct htr_t htr;
@@ -18,16 +19,139 @@ typedef struct htr_t htr;
 htr * htr_new   ( void * ctx, htr_hash_function function );
 void  htr_clear ( htr * trie );
 
+// Trie with values of 0, 1, 2, 4 or 8 bytes or HTR_VALUE_BLOB, other sizes are rejected with NULL.
+// Every pair in buckets stores only value_size bytes of the value, so trie with 0 bytes values is a set of strings.
+// Narrow values are accessed by htr_set, htr_read and htr_iterator_value, values wider than value_size are truncated.
+// Blob values are accessed only by htr_blob_* functions and htr_iterator_blob.
+htr * htr_new_sized ( void * ctx, htr_hash_function function, size_t value_size );
+
+// Buckets of front coded trie keep keys sorted in their slots and store only the part that differs from the previous key.
+// It saves memory for keys with long common prefixes, like URLs or paths, while lookup decodes a slot during the scan.
+// Encoding may be changed only for empty mutable trie, otherwise it returns -1 with EINVAL.
+int htr_set_front_coded ( htr * trie, bool front_coded );
+
+// Trie nodes and buckets of scored trie keep the maximum of values below them for htr_topk_prefix.
+// Values of scored trie are changed only by htr_set and htr_insert, so htr_get returns NULL and values must not be written by pointers.
+// Maximums are upper bounds: deleted or lowered values don't decrease them, image of the trie keeps exact maximums.
+// Scoring may be changed only for empty mutable trie with narrow values, otherwise it returns -1 with EINVAL.
+int htr_set_scored ( htr * trie, bool scored );
+
 // Find the given key in the trie, inserting it if it does not exist, and returning a pointer to it's key.
 // This pointer is not guaranteed to be valid after additional calls to hattrie_get, hattrie_del, hattrie_clear, or other functions that modifies the trie.
+// Pointers are returned only for 8 bytes values of trie that is not scored, otherwise it returns NULL.
 htr_value * htr_get ( htr * trie, const char * key, size_t length );
 
-// Find a given key in the table, returning a NULL pointer if it does not exist.
+// Find a given key in the table, returning a NULL pointer if it does not exist. It needs 8 bytes values like htr_get.
 htr_value * htr_tryget ( htr * trie, const char * key, size_t length );
 
-// Delete a given key from trie. Returns 0 if successful or -1 if not found.
+// Find the longest key that is a prefix of the given key, its length is written to matched and its value to value.
+// Both of them may be NULL, value must be NULL for blob values. Returns 0 if key is found or -1 if no prefix is stored.
+// Trie nodes of the key are consumed once, only prefixes that end in the last bucket are looked up one by one.
+// Prefixes of keys of trie with encoder are looked up one by one from the longest one.
+int htr_longest_prefix ( htr * trie, const char * key, size_t length, size_t * matched, htr_value * value );
+
+// Find the longest prefixes of many keys, matched length is SIZE_MAX if key has no prefix. Values may be NULL like in htr_longest_prefix.
+// Trie nodes of several keys are consumed by turns to overlap cache misses. Returns the number of found prefixes.
+size_t htr_longest_prefix_batch ( htr * trie, const char * const * keys, const size_t * lengths, size_t count, size_t * matched, htr_value * values );
+
+// Set API works with values of any size.
+// Insert the key with zero value if it does not exist. Returns 1 if key is inserted, 0 if it exists or -1 on error.
+int  htr_insert   ( htr * trie, const char * key, size_t length );
+bool htr_contains ( htr * trie, const char * key, size_t length );
+
+// Read the value of the key. Returns 0 if key is found or -1 if it does not exist.
+int htr_read ( htr * trie, const char * key, size_t length, htr_value * value );
+
+// Set the value of the key, inserting it if it does not exist.
+// Change is appended to the log if the trie has one, see log.h. Returns 0 on success or -1 on error.
+int htr_set ( htr * trie, const char * key, size_t length, htr_value value );
+
+// Blob values of any length are stored inline in bucket records after the key, their length is varint.
+// Set the blob of the key, inserting it if it does not exist. The change is logged like htr_set. Returns 0 on success or -1 on error.
+int htr_blob_set ( htr * trie, const char * key, size_t length, const void * data, size_t size );
+
+// Resize the blob of the key inserting it if it does not exist, first bytes are kept and new bytes are zeroed.
+// Returns pointer to the bytes of the blob for writing in place or NULL on error, the change is not logged.
+// This pointer is not valid after any other modification of the trie.
+void * htr_blob_resize ( htr * trie, const char * key, size_t length, size_t size );
+
+// Find the blob of the key, returns NULL if it does not exist.
+const void * htr_blob_get ( htr * trie, const char * key, size_t length, size_t * size );
+
+// Decode the blob from the value pointer that is passed to the walk callback.
+const void * htr_blob_data ( const htr_value * value, size_t * size );
+
+// Delete a given key from trie. Returns 0 if successful or -1 if not found or the change of logged trie is not appended to the log.
 int htr_del ( htr * trie, const char * key, size_t length );
 
+// Combine values of the key that is found in both tries merged by htr_merge.
+typedef htr_value ( * htr_merge_callback ) ( htr_value dst, htr_value src, void * data );
+
+// Move all pairs of src into dst, src is left empty. Value of the key found in both tries is combine ( dst value, src value, data ),
+// NULL combine keeps the value of src. Blob values are not combined, blob of src replaces the blob of dst.
+// Subtrees and buckets of src that meet only empty buckets of dst are moved as is, buckets that meet keys of dst are merged pair by pair,
+// so the cost depends on the region where both tries have keys.
+// Tries with different hash function, bucket encoding or encoder and logged dst get pairs of src one by one.
+// Both tries must be mutable with the same value size and src must not be logged, otherwise it returns -1 with EINVAL.
+// Returns 0 on success or -1 on error (errno is set), the pair that can't be stored is lost then.
+int htr_merge ( htr * dst, htr * src, htr_merge_callback combine, void * data );
+
+// Callback for walk. Key view and value pointer are valid only during the call, trie must not be modified.
+// Narrow value is passed as a copy, so writing it doesn't change the trie. Blob value is decoded by htr_blob_data.
+// Callback may return non zero value to stop the walk.
+typedef int ( * htr_walk_callback ) ( const htr_key_view * key, htr_value * value, void * data );
+
+// Push style traversal of keys starting with prefix, keys are visited in order if sorted is true.
+// Returns the value that stopped the walk or 0.
+int htr_walk ( const htr * trie, const char * prefix, size_t length, bool sorted, htr_walk_callback callback, void * data );
+
+// Set operations visit pairs of trie a with the values of a like htr_walk.
+// htr_intersect visits keys of a that are found in b, htr_difference visits keys of a that are missing in b.
+// Trie nodes of both tries are descended together: subtrees of a are skipped or visited without lookups where b has no keys,
+// other keys are looked up in b from the last common trie node. Tries may be mutable or mapped.
+// Encoded keys are compared as is only if both tries have the same encoder, otherwise keys of a are decoded and looked up in b.
+// Returns the value that stopped the walk or 0.
+int htr_intersect  ( const htr * a, const htr * b, bool sorted, htr_walk_callback callback, void * data );
+int htr_difference ( const htr * a, const htr * b, bool sorted, htr_walk_callback callback, void * data );
+
+// Visit keys within max_distance edits (insertions, deletions and substitutions of bytes) from the query.
+// Rows of the Levenshtein table are computed once per trie node, subtrees and buckets are skipped when no key below them may be close enough.
+// Keys of trie with encoder are decoded and checked one by one. Returns the value that stopped the search or 0.
+int htr_fuzzy_search ( const htr * trie, const char * query, size_t length, size_t max_distance, htr_walk_callback callback, void * data );
+
+// Visit keys matched by the glob pattern: "?" matches any byte, "*" any number of bytes, "[a-z]" and "[!a-z]" a byte of the class,
+// "\\" escapes the next char. Pattern is stepped through trie nodes, so only buckets that may have matched keys are scanned,
+// literal prefix of the pattern is consumed like the prefix of htr_walk. Returns the value that stopped the walk or 0.
+int htr_match ( const htr * trie, const char * pattern, size_t length, htr_walk_callback callback, void * data );
+
+// Visit at most k keys starting with prefix that have the greatest values, in descending order of values.
+// Subtrees and buckets are opened by the greatest maximum first, so only the part of scored trie or image that may have the best keys is read.
+// Mutable trie that is not scored has no maximums and all its keys are ranked. Keys with equal values are visited in any order.
+// Returns the value that stopped the walk or 0, blob values are rejected with -1 and EINVAL.
+int htr_topk_prefix ( const htr * trie, const char * prefix, size_t length, size_t k, htr_walk_callback callback, void * data );
+
+// Trie nodes of counted trie keep the number of keys below them, it is updated by every insertion and deletion.
+// Order statistics read the counts of counted trie and image, other mutable tries count their subtrees on every call.
+// Counting may be changed only for empty mutable trie, otherwise it returns -1 with EINVAL.
+int htr_set_counted ( htr * trie, bool counted );
+
+// Number of keys starting with prefix, only the bucket of the prefix is scanned.
+// Prefix of trie with code encoder is counted by two ranks. Returns SIZE_MAX if memory can't be allocated.
+size_t htr_count_prefix ( const htr * trie, const char * prefix, size_t length );
+
+// Number of keys less than the key in sorted order, the key may be missing.
+// Returns SIZE_MAX if memory can't be allocated or key has a byte out of the alphabet of the encoder.
+size_t htr_rank ( const htr * trie, const char * key, size_t length );
+
+// Visit count keys in sorted order starting from the key with the given index, for example the page of results.
+// Subtrees before the index are skipped by their counts and only the bucket of the first key is sorted to be skipped partly.
+// Returns the value that stopped the walk or 0.
+int htr_select ( const htr * trie, size_t index, size_t count, htr_walk_callback callback, void * data );
+
+// Walk callback that sets visited pairs in the trie passed as data, it must have the same value size as the walked trie.
+// For example htr_intersect ( a, b, false, htr_collect, result ) builds the intersection. Returns -1 if the pair can't be set.
+int htr_collect ( const htr_key_view * key, htr_value * value, void * trie );
+
 typedef struct htr_iterator_t htr_iterator;
 
 htr_iterator * htr_iterator_begin     ( const htr * trie, bool sorted );
@@ -35,6 +159,59 @@ void           htr_iterator_next      ( htr_iterator * iterator );
 bool           htr_iterator_finished  ( htr_iterator * iterator );
 void           htr_iterator_free      ( htr_iterator * iterator );
 const char *   htr_iterator_key       ( htr_iterator * iterator, size_t * length );
-htr_value  *   htr_iterator_val       ( htr_iterator * iterator );
+htr_value  *   htr_iterator_val       ( htr_iterator * iterator ); // NULL unless values are 8 bytes
+htr_value      htr_iterator_value     ( htr_iterator * iterator );
+const void *   htr_iterator_blob      ( htr_iterator * iterator, size_t * size ); // NULL unless values are blobs
+
+// Get the current key without copying it.
+// Prefix is changed only when iterator moves to another trie node or bucket, suffix points into the bucket.
+// View is valid until the next call of htr_iterator_next or htr_iterator_key, or modification of the trie.
+// Keys of trie with encoder are decoded, the whole key is the prefix of view.
+void htr_iterator_key_view ( htr_iterator * iterator, htr_key_view * view );
+
+// Iterator doesn't allocate memory per trie node or bucket.
+// Trie nodes are kept in the stack array, first frames and key bytes are stored inline.
+// Iterator is declared here only to be placed on the stack or embedded, use htr_iterator_init and htr_iterator_destroy for it.
+// Its fields are private.
+
+#define HTR_ITERATOR_INLINE_FRAMES 32
+#define HTR_ITERATOR_INLINE_KEY    128
+
+typedef struct htr_iterator_frame_t {
+    const uint8_t * node;  // trie node
+    size_t          level; // length of the key consumed by node
+    unsigned int    next;  // next child char to visit
+} htr_iterator_frame;
+
+struct htr_iterator_t {
+    const htr * T;
+    bool        sorted;
+
+    // key prefix consumed by trie nodes
+    char * key; // used when keysize > HTR_ITERATOR_INLINE_KEY
+    size_t keysize;
+    size_t level;
+
+    // keep track of keys stored in trie nodes
+    bool        has_nil_key;
+    htr_value * nil_val;
+
+    bool               has_table;
+    htr_table_iterator table_iterator;
+
+    htr_iterator_frame * frames; // used when frames_capacity > HTR_ITERATOR_INLINE_FRAMES
+    size_t               frames_count;
+    size_t               frames_capacity;
+
+    // key decoded by the encoder of trie
+    char * decoded;
+    size_t decoded_capacity;
+
+    htr_iterator_frame inline_frames[HTR_ITERATOR_INLINE_FRAMES];
+    char               inline_key[HTR_ITERATOR_INLINE_KEY];
+};
+
+void htr_iterator_init    ( htr_iterator * iterator, const htr * trie, bool sorted );
+void htr_iterator_destroy ( htr_iterator * iterator );
 
 #endif
@@ -0,0 +1,375 @@
+// This file is part of hat-trie.
+// Copyright (c) 2013 by Andrew Aladjev <aladjev.andrew@gmail.com>
+//
+// Header only C++17 layer over the C trie. Keys are std::string_view passed to the C functions as is, so no key is copied.
+// Map and set own their trie and free it with talloc, they are move only. Values are trivially copyable types of 1, 2, 4 or 8 bytes,
+// they are stored in the pairs of trie with the same value size.
+// Hash function may be the template argument, so tries of the same type always have the same hash and their nodes are merged as is.
+// Namespace is hattrie, because htr is the name of the C trie type.
+
+#ifndef HTR_TRIE_HPP
+#define HTR_TRIE_HPP
+
+extern "C" {
+#include "trie.h"
+#include <talloc2/tree.h>
+}
+
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace hattrie {
+
+namespace detail {
+
+// Unsigned integer of the value size, values are converted through it, so they don't depend on byte order.
+template < size_t Size > struct value_bits;
+template <> struct value_bits<1> {
+    typedef uint8_t type;
+};
+template <> struct value_bits<2> {
+    typedef uint16_t type;
+};
+template <> struct value_bits<4> {
+    typedef uint32_t type;
+};
+template <> struct value_bits<8> {
+    typedef uint64_t type;
+};
+
+template < typename T >
+inline htr_value to_value ( const T & value ) noexcept
+{
+    typename value_bits<sizeof ( T )>::type bits;
+    std::memcpy ( &bits, &value, sizeof ( T ) );
+    return bits;
+}
+
+template < typename T >
+inline T from_value ( htr_value value ) noexcept
+{
+    typename value_bits<sizeof ( T )>::type bits = static_cast<typename value_bits<sizeof ( T )>::type> ( value );
+    T result;
+    std::memcpy ( &result, &bits, sizeof ( T ) );
+    return result;
+}
+
+inline std::string_view key_of ( const htr_key_view * view, std::string & buffer )
+{
+    if ( view->suffix_length == 0 ) {
+        return std::string_view ( view->prefix, view->prefix_length );
+    }
+    buffer.assign ( view->prefix, view->prefix_length );
+    buffer.append ( view->suffix, view->suffix_length );
+    return buffer;
+}
+
+// Iterator of trie keys. State of the C iterator can't be cloned, so copies share it and the iterator is single pass.
+// Key view is valid until the next increment. Value is void for set.
+template < typename Value >
+class iterator {
+public:
+    typedef std::input_iterator_tag iterator_category;
+    typedef typename std::conditional < std::is_void<Value>::value, std::string_view, std::pair<std::string_view, Value> >::type value_type;
+    typedef value_type     reference;
+    typedef void           pointer;
+    typedef std::ptrdiff_t difference_type;
+
+    iterator() noexcept = default;
+
+    iterator ( const htr * trie, bool sorted ) : state ( htr_iterator_begin ( trie, sorted ), htr_iterator_free )
+    {
+        if ( !state ) {
+            throw std::bad_alloc();
+        }
+    }
+
+    reference operator * () const
+    {
+        size_t length;
+        const char * key = htr_iterator_key ( state.get(), &length );
+        if constexpr ( std::is_void<Value>::value ) {
+            return std::string_view ( key, length );
+        } else {
+            return reference ( std::string_view ( key, length ), from_value<Value> ( htr_iterator_value ( state.get() ) ) );
+        }
+    }
+
+    iterator & operator ++ ()
+    {
+        htr_iterator_next ( state.get() );
+        return *this;
+    }
+
+    // Post increment returns the iterator itself, previous key is not kept by single pass iterator.
+    iterator & operator ++ ( int )
+    {
+        return ++*this;
+    }
+
+    bool operator == ( const iterator & other ) const noexcept
+    {
+        return state == other.state || ( finished() && other.finished() );
+    }
+
+    bool operator != ( const iterator & other ) const noexcept
+    {
+        return ! ( *this == other );
+    }
+
+private:
+    bool finished() const noexcept
+    {
+        return !state || htr_iterator_finished ( state.get() );
+    }
+
+    std::shared_ptr<htr_iterator> state;
+};
+
+// Ownership and functions of map and set that don't depend on values.
+class trie_base {
+public:
+    trie_base ( const trie_base & ) = delete;
+    trie_base & operator = ( const trie_base & ) = delete;
+
+    trie_base ( trie_base && other ) noexcept : trie ( std::exchange ( other.trie, nullptr ) ) {}
+
+    trie_base & operator = ( trie_base && other ) noexcept
+    {
+        if ( this != &other ) {
+            reset();
+            trie = std::exchange ( other.trie, nullptr );
+        }
+        return *this;
+    }
+
+    ~trie_base()
+    {
+        reset();
+    }
+
+    bool contains ( std::string_view key ) const noexcept
+    {
+        return htr_contains ( trie, key.data(), key.size() );
+    }
+
+    // Returns true if the key is erased.
+    bool erase ( std::string_view key ) noexcept
+    {
+        return htr_del ( trie, key.data(), key.size() ) == 0;
+    }
+
+    size_t size() const noexcept
+    {
+        return htr_count_prefix ( trie, "", 0 );
+    }
+
+    bool empty() const noexcept
+    {
+        return size() == 0;
+    }
+
+    size_t count_prefix ( std::string_view prefix ) const noexcept
+    {
+        return htr_count_prefix ( trie, prefix.data(), prefix.size() );
+    }
+
+    // The C trie for functions that are not wrapped, it is still owned by this object.
+    htr * get() const noexcept
+    {
+        return trie;
+    }
+
+    // Give up the ownership, trie is freed by talloc_free of caller.
+    htr * release() noexcept
+    {
+        return std::exchange ( trie, nullptr );
+    }
+
+protected:
+    // Trie is allocated on the talloc context ctx, it is the allocation hook of the C core.
+    trie_base ( void * ctx, htr_hash_function hash, size_t value_size ) : trie ( htr_new_sized ( ctx, hash, value_size ) )
+    {
+        if ( trie == nullptr ) {
+            throw std::bad_alloc();
+        }
+    }
+
+    void reset() noexcept
+    {
+        if ( trie != nullptr ) {
+            talloc_free ( trie );
+            trie = nullptr;
+        }
+    }
+
+    // Walk callback calls the function with the key and value, function may return true to stop the walk.
+    template < typename Value, typename Function >
+    static int walk_callback ( const htr_key_view * view, htr_value * value, void * data )
+    {
+        auto * context = static_cast<std::pair<Function *, std::string *> *> ( data );
+        std::string_view key = key_of ( view, *context->second );
+        if constexpr ( std::is_void<Value>::value ) {
+            ( void ) value;
+            if constexpr ( std::is_void<std::invoke_result_t<Function &, std::string_view>>::value ) {
+                ( *context->first ) ( key );
+                return 0;
+            } else {
+                return ( *context->first ) ( key ) ? 1 : 0;
+            }
+        } else {
+            Value copy = from_value<Value> ( *value );
+            if constexpr ( std::is_void<std::invoke_result_t<Function &, std::string_view, Value>>::value ) {
+                ( *context->first ) ( key, copy );
+                return 0;
+            } else {
+                return ( *context->first ) ( key, copy ) ? 1 : 0;
+            }
+        }
+    }
+
+    htr * trie;
+};
+
+}
+
+// Map of string keys to trivially copyable values of 1, 2, 4 or 8 bytes.
+// Hash is given to constructor if the template argument Hash is nullptr.
+template < typename T, htr_hash_function Hash = nullptr >
+class map : public detail::trie_base {
+    static_assert ( std::is_trivially_copyable<T>::value, "values are copied as bytes" );
+    static_assert ( sizeof ( T ) == 1 || sizeof ( T ) == 2 || sizeof ( T ) == 4 || sizeof ( T ) == 8, "value size is not supported by trie" );
+
+public:
+    typedef std::string_view           key_type;
+    typedef T                          mapped_type;
+    typedef detail::iterator<T>        iterator;
+    typedef detail::iterator<T>        const_iterator;
+
+    explicit map ( htr_hash_function hash, void * ctx = nullptr ) : trie_base ( ctx, hash, sizeof ( T ) ) {}
+
+    template < htr_hash_function H = Hash, typename = typename std::enable_if < H != nullptr >::type >
+    explicit map ( void * ctx = nullptr ) : trie_base ( ctx, H, sizeof ( T ) ) {}
+
+    std::optional<T> find ( std::string_view key ) const noexcept
+    {
+        htr_value value;
+        if ( htr_read ( trie, key.data(), key.size(), &value ) != 0 ) {
+            return std::nullopt;
+        }
+        return detail::from_value<T> ( value );
+    }
+
+    // Set the value of the key. Returns true if the key is inserted or false if it is assigned.
+    bool insert_or_assign ( std::string_view key, const T & value )
+    {
+        size_t count = size();
+        if ( htr_set ( trie, key.data(), key.size(), detail::to_value ( value ) ) != 0 ) {
+            throw std::bad_alloc();
+        }
+        return size() != count;
+    }
+
+    // Insert the value built from args if the key does not exist, the value is not built otherwise. Returns true if the key is inserted.
+    template < typename... Args >
+    bool try_emplace ( std::string_view key, Args &&... args )
+    {
+        if ( contains ( key ) ) {
+            return false;
+        }
+        if ( htr_set ( trie, key.data(), key.size(), detail::to_value ( T ( std::forward<Args> ( args )... ) ) ) != 0 ) {
+            throw std::bad_alloc();
+        }
+        return true;
+    }
+
+    // Move all pairs of other into this map, values of other replace existing values. See htr_merge.
+    void merge ( map & other )
+    {
+        if ( htr_merge ( trie, other.trie, nullptr, nullptr ) != 0 ) {
+            throw std::bad_alloc();
+        }
+    }
+
+    // Keys are visited in order if sorted is true.
+    iterator begin ( bool sorted = false ) const
+    {
+        return iterator ( trie, sorted );
+    }
+
+    iterator end() const noexcept
+    {
+        return iterator();
+    }
+
+    // Call function ( key, value ) for keys starting with the prefix without iterator state, it may return true to stop.
+    template < typename Function >
+    void walk ( std::string_view prefix, bool sorted, Function && function ) const
+    {
+        std::string buffer;
+        std::pair<typename std::remove_reference<Function>::type *, std::string *> context ( &function, &buffer );
+        htr_walk ( trie, prefix.data(), prefix.size(), sorted, walk_callback<T, typename std::remove_reference<Function>::type>, &context );
+    }
+};
+
+// Set of string keys, its trie has no values. Hash is given like for map.
+template < htr_hash_function Hash = nullptr >
+class set : public detail::trie_base {
+public:
+    typedef std::string_view       key_type;
+    typedef detail::iterator<void> iterator;
+    typedef detail::iterator<void> const_iterator;
+
+    explicit set ( htr_hash_function hash, void * ctx = nullptr ) : trie_base ( ctx, hash, 0 ) {}
+
+    template < htr_hash_function H = Hash, typename = typename std::enable_if < H != nullptr >::type >
+    explicit set ( void * ctx = nullptr ) : trie_base ( ctx, H, 0 ) {}
+
+    // Returns true if the key is inserted.
+    bool insert ( std::string_view key )
+    {
+        int result = htr_insert ( trie, key.data(), key.size() );
+        if ( result < 0 ) {
+            throw std::bad_alloc();
+        }
+        return result == 1;
+    }
+
+    void merge ( set & other )
+    {
+        if ( htr_merge ( trie, other.trie, nullptr, nullptr ) != 0 ) {
+            throw std::bad_alloc();
+        }
+    }
+
+    iterator begin ( bool sorted = false ) const
+    {
+        return iterator ( trie, sorted );
+    }
+
+    iterator end() const noexcept
+    {
+        return iterator();
+    }
+
+    // Call function ( key ) for keys starting with the prefix, it may return true to stop.
+    template < typename Function >
+    void walk ( std::string_view prefix, bool sorted, Function && function ) const
+    {
+        std::string buffer;
+        std::pair<typename std::remove_reference<Function>::type *, std::string *> context ( &function, &buffer );
+        htr_walk ( trie, prefix.data(), prefix.size(), sorted, walk_callback<void, typename std::remove_reference<Function>::type>, &context );
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "murmur_hash.h"
+#include <hat-trie/trie.h>
+#include <hat-trie/allocator.h>
+#include <talloc2/tree.h>
+
+const size_t n = 200000; // how many strings
+const size_t m_low  = 1;   // minimum length of each string
+const size_t m_high = 300; // maximum length of each string, long keys are stored out of line
+
+char ** xs;
+size_t * lengths;
+
+void setup()
+{
+    fprintf ( stderr, "generating %zu keys ... ", n );
+    xs      = malloc ( n * sizeof ( char * ) );
+    lengths = malloc ( n * sizeof ( size_t ) );
+    size_t i, j;
+    for ( i = 0; i < n; ++i ) {
+        lengths[i] = i % 50 == 0 ? m_low + rand() % ( m_high - m_low ) : m_low + rand() % 12;
+        xs[i]      = malloc ( m_high );
+        for ( j = 0; j < lengths[i]; j++ ) {
+            xs[i][j] = ( char ) ( 'a' + rand() % 26 );
+        }
+    }
+    fprintf ( stderr, "done.\n" );
+}
+
+void teardown()
+{
+    size_t i;
+    for ( i = 0; i < n; ++i ) {
+        free ( xs[i] );
+    }
+    free ( xs );
+    free ( lengths );
+}
+
+// Allocator that keeps the size of every block before it, so size hints are checked and blocks are counted.
+typedef struct counter_t {
+    size_t blocks;
+    size_t allocs;
+} counter;
+
+static const size_t HEADER = 16;
+
+static void * counter_alloc ( void * data, size_t size )
+{
+    counter * c = data;
+    uint8_t * block = malloc ( HEADER + size );
+    if ( block == NULL ) {
+        return NULL;
+    }
+    memcpy ( block, &size, sizeof ( size_t ) );
+    c->blocks++;
+    c->allocs++;
+    return block + HEADER;
+}
+
+static void check_hint ( void * pointer, size_t size )
+{
+    size_t allocated;
+    memcpy ( &allocated, ( uint8_t * ) pointer - HEADER, sizeof ( size_t ) );
+    if ( size > allocated ) {
+        fprintf ( stderr, "[error] size hint %zu is greater than allocated size %zu\n", size, allocated );
+    }
+}
+
+static void * counter_realloc ( void * data, void * pointer, size_t old_size, size_t size )
+{
+    counter * c = data;
+    if ( pointer == NULL ) {
+        return counter_alloc ( data, size );
+    }
+    check_hint ( pointer, old_size );
+    uint8_t * block = realloc ( ( uint8_t * ) pointer - HEADER, HEADER + size );
+    if ( block == NULL ) {
+        return NULL;
+    }
+    memcpy ( block, &size, sizeof ( size_t ) );
+    c->allocs++;
+    return block + HEADER;
+}
+
+static void counter_free ( void * data, void * pointer, size_t size )
+{
+    counter * c = data;
+    check_hint ( pointer, size );
+    c->blocks--;
+    free ( ( uint8_t * ) pointer - HEADER );
+}
+
+// Trie of allocator has the same pairs as the trie of malloc after inserts, deletes and merge.
+static void check_allocator ( const htr_allocator * allocator, size_t value_size, bool front_coded, const char * what )
+{
+    htr * A = htr_new_sized ( NULL, murmur_hash, value_size );
+    htr * B = htr_new_sized ( NULL, murmur_hash, value_size );
+    htr * P = htr_new_sized ( NULL, murmur_hash, value_size );
+    htr_set_front_coded ( A, front_coded );
+    htr_set_front_coded ( B, front_coded );
+    htr_set_front_coded ( P, front_coded );
+    if ( htr_set_allocator ( A, allocator ) != 0 || htr_set_allocator ( B, allocator ) != 0 ) {
+        fprintf ( stderr, "[error] %s: allocator is not set\n", what );
+    }
+
+    size_t i;
+    char blob[64];
+    for ( i = 0; i < n; ++i ) {
+        // the first half goes to A, the second one to B, that is merged into A
+        htr * T = i < n / 2 ? A : B;
+        if ( value_size == HTR_VALUE_BLOB ) {
+            size_t size = i % sizeof ( blob );
+            memset ( blob, ( int ) i, size );
+            htr_blob_set ( T, xs[i], lengths[i], blob, size );
+            htr_blob_set ( P, xs[i], lengths[i], blob, size );
+        } else {
+            htr_set ( T, xs[i], lengths[i], i );
+            htr_set ( P, xs[i], lengths[i], i );
+        }
+    }
+    if ( htr_set_allocator ( A, NULL ) != -1 || errno != EINVAL ) {
+        fprintf ( stderr, "[error] %s: allocator of not empty trie is changed\n", what );
+    }
+    if ( htr_merge ( A, B, NULL, NULL ) != 0 ) {
+        fprintf ( stderr, "[error] %s: htr_merge failed\n", what );
+    }
+    for ( i = 0; i < n; i += 3 ) {
+        if ( htr_del ( A, xs[i], lengths[i] ) != htr_del ( P, xs[i], lengths[i] ) ) {
+            fprintf ( stderr, "[error] %s: key is not deleted\n", what );
+        }
+    }
+
+    for ( i = 0; i < n; ++i ) {
+        if ( value_size == HTR_VALUE_BLOB ) {
+            size_t a_size, p_size;
+            const void * a = htr_blob_get ( A, xs[i], lengths[i], &a_size );
+            const void * p = htr_blob_get ( P, xs[i], lengths[i], &p_size );
+            if ( ( a != NULL ) != ( p != NULL ) || ( a != NULL && ( a_size != p_size || memcmp ( a, p, a_size ) != 0 ) ) ) {
+                fprintf ( stderr, "[error] %s: incorrect blob of key %zu\n", what, i );
+            }
+        } else {
+            htr_value a, p;
+            int a_found = htr_read ( A, xs[i], lengths[i], &a );
+            int p_found = htr_read ( P, xs[i], lengths[i], &p );
+            if ( a_found != p_found || ( a_found == 0 && a != p ) ) {
+                fprintf ( stderr, "[error] %s: incorrect value of key %zu\n", what, i );
+            }
+        }
+    }
+
+    size_t count = 0;
+    htr_iterator * it = htr_iterator_begin ( A, true );
+    while ( !htr_iterator_finished ( it ) ) {
+        count++;
+        htr_iterator_next ( it );
+    }
+    htr_iterator_free ( it );
+    if ( count != htr_count_prefix ( P, "", 0 ) ) {
+        fprintf ( stderr, "[error] %s: iterated through %zu keys\n", what, count );
+    }
+
+    talloc_free ( A );
+    talloc_free ( B );
+    talloc_free ( P );
+}
+
+void test_allocator()
+{
+    fprintf ( stderr, "checking allocators ... \n" );
+
+    counter c = { 0, 0 };
+    htr_allocator counting;
+    counting.alloc   = counter_alloc;
+    counting.realloc = counter_realloc;
+    counting.free    = counter_free;
+    counting.data    = &c;
+
+    void * ctx = talloc ( NULL, 0 );
+    htr_allocator * allocators[] = {
+        &counting, htr_allocator_talloc ( ctx ), htr_allocator_arena ( ctx, 1 << 20 ), htr_allocator_huge ( ctx, 0 )
+    };
+    const char * names[] = { "counting", "talloc", "arena", "huge" };
+    size_t a;
+    for ( a = 0; a < sizeof ( allocators ) / sizeof ( allocators[0] ); a++ ) {
+        if ( allocators[a] == NULL ) {
+            fprintf ( stderr, "[error] %s allocator is not created\n", names[a] );
+            continue;
+        }
+        check_allocator ( allocators[a], sizeof ( htr_value ), false, names[a] );
+        check_allocator ( allocators[a], 2, true, names[a] );
+        check_allocator ( allocators[a], HTR_VALUE_BLOB, false, names[a] );
+    }
+    talloc_free ( ctx );
+
+    // every block is freed with the trie
+    if ( c.allocs == 0 || c.blocks != 0 ) {
+        fprintf ( stderr, "[error] %zu blocks of %zu are not freed\n", c.blocks, c.allocs );
+    }
+
+    fprintf ( stderr, "done.\n" );
+}
+
+int main()
+{
+    setup();
+    test_allocator();
+    teardown();
+
+    return 0;
+}
@@ -0,0 +1,312 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "murmur_hash.h"
+#include <hat-trie/trie.h>
+#include <hat-trie/image.h>
+#include <hat-trie/encoder.h>
+#include <talloc2/tree.h>
+
+const size_t n = 100000; // how many unique strings
+const size_t s = 1000;   // size of the sample
+
+static const char * words[] = { "catalog", "section", "item", "news", "about", "search", "index", "user", "profile", "page" };
+
+char ** xs;
+size_t * lengths;
+
+// URL like keys, the last ones are binary keys with zero bytes and long keys, the first key is empty
+void setup()
+{
+    fprintf ( stderr, "generating %zu keys ... ", n );
+    xs      = malloc ( n * sizeof ( char * ) );
+    lengths = malloc ( n * sizeof ( size_t ) );
+    size_t i, j;
+    for ( i = 0; i < n; ++i ) {
+        xs[i] = malloc ( 1024 );
+        if ( i == 0 ) {
+            lengths[i] = 0;
+        } else if ( i % 100 == 1 ) {
+            lengths[i] = 1 + rand() % 8;
+            for ( j = 0; j < lengths[i]; j++ ) {
+                xs[i][j] = ( char ) ( rand() % 3 == 0 ? 0 : rand() );
+            }
+        } else if ( i % 100 == 2 ) {
+            lengths[i] = 300 + rand() % 700;
+            for ( j = 0; j < lengths[i]; j++ ) {
+                xs[i][j] = ( char ) ( 'a' + rand() % 26 );
+            }
+        } else {
+            lengths[i] = ( size_t ) sprintf ( xs[i], "https://www.example.com/%s/%s/%zu", words[rand() % 10], words[rand() % 10], i );
+        }
+    }
+    fprintf ( stderr, "done.\n" );
+}
+
+void teardown()
+{
+    size_t i;
+    for ( i = 0; i < n; ++i ) {
+        free ( xs[i] );
+    }
+    free ( xs );
+    free ( lengths );
+}
+
+// encoded trie has the same pairs in the same order as the plain trie
+static void check_trie ( htr * E, htr * P, const char * what )
+{
+    size_t i;
+    for ( i = 0; i < n; ++i ) {
+        htr_value * u = htr_tryget ( E, xs[i], lengths[i] );
+        htr_value * v = htr_tryget ( P, xs[i], lengths[i] );
+        if ( ( u != NULL ) != ( v != NULL ) || ( u != NULL && *u != *v ) ) {
+            fprintf ( stderr, "[error] %s: incorrect value of key %zu\n", what, i );
+        }
+    }
+
+    htr_iterator a, b;
+    htr_iterator_init ( &a, E, true );
+    htr_iterator_init ( &b, P, true );
+    const char * a_key, * b_key;
+    size_t a_len, b_len;
+    while ( !htr_iterator_finished ( &a ) && !htr_iterator_finished ( &b ) ) {
+        a_key = htr_iterator_key ( &a, &a_len );
+        b_key = htr_iterator_key ( &b, &b_len );
+        if ( a_len != b_len || memcmp ( a_key, b_key, a_len ) != 0 || htr_iterator_value ( &a ) != htr_iterator_value ( &b ) ) {
+            fprintf ( stderr, "[error] %s: encoded keys are iterated out of order\n", what );
+            break;
+        }
+        htr_iterator_next ( &a );
+        htr_iterator_next ( &b );
+    }
+    if ( !htr_iterator_finished ( &a ) || !htr_iterator_finished ( &b ) ) {
+        fprintf ( stderr, "[error] %s: different number of keys\n", what );
+    }
+    htr_iterator_destroy ( &a );
+    htr_iterator_destroy ( &b );
+
+    size_t count = 0, expected = 0;
+    htr_iterator_init ( &a, E, false );
+    while ( !htr_iterator_finished ( &a ) ) {
+        htr_key_view view;
+        htr_iterator_key_view ( &a, &view );
+        htr_value * v = htr_tryget ( P, view.prefix, view.prefix_length );
+        if ( view.suffix_length != 0 || v == NULL || *v != htr_iterator_value ( &a ) ) {
+            fprintf ( stderr, "[error] %s: incorrect key view\n", what );
+        }
+        count++;
+        htr_iterator_next ( &a );
+    }
+    htr_iterator_destroy ( &a );
+    htr_iterator_init ( &b, P, false );
+    while ( !htr_iterator_finished ( &b ) ) {
+        expected++;
+        htr_iterator_next ( &b );
+    }
+    htr_iterator_destroy ( &b );
+    if ( count != expected ) {
+        fprintf ( stderr, "[error] %s: iterated through %zu keys, expected %zu\n", what, count, expected );
+    }
+}
+
+typedef struct walk_data_t {
+    htr *        P;
+    const char * prefix;
+    size_t       prefix_length;
+    size_t       count;
+} walk_data;
+
+static int walk_callback ( const htr_key_view * view, htr_value * value, void * data )
+{
+    walk_data * w = data;
+    htr_value * v = htr_tryget ( w->P, view->prefix, view->prefix_length );
+    if (
+        view->suffix_length != 0 || v == NULL || *v != *value ||
+        view->prefix_length < w->prefix_length || memcmp ( view->prefix, w->prefix, w->prefix_length ) != 0
+    ) {
+        fprintf ( stderr, "[error] incorrect walked key\n" );
+    }
+    w->count++;
+    return 0;
+}
+
+static int count_callback ( const htr_key_view * view, htr_value * value, void * data )
+{
+    ( void ) view;
+    ( void ) value;
+    ( *( size_t * ) data )++;
+    return 0;
+}
+
+// walk with prefix visits the same keys in both tries
+static void check_walk ( htr * E, htr * P )
+{
+    const char * prefixes[] = { "", "h", "https://www.example.com/", "https://www.example.com/news/", "https://www.example.com/news/item/1", "zzz" };
+    size_t p, expected;
+    bool sorted;
+    for ( p = 0; p < sizeof ( prefixes ) / sizeof ( prefixes[0] ); p++ ) {
+        for ( sorted = false; ; sorted = true ) {
+            walk_data w;
+            w.P             = P;
+            w.prefix        = prefixes[p];
+            w.prefix_length = strlen ( prefixes[p] );
+            w.count         = 0;
+            expected        = 0;
+            htr_walk ( E, w.prefix, w.prefix_length, sorted, walk_callback, &w );
+            htr_walk ( P, w.prefix, w.prefix_length, sorted, count_callback, &expected );
+            if ( w.count != expected ) {
+                fprintf ( stderr, "[error] walked through %zu keys with prefix \"%s\", expected %zu\n", w.count, w.prefix, expected );
+            }
+            if ( sorted ) break;
+        }
+    }
+}
+
+void test_encoder()
+{
+    fprintf ( stderr, "encoding %zu keys ... \n", n );
+
+    htr_encoder * encoder = htr_encoder_new ( NULL, ( const char * const * ) xs, lengths, s );
+    htr * E = htr_new ( NULL, murmur_hash );
+    htr * P = htr_new ( NULL, murmur_hash );
+    if ( encoder == NULL || htr_set_encoder ( E, encoder ) != 0 ) {
+        fprintf ( stderr, "[error] encoder is not set\n" );
+    }
+    talloc_free ( encoder );
+
+    size_t i;
+    for ( i = 0; i < n; ++i ) {
+        *htr_get ( E, xs[i], lengths[i] ) = i + 1;
+        *htr_get ( P, xs[i], lengths[i] ) = i + 1;
+    }
+    if ( htr_set_encoder ( E, NULL ) != -1 ) {
+        fprintf ( stderr, "[error] encoder of not empty trie is changed\n" );
+    }
+    for ( i = 0; i < n; i += 3 ) {
+        // short binary keys may repeat, so they are deleted only once
+        if ( htr_del ( E, xs[i], lengths[i] ) != htr_del ( P, xs[i], lengths[i] ) ) {
+            fprintf ( stderr, "[error] encoded key is not deleted\n" );
+        }
+    }
+
+    check_trie ( E, P, "mutable" );
+    check_walk ( E, P );
+
+    bool sorted;
+    for ( sorted = false; ; sorted = true ) {
+        htr * F = htr_freeze ( NULL, E, sorted );
+        if ( F == NULL ) {
+            fprintf ( stderr, "[error] htr_freeze failed\n" );
+        } else {
+            check_trie ( F, P, sorted ? "sorted image" : "hashed image" );
+            check_walk ( F, P );
+            talloc_free ( F );
+        }
+        if ( sorted ) break;
+    }
+
+    char path[] = "/tmp/hat-trie-encoder-XXXXXX";
+    int fd = mkstemp ( path );
+    if ( htr_save ( E, fd ) != 0 ) {
+        fprintf ( stderr, "[error] htr_save failed\n" );
+    }
+    close ( fd );
+    htr * M = htr_open_mmap ( NULL, path, murmur_hash );
+    if ( M == NULL ) {
+        fprintf ( stderr, "[error] htr_open_mmap failed\n" );
+    } else {
+        check_trie ( M, P, "mapped image" );
+        talloc_free ( M );
+    }
+    unlink ( path );
+
+    for ( i = 0; i < n; ++i ) {
+        htr_del ( E, xs[i], lengths[i] );
+    }
+    if ( htr_set_encoder ( E, NULL ) != 0 ) {
+        fprintf ( stderr, "[error] encoder of emptied trie is not removed\n" );
+    }
+
+    talloc_free ( E );
+    talloc_free ( P );
+    fprintf ( stderr, "done.\n" );
+}
+
+// keys of the alphabet are kept in the trie with small nodes, other keys are rejected
+void test_alphabet()
+{
+    fprintf ( stderr, "encoding %zu keys by alphabet ... \n", n );
+
+    const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789:/.";
+    htr_encoder * encoder = htr_encoder_alphabet ( NULL, alphabet, sizeof ( alphabet ) - 1 );
+    htr * E = htr_new ( NULL, murmur_hash );
+    htr * P = htr_new ( NULL, murmur_hash );
+    if ( encoder == NULL || htr_set_encoder ( E, encoder ) != 0 ) {
+        fprintf ( stderr, "[error] alphabet encoder is not set\n" );
+    }
+    talloc_free ( encoder );
+    if ( htr_encoder_alphabet ( NULL, "aaa", 3 ) != NULL ) {
+        fprintf ( stderr, "[error] alphabet of single byte is accepted\n" );
+    }
+
+    size_t i, j;
+    for ( i = 0; i < n; ++i ) {
+        bool mapped = true;
+        for ( j = 0; j < lengths[i]; j++ ) {
+            mapped = mapped && xs[i][j] != 0 && strchr ( alphabet, xs[i][j] ) != NULL;
+        }
+        if ( !mapped ) {
+            errno = 0;
+            if ( htr_get ( E, xs[i], lengths[i] ) != NULL || errno != EINVAL || htr_set ( E, xs[i], lengths[i], 1 ) != -1 ) {
+                fprintf ( stderr, "[error] key out of the alphabet is inserted\n" );
+            }
+            continue;
+        }
+        *htr_get ( E, xs[i], lengths[i] ) = i + 1;
+        *htr_get ( P, xs[i], lengths[i] ) = i + 1;
+    }
+    for ( i = 0; i < n; i += 3 ) {
+        if ( htr_del ( E, xs[i], lengths[i] ) != htr_del ( P, xs[i], lengths[i] ) ) {
+            fprintf ( stderr, "[error] key of the alphabet is not deleted\n" );
+        }
+    }
+
+    check_trie ( E, P, "alphabet" );
+    check_walk ( E, P );
+    const char * prefixes[] = { "https://www.example.com/news/", "https://www.example.com/News/", "a" };
+    for ( i = 0; i < sizeof ( prefixes ) / sizeof ( prefixes[0] ); i++ ) {
+        size_t length = strlen ( prefixes[i] );
+        if ( htr_count_prefix ( E, prefixes[i], length ) != htr_count_prefix ( P, prefixes[i], length ) ) {
+            fprintf ( stderr, "[error] incorrect count of keys with prefix \"%s\"\n", prefixes[i] );
+        }
+    }
+
+    htr * F = htr_freeze ( NULL, E, true );
+    if ( F == NULL ) {
+        fprintf ( stderr, "[error] htr_freeze failed\n" );
+    } else {
+        check_trie ( F, P, "alphabet image" );
+        check_walk ( F, P );
+        talloc_free ( F );
+    }
+
+    talloc_free ( E );
+    talloc_free ( P );
+    fprintf ( stderr, "done.\n" );
+}
+
+int main()
+{
+    setup();
+    test_encoder();
+    test_alphabet();
+    teardown();
+
+    return 0;
+}
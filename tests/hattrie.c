@@ -6,6 +6,7 @@
 #include "str_map.h"
 #include "murmur_hash.h"
 #include <hat-trie/trie.h>
+#include <hat-trie/image.h>
 #include <talloc2/tree.h>
 
 /* Simple random string generation. */
@@ -227,6 +228,426 @@ void test_hattrie_sorted_iteration()
 }
 
 
+void test_hattrie_stack_iteration()
+{
+    fprintf ( stderr, "iterating in order through %zu keys with iterator on the stack ... \n", k );
+
+    htr_iterator i;
+    htr_iterator_init ( &i, T, true );
+
+    size_t count = 0;
+    htr_value * u;
+    htr_value   v;
+
+    size_t len;
+    const char* key;
+    htr_key_view view;
+
+    while ( !htr_iterator_finished ( &i ) ) {
+        ++count;
+
+        key = htr_iterator_key ( &i, &len );
+        u   = htr_iterator_val ( &i );
+        v   = str_map_get ( M, key, len );
+
+        htr_iterator_key_view ( &i, &view );
+        if ( view.prefix_length + view.suffix_length != len ||
+                memcmp ( view.prefix, key, view.prefix_length ) != 0 ||
+                memcmp ( view.suffix, key + view.prefix_length, view.suffix_length ) != 0 ) {
+            fprintf ( stderr, "[error] key view doesn't match the key\n" );
+        }
+
+        if ( *u != v ) {
+            fprintf ( stderr, "[error] incorrect iteration tally (%lu, %lu)\n", *u, v );
+        }
+        str_map_set ( M, key, len, 0 );
+
+        htr_iterator_next ( &i );
+    }
+
+    if ( count != M->m ) {
+        fprintf ( stderr, "[error] iterated through %zu element, expected %zu\n",
+                  count, M->m );
+    }
+
+    htr_iterator_destroy ( &i );
+
+    fprintf ( stderr, "done.\n" );
+}
+
+
+typedef struct walk_data_t {
+    size_t count;
+    char * prev_key;
+    size_t prev_len;
+} walk_data;
+
+int walk_callback ( const htr_key_view * view, htr_value * u, void * data )
+{
+    walk_data * w = data;
+    ++w->count;
+
+    char key[m_high + 1];
+    size_t len = view->prefix_length + view->suffix_length;
+    memcpy ( key, view->prefix, view->prefix_length );
+    memcpy ( key + view->prefix_length, view->suffix, view->suffix_length );
+
+    if ( w->count > 1 && cmpkey ( w->prev_key, w->prev_len, key, len ) > 0 ) {
+        fprintf ( stderr, "[error] walk is not correctly ordered.\n" );
+    }
+    memcpy ( w->prev_key, key, len );
+    w->prev_len = len;
+
+    htr_value v = str_map_get ( M, key, len );
+    if ( *u != v ) {
+        fprintf ( stderr, "[error] incorrect walk tally (%lu, %lu)\n", *u, v );
+    }
+    str_map_set ( M, key, len, 0 );
+
+    return 0;
+}
+
+int walk_stop_callback ( const htr_key_view * view, htr_value * u, void * data )
+{
+    ( void ) view;
+    ( void ) u;
+    size_t * count = data;
+    return ++*count == 10 ? -1 : 0;
+}
+
+
+void test_hattrie_walk()
+{
+    fprintf ( stderr, "walking in order through %zu keys ... \n", k );
+
+    walk_data w;
+    w.count    = 0;
+    w.prev_key = malloc ( m_high + 1 );
+    w.prev_len = 0;
+
+    if ( htr_walk ( T, NULL, 0, true, walk_callback, &w ) != 0 ) {
+        fprintf ( stderr, "[error] walk was stopped\n" );
+    }
+    if ( w.count != M->m ) {
+        fprintf ( stderr, "[error] walked through %zu element, expected %zu\n",
+                  w.count, M->m );
+    }
+    free ( w.prev_key );
+
+    size_t count = 0;
+    if ( htr_walk ( T, NULL, 0, false, walk_stop_callback, &count ) != -1 || count != 10 ) {
+        fprintf ( stderr, "[error] walk was not stopped by callback\n" );
+    }
+
+    fprintf ( stderr, "done.\n" );
+}
+
+
+void test_hattrie_value_sizes()
+{
+    const size_t sizes[] = { 0, 1, 2, 4, 8 };
+    size_t s;
+    for ( s = 0; s < sizeof ( sizes ) / sizeof ( sizes[0] ); s++ ) {
+        size_t value_size = sizes[s];
+        fprintf ( stderr, "setting %zu keys with %zu bytes values ... \n", k, value_size );
+
+        htr_value mask = value_size == 8 ? ~ ( htr_value ) 0 : ( ( htr_value ) 1 << ( 8 * value_size ) ) - 1;
+        htr * S = htr_new_sized ( NULL, murmur_hash, value_size );
+        str_map * V = str_map_create();
+
+        size_t i, j;
+        for ( j = 0; j < k; ++j ) {
+            i = rand() % n;
+            if ( j % 2 == 0 ) {
+                int inserted = htr_insert ( S, xs[i], strlen ( xs[i] ) );
+                if ( inserted != ( str_map_get ( V, xs[i], strlen ( xs[i] ) ) == 0 ) ) {
+                    fprintf ( stderr, "[error] htr_insert returned %d\n", inserted );
+                }
+                if ( inserted == 1 ) {
+                    str_map_set ( V, xs[i], strlen ( xs[i] ), 1 );
+                }
+            } else {
+                htr_set ( S, xs[i], strlen ( xs[i] ), j );
+                str_map_set ( V, xs[i], strlen ( xs[i] ), ( j & mask ) + 1 );
+            }
+        }
+
+        // values in the map are shifted by 1, because 0 means missing key
+        htr_value u;
+        htr_value v;
+        for ( i = 0; i < n; ++i ) {
+            v = str_map_get ( V, xs[i], strlen ( xs[i] ) );
+            if ( htr_contains ( S, xs[i], strlen ( xs[i] ) ) != ( v != 0 ) ) {
+                fprintf ( stderr, "[error] incorrect membership\n" );
+            }
+            if ( v != 0 && ( htr_read ( S, xs[i], strlen ( xs[i] ), &u ) != 0 || u != v - 1 ) ) {
+                fprintf ( stderr, "[error] incorrect value %lu, expected %lu\n", u, v - 1 );
+            }
+        }
+
+        if ( value_size != sizeof ( htr_value ) && htr_get ( S, xs[0], strlen ( xs[0] ) ) != NULL ) {
+            fprintf ( stderr, "[error] htr_get returned pointer to narrow value\n" );
+        }
+
+        htr_iterator it;
+        htr_iterator_init ( &it, S, false );
+        size_t count = 0;
+        const char * key;
+        size_t len;
+        while ( !htr_iterator_finished ( &it ) ) {
+            key = htr_iterator_key ( &it, &len );
+            v   = str_map_get ( V, key, len );
+            if ( v == 0 || htr_iterator_value ( &it ) != v - 1 ) {
+                fprintf ( stderr, "[error] incorrect iteration value\n" );
+            }
+            ++count;
+            htr_iterator_next ( &it );
+        }
+        htr_iterator_destroy ( &it );
+        if ( count != V->m ) {
+            fprintf ( stderr, "[error] iterated through %zu element, expected %zu\n", count, V->m );
+        }
+
+        for ( i = 0; i < n; i += 2 ) {
+            htr_del ( S, xs[i], strlen ( xs[i] ) );
+            if ( htr_contains ( S, xs[i], strlen ( xs[i] ) ) ) {
+                fprintf ( stderr, "[error] deleted key is found\n" );
+            }
+        }
+
+        str_map_destroy ( V );
+        talloc_free ( S );
+        fprintf ( stderr, "done.\n" );
+    }
+}
+
+
+// Blob of the j-th set has j % 300 bytes equal to j.
+static bool blob_valid ( const void * blob, size_t size, htr_value j )
+{
+    const uint8_t * data = blob;
+    size_t i;
+    if ( blob == NULL || size != j % 300 ) {
+        return false;
+    }
+    for ( i = 0; i < size; i++ ) {
+        if ( data[i] != ( uint8_t ) j ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void check_blobs ( htr * S, str_map * V )
+{
+    size_t i, size;
+    htr_value v;
+    for ( i = 0; i < n; ++i ) {
+        v = str_map_get ( V, xs[i], strlen ( xs[i] ) );
+        const void * blob = htr_blob_get ( S, xs[i], strlen ( xs[i] ), &size );
+        if ( ( blob != NULL ) != ( v != 0 ) || ( v != 0 && !blob_valid ( blob, size, v - 1 ) ) ) {
+            fprintf ( stderr, "[error] incorrect blob\n" );
+        }
+    }
+    for ( i = 0; i <= strlen ( xs[0] ); ++i ) {
+        v = str_map_get ( V, xs[0], i );
+        const void * blob = htr_blob_get ( S, xs[0], i, &size );
+        if ( ( blob != NULL ) != ( v != 0 ) || ( v != 0 && !blob_valid ( blob, size, v - 1 ) ) ) {
+            fprintf ( stderr, "[error] incorrect blob of %zu bytes prefix\n", i );
+        }
+    }
+
+    htr_iterator it;
+    htr_iterator_init ( &it, S, true );
+    size_t count = 0;
+    const char * key;
+    size_t len;
+    while ( !htr_iterator_finished ( &it ) ) {
+        key = htr_iterator_key ( &it, &len );
+        v   = str_map_get ( V, key, len );
+        const void * blob = htr_iterator_blob ( &it, &size );
+        if ( v == 0 || !blob_valid ( blob, size, v - 1 ) ) {
+            fprintf ( stderr, "[error] incorrect iteration blob\n" );
+        }
+        ++count;
+        htr_iterator_next ( &it );
+    }
+    htr_iterator_destroy ( &it );
+    if ( count != V->m ) {
+        fprintf ( stderr, "[error] iterated through %zu element, expected %zu\n", count, V->m );
+    }
+}
+
+void test_hattrie_blobs ( bool front_coded )
+{
+    fprintf ( stderr, "setting %zu blobs%s ... \n", k, front_coded ? " into front coded buckets" : "" );
+
+    htr * S = htr_new_sized ( NULL, murmur_hash, HTR_VALUE_BLOB );
+    htr_set_front_coded ( S, front_coded );
+    str_map * V = str_map_create();
+
+    uint8_t blob[300];
+    size_t i, j, len = strlen ( xs[0] );
+    for ( j = 0; j < k; ++j ) {
+        i = rand() % n;
+        memset ( blob, ( int ) ( j & 0xff ), j % 300 );
+        if ( htr_blob_set ( S, xs[i], strlen ( xs[i] ), blob, j % 300 ) != 0 ) {
+            fprintf ( stderr, "[error] htr_blob_set failed\n" );
+        }
+        str_map_set ( V, xs[i], strlen ( xs[i] ), j + 1 );
+    }
+
+    // prefixes of the first key are consumed on trie nodes
+    for ( j = 0; j <= len; ++j ) {
+        memset ( blob, ( int ) ( j & 0xff ), j % 300 );
+        htr_blob_set ( S, xs[0], j, blob, j % 300 );
+        str_map_set ( V, xs[0], j, j + 1 );
+    }
+
+    htr_value u;
+    if ( htr_read ( S, xs[0], len, &u ) != -1 || htr_get ( S, xs[0], len ) != NULL ) {
+        fprintf ( stderr, "[error] blob is read as fixed size value\n" );
+    }
+    check_blobs ( S, V );
+
+    bool sorted;
+    for ( sorted = false; ; sorted = true ) {
+        htr * F = htr_freeze ( NULL, S, sorted );
+        if ( F == NULL ) {
+            fprintf ( stderr, "[error] htr_freeze failed\n" );
+        } else {
+            check_blobs ( F, V );
+            talloc_free ( F );
+        }
+        if ( sorted ) break;
+    }
+
+    // resized blob keeps its first bytes and new bytes are zeroed
+    for ( j = 0; j <= len; j += len / 4 + 1 ) {
+        uint8_t * data = htr_blob_resize ( S, xs[0], j, 1000 );
+        size_t size, kept = j % 300, b;
+        for ( b = 0; data != NULL && b < 1000; b++ ) {
+            if ( data[b] != ( b < kept ? ( uint8_t ) j : 0 ) ) break;
+        }
+        if ( data == NULL || b != 1000 || htr_blob_get ( S, xs[0], j, &size ) != data || size != 1000 ) {
+            fprintf ( stderr, "[error] incorrect resized blob\n" );
+        }
+        htr_blob_resize ( S, xs[0], j, kept );
+    }
+    check_blobs ( S, V );
+
+    for ( i = 0; i < n; i += 2 ) {
+        htr_del ( S, xs[i], strlen ( xs[i] ) );
+        str_map_del ( V, xs[i], strlen ( xs[i] ) );
+    }
+    for ( j = 0; j <= len; j += 2 ) {
+        htr_del ( S, xs[0], j );
+        str_map_del ( V, xs[0], j );
+    }
+    check_blobs ( S, V );
+
+    str_map_destroy ( V );
+    talloc_free ( S );
+    fprintf ( stderr, "done.\n" );
+}
+
+
+// Keys share long prefixes like URLs of the same site.
+static void url_key ( char * key, size_t i )
+{
+    sprintf ( key, "https://www.example.com/catalog/section-%zu/item-%zu.html", i % 37, i );
+}
+
+void test_hattrie_front_coded()
+{
+    const size_t urls_count = 50000;
+    fprintf ( stderr, "setting %zu urls into front coded buckets ... \n", urls_count );
+
+    htr * S = htr_new ( NULL, murmur_hash );
+    htr * P = htr_new ( NULL, murmur_hash );
+    if ( htr_set_front_coded ( S, true ) != 0 ) {
+        fprintf ( stderr, "[error] htr_set_front_coded failed for empty trie\n" );
+    }
+
+    char key[128];
+    size_t i;
+    for ( i = 0; i < urls_count; i++ ) {
+        url_key ( key, i );
+        *htr_get ( S, key, strlen ( key ) ) = i;
+        *htr_get ( P, key, strlen ( key ) ) = i;
+    }
+    if ( htr_set_front_coded ( S, false ) != -1 ) {
+        fprintf ( stderr, "[error] encoding of not empty trie is changed\n" );
+    }
+
+    for ( i = 0; i < urls_count; i += 3 ) {
+        url_key ( key, i );
+        htr_del ( S, key, strlen ( key ) );
+        htr_del ( P, key, strlen ( key ) );
+        if ( htr_tryget ( S, key, strlen ( key ) ) != NULL ) {
+            fprintf ( stderr, "[error] deleted url is found\n" );
+        }
+    }
+
+    // front coded trie holds the same pairs in the same order as the plain one
+    bool sorted;
+    for ( sorted = false; ; sorted = true ) {
+        htr * F = htr_freeze ( NULL, S, sorted );
+        htr * targets[] = { S, F };
+        size_t t;
+        for ( t = 0; t < 2; t++ ) {
+            htr * R = targets[t];
+            if ( R == NULL ) {
+                fprintf ( stderr, "[error] htr_freeze failed\n" );
+                continue;
+            }
+            for ( i = 0; i < urls_count; i++ ) {
+                url_key ( key, i );
+                htr_value * u = htr_tryget ( R, key, strlen ( key ) );
+                if ( ( u != NULL ) != ( i % 3 != 0 ) || ( u != NULL && *u != i ) ) {
+                    fprintf ( stderr, "[error] incorrect value of url %zu\n", i );
+                }
+            }
+
+            htr_iterator a, b;
+            htr_iterator_init ( &a, R, true );
+            htr_iterator_init ( &b, P, true );
+            const char * a_key, * b_key;
+            size_t a_len, b_len;
+            while ( !htr_iterator_finished ( &a ) && !htr_iterator_finished ( &b ) ) {
+                a_key = htr_iterator_key ( &a, &a_len );
+                b_key = htr_iterator_key ( &b, &b_len );
+                if ( a_len != b_len || memcmp ( a_key, b_key, a_len ) != 0 || htr_iterator_value ( &a ) != htr_iterator_value ( &b ) ) {
+                    fprintf ( stderr, "[error] front coded trie is iterated out of order\n" );
+                    break;
+                }
+                htr_iterator_next ( &a );
+                htr_iterator_next ( &b );
+            }
+            if ( !htr_iterator_finished ( &a ) || !htr_iterator_finished ( &b ) ) {
+                fprintf ( stderr, "[error] front coded trie has different number of urls\n" );
+            }
+            htr_iterator_destroy ( &a );
+            htr_iterator_destroy ( &b );
+        }
+        talloc_free ( F );
+        if ( sorted ) break;
+    }
+
+    for ( i = 0; i < urls_count; i++ ) {
+        url_key ( key, i );
+        htr_del ( S, key, strlen ( key ) );
+    }
+    if ( htr_set_front_coded ( S, false ) != 0 ) {
+        fprintf ( stderr, "[error] encoding of emptied trie is not changed\n" );
+    }
+
+    talloc_free ( S );
+    talloc_free ( P );
+    fprintf ( stderr, "done.\n" );
+}
+
+
 void test_trie_non_ascii()
 {
     fprintf ( stderr, "checking non-ascii... \n" );
@@ -264,6 +685,42 @@ int main()
     test_hattrie_sorted_iteration();
     teardown();
 
+    setup();
+    test_hattrie_insert();
+    test_hattrie_stack_iteration();
+    teardown();
+
+    setup();
+    test_hattrie_insert();
+    test_hattrie_walk();
+    teardown();
+
+    setup();
+    test_hattrie_value_sizes();
+    teardown();
+
+    setup();
+    test_hattrie_blobs ( false );
+    teardown();
+
+    setup();
+    htr_set_front_coded ( T, true );
+    test_hattrie_insert();
+    test_hattrie_sorted_iteration();
+    teardown();
+
+    setup();
+    htr_set_front_coded ( T, true );
+    test_hattrie_insert();
+    test_hattrie_walk();
+    teardown();
+
+    setup();
+    test_hattrie_blobs ( true );
+    teardown();
+
+    test_hattrie_front_coded();
+
     return 0;
 }
 
@@ -0,0 +1,245 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "str_map.h"
+#include "murmur_hash.h"
+#include <hat-trie/trie.h>
+#include <hat-trie/image.h>
+#include <talloc2/tree.h>
+
+/* Simple random string generation. */
+void randstr ( char* x, size_t len )
+{
+    x[len] = '\0';
+    while ( len > 0 ) {
+        x[--len] = '\x20' + ( rand() % ( '\x7e' - '\x20' + 1 ) );
+    }
+}
+
+const size_t n = 100000;  // how many unique strings
+const size_t m_low  = 1;   // minimum length of each string
+const size_t m_high = 100; // maximum length of each string
+const size_t k = 200000;  // number of insertions
+
+char** xs;
+
+htr * T;
+str_map* M;
+char path[] = "/tmp/hat-trie-image-XXXXXX";
+
+
+void setup()
+{
+    fprintf ( stderr, "generating %zu keys ... ", n );
+    xs = malloc ( n * sizeof ( char* ) );
+    size_t i;
+    size_t m;
+    for ( i = 0; i < n; ++i ) {
+        m = m_low + rand() % ( m_high - m_low );
+        xs[i] = malloc ( m + 1 );
+        randstr ( xs[i], m );
+    }
+
+    T = htr_new ( NULL, murmur_hash );
+    M = str_map_create();
+
+    size_t j;
+    for ( j = 0; j < k; ++j ) {
+        i = rand() % n;
+        str_map_set ( M, xs[i], strlen ( xs[i] ), 1 + str_map_get ( M, xs[i], strlen ( xs[i] ) ) );
+        *htr_get ( T, xs[i], strlen ( xs[i] ) ) += 1;
+    }
+    fprintf ( stderr, "done.\n" );
+}
+
+
+void teardown()
+{
+    talloc_free ( T );
+    str_map_destroy ( M );
+
+    size_t i;
+    for ( i = 0; i < n; ++i ) {
+        free ( xs[i] );
+    }
+    free ( xs );
+}
+
+
+// image with value size that no trie has is rejected
+void test_image_value_size()
+{
+    // value_size follows magic, version, byte order, size, pairs count and root in the header
+    const off_t offset = 40;
+    uint64_t original, value_size;
+    int fd = open ( path, O_RDWR );
+    if ( fd < 0 || pread ( fd, &original, sizeof ( original ), offset ) != sizeof ( original ) ) {
+        fprintf ( stderr, "[error] can't read image header\n" );
+        close ( fd );
+        return;
+    }
+    for ( value_size = 3; value_size < 16; value_size++ ) {
+        if ( value_size == 4 || value_size == 8 ) {
+            continue;
+        }
+        pwrite ( fd, &value_size, sizeof ( value_size ), offset );
+        errno = 0;
+        htr * image = htr_open_mmap ( NULL, path, murmur_hash );
+        if ( image != NULL || errno != EINVAL ) {
+            fprintf ( stderr, "[error] image with value size %u is mapped\n", ( unsigned ) value_size );
+            talloc_free ( image );
+        }
+    }
+    pwrite ( fd, &original, sizeof ( original ), offset );
+    close ( fd );
+}
+
+
+htr * test_image_save()
+{
+    fprintf ( stderr, "saving and mapping trie ... \n" );
+
+    int fd = mkstemp ( path );
+    if ( fd < 0 ) {
+        fprintf ( stderr, "[error] can't create image file\n" );
+        return NULL;
+    }
+    if ( htr_save ( T, fd ) != 0 ) {
+        fprintf ( stderr, "[error] can't save trie\n" );
+    }
+    close ( fd );
+
+    htr * image = htr_open_mmap ( NULL, path, murmur_hash );
+    if ( image == NULL ) {
+        fprintf ( stderr, "[error] can't map trie\n" );
+    }
+    test_image_value_size();
+    unlink ( path );
+
+    fprintf ( stderr, "done.\n" );
+    return image;
+}
+
+
+htr * test_image_freeze ( bool sorted )
+{
+    fprintf ( stderr, "freezing trie with %s buckets ... \n", sorted ? "sorted" : "hashed" );
+
+    htr * image = htr_freeze ( NULL, T, sorted );
+    if ( image == NULL ) {
+        fprintf ( stderr, "[error] can't freeze trie\n" );
+    }
+
+    fprintf ( stderr, "done.\n" );
+    return image;
+}
+
+
+void test_image_tryget ( htr * image )
+{
+    fprintf ( stderr, "finding %zu keys in mapped trie ... \n", n );
+
+    size_t i;
+    htr_value * u;
+    htr_value   v;
+    for ( i = 0; i < n; ++i ) {
+        u = htr_tryget ( image, xs[i], strlen ( xs[i] ) );
+        v = str_map_get ( M, xs[i], strlen ( xs[i] ) );
+        if ( ( u == NULL && v != 0 ) || ( u != NULL && *u != v ) ) {
+            fprintf ( stderr, "[error] incorrect value in mapped trie\n" );
+        }
+    }
+
+    if ( htr_get ( image, xs[0], strlen ( xs[0] ) ) != NULL || htr_del ( image, xs[0], strlen ( xs[0] ) ) != -1 ) {
+        fprintf ( stderr, "[error] mapped trie is not read only\n" );
+    }
+
+    fprintf ( stderr, "done.\n" );
+}
+
+
+int cmpkey ( const char* a, size_t ka, const char* b, size_t kb )
+{
+    int c = memcmp ( a, b, ka < kb ? ka : kb );
+    return c == 0 ? ( int ) ka - ( int ) kb : c;
+}
+
+
+void test_image_sorted_iteration ( htr * image )
+{
+    fprintf ( stderr, "iterating in order through mapped trie ... \n" );
+
+    htr_iterator i;
+    htr_iterator_init ( &i, image, true );
+
+    size_t count = 0;
+    htr_value * u;
+    htr_value   v;
+
+    char* prev_key = malloc ( m_high + 1 );
+    size_t prev_len = 0;
+
+    const char *key = NULL;
+    size_t len = 0;
+
+    while ( !htr_iterator_finished ( &i ) ) {
+        key = htr_iterator_key ( &i, &len );
+        if ( count > 0 && cmpkey ( prev_key, prev_len, key, len ) >= 0 ) {
+            fprintf ( stderr, "[error] iteration is not correctly ordered.\n" );
+        }
+        memcpy ( prev_key, key, len );
+        prev_len = len;
+        ++count;
+
+        u = htr_iterator_val ( &i );
+        v = str_map_get ( M, key, len );
+        if ( *u != v ) {
+            fprintf ( stderr, "[error] incorrect iteration tally (%lu, %lu)\n", *u, v );
+        }
+
+        htr_iterator_next ( &i );
+    }
+
+    if ( count != M->m ) {
+        fprintf ( stderr, "[error] iterated through %zu element, expected %zu\n",
+                  count, M->m );
+    }
+
+    htr_iterator_destroy ( &i );
+    free ( prev_key );
+
+    fprintf ( stderr, "done.\n" );
+}
+
+
+int main()
+{
+    setup();
+    htr * image = test_image_save();
+    if ( image != NULL ) {
+        test_image_tryget ( image );
+        test_image_sorted_iteration ( image );
+        talloc_free ( image );
+    }
+
+    bool sorted;
+    for ( sorted = false; ; sorted = true ) {
+        image = test_image_freeze ( sorted );
+        if ( image != NULL ) {
+            test_image_tryget ( image );
+            test_image_sorted_iteration ( image );
+            talloc_free ( image );
+        }
+        if ( sorted ) break;
+    }
+    teardown();
+
+    return 0;
+}
@@ -0,0 +1,202 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "str_map.h"
+#include "murmur_hash.h"
+#include <hat-trie/trie.h>
+#include <hat-trie/log.h>
+#include <talloc2/tree.h>
+
+/* Simple random string generation. */
+void randstr ( char* x, size_t len )
+{
+    x[len] = '\0';
+    while ( len > 0 ) {
+        x[--len] = '\x20' + ( rand() % ( '\x7e' - '\x20' + 1 ) );
+    }
+}
+
+const size_t n = 50000;   // how many unique strings
+const size_t m_low  = 1;   // minimum length of each string
+const size_t m_high = 100; // maximum length of each string
+const size_t k = 100000;  // number of changes between checks
+
+char** xs;
+
+str_map* M;
+char snapshot_path[] = "/tmp/hat-trie-snapshot-XXXXXX";
+char log_path[]      = "/tmp/hat-trie-log-XXXXXX";
+
+
+void setup()
+{
+    fprintf ( stderr, "generating %zu keys ... ", n );
+    xs = malloc ( n * sizeof ( char* ) );
+    size_t i;
+    size_t m;
+    for ( i = 0; i < n; ++i ) {
+        m = m_low + rand() % ( m_high - m_low );
+        xs[i] = malloc ( m + 1 );
+        randstr ( xs[i], m );
+    }
+
+    M = str_map_create();
+
+    int fd = mkstemp ( snapshot_path );
+    close ( fd );
+    unlink ( snapshot_path );
+    fd = mkstemp ( log_path );
+    close ( fd );
+    unlink ( log_path );
+    fprintf ( stderr, "done.\n" );
+}
+
+
+void teardown()
+{
+    unlink ( snapshot_path );
+    unlink ( log_path );
+    str_map_destroy ( M );
+
+    size_t i;
+    for ( i = 0; i < n; ++i ) {
+        free ( xs[i] );
+    }
+    free ( xs );
+}
+
+
+// random sets and deletions, deleted keys are kept in the map with zero value
+void test_log_changes ( htr * T )
+{
+    fprintf ( stderr, "making %zu logged changes ... \n", k );
+
+    size_t i, j;
+    for ( j = 0; j < k; ++j ) {
+        i = rand() % n;
+        if ( rand() % 4 == 0 ) {
+            htr_del ( T, xs[i], strlen ( xs[i] ) );
+            str_map_set ( M, xs[i], strlen ( xs[i] ), 0 );
+        } else {
+            if ( htr_set ( T, xs[i], strlen ( xs[i] ), j + 1 ) != 0 ) {
+                fprintf ( stderr, "[error] can't set value\n" );
+            }
+            str_map_set ( M, xs[i], strlen ( xs[i] ), j + 1 );
+        }
+    }
+
+    fprintf ( stderr, "done.\n" );
+}
+
+
+htr * test_log_recover()
+{
+    fprintf ( stderr, "recovering trie ... \n" );
+
+    htr * T = htr_log_open ( NULL, snapshot_path, log_path, murmur_hash, sizeof ( htr_value ), 1 << 12 );
+    if ( T == NULL ) {
+        fprintf ( stderr, "[error] can't recover trie\n" );
+        return NULL;
+    }
+
+    size_t i;
+    htr_value * u;
+    htr_value   v;
+    for ( i = 0; i < n; ++i ) {
+        u = htr_tryget ( T, xs[i], strlen ( xs[i] ) );
+        v = str_map_get ( M, xs[i], strlen ( xs[i] ) );
+        if ( ( u == NULL && v != 0 ) || ( u != NULL && *u != v ) ) {
+            fprintf ( stderr, "[error] incorrect value in recovered trie\n" );
+        }
+    }
+
+    fprintf ( stderr, "done.\n" );
+    return T;
+}
+
+
+void test_log_torn_tail()
+{
+    fprintf ( stderr, "appending torn record to the log ... \n" );
+
+    int fd = open ( log_path, O_WRONLY | O_APPEND );
+    if ( fd < 0 || write ( fd, "\x01\x05tor", 5 ) != 5 ) {
+        fprintf ( stderr, "[error] can't append to the log\n" );
+    }
+    close ( fd );
+
+    fprintf ( stderr, "done.\n" );
+}
+
+
+// trie with other values can't be recovered from the files and they are kept untouched
+void test_log_value_size()
+{
+    fprintf ( stderr, "recovering trie with other value size ... \n" );
+
+    struct stat before, after;
+    stat ( log_path, &before );
+    size_t sizes[] = { 4, HTR_VALUE_BLOB };
+    size_t i;
+    for ( i = 0; i < sizeof ( sizes ) / sizeof ( sizes[0] ); i++ ) {
+        htr * T = htr_log_open ( NULL, snapshot_path, log_path, murmur_hash, sizes[i], 1 << 12 );
+        if ( T != NULL ) {
+            fprintf ( stderr, "[error] trie with value size %zu is recovered\n", sizes[i] );
+            talloc_free ( T );
+        }
+    }
+    stat ( log_path, &after );
+    if ( after.st_size != before.st_size ) {
+        fprintf ( stderr, "[error] log is truncated by failed recovery\n" );
+    }
+
+    fprintf ( stderr, "done.\n" );
+}
+
+
+int main()
+{
+    setup();
+
+    htr * T = test_log_recover();
+    if ( T != NULL ) {
+        test_log_changes ( T );
+        if ( htr_log_commit ( T ) != 0 ) {
+            fprintf ( stderr, "[error] can't commit log\n" );
+        }
+        talloc_free ( T );
+    }
+    test_log_value_size();
+
+    T = test_log_recover();
+    if ( T != NULL ) {
+        if ( htr_log_checkpoint ( T ) != 0 ) {
+            fprintf ( stderr, "[error] can't make checkpoint\n" );
+        }
+        test_log_changes ( T );
+        htr_log_commit ( T );
+        talloc_free ( T );
+    }
+
+    test_log_value_size();
+    test_log_torn_tail();
+
+    T = test_log_recover();
+    if ( T != NULL ) {
+        test_log_changes ( T );
+        htr_log_commit ( T );
+        talloc_free ( T );
+    }
+
+    T = test_log_recover();
+    talloc_free ( T );
+
+    teardown();
+
+    return 0;
+}
@@ -0,0 +1,235 @@
+/* Test of the C++ layer and a quick comparison of its map with std::unordered_map. */
+
+extern "C" {
+#include "murmur_hash.h"
+}
+#include <hat-trie/trie.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Simple random string generation. */
+static std::string randstr ( size_t len )
+{
+    std::string x ( len, '\0' );
+    while ( len > 0 ) {
+        x[--len] = '\x20' + ( rand() % ( '\x7e' - '\x20' + 1 ) );
+    }
+    return x;
+}
+
+const size_t n = 1000000; // how many strings
+const size_t m_low  = 5;  // minimum length of each string
+const size_t m_high = 30; // maximum length of each string
+
+std::vector<std::string> xs;
+
+static void setup()
+{
+    fprintf ( stderr, "generating %zu keys ... ", n );
+    xs.reserve ( n );
+    for ( size_t i = 0; i < n; ++i ) {
+        xs.push_back ( randstr ( m_low + rand() % ( m_high - m_low ) ) );
+    }
+    fprintf ( stderr, "done.\n" );
+}
+
+struct point {
+    int16_t x;
+    int16_t y;
+};
+
+static void test_map()
+{
+    fprintf ( stderr, "checking map and set ... " );
+
+    hattrie::map<uint32_t> M ( murmur_hash );
+    hattrie::set S ( murmur_hash );
+    std::unordered_map<std::string, uint32_t> R;
+    const size_t count = 100000;
+    for ( size_t i = 0; i < count; ++i ) {
+        uint32_t value = ( uint32_t ) rand();
+        bool inserted = R.insert_or_assign ( xs[i], value ).second;
+        if ( M.insert_or_assign ( xs[i], value ) != inserted || S.insert ( xs[i] ) != inserted ) {
+            fprintf ( stderr, "[error] insert returned incorrect result\n" );
+        }
+    }
+    if ( M.size() != R.size() || S.size() != R.size() ) {
+        fprintf ( stderr, "[error] incorrect size\n" );
+    }
+
+    // try_emplace doesn't change existing values
+    if ( M.try_emplace ( xs[0], 7u ) || M.find ( xs[0] ) != R[xs[0]] || !M.try_emplace ( "missing key", 7u ) || M.find ( "missing key" ) != 7u ) {
+        fprintf ( stderr, "[error] incorrect try_emplace\n" );
+    }
+    if ( !M.erase ( "missing key" ) || M.erase ( "missing key" ) || M.contains ( "missing key" ) || M.find ( "missing key" ) ) {
+        fprintf ( stderr, "[error] incorrect erase\n" );
+    }
+
+    size_t visited = 0;
+    for ( auto pair : M ) {
+        auto found = R.find ( std::string ( pair.first ) );
+        if ( found == R.end() || found->second != pair.second ) {
+            fprintf ( stderr, "[error] iterator returned incorrect pair\n" );
+        }
+        visited++;
+    }
+    if ( visited != R.size() ) {
+        fprintf ( stderr, "[error] iterator visited %zu keys instead of %zu\n", visited, R.size() );
+    }
+
+    // sorted keys work with algorithms of input iterators
+    std::vector<std::string> keys ( S.begin ( true ), S.end() );
+    if ( keys.size() != R.size() || !std::is_sorted ( keys.begin(), keys.end() ) ) {
+        fprintf ( stderr, "[error] sorted iterator returned incorrect keys\n" );
+    }
+
+    size_t prefixed = 0, walked = 0;
+    for ( const std::string & key : keys ) {
+        prefixed += key.compare ( 0, 1, "a" ) == 0;
+    }
+    M.walk ( "a", false, [&] ( std::string_view key, uint32_t value ) {
+        if ( key[0] != 'a' || R[std::string ( key )] != value ) {
+            fprintf ( stderr, "[error] walk visited incorrect pair\n" );
+        }
+        walked++;
+    } );
+    if ( walked != prefixed || M.count_prefix ( "a" ) != prefixed ) {
+        fprintf ( stderr, "[error] walk visited %zu keys instead of %zu\n", walked, prefixed );
+    }
+    walked = 0;
+    S.walk ( "", true, [&] ( std::string_view ) {
+        return ++walked == 3;
+    } );
+    if ( walked != 3 ) {
+        fprintf ( stderr, "[error] walk is not stopped\n" );
+    }
+
+    // values of any trivially copyable type, trie is moved without copy
+    hattrie::map<point> P ( murmur_hash );
+    P.insert_or_assign ( "point", point { -3, 4 } );
+    hattrie::map<point> Q ( std::move ( P ) );
+    std::optional<point> p = Q.find ( "point" );
+    if ( P.get() != nullptr || !p || p->x != -3 || p->y != 4 ) {
+        fprintf ( stderr, "[error] incorrect value of struct\n" );
+    }
+
+    // hash of the type, maps are merged without the hash argument
+    hattrie::map<uint32_t, murmur_hash> A, B;
+    hattrie::set<murmur_hash> C;
+    A.insert_or_assign ( "a", 1 );
+    A.insert_or_assign ( "b", 2 );
+    B.insert_or_assign ( "b", 3 );
+    B.insert_or_assign ( "c", 4 );
+    C.insert ( "a" );
+    A.merge ( B );
+    if ( A.size() != 3 || !B.empty() || A.find ( "b" ) != 3u || A.find ( "c" ) != 4u || !C.contains ( "a" ) ) {
+        fprintf ( stderr, "[error] incorrect merge\n" );
+    }
+
+    // trie may be allocated on the talloc context of the caller
+    void * ctx = talloc ( NULL, 0 );
+    hattrie::map<double> D ( murmur_hash, ctx );
+    D.insert_or_assign ( "pi", 3.25 );
+    if ( D.find ( "pi" ) != 3.25 ) {
+        fprintf ( stderr, "[error] incorrect value of double\n" );
+    }
+    htr * T = D.release();
+    if ( htr_contains ( T, "pi", 2 ) != true ) {
+        fprintf ( stderr, "[error] released trie lost its keys\n" );
+    }
+    talloc_free ( ctx );
+
+    fprintf ( stderr, "done.\n" );
+}
+
+static void bench_map()
+{
+    clock_t t0, t;
+    hattrie::map<uint64_t> M ( murmur_hash );
+    std::unordered_map<std::string, uint64_t> U;
+    uint64_t sum = 0, read = 0, unordered = 0;
+
+    fprintf ( stderr, "inserting into hattrie::map ... " );
+    t0 = clock();
+    for ( size_t i = 0; i < n; ++i ) {
+        M.insert_or_assign ( xs[i], i );
+    }
+    t = clock();
+    fprintf ( stderr, "finished. (%0.2f seconds)\n", ( double ) ( t - t0 ) / ( double ) CLOCKS_PER_SEC );
+
+    fprintf ( stderr, "inserting into std::unordered_map ... " );
+    t0 = clock();
+    for ( size_t i = 0; i < n; ++i ) {
+        U.insert_or_assign ( xs[i], i );
+    }
+    t = clock();
+    fprintf ( stderr, "finished. (%0.2f seconds)\n", ( double ) ( t - t0 ) / ( double ) CLOCKS_PER_SEC );
+
+    fprintf ( stderr, "finding in hattrie::map ... " );
+    t0 = clock();
+    for ( size_t i = 0; i < n; ++i ) {
+        sum += *M.find ( xs[i * 7919 % n] );
+    }
+    t = clock();
+    fprintf ( stderr, "finished. (%0.2f seconds)\n", ( double ) ( t - t0 ) / ( double ) CLOCKS_PER_SEC );
+
+    // the same lookups through the C functions show the overhead of the layer
+    fprintf ( stderr, "finding by htr_read ... " );
+    t0 = clock();
+    htr_value value;
+    for ( size_t i = 0; i < n; ++i ) {
+        const std::string & key = xs[i * 7919 % n];
+        htr_read ( M.get(), key.data(), key.size(), &value );
+        read += value;
+    }
+    t = clock();
+    fprintf ( stderr, "finished. (%0.2f seconds)\n", ( double ) ( t - t0 ) / ( double ) CLOCKS_PER_SEC );
+
+    fprintf ( stderr, "finding in std::unordered_map ... " );
+    t0 = clock();
+    for ( size_t i = 0; i < n; ++i ) {
+        unordered += U.find ( xs[i * 7919 % n] )->second;
+    }
+    t = clock();
+    fprintf ( stderr, "finished. (%0.2f seconds)\n", ( double ) ( t - t0 ) / ( double ) CLOCKS_PER_SEC );
+
+    if ( sum != read || sum != unordered ) {
+        fprintf ( stderr, "[error] maps found different values\n" );
+    }
+    sum = 0;
+
+    fprintf ( stderr, "iterating hattrie::map ... " );
+    t0 = clock();
+    for ( auto pair : M ) {
+        sum += pair.second;
+    }
+    t = clock();
+    fprintf ( stderr, "finished. (%0.2f seconds)\n", ( double ) ( t - t0 ) / ( double ) CLOCKS_PER_SEC );
+
+    fprintf ( stderr, "iterating std::unordered_map ... " );
+    t0 = clock();
+    for ( auto & pair : U ) {
+        sum -= pair.second;
+    }
+    t = clock();
+    fprintf ( stderr, "finished. (%0.2f seconds)\n", ( double ) ( t - t0 ) / ( double ) CLOCKS_PER_SEC );
+
+    if ( sum != 0 ) {
+        fprintf ( stderr, "[error] maps iterated different values\n" );
+    }
+}
+
+int main()
+{
+    setup();
+    test_map();
+    bench_map();
+
+    return 0;
+}
@@ -0,0 +1,407 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "str_map.h"
+#include "murmur_hash.h"
+#include <hat-trie/trie.h>
+#include <hat-trie/image.h>
+#include <hat-trie/encoder.h>
+#include <talloc2/tree.h>
+
+const size_t n = 200000; // how many strings
+const size_t m_low  = 1;  // minimum length of each string
+const size_t m_high = 24; // maximum length of each string
+
+char ** xs;
+size_t * lengths;
+
+// Keys have small alphabet, so upper levels of the trie are trie nodes and first chars split keys into groups.
+void setup()
+{
+    fprintf ( stderr, "generating %zu keys ... ", n );
+    xs      = malloc ( n * sizeof ( char * ) );
+    lengths = malloc ( n * sizeof ( size_t ) );
+    size_t i, j;
+    for ( i = 0; i < n; ++i ) {
+        lengths[i] = m_low + rand() % ( m_high - m_low );
+        xs[i]      = malloc ( lengths[i] );
+        for ( j = 0; j < lengths[i]; j++ ) {
+            xs[i][j] = ( char ) ( 'a' + rand() % 8 );
+        }
+    }
+    fprintf ( stderr, "done.\n" );
+}
+
+void teardown()
+{
+    size_t i;
+    for ( i = 0; i < n; ++i ) {
+        free ( xs[i] );
+    }
+    free ( xs );
+    free ( lengths );
+}
+
+typedef struct merge_config_t {
+    const char * name;
+    size_t       value_size;
+    bool         dst_front_coded;
+    bool         src_front_coded;
+    bool         dst_encoder;
+    bool         src_encoder;
+    bool         disjoint; // keys of src start with other chars than keys of dst
+} merge_config;
+
+static htr_value sum ( htr_value dst, htr_value src, void * data )
+{
+    ( *( size_t * ) data )++;
+    return dst + src;
+}
+
+static void set_value ( htr * T, size_t value_size, size_t i, htr_value value )
+{
+    if ( value_size == HTR_VALUE_BLOB ) {
+        char blob[32];
+        int size = sprintf ( blob, "%llu", ( unsigned long long ) value );
+        htr_blob_set ( T, xs[i], lengths[i], blob, ( size_t ) size );
+    } else {
+        htr_set ( T, xs[i], lengths[i], value );
+    }
+}
+
+// Value of the key in the merged trie, keys that are missing have 0.
+static htr_value get_value ( htr * T, size_t value_size, size_t i )
+{
+    htr_value value = 0;
+    if ( value_size == HTR_VALUE_BLOB ) {
+        size_t size;
+        const char * blob = htr_blob_get ( T, xs[i], lengths[i], &size );
+        if ( blob != NULL ) {
+            char text[32];
+            memcpy ( text, blob, size );
+            text[size] = '\0';
+            value = strtoull ( text, NULL, 10 );
+        }
+    } else if ( value_size == 0 ) {
+        value = htr_contains ( T, xs[i], lengths[i] );
+    } else {
+        htr_read ( T, xs[i], lengths[i], &value );
+    }
+    return value;
+}
+
+static htr * new_trie ( size_t value_size, bool front_coded, htr_encoder * encoder )
+{
+    htr * T = htr_new_sized ( NULL, murmur_hash, value_size );
+    htr_set_front_coded ( T, front_coded );
+    if ( encoder != NULL ) {
+        htr_set_encoder ( T, encoder );
+    }
+    return T;
+}
+
+static int count_callback ( const htr_key_view * view, htr_value * value, void * data )
+{
+    ( void ) view;
+    ( void ) value;
+    ( *( size_t * ) data )++;
+    return 0;
+}
+
+void test_merge ( const merge_config * config )
+{
+    fprintf ( stderr, "merging tries: %s ... \n", config->name );
+
+    htr_encoder * encoder = htr_encoder_new ( NULL, ( const char * const * ) xs, lengths, 1000 );
+    htr * dst = new_trie ( config->value_size, config->dst_front_coded, config->dst_encoder ? encoder : NULL );
+    htr * src = new_trie ( config->value_size, config->src_front_coded, config->src_encoder ? encoder : NULL );
+    str_map * D = str_map_create();
+    str_map * S = str_map_create();
+
+    // values are not zero, so 0 means that key is missing, they fit 4 bytes values
+    size_t i;
+    htr_value value;
+    for ( i = 0; i < n; ++i ) {
+        value = config->value_size == 0 ? 1 : 1 + rand() % 100000;
+        bool to_dst, to_src;
+        if ( config->disjoint ) {
+            to_dst = xs[i][0] < 'e' || i % 1000 == 0;
+            to_src = !to_dst || i % 2000 == 0;
+        } else {
+            to_dst = i < n * 2 / 3;
+            to_src = i >= n / 3;
+        }
+        if ( to_dst ) {
+            set_value ( dst, config->value_size, i, value );
+            str_map_set ( D, xs[i], lengths[i], value );
+        }
+        if ( to_src ) {
+            set_value ( src, config->value_size, i, value + 1 );
+            str_map_set ( S, xs[i], lengths[i], value + 1 );
+        }
+    }
+
+    size_t combined = 0;
+    if ( htr_merge ( dst, src, sum, &combined ) != 0 ) {
+        fprintf ( stderr, "[error] htr_merge failed\n" );
+    }
+
+    str_map * expected = str_map_create();
+    size_t expected_count = 0, expected_combined = 0;
+    htr_value d, s;
+    for ( i = 0; i < n; ++i ) {
+        if ( str_map_get ( expected, xs[i], lengths[i] ) != 0 ) {
+            continue;
+        }
+        d = str_map_get ( D, xs[i], lengths[i] );
+        s = str_map_get ( S, xs[i], lengths[i] );
+        if ( d == 0 && s == 0 ) {
+            continue;
+        }
+        if ( d != 0 && s != 0 ) {
+            expected_combined++;
+            value = config->value_size == HTR_VALUE_BLOB ? s : d + s;
+        } else {
+            value = d != 0 ? d : s;
+        }
+        if ( config->value_size == 0 ) {
+            value = 1;
+        }
+        str_map_set ( expected, xs[i], lengths[i], value );
+        expected_count++;
+    }
+
+    for ( i = 0; i < n; ++i ) {
+        value = str_map_get ( expected, xs[i], lengths[i] );
+        if ( get_value ( dst, config->value_size, i ) != value ) {
+            fprintf ( stderr, "[error] incorrect value of merged key %zu\n", i );
+            break;
+        }
+    }
+
+    size_t count = 0;
+    htr_walk ( dst, "", 0, false, count_callback, &count );
+    if ( count != expected_count ) {
+        fprintf ( stderr, "[error] merged trie has %zu keys, expected %zu\n", count, expected_count );
+    }
+    if ( config->value_size != 0 && config->value_size != HTR_VALUE_BLOB && combined != expected_combined ) {
+        fprintf ( stderr, "[error] %zu values are combined, expected %zu\n", combined, expected_combined );
+    }
+
+    count = 0;
+    htr_walk ( src, "", 0, false, count_callback, &count );
+    if ( count != 0 ) {
+        fprintf ( stderr, "[error] source trie is not empty after merge\n" );
+    }
+    set_value ( src, config->value_size, 0, 1 );
+    if ( get_value ( src, config->value_size, 0 ) != 1 ) {
+        fprintf ( stderr, "[error] source trie is not usable after merge\n" );
+    }
+
+    str_map_destroy ( expected );
+    str_map_destroy ( D );
+    str_map_destroy ( S );
+    talloc_free ( dst );
+    talloc_free ( src );
+    talloc_free ( encoder );
+    fprintf ( stderr, "done.\n" );
+}
+
+void test_merge_invalid()
+{
+    htr * A = htr_new ( NULL, murmur_hash );
+    htr * B = htr_new_sized ( NULL, murmur_hash, 4 );
+    if ( htr_merge ( A, B, NULL, NULL ) != -1 || htr_merge ( A, A, NULL, NULL ) != -1 ) {
+        fprintf ( stderr, "[error] tries with different values are merged\n" );
+    }
+    talloc_free ( A );
+    talloc_free ( B );
+}
+
+typedef struct set_config_t {
+    const char * name;
+    bool         a_front_coded;
+    bool         b_front_coded;
+    bool         a_encoder;
+    bool         b_encoder;
+    bool         same_encoder;
+    bool         a_image;
+    bool         b_image;
+} set_config;
+
+typedef struct set_data_t {
+    str_map * A;
+    str_map * B;
+    bool      found;
+    bool      sorted;
+    size_t    count;
+    char      previous[32];
+    size_t    previous_length;
+} set_data;
+
+static int set_callback ( const htr_key_view * view, htr_value * value, void * data )
+{
+    set_data * d = data;
+    char key[32];
+    size_t length = view->prefix_length + view->suffix_length;
+    memcpy ( key, view->prefix, view->prefix_length );
+    memcpy ( key + view->prefix_length, view->suffix, view->suffix_length );
+
+    if ( str_map_get ( d->A, key, length ) != *value || ( str_map_get ( d->B, key, length ) != 0 ) != d->found ) {
+        fprintf ( stderr, "[error] incorrect key is visited by set operation\n" );
+    }
+    if ( d->sorted && d->count > 0 ) {
+        size_t common = length < d->previous_length ? length : d->previous_length;
+        int cmp = memcmp ( d->previous, key, common );
+        if ( cmp > 0 || ( cmp == 0 && d->previous_length >= length ) ) {
+            fprintf ( stderr, "[error] set operation visits keys out of order\n" );
+        }
+    }
+    memcpy ( d->previous, key, length );
+    d->previous_length = length;
+    d->count++;
+    return 0;
+}
+
+static int stop_callback ( const htr_key_view * view, htr_value * value, void * data )
+{
+    ( void ) view;
+    ( void ) value;
+    return ++*( size_t * ) data == 10 ? 7 : 0;
+}
+
+// Keys of b skip the first chars 'a' and 'b', so subtrees of a are skipped or visited as a whole there.
+void test_set_operations ( const set_config * config )
+{
+    fprintf ( stderr, "intersecting tries: %s ... \n", config->name );
+
+    htr_encoder * a_encoder = htr_encoder_new ( NULL, ( const char * const * ) xs, lengths, 1000 );
+    htr_encoder * b_encoder = htr_encoder_new ( NULL, ( const char * const * ) ( xs + 1000 ), lengths + 1000, 10 );
+    htr * a = new_trie ( sizeof ( htr_value ), config->a_front_coded, config->a_encoder ? a_encoder : NULL );
+    htr * b = new_trie ( sizeof ( htr_value ), config->b_front_coded, config->b_encoder ? ( config->same_encoder ? a_encoder : b_encoder ) : NULL );
+    str_map * A = str_map_create();
+    str_map * B = str_map_create();
+
+    size_t i;
+    for ( i = 0; i < n; ++i ) {
+        if ( i < n * 2 / 3 ) {
+            htr_set ( a, xs[i], lengths[i], i + 1 );
+            str_map_set ( A, xs[i], lengths[i], i + 1 );
+        }
+        if ( i >= n / 3 && xs[i][0] > 'b' ) {
+            htr_set ( b, xs[i], lengths[i], i + 1 );
+            str_map_set ( B, xs[i], lengths[i], i + 1 );
+        }
+    }
+    if ( config->a_image ) {
+        htr * image = htr_freeze ( NULL, a, true );
+        talloc_free ( a );
+        a = image;
+    }
+    if ( config->b_image ) {
+        htr * image = htr_freeze ( NULL, b, false );
+        talloc_free ( b );
+        b = image;
+    }
+
+    // distinct keys of a found in b and missing in b
+    size_t found = 0, missing = 0;
+    str_map * seen = str_map_create();
+    for ( i = 0; i < n; ++i ) {
+        if ( str_map_get ( A, xs[i], lengths[i] ) == 0 || str_map_get ( seen, xs[i], lengths[i] ) != 0 ) {
+            continue;
+        }
+        str_map_set ( seen, xs[i], lengths[i], 1 );
+        if ( str_map_get ( B, xs[i], lengths[i] ) != 0 ) {
+            found++;
+        } else {
+            missing++;
+        }
+    }
+    str_map_destroy ( seen );
+
+    set_data d;
+    d.A = A;
+    d.B = B;
+    bool sorted;
+    for ( sorted = false; ; sorted = true ) {
+        d.sorted = sorted;
+        d.found  = true;
+        d.count  = 0;
+        htr_intersect ( a, b, sorted, set_callback, &d );
+        if ( d.count != found ) {
+            fprintf ( stderr, "[error] intersection has %zu keys, expected %zu\n", d.count, found );
+        }
+        d.found = false;
+        d.count = 0;
+        htr_difference ( a, b, sorted, set_callback, &d );
+        if ( d.count != missing ) {
+            fprintf ( stderr, "[error] difference has %zu keys, expected %zu\n", d.count, missing );
+        }
+        if ( sorted ) break;
+    }
+
+    htr * result = htr_new ( NULL, murmur_hash );
+    size_t count = 0;
+    htr_difference ( a, b, false, htr_collect, result );
+    htr_walk ( result, "", 0, false, count_callback, &count );
+    if ( count != missing ) {
+        fprintf ( stderr, "[error] collected difference has %zu keys, expected %zu\n", count, missing );
+    }
+    talloc_free ( result );
+
+    count = 0;
+    if ( htr_intersect ( a, b, false, stop_callback, &count ) != 7 || count != 10 ) {
+        fprintf ( stderr, "[error] intersection is not stopped by callback\n" );
+    }
+
+    str_map_destroy ( A );
+    str_map_destroy ( B );
+    talloc_free ( a );
+    talloc_free ( b );
+    talloc_free ( a_encoder );
+    talloc_free ( b_encoder );
+    fprintf ( stderr, "done.\n" );
+}
+
+int main()
+{
+    setup();
+
+    const merge_config configs[] = {
+        { "overlapping keys",       sizeof ( htr_value ), false, false, false, false, false },
+        { "disjoint subtrees",      sizeof ( htr_value ), false, false, false, false, true  },
+        { "front coded buckets",    sizeof ( htr_value ), true,  true,  false, false, false },
+        { "4 bytes values",         4,                    false, false, false, false, true  },
+        { "set of keys",            0,                    false, false, false, false, false },
+        { "blob values",            HTR_VALUE_BLOB,       false, false, false, false, false },
+        { "encoded keys",           sizeof ( htr_value ), false, false, true,  true,  false },
+        { "different encoders",     sizeof ( htr_value ), false, false, false, true,  true  },
+        { "different bucket types", sizeof ( htr_value ), true,  false, false, false, false },
+    };
+    size_t i;
+    for ( i = 0; i < sizeof ( configs ) / sizeof ( configs[0] ); i++ ) {
+        test_merge ( &configs[i] );
+    }
+    test_merge_invalid();
+
+    const set_config set_configs[] = {
+        { "mutable tries",       false, false, false, false, false, false, false },
+        { "front coded buckets", true,  false, false, false, false, false, false },
+        { "images",              false, false, false, false, false, true,  true  },
+        { "mutable and image",   false, true,  false, false, false, false, true  },
+        { "encoded keys",        false, false, true,  true,  true,  false, false },
+        { "encoded images",      false, false, true,  true,  true,  true,  true  },
+        { "different encoders",  false, false, true,  true,  false, true,  false },
+        { "encoded and plain",   false, false, false, true,  false, false, false },
+    };
+    for ( i = 0; i < sizeof ( set_configs ) / sizeof ( set_configs[0] ); i++ ) {
+        test_set_operations ( &set_configs[i] );
+    }
+
+    teardown();
+
+    return 0;
+}
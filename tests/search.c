@@ -0,0 +1,764 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <fnmatch.h>
+
+#include "murmur_hash.h"
+#include <hat-trie/trie.h>
+#include <hat-trie/image.h>
+#include <hat-trie/encoder.h>
+#include <talloc2/tree.h>
+
+const size_t n = 50000; // how many strings
+const size_t m_low  = 1;  // minimum length of each string
+const size_t m_high = 10; // maximum length of each string
+const size_t q = 60;      // how many queries
+
+char ** xs;
+size_t * lengths;
+
+// Keys have small alphabet, so many keys are close to each other.
+void setup()
+{
+    fprintf ( stderr, "generating %zu keys ... ", n );
+    xs      = malloc ( n * sizeof ( char * ) );
+    lengths = malloc ( n * sizeof ( size_t ) );
+    size_t i, j;
+    for ( i = 0; i < n; ++i ) {
+        lengths[i] = m_low + rand() % ( m_high - m_low );
+        xs[i]      = malloc ( m_high );
+        for ( j = 0; j < lengths[i]; j++ ) {
+            xs[i][j] = ( char ) ( 'a' + rand() % 6 );
+        }
+    }
+    fprintf ( stderr, "done.\n" );
+}
+
+void teardown()
+{
+    size_t i;
+    for ( i = 0; i < n; ++i ) {
+        free ( xs[i] );
+    }
+    free ( xs );
+    free ( lengths );
+}
+
+// Query is a key with some random edits or the empty key.
+static size_t make_query ( char * query, size_t i )
+{
+    if ( i == 0 ) {
+        return 0;
+    }
+    size_t length = lengths[i];
+    memcpy ( query, xs[i], length );
+    size_t edits = rand() % 3, k;
+    for ( k = 0; k < edits && length > 0; k++ ) {
+        query[rand() % length] = ( char ) ( 'a' + rand() % 7 );
+    }
+    return length;
+}
+
+static size_t distance ( const char * a, size_t a_length, const char * b, size_t b_length )
+{
+    size_t row[64], next[64], i, j;
+    for ( j = 0; j <= b_length; j++ ) {
+        row[j] = j;
+    }
+    for ( i = 1; i <= a_length; i++ ) {
+        next[0] = i;
+        for ( j = 1; j <= b_length; j++ ) {
+            size_t d = row[j - 1] + ( a[i - 1] != b[j - 1] );
+            if ( row[j] + 1 < d )      d = row[j] + 1;
+            if ( next[j - 1] + 1 < d ) d = next[j - 1] + 1;
+            next[j] = d;
+        }
+        memcpy ( row, next, ( b_length + 1 ) * sizeof ( size_t ) );
+    }
+    return row[b_length];
+}
+
+typedef struct fuzzy_data_t {
+    htr *        P;
+    htr *        visited;
+    const char * query;
+    size_t       length;
+    size_t       max_distance;
+    size_t       count;
+} fuzzy_data;
+
+static int fuzzy_callback ( const htr_key_view * view, htr_value * value, void * data )
+{
+    fuzzy_data * f = data;
+    char key[64];
+    size_t length = view->prefix_length + view->suffix_length;
+    memcpy ( key, view->prefix, view->prefix_length );
+    memcpy ( key + view->prefix_length, view->suffix, view->suffix_length );
+
+    htr_value * v = htr_tryget ( f->P, key, length );
+    if ( v == NULL || *v != *value || distance ( key, length, f->query, f->length ) > f->max_distance ) {
+        fprintf ( stderr, "[error] fuzzy search visited incorrect key\n" );
+    }
+    htr_value * seen = htr_get ( f->visited, key, length );
+    if ( *seen != 0 ) {
+        fprintf ( stderr, "[error] fuzzy search visited the key twice\n" );
+    }
+    *seen = 1;
+    f->count++;
+    return 0;
+}
+
+static int stop_callback ( const htr_key_view * view, htr_value * value, void * data )
+{
+    ( void ) view;
+    ( void ) value;
+    return ++( *( size_t * ) data ) == 3 ? 7 : 0;
+}
+
+// Fuzzy search visits the same keys as brute force over all keys.
+static void check_fuzzy ( htr * T, htr * P, const char * what )
+{
+    char query[64];
+    size_t i, max_distance;
+    for ( i = 0; i < q; i++ ) {
+        size_t length = make_query ( query, i * ( n / q ) );
+
+        // expected[d] keys are within distance d
+        size_t expected[4] = { 0, 0, 0, 0 }, key_length, d;
+        htr_iterator * it;
+        for ( it = htr_iterator_begin ( P, false ); !htr_iterator_finished ( it ); htr_iterator_next ( it ) ) {
+            const char * key = htr_iterator_key ( it, &key_length );
+            for ( d = distance ( key, key_length, query, length ); d <= 3; d++ ) {
+                expected[d]++;
+            }
+        }
+        htr_iterator_free ( it );
+
+        for ( max_distance = 0; max_distance <= 3; max_distance++ ) {
+
+            fuzzy_data f;
+            f.P            = P;
+            f.visited      = htr_new ( NULL, murmur_hash );
+            f.query        = query;
+            f.length       = length;
+            f.max_distance = max_distance;
+            f.count        = 0;
+            if ( htr_fuzzy_search ( T, query, length, max_distance, fuzzy_callback, &f ) != 0 ) {
+                fprintf ( stderr, "[error] %s: fuzzy search is stopped\n", what );
+            }
+            if ( f.count != expected[max_distance] ) {
+                fprintf ( stderr, "[error] %s: fuzzy search visited %zu keys, expected %zu\n", what, f.count, expected[max_distance] );
+            }
+            talloc_free ( f.visited );
+        }
+    }
+
+    size_t count = 0;
+    if ( htr_fuzzy_search ( T, "abc", 3, 3, stop_callback, &count ) != 7 || count != 3 ) {
+        fprintf ( stderr, "[error] %s: fuzzy search is not stopped by callback\n", what );
+    }
+}
+
+typedef struct match_data_t {
+    htr *        P;
+    htr *        visited;
+    const char * pattern;
+    size_t       count;
+} match_data;
+
+static int match_callback ( const htr_key_view * view, htr_value * value, void * data )
+{
+    match_data * m = data;
+    char key[64];
+    size_t length = view->prefix_length + view->suffix_length;
+    memcpy ( key, view->prefix, view->prefix_length );
+    memcpy ( key + view->prefix_length, view->suffix, view->suffix_length );
+    key[length] = '\0';
+
+    htr_value * v = htr_tryget ( m->P, key, length );
+    if ( v == NULL || *v != *value || fnmatch ( m->pattern, key, 0 ) != 0 ) {
+        fprintf ( stderr, "[error] key \"%s\" doesn't match \"%s\"\n", key, m->pattern );
+    }
+    htr_value * seen = htr_get ( m->visited, key, length );
+    if ( *seen != 0 ) {
+        fprintf ( stderr, "[error] key \"%s\" is matched twice\n", key );
+    }
+    *seen = 1;
+    m->count++;
+    return 0;
+}
+
+// Pattern matching visits the same keys as fnmatch over all keys.
+static void check_match ( htr * T, htr * P, const char * what )
+{
+    const char * patterns[] = {
+        "", "*", "**", "?", "a", "abc", "abc*", "ab?d*", "*fa", "a*b*c", "[a-c]*f", "[!a]b*", "[^ab][ef]?",
+        "??", "*[ef]", "a*[]a]", "\\a?c", "a[", "[b-a]*", "*a*a*a*a*", "fff*e", "[abc][def]*[abc]",
+        // more than 64 positions
+        "*a*b*c*d*e*f*a*b*c*d*e*f*a*b*c*d*e*f*a*b*c*d*e*f*a*b*c*d*e*f*a*b*c*d*e*f*"
+    };
+    size_t p;
+    for ( p = 0; p < sizeof ( patterns ) / sizeof ( patterns[0] ); p++ ) {
+        size_t expected = 0, key_length;
+        char key[64];
+        htr_iterator * it;
+        for ( it = htr_iterator_begin ( P, false ); !htr_iterator_finished ( it ); htr_iterator_next ( it ) ) {
+            const char * k = htr_iterator_key ( it, &key_length );
+            memcpy ( key, k, key_length );
+            key[key_length] = '\0';
+            if ( fnmatch ( patterns[p], key, 0 ) == 0 ) {
+                expected++;
+            }
+        }
+        htr_iterator_free ( it );
+
+        match_data m;
+        m.P       = P;
+        m.visited = htr_new ( NULL, murmur_hash );
+        m.pattern = patterns[p];
+        m.count   = 0;
+        if ( htr_match ( T, patterns[p], strlen ( patterns[p] ), match_callback, &m ) != 0 ) {
+            fprintf ( stderr, "[error] %s: pattern matching is stopped\n", what );
+        }
+        if ( m.count != expected ) {
+            fprintf ( stderr, "[error] %s: pattern \"%s\" matched %zu keys, expected %zu\n", what, patterns[p], m.count, expected );
+        }
+        talloc_free ( m.visited );
+    }
+
+    size_t count = 0;
+    if ( htr_match ( T, "a*", 2, stop_callback, &count ) != 7 || count != 3 ) {
+        fprintf ( stderr, "[error] %s: pattern matching is not stopped by callback\n", what );
+    }
+}
+
+// Longest prefix of every key is the same as the longest of its prefixes found by htr_read.
+static void check_longest_prefix ( htr * T, htr * R, const char * what )
+{
+    const size_t count = 1000;
+    char ** queries = malloc ( count * sizeof ( char * ) );
+    size_t * query_lengths = malloc ( count * sizeof ( size_t ) );
+    size_t * expected = malloc ( count * sizeof ( size_t ) );
+    htr_value * expected_values = malloc ( count * sizeof ( htr_value ) );
+    size_t i, j, expected_found = 0;
+    srand ( 1 );
+    for ( i = 0; i < count; i++ ) {
+        // keys with random tails and the empty key
+        size_t k = rand() % n;
+        queries[i] = malloc ( 2 * m_high );
+        query_lengths[i] = i == 0 ? 0 : lengths[k] + rand() % m_high;
+        for ( j = 0; j < query_lengths[i]; j++ ) {
+            queries[i][j] = j < lengths[k] ? xs[k][j] : ( char ) ( 'a' + rand() % 6 );
+        }
+        expected[i] = SIZE_MAX;
+        for ( j = query_lengths[i] + 1; j-- > 0; ) {
+            if ( htr_read ( R, queries[i], j, &expected_values[i] ) == 0 ) {
+                expected[i] = j;
+                expected_found++;
+                break;
+            }
+        }
+    }
+
+    size_t matched;
+    htr_value value;
+    for ( i = 0; i < count; i++ ) {
+        int found = htr_longest_prefix ( T, queries[i], query_lengths[i], &matched, &value );
+        if ( expected[i] == SIZE_MAX ? found != -1 : found != 0 || matched != expected[i] || value != expected_values[i] ) {
+            fprintf ( stderr, "[error] %s: incorrect longest prefix of query %zu\n", what, i );
+        }
+    }
+
+    size_t * batch_matched = malloc ( count * sizeof ( size_t ) );
+    htr_value * batch_values = malloc ( count * sizeof ( htr_value ) );
+    if ( htr_longest_prefix_batch ( T, ( const char * const * ) queries, query_lengths, count, batch_matched, batch_values ) != expected_found ) {
+        fprintf ( stderr, "[error] %s: incorrect number of longest prefixes in batch\n", what );
+    }
+    for ( i = 0; i < count; i++ ) {
+        if ( batch_matched[i] != expected[i] || ( expected[i] != SIZE_MAX && batch_values[i] != expected_values[i] ) ) {
+            fprintf ( stderr, "[error] %s: incorrect longest prefix of query %zu in batch\n", what, i );
+        }
+    }
+
+    for ( i = 0; i < count; i++ ) {
+        free ( queries[i] );
+    }
+    free ( queries );
+    free ( query_lengths );
+    free ( expected );
+    free ( expected_values );
+    free ( batch_matched );
+    free ( batch_values );
+}
+
+typedef struct topk_data_t {
+    htr *        P;
+    htr *        visited;
+    const char * prefix;
+    size_t       length;
+    htr_value *  values;
+    size_t       count;
+} topk_data;
+
+static int topk_callback ( const htr_key_view * view, htr_value * value, void * data )
+{
+    topk_data * t = data;
+    char key[64];
+    size_t length = view->prefix_length + view->suffix_length;
+    memcpy ( key, view->prefix, view->prefix_length );
+    memcpy ( key + view->prefix_length, view->suffix, view->suffix_length );
+
+    htr_value expected;
+    if ( length < t->length || memcmp ( key, t->prefix, t->length ) != 0 || htr_read ( t->P, key, length, &expected ) != 0 || expected != *value ) {
+        fprintf ( stderr, "[error] top-k visited incorrect key\n" );
+    }
+    if ( htr_insert ( t->visited, key, length ) != 1 ) {
+        fprintf ( stderr, "[error] top-k visited the key twice\n" );
+    }
+    t->values[t->count++] = *value;
+    return 0;
+}
+
+static int value_callback ( const htr_key_view * view, htr_value * value, void * data )
+{
+    ( void ) view;
+    topk_data * t = data;
+    t->values[t->count++] = *value;
+    return 0;
+}
+
+static int descending ( const void * a, const void * b )
+{
+    htr_value x = * ( const htr_value * ) a, y = * ( const htr_value * ) b;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Top-k visits the best values of the full prefix scan in descending order, keys with equal values may be any of them.
+static void check_topk ( htr * T, htr * P, const char * what )
+{
+    const size_t ks[] = { 1, 10, 100, 100000 };
+    topk_data expected, visited;
+    expected.values = malloc ( ( n + 1 ) * sizeof ( htr_value ) );
+    visited.values  = malloc ( ( n + 1 ) * sizeof ( htr_value ) );
+    visited.P       = P;
+    size_t i, j, l;
+    srand ( 2 );
+    for ( i = 0; i < q; i++ ) {
+        size_t x = rand() % n;
+        visited.prefix = xs[x];
+        visited.length = i == 0 ? 0 : rand() % ( lengths[x] < 4 ? lengths[x] + 1 : 4 );
+
+        expected.count = 0;
+        htr_walk ( P, visited.prefix, visited.length, false, value_callback, &expected );
+        qsort ( expected.values, expected.count, sizeof ( htr_value ), descending );
+
+        for ( j = 0; j < sizeof ( ks ) / sizeof ( ks[0] ); j++ ) {
+            visited.visited = htr_new_sized ( NULL, murmur_hash, 0 );
+            visited.count   = 0;
+            if ( htr_topk_prefix ( T, visited.prefix, visited.length, ks[j], topk_callback, &visited ) != 0 ) {
+                fprintf ( stderr, "[error] %s: top-k failed\n", what );
+            }
+            size_t count = expected.count < ks[j] ? expected.count : ks[j];
+            if ( visited.count != count ) {
+                fprintf ( stderr, "[error] %s: top-k visited %zu keys instead of %zu\n", what, visited.count, count );
+            } else {
+                for ( l = 0; l < count; l++ ) {
+                    if ( visited.values[l] != expected.values[l] ) {
+                        fprintf ( stderr, "[error] %s: top-k visited incorrect value %zu\n", what, l );
+                        break;
+                    }
+                }
+            }
+            talloc_free ( visited.visited );
+        }
+    }
+
+    size_t stops = 0;
+    if ( htr_topk_prefix ( T, "", 0, 10, stop_callback, &stops ) != 7 || stops != 3 ) {
+        fprintf ( stderr, "[error] %s: top-k is not stopped by callback\n", what );
+    }
+    free ( expected.values );
+    free ( visited.values );
+}
+
+void test_topk()
+{
+    fprintf ( stderr, "top-k of %zu keys ... \n", n );
+
+    htr * P = htr_new ( NULL, murmur_hash );
+    htr * S = htr_new ( NULL, murmur_hash );
+    htr * F = htr_new ( NULL, murmur_hash );
+    htr * E = htr_new ( NULL, murmur_hash );
+    htr * N = htr_new_sized ( NULL, murmur_hash, 2 );
+    htr * B = htr_new_sized ( NULL, murmur_hash, HTR_VALUE_BLOB );
+    htr_set_front_coded ( F, true );
+    htr_encoder * encoder = htr_encoder_new ( NULL, ( const char * const * ) xs, lengths, 1000 );
+    htr_set_encoder ( E, encoder );
+    talloc_free ( encoder );
+    if ( htr_set_scored ( S, true ) != 0 || htr_set_scored ( F, true ) != 0 || htr_set_scored ( E, true ) != 0 || htr_set_scored ( N, true ) != 0 ) {
+        fprintf ( stderr, "[error] htr_set_scored failed\n" );
+    }
+    if ( htr_set_scored ( B, true ) != -1 ) {
+        fprintf ( stderr, "[error] blob trie is scored\n" );
+    }
+
+    // values have many ties, some of them are lowered and deleted later
+    size_t i;
+    for ( i = 0; i < n; ++i ) {
+        htr_value value = ( htr_value ) ( rand() % 5000 );
+        htr_set ( P, xs[i], lengths[i], value );
+        htr_set ( S, xs[i], lengths[i], value );
+        htr_set ( F, xs[i], lengths[i], value );
+        htr_set ( E, xs[i], lengths[i], value );
+        htr_set ( N, xs[i], lengths[i], value );
+    }
+    htr_set ( P, "", 0, 4000 );
+    htr_set ( S, "", 0, 4000 );
+    htr_set ( N, "", 0, 4000 );
+    for ( i = 0; i < n; i += 7 ) {
+        htr_set ( P, xs[i], lengths[i], 1 );
+        htr_set ( S, xs[i], lengths[i], 1 );
+        htr_set ( N, xs[i], lengths[i], 1 );
+    }
+    for ( i = 3; i < n; i += 11 ) {
+        htr_del ( P, xs[i], lengths[i] );
+        htr_del ( S, xs[i], lengths[i] );
+        htr_del ( N, xs[i], lengths[i] );
+    }
+
+    if ( htr_get ( S, xs[0], lengths[0] ) != NULL ) {
+        fprintf ( stderr, "[error] htr_get of scored trie returned pointer\n" );
+    }
+    if ( htr_set_scored ( S, false ) != -1 ) {
+        fprintf ( stderr, "[error] scoring of not empty trie is changed\n" );
+    }
+
+    check_topk ( S, P, "scored" );
+    check_topk ( P, P, "not scored" );
+    check_topk ( N, P, "2 bytes values" );
+
+    // tries without lowered values
+    htr * R = htr_new ( NULL, murmur_hash );
+    htr_iterator * it;
+    for ( it = htr_iterator_begin ( F, false ); !htr_iterator_finished ( it ); htr_iterator_next ( it ) ) {
+        size_t length;
+        const char * key = htr_iterator_key ( it, &length );
+        htr_set ( R, key, length, htr_iterator_value ( it ) );
+    }
+    htr_iterator_free ( it );
+    check_topk ( F, R, "front coded" );
+    check_topk ( E, R, "encoded" );
+
+    bool sorted;
+    for ( sorted = false; ; sorted = true ) {
+        htr * I = htr_freeze ( NULL, S, sorted );
+        if ( I == NULL ) {
+            fprintf ( stderr, "[error] htr_freeze failed\n" );
+        } else {
+            check_topk ( I, P, sorted ? "sorted image" : "hashed image" );
+            talloc_free ( I );
+        }
+        if ( sorted ) break;
+    }
+
+    if ( htr_topk_prefix ( B, "", 0, 10, value_callback, NULL ) != -1 ) {
+        fprintf ( stderr, "[error] top-k of blob trie is not rejected\n" );
+    }
+
+    talloc_free ( P );
+    talloc_free ( S );
+    talloc_free ( F );
+    talloc_free ( E );
+    talloc_free ( N );
+    talloc_free ( B );
+    talloc_free ( R );
+    fprintf ( stderr, "done.\n" );
+}
+
+typedef struct select_data_t {
+    char **  keys;
+    size_t * lengths;
+    size_t   index;
+    size_t   count;
+    bool     failed;
+} select_data;
+
+static int select_callback ( const htr_key_view * view, htr_value * value, void * data )
+{
+    ( void ) value;
+    select_data * s = data;
+    size_t i = s->index + s->count++;
+    if ( view->prefix_length + view->suffix_length != s->lengths[i] ||
+            memcmp ( view->prefix, s->keys[i], view->prefix_length ) != 0 ||
+            memcmp ( view->suffix, s->keys[i] + view->prefix_length, view->suffix_length ) != 0 ) {
+        s->failed = true;
+    }
+    return 0;
+}
+
+static int compare_key ( const char * a, size_t a_length, const char * b, size_t b_length )
+{
+    int result = memcmp ( a, b, a_length < b_length ? a_length : b_length );
+    return result != 0 ? result : ( a_length > b_length ) - ( a_length < b_length );
+}
+
+// Ranks, selected pages and prefix counts match the sorted keys of the plain trie.
+static void check_order ( htr * T, char ** keys, size_t * key_lengths, size_t count, const char * what )
+{
+    size_t i, j;
+    srand ( 3 );
+    for ( i = 0; i < q; i++ ) {
+        size_t index = i == 0 ? 0 : i == 1 ? count - 1 : ( size_t ) rand() % count;
+        if ( htr_rank ( T, keys[index], key_lengths[index] ) != index ) {
+            fprintf ( stderr, "[error] %s: incorrect rank of key %zu\n", what, index );
+        }
+
+        select_data s;
+        s.keys    = keys;
+        s.lengths = key_lengths;
+        s.index   = index;
+        s.count   = 0;
+        s.failed  = false;
+        size_t page = index + 20 < count ? 20 : count - index;
+        if ( htr_select ( T, index, 20, select_callback, &s ) != 0 || s.count != page || s.failed ) {
+            fprintf ( stderr, "[error] %s: incorrect page from key %zu\n", what, index );
+        }
+
+        // missing keys and prefixes of the key
+        char query[64];
+        size_t length = make_query ( query, ( size_t ) rand() % n );
+        size_t less = 0, prefixed = 0;
+        for ( j = 0; j < count; j++ ) {
+            if ( compare_key ( keys[j], key_lengths[j], query, length ) < 0 ) {
+                less++;
+            }
+        }
+        if ( htr_rank ( T, query, length ) != less ) {
+            fprintf ( stderr, "[error] %s: incorrect rank of query %zu\n", what, i );
+        }
+        length = length < 3 ? length : ( size_t ) rand() % 4;
+        for ( j = 0; j < count; j++ ) {
+            if ( key_lengths[j] >= length && memcmp ( keys[j], query, length ) == 0 ) {
+                prefixed++;
+            }
+        }
+        if ( htr_count_prefix ( T, query, length ) != prefixed ) {
+            fprintf ( stderr, "[error] %s: incorrect count of prefix %zu\n", what, i );
+        }
+    }
+
+    select_data s;
+    s.count = 0;
+    if ( htr_select ( T, count, 1, select_callback, &s ) != 0 || s.count != 0 ) {
+        fprintf ( stderr, "[error] %s: key is selected past the end\n", what );
+    }
+    size_t stops = 0;
+    if ( htr_select ( T, 1, 10, stop_callback, &stops ) != 7 || stops != 3 ) {
+        fprintf ( stderr, "[error] %s: select is not stopped by callback\n", what );
+    }
+}
+
+void test_order()
+{
+    fprintf ( stderr, "order statistics of %zu keys ... \n", n );
+
+    htr * P = htr_new ( NULL, murmur_hash );
+    htr * C = htr_new ( NULL, murmur_hash );
+    htr * F = htr_new ( NULL, murmur_hash );
+    htr * E = htr_new ( NULL, murmur_hash );
+    htr * B = htr_new_sized ( NULL, murmur_hash, HTR_VALUE_BLOB );
+    htr_set_front_coded ( F, true );
+    htr_encoder * encoder = htr_encoder_new ( NULL, ( const char * const * ) xs, lengths, 1000 );
+    htr_set_encoder ( E, encoder );
+    talloc_free ( encoder );
+    if ( htr_set_counted ( C, true ) != 0 || htr_set_counted ( F, true ) != 0 || htr_set_counted ( E, true ) != 0 || htr_set_counted ( B, true ) != 0 ) {
+        fprintf ( stderr, "[error] htr_set_counted failed\n" );
+    }
+
+    // deleted keys and the empty key change counts of trie nodes
+    size_t i;
+    for ( i = 0; i < n; ++i ) {
+        htr_set ( P, xs[i], lengths[i], i );
+        htr_set ( C, xs[i], lengths[i], i );
+        htr_set ( F, xs[i], lengths[i], i );
+        htr_set ( E, xs[i], lengths[i], i );
+        htr_blob_set ( B, xs[i], lengths[i], "key", 3 );
+    }
+    for ( i = 0; i < n; i += 3 ) {
+        htr_del ( P, xs[i], lengths[i] );
+        htr_del ( C, xs[i], lengths[i] );
+        htr_del ( F, xs[i], lengths[i] );
+        htr_del ( E, xs[i], lengths[i] );
+        htr_del ( B, xs[i], lengths[i] );
+    }
+    htr_insert ( P, "", 0 );
+    htr_insert ( C, "", 0 );
+    htr_insert ( F, "", 0 );
+    htr_insert ( E, "", 0 );
+    htr_insert ( B, "", 0 );
+    if ( htr_set_counted ( C, false ) != -1 ) {
+        fprintf ( stderr, "[error] counting of not empty trie is changed\n" );
+    }
+
+    size_t count, length;
+    char ** keys = malloc ( ( n + 1 ) * sizeof ( char * ) );
+    size_t * key_lengths = malloc ( ( n + 1 ) * sizeof ( size_t ) );
+    htr_iterator * it;
+    for ( i = 0, it = htr_iterator_begin ( P, true ); !htr_iterator_finished ( it ); htr_iterator_next ( it ), i++ ) {
+        const char * key = htr_iterator_key ( it, &length );
+        keys[i] = malloc ( length + 1 );
+        memcpy ( keys[i], key, length );
+        key_lengths[i] = length;
+    }
+    htr_iterator_free ( it );
+    count = i;
+
+    check_order ( C, keys, key_lengths, count, "counted" );
+    check_order ( P, keys, key_lengths, count, "not counted" );
+    check_order ( F, keys, key_lengths, count, "front coded" );
+    check_order ( E, keys, key_lengths, count, "encoded" );
+    check_order ( B, keys, key_lengths, count, "blob" );
+
+    bool sorted;
+    for ( sorted = false; ; sorted = true ) {
+        htr * I = htr_freeze ( NULL, P, sorted );
+        if ( I == NULL ) {
+            fprintf ( stderr, "[error] htr_freeze failed\n" );
+        } else {
+            check_order ( I, keys, key_lengths, count, sorted ? "sorted image" : "hashed image" );
+            talloc_free ( I );
+        }
+        if ( sorted ) break;
+    }
+
+    for ( i = 0; i < count; i++ ) {
+        free ( keys[i] );
+    }
+    free ( keys );
+    free ( key_lengths );
+    talloc_free ( P );
+    talloc_free ( C );
+    talloc_free ( F );
+    talloc_free ( E );
+    talloc_free ( B );
+    fprintf ( stderr, "done.\n" );
+}
+
+void test_longest_prefix()
+{
+    fprintf ( stderr, "longest prefixes of %zu keys ... \n", n );
+
+    // routes are every 5th key
+    htr * R = htr_new ( NULL, murmur_hash );
+    htr * F = htr_new ( NULL, murmur_hash );
+    htr * E = htr_new ( NULL, murmur_hash );
+    htr * N = htr_new_sized ( NULL, murmur_hash, 2 );
+    htr * B = htr_new_sized ( NULL, murmur_hash, HTR_VALUE_BLOB );
+    htr_set_front_coded ( F, true );
+    htr_encoder * encoder = htr_encoder_new ( NULL, ( const char * const * ) xs, lengths, 1000 );
+    htr_set_encoder ( E, encoder );
+    talloc_free ( encoder );
+
+    size_t i;
+    for ( i = 0; i < n; i += 5 ) {
+        htr_value value = i % 60000 + 1;
+        htr_set ( R, xs[i], lengths[i], value );
+        htr_set ( F, xs[i], lengths[i], value );
+        htr_set ( E, xs[i], lengths[i], value );
+        htr_set ( N, xs[i], lengths[i], value );
+        htr_blob_set ( B, xs[i], lengths[i], "route", 5 );
+    }
+
+    check_longest_prefix ( R, R, "mutable" );
+    check_longest_prefix ( F, R, "front coded" );
+    check_longest_prefix ( E, R, "encoded" );
+    check_longest_prefix ( N, R, "2 bytes values" );
+
+    bool sorted;
+    for ( sorted = false; ; sorted = true ) {
+        htr * I = htr_freeze ( NULL, R, sorted );
+        if ( I == NULL ) {
+            fprintf ( stderr, "[error] htr_freeze failed\n" );
+        } else {
+            check_longest_prefix ( I, R, sorted ? "sorted image" : "hashed image" );
+            talloc_free ( I );
+        }
+        if ( sorted ) break;
+    }
+
+    // the empty key is the prefix of every key
+    htr_set ( R, "", 0, 7 );
+    check_longest_prefix ( R, R, "mutable with empty key" );
+
+    size_t matched;
+    htr_value value;
+    if ( htr_longest_prefix ( B, xs[0], lengths[0], &matched, &value ) != -1 || htr_longest_prefix ( B, xs[0], lengths[0], &matched, NULL ) != 0 || matched != lengths[0] ) {
+        fprintf ( stderr, "[error] incorrect longest prefix of blob\n" );
+    }
+
+    talloc_free ( R );
+    talloc_free ( F );
+    talloc_free ( E );
+    talloc_free ( N );
+    talloc_free ( B );
+    fprintf ( stderr, "done.\n" );
+}
+
+void test_search()
+{
+    fprintf ( stderr, "searching %zu keys ... \n", n );
+
+    htr * P = htr_new ( NULL, murmur_hash );
+    htr * F = htr_new ( NULL, murmur_hash );
+    htr * E = htr_new ( NULL, murmur_hash );
+    htr_set_front_coded ( F, true );
+    htr_encoder * encoder = htr_encoder_new ( NULL, ( const char * const * ) xs, lengths, 1000 );
+    htr_set_encoder ( E, encoder );
+    talloc_free ( encoder );
+
+    size_t i;
+    for ( i = 0; i < n; ++i ) {
+        htr_set ( P, xs[i], lengths[i], i + 1 );
+        htr_set ( F, xs[i], lengths[i], i + 1 );
+        htr_set ( E, xs[i], lengths[i], i + 1 );
+    }
+    // the empty key is reached by deletions
+    htr_set ( P, "", 0, 1 );
+    htr_set ( F, "", 0, 1 );
+    htr_set ( E, "", 0, 1 );
+
+    check_fuzzy ( P, P, "mutable" );
+    check_fuzzy ( F, P, "front coded" );
+    check_fuzzy ( E, P, "encoded" );
+    check_match ( P, P, "mutable" );
+    check_match ( F, P, "front coded" );
+    check_match ( E, P, "encoded" );
+
+    htr * I = htr_freeze ( NULL, P, true );
+    if ( I == NULL ) {
+        fprintf ( stderr, "[error] htr_freeze failed\n" );
+    } else {
+        check_fuzzy ( I, P, "image" );
+        check_match ( I, P, "image" );
+        talloc_free ( I );
+    }
+
+    talloc_free ( P );
+    talloc_free ( F );
+    talloc_free ( E );
+    fprintf ( stderr, "done.\n" );
+}
+
+
+int main()
+{
+    setup();
+    test_search();
+    test_longest_prefix();
+    test_topk();
+    test_order();
+    teardown();
+
+    return 0;
+}
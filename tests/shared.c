@@ -0,0 +1,156 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "murmur_hash.h"
+#include <hat-trie/trie.h>
+#include <hat-trie/shared.h>
+#include <talloc2/tree.h>
+
+/* Simple random string generation. */
+void randstr ( char* x, size_t len )
+{
+    x[len] = '\0';
+    while ( len > 0 ) {
+        x[--len] = '\x20' + ( rand() % ( '\x7e' - '\x20' + 1 ) );
+    }
+}
+
+const size_t n = 100000;  // how many unique strings
+const size_t m_low  = 1;   // minimum length of each string
+const size_t m_high = 100; // maximum length of each string
+
+char** xs;
+
+htr * T;
+char path[] = "/tmp/hat-trie-shared-XXXXXX";
+
+
+void setup()
+{
+    fprintf ( stderr, "generating %zu keys ... ", n );
+    xs = malloc ( n * sizeof ( char* ) );
+    size_t i;
+    size_t m;
+    for ( i = 0; i < n; ++i ) {
+        m = m_low + rand() % ( m_high - m_low );
+        xs[i] = malloc ( m + 1 );
+        randstr ( xs[i], m );
+    }
+
+    T = htr_new ( NULL, murmur_hash );
+    for ( i = 0; i < n; ++i ) {
+        *htr_get ( T, xs[i], strlen ( xs[i] ) ) = 1;
+    }
+
+    int fd = mkstemp ( path );
+    close ( fd );
+    unlink ( path );
+    fprintf ( stderr, "done.\n" );
+}
+
+
+void teardown()
+{
+    char image_path[sizeof ( path ) + 4];
+    snprintf ( image_path, sizeof ( image_path ), "%s.2", path );
+    unlink ( image_path );
+    unlink ( path );
+
+    talloc_free ( T );
+
+    size_t i;
+    for ( i = 0; i < n; ++i ) {
+        free ( xs[i] );
+    }
+    free ( xs );
+}
+
+
+// count keys of the trie that have the given value
+size_t check_values ( htr * trie, htr_value value )
+{
+    size_t i, count = 0;
+    htr_value * u;
+    for ( i = 0; i < n; ++i ) {
+        u = htr_tryget ( trie, xs[i], strlen ( xs[i] ) );
+        if ( u != NULL && *u == value ) {
+            count++;
+        }
+    }
+    return count;
+}
+
+
+void test_shared_publish ( htr_shared * writer, htr_shared * reader, htr_value value, uint64_t generation )
+{
+    fprintf ( stderr, "publishing generation %lu ... \n", ( unsigned long ) generation );
+
+    size_t i;
+    for ( i = 0; i < n; ++i ) {
+        *htr_get ( T, xs[i], strlen ( xs[i] ) ) = value;
+    }
+    if ( htr_shared_publish ( writer, T ) != 0 ) {
+        fprintf ( stderr, "[error] can't publish trie\n" );
+        return;
+    }
+
+    htr * trie = htr_shared_get ( reader );
+    if ( trie == NULL || htr_shared_generation ( reader ) != generation ) {
+        fprintf ( stderr, "[error] reader doesn't see generation %lu\n", ( unsigned long ) generation );
+        return;
+    }
+    if ( check_values ( trie, value ) != n ) {
+        fprintf ( stderr, "[error] incorrect values in shared trie\n" );
+    }
+
+    fprintf ( stderr, "done.\n" );
+}
+
+
+void test_shared_process ( htr_value value )
+{
+    fprintf ( stderr, "reading shared trie from other process ... \n" );
+
+    pid_t pid = fork();
+    if ( pid == 0 ) {
+        htr_shared * shared = htr_shared_open ( NULL, path, murmur_hash );
+        htr * trie = shared == NULL ? NULL : htr_shared_get ( shared );
+        _exit ( trie != NULL && check_values ( trie, value ) == n ? 0 : 1 );
+    }
+
+    int status;
+    if ( pid < 0 || waitpid ( pid, &status, 0 ) != pid || !WIFEXITED ( status ) || WEXITSTATUS ( status ) != 0 ) {
+        fprintf ( stderr, "[error] other process can't read shared trie\n" );
+    }
+
+    fprintf ( stderr, "done.\n" );
+}
+
+
+int main()
+{
+    setup();
+
+    htr_shared * writer = htr_shared_open ( NULL, path, murmur_hash );
+    htr_shared * reader = htr_shared_open ( NULL, path, murmur_hash );
+    if ( writer == NULL || reader == NULL ) {
+        fprintf ( stderr, "[error] can't open shared trie\n" );
+    } else {
+        if ( htr_shared_get ( reader ) != NULL ) {
+            fprintf ( stderr, "[error] trie is mapped before publishing\n" );
+        }
+        test_shared_publish ( writer, reader, 1, 1 );
+        test_shared_publish ( writer, reader, 2, 2 );
+        test_shared_process ( 2 );
+    }
+    talloc_free ( reader );
+    talloc_free ( writer );
+
+    teardown();
+
+    return 0;
+}
@@ -4,6 +4,7 @@
 #include "murmur_hash.h"
 
 #include <hat-trie/trie.h>
+#include <hat-trie/table.h>
 #include <talloc2/tree.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,6 +20,14 @@ void randstr ( char* x, size_t len )
     }
 }
 
+int walk_callback ( const htr_key_view * key, htr_value * value, void * data )
+{
+    ( void ) key;
+    ( void ) value;
+    ( void ) data;
+    return 0;
+}
+
 int main()
 {
     htr * T = htr_new ( NULL, murmur_hash );
@@ -67,7 +76,49 @@ int main()
     fprintf ( stderr, "finished. (%0.2f seconds)\n", ( double ) ( t - t0 ) / ( double ) CLOCKS_PER_SEC );
 
 
+    /* walk in unsorted order */
+    fprintf ( stderr, "walking out of order ... " );
+    t0 = clock();
+    for ( r = 0; r < repetitions; ++r ) {
+        htr_walk ( T, NULL, 0, false, walk_callback, NULL );
+    }
+    t = clock();
+    fprintf ( stderr, "finished. (%0.2f seconds)\n", ( double ) ( t - t0 ) / ( double ) CLOCKS_PER_SEC );
+
+
+    /* walk in sorted order */
+    fprintf ( stderr, "walking in order ... " );
+    t0 = clock();
+    for ( r = 0; r < repetitions; ++r ) {
+        htr_walk ( T, NULL, 0, true, walk_callback, NULL );
+    }
+    t = clock();
+    fprintf ( stderr, "finished. (%0.2f seconds)\n", ( double ) ( t - t0 ) / ( double ) CLOCKS_PER_SEC );
+
+
     talloc_free ( T );
 
+
+    /* sort a single large table, it is the worst case for sorted iteration of buckets */
+    const size_t table_n = 100000;
+    htr_table * table = htr_table_new ();
+    for ( i = 0; i < table_n; ++i ) {
+        m = m_low + rand() % ( m_high - m_low );
+        randstr ( x, m );
+        *htr_table_get ( table, murmur_hash, x, m ) = 1;
+    }
+
+    htr_table_iterator * table_it;
+    fprintf ( stderr, "sorting table of %zu keys ... ", table_n );
+    t0 = clock();
+    for ( r = 0; r < repetitions; ++r ) {
+        table_it = htr_table_iterator_begin ( table, true );
+        htr_table_iterator_free ( table_it );
+    }
+    t = clock();
+    fprintf ( stderr, "finished. (%0.2f seconds)\n", ( double ) ( t - t0 ) / ( double ) CLOCKS_PER_SEC );
+
+    htr_table_free ( table );
+
     return 0;
 }
@@ -202,6 +202,92 @@ void test_htr_table_sorted_iteration()
 }
 
 
+// Keys longer than 32 KB and keys stored out of line are mixed with short ones.
+void test_htr_table_long_keys()
+{
+    const size_t lengths[] = { 0, 1, 127, 128, 1023, 1024, 5000, 32767, 32768, 70000 };
+    const size_t lengths_count = sizeof ( lengths ) / sizeof ( lengths[0] );
+    const size_t count = 20 * lengths_count;
+
+    fprintf ( stderr, "inserting %zu long keys ... \n", count );
+
+    htr_table * L = htr_table_new ();
+    str_map * V = str_map_create();
+    char ** keys = malloc ( count * sizeof ( char * ) );
+    size_t * sizes = malloc ( count * sizeof ( size_t ) );
+
+    size_t i;
+    for ( i = 0; i < count; ++i ) {
+        sizes[i] = lengths[i % lengths_count];
+        keys[i]  = malloc ( sizes[i] + 1 );
+        randstr ( keys[i], sizes[i] );
+        *htr_table_get ( L, murmur_hash, keys[i], sizes[i] ) = i + 1;
+        str_map_set ( V, keys[i], sizes[i], i + 1 );
+    }
+
+    htr_value * u;
+    for ( i = 0; i < count; ++i ) {
+        u = htr_table_tryget ( L, murmur_hash, keys[i], sizes[i] );
+        if ( u == NULL || *u != str_map_get ( V, keys[i], sizes[i] ) ) {
+            fprintf ( stderr, "[error] incorrect value of %zu bytes key\n", sizes[i] );
+        }
+    }
+
+    uint8_t encoding;
+    for ( encoding = HTR_TABLE_IMAGE_HASHED; encoding <= HTR_TABLE_IMAGE_SORTED; encoding++ ) {
+        size_t size;
+        htr_table_image * image = htr_table_image_new ( L, murmur_hash, encoding, &size );
+        if ( image == NULL ) {
+            fprintf ( stderr, "[error] image of long keys is not created\n" );
+            continue;
+        }
+        for ( i = 0; i < count; ++i ) {
+            u = htr_table_image_tryget ( image, murmur_hash, keys[i], sizes[i] );
+            if ( u == NULL || *u != str_map_get ( V, keys[i], sizes[i] ) ) {
+                fprintf ( stderr, "[error] incorrect image value of %zu bytes key\n", sizes[i] );
+            }
+        }
+        free ( image );
+    }
+
+    for ( i = 0; i < count; i += 3 ) {
+        htr_table_del ( L, murmur_hash, keys[i], sizes[i] );
+        str_map_del ( V, keys[i], sizes[i] );
+    }
+
+    bool sorted;
+    for ( sorted = false; ; sorted = true ) {
+        htr_table_iterator it;
+        htr_table_iterator_init ( &it, L, sorted );
+        size_t iterated = 0, len;
+        const char * key;
+        while ( !htr_table_iterator_finished ( &it ) ) {
+            key = htr_table_iterator_key ( &it, &len );
+            u   = htr_table_iterator_val ( &it );
+            if ( str_map_get ( V, key, len ) != *u ) {
+                fprintf ( stderr, "[error] incorrect iteration value of %zu bytes key\n", len );
+            }
+            iterated++;
+            htr_table_iterator_next ( &it );
+        }
+        htr_table_iterator_destroy ( &it );
+        if ( iterated != V->m ) {
+            fprintf ( stderr, "[error] iterated through %zu element, expected %zu\n", iterated, V->m );
+        }
+        if ( sorted ) break;
+    }
+
+    for ( i = 0; i < count; ++i ) {
+        free ( keys[i] );
+    }
+    free ( keys );
+    free ( sizes );
+    str_map_destroy ( V );
+    htr_table_free ( L );
+    fprintf ( stderr, "done.\n" );
+}
+
+
 int main()
 {
     setup();
@@ -214,5 +300,7 @@ int main()
     test_htr_table_sorted_iteration();
     teardown();
 
+    test_htr_table_long_keys();
+
     return 0;
 }